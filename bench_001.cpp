@@ -0,0 +1,101 @@
+#include <malloc.h>
+
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <random>
+
+#include "bttrack.h"
+
+// benchmark: record synthetic stacks into bttrack vs the std::map<Stack, ...>
+// it replaced, with 1k to 1M distinct stacks of depth 16-48
+
+struct StackStat {
+  uint64_t count;
+  int64_t score;
+};
+
+// generate stacks like real call paths: each new stack branches from a
+// previous one near its innermost frames, so outer frames like main and event
+// loop are shared by all stacks
+std::vector<bttrack::FramePointers> MakeStacks(size_t n, uint32_t seed) {
+  std::mt19937_64 rng(seed);
+  std::vector<bttrack::FramePointers> stacks(n);
+  const uintptr_t kBase = 0x400000;
+  uintptr_t next_addr = kBase;
+  stacks[0].resize(32);
+  for (auto& addr : stacks[0]) {
+    addr = (const void*)(next_addr += 16);
+  }
+  for (size_t j = 1; j < n; j++) {
+    const auto& from = stacks[rng() % j];
+    // drop 1-4 inner frames, then call 1-6 new inner frames
+    size_t keep = std::max<size_t>(from.size() - 1 - rng() % 4, 8);
+    size_t depth = std::min<size_t>(keep + 1 + rng() % 6, 64);
+    auto& s = stacks[j];
+    s.resize(depth);
+    std::copy(from.end() - keep, from.end(), s.end() - keep);
+    for (size_t i = 0; i < depth - keep; i++) {
+      s[i] = (const void*)(next_addr += 16);
+    }
+  }
+  return stacks;
+}
+
+// heap bytes in use
+double HeapMB() {
+  auto info = mallinfo2();
+  return (info.uordblks + info.hblkhd) / 1048576.0;
+}
+
+template <typename F>
+double Measure(const std::vector<bttrack::FramePointers>& stacks, int rounds,
+               F&& func) {
+  auto start = std::chrono::steady_clock::now();
+  for (int r = 0; r < rounds; r++) {
+    for (const auto& s : stacks) {
+      func(s);
+    }
+  }
+  std::chrono::duration<double, std::nano> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count() / (stacks.size() * rounds);
+}
+
+int main() {
+  const int kRounds = 4;
+  uint8_t id = 0;
+  printf("%10s %12s %12s %14s %14s\n", "stacks", "map ns/op", "map MB",
+         "bttrack ns/op", "bttrack MB");
+  for (size_t n = 1000; n <= 1000000; n *= 10) {
+    auto stacks = MakeStacks(n, n);
+
+    double mem = HeapMB();
+    std::mutex mutex;
+    std::map<bttrack::FramePointers, StackStat> map;
+    using Stack = bttrack::FramePointers;
+    double t_map = Measure(stacks, kRounds, [&](const Stack& s) {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto it = map.find(s);
+      if (it == map.end()) {
+        map.emplace(s, StackStat{1, 1});
+      } else {
+        it->second.count++;
+        it->second.score++;
+      }
+    });
+
+    double mem_map = HeapMB() - mem;
+
+    mem = HeapMB();
+    double t_table = Measure(
+        stacks, kRounds, [&](const Stack& s) { bttrack::Record(id, s, 1); });
+    double mem_table = HeapMB() - mem;
+    id++;
+
+    printf("%10lu %12.1f %12.1f %14.1f %14.1f\n", n, t_map, mem_map, t_table,
+           mem_table);
+  }
+  return 0;
+}
@@ -0,0 +1,87 @@
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <utility>
+
+#include "bttrack.h"
+
+// benchmark: cold symbolization of thousands of distinct frames, in-process
+// ELF/DWARF symbolizer vs addr2line
+
+const int kNumFuncs = 4000;
+
+template <int N>
+int __attribute__((noinline)) Leaf(int x) {
+  return x * N + N / 3;
+}
+
+template <int... N>
+std::vector<const void*> LeafAddrs(std::integer_sequence<int, N...>) {
+  // an address inside each function, like a return address
+  return {reinterpret_cast<const char*>(&Leaf<N>) + 1 ...};
+}
+
+// dump channel 0 in a child process, so frames are resolved from scratch,
+// return the time and innermost frame of each stack
+double DumpInChild(bttrack::Symbolizer symbolizer, std::string& frames) {
+  int fds[2];
+  if (pipe(fds) != 0) {
+    return -1;
+  }
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(fds[0]);
+    bttrack::SetSymbolizer(symbolizer);
+    std::vector<bttrack::StackFrames> result;
+    auto start = std::chrono::steady_clock::now();
+    bttrack::Dump(0, result);
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    std::string out = std::to_string(elapsed.count()) + "\n";
+    for (const auto& record : result) {
+      const auto* frame = record.frames[0];
+      out += frame->func + " " + frame->file + ":" +
+             std::to_string(frame->line) + "\n";
+    }
+    ssize_t n = write(fds[1], out.data(), out.size());
+    _exit(n == static_cast<ssize_t>(out.size()) ? 0 : 1);
+  }
+  close(fds[1]);
+  std::string out;
+  char buf[4096];
+  ssize_t n;
+  while ((n = read(fds[0], buf, sizeof(buf))) > 0) {
+    out.append(buf, n);
+  }
+  close(fds[0]);
+  waitpid(pid, nullptr, 0);
+  size_t pos = out.find('\n');
+  if (pos == std::string::npos) {
+    return -1;
+  }
+  frames = out.substr(pos + 1);
+  return std::stod(out.substr(0, pos));
+}
+
+int main() {
+  std::vector<const void*> addrs =
+      LeafAddrs(std::make_integer_sequence<int, kNumFuncs>());
+  bttrack::FramePointers base;
+  bttrack::GetBacktrace(base);
+  for (const void* addr : addrs) {
+    bttrack::FramePointers stack = base;
+    stack.insert(stack.begin(), addr);
+    bttrack::Record(0, stack);
+  }
+
+  std::string elf, addr2line;
+  double elf_s = DumpInChild(bttrack::kSymbolizeElf, elf);
+  double addr2line_s = DumpInChild(bttrack::kSymbolizeAddr2line, addr2line);
+  printf("%d frames: elf %.3fs, addr2line %.3fs (%.1fx), %s\n", kNumFuncs,
+         elf_s, addr2line_s, addr2line_s / elf_s,
+         elf == addr2line ? "same" : "different");
+  return 0;
+}
@@ -0,0 +1,110 @@
+#include <cxxabi.h>
+#include <dlfcn.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "bttrack.h"
+
+// benchmark: demangle the names of a large dump, where templated functions
+// repeat in many frames and inlined frames, __cxa_demangle() on each call vs
+// demangle_symbol() with its cache
+
+namespace bttrack {
+// internal, used by all symbolizers
+bool demangle_symbol(std::string& func, const char* symbol);
+}  // namespace bttrack
+
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t n, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void __libc_free(void* ptr);
+
+// count allocations, including those inside __cxa_demangle()
+std::atomic<uint64_t> num_allocs{0};
+
+void* malloc(size_t size) {
+  num_allocs.fetch_add(1, std::memory_order_relaxed);
+  return __libc_malloc(size);
+}
+void* calloc(size_t n, size_t size) {
+  num_allocs.fetch_add(1, std::memory_order_relaxed);
+  return __libc_calloc(n, size);
+}
+void* realloc(void* ptr, size_t size) {
+  num_allocs.fetch_add(1, std::memory_order_relaxed);
+  return __libc_realloc(ptr, size);
+}
+void free(void* ptr) { __libc_free(ptr); }
+}
+
+const int kNumFuncs = 200;
+const int kNumCalls = 200000;  // each name repeats 1000 times
+
+template <int N>
+struct Tag {};
+
+template <typename T>
+void __attribute__((noinline)) Work(T*) {
+  asm volatile("");
+}
+
+template <int N>
+using Heavy =
+    std::map<std::string, std::vector<std::pair<Tag<N>, std::unique_ptr<int>>>>;
+
+template <int... N>
+std::vector<void*> WorkAddrs(std::integer_sequence<int, N...>) {
+  return {reinterpret_cast<void*>(&Work<Heavy<N>>)...};
+}
+
+int main() {
+  std::vector<std::string> names;
+  for (void* addr : WorkAddrs(std::make_integer_sequence<int, kNumFuncs>())) {
+    Dl_info info;
+    if (dladdr(addr, &info) && info.dli_sname != nullptr) {
+      names.emplace_back(info.dli_sname);
+    }
+  }
+  if (names.empty()) {
+    printf("no symbol names, build with -rdynamic\n");
+    return 1;
+  }
+
+  std::string func;
+  size_t total_size = 0;
+  auto run = [&](const char* label, bool cached) {
+    uint64_t allocs = num_allocs.load();
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < kNumCalls; i++) {
+      const char* name = names[i % names.size()].c_str();
+      if (cached) {
+        bttrack::demangle_symbol(func, name);
+      } else {
+        int status;
+        char* demangled = abi::__cxa_demangle(name, nullptr, nullptr, &status);
+        func = demangled;
+        free(demangled);
+      }
+      total_size += func.size();
+    }
+    std::chrono::duration<double, std::nano> elapsed =
+        std::chrono::steady_clock::now() - start;
+    printf("%-16s %7.1f ns/call, %5.2f allocs/call\n", label,
+           elapsed.count() / kNumCalls,
+           double(num_allocs.load() - allocs) / kNumCalls);
+  };
+  printf("%lu names of %lu chars, %d calls\n", names.size(), names[0].size(),
+         kNumCalls);
+  run("__cxa_demangle", false);
+  run("demangle_symbol", true);
+  return total_size > 0 ? 0 : 1;
+}
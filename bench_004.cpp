@@ -0,0 +1,340 @@
+#include <fcntl.h>
+#include <malloc.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "bttrack.h"
+
+// benchmark: format a large dump by the std::ostringstream serializers these
+// replaced, by StackFramesToString/Json(), and stream it to a memfd by
+// WriteStackFrames/Json(), time and peak heap of each, a memfd is not
+// throttled by disk writeback, then the same JSON as kJsonFrameTable, and
+// the binary format written, mapped and read back
+
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t n, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void __libc_free(void* ptr);
+
+// live and peak heap bytes
+std::atomic<int64_t> live_bytes{0};
+std::atomic<int64_t> peak_bytes{0};
+
+static void* Track(void* ptr) {
+  if (ptr != nullptr) {
+    int64_t live = live_bytes.fetch_add(malloc_usable_size(ptr)) +
+                   malloc_usable_size(ptr);
+    int64_t peak = peak_bytes.load();
+    while (live > peak && !peak_bytes.compare_exchange_weak(peak, live)) {
+    }
+  }
+  return ptr;
+}
+
+static void Untrack(void* ptr) {
+  if (ptr != nullptr) {
+    live_bytes.fetch_sub(malloc_usable_size(ptr));
+  }
+}
+
+void* malloc(size_t size) { return Track(__libc_malloc(size)); }
+void* calloc(size_t n, size_t size) { return Track(__libc_calloc(n, size)); }
+void* realloc(void* ptr, size_t size) {
+  Untrack(ptr);
+  return Track(__libc_realloc(ptr, size));
+}
+void free(void* ptr) {
+  Untrack(ptr);
+  __libc_free(ptr);
+}
+}
+
+namespace baseline {
+
+using namespace bttrack;
+
+// StackFramesToString() and StackFramesToJson() before OutputWriter
+
+void StackFrameToString(std::ostringstream& oss, const StackFrames& stack,
+                        double sum, double sum_score, bool print_symbol) {
+  oss << "recorded " << stack.count << " times (" << (stack.count / sum * 100.0)
+      << "%), score " << stack.score << " ("
+      << (stack.score / sum_score * 100.0) << "%)";
+  if (stack.count_error > 0 || stack.score_error > 0) {
+    oss << ", error +-" << stack.count_error << " times, score +-"
+        << stack.score_error;
+  }
+  oss << ", stack:" << std::endl;
+  for (size_t f = 0; f < stack.frames.size(); f++) {
+    auto* frame = stack.frames[f];
+    oss << "#" << f << (f < 10 ? "  " : " ") << frame->func;
+    oss << " at " << frame->file << ":";
+    if (frame->line >= 0) {
+      oss << frame->line;
+    } else {
+      oss << "?";
+    }
+    if (frame->faddr) {
+      void* offset = (void*)((char*)frame->addr - (char*)frame->faddr);
+      oss << " (" << frame->exec << "+" << offset << ")";
+    } else {
+      oss << " (" << frame->exec << "+?)";
+    }
+    if (!frame->inlined_by.empty()) {
+      oss << " (inlined by " << frame->inlined_by.size() << ")";
+    }
+    if (print_symbol) {
+      oss << " <symbol=" << frame->symbol << ">";
+    }
+    oss << std::endl;
+  }
+}
+
+std::string StackFramesToString(const std::vector<StackFrames>& records,
+                                bool print_symbol) {
+  uint64_t sum = 0;
+  int64_t sum_score = 0;
+  for (const auto& it : records) {
+    sum += it.count;
+    sum_score += it.score;
+  }
+  std::ostringstream oss;
+  oss << "Stack format: #N func at file:line (exec+offset)";
+  if (print_symbol) {
+    oss << " <symbol=...>";
+  }
+  oss << std::endl
+      << "Report: total " << sum << " records, score " << sum_score << ", in "
+      << records.size() << " different stack frames:" << std::endl;
+  for (size_t i = 0; i < records.size(); i++) {
+    oss << "[" << i << "] ";
+    StackFrameToString(oss, records[i], (double)sum, (double)sum_score,
+                       print_symbol);
+    oss << std::endl;
+  }
+  return oss.str();
+}
+
+void StackFrameToJson(std::ostringstream& oss, const StackFrames& stack) {
+  oss << "{\"count\": " << stack.count << ", \"score\": " << stack.score;
+  if (stack.count_error > 0 || stack.score_error > 0) {
+    oss << ", \"count_error\": " << stack.count_error
+        << ", \"score_error\": " << stack.score_error;
+  }
+  oss << ", \"frames\": [";
+  for (size_t f = 0; f < stack.frames.size(); f++) {
+    auto* frame = stack.frames[f];
+    void* offset =
+        frame->faddr ? (void*)((char*)frame->addr - (char*)frame->faddr) : 0;
+    oss << "{\"address\": " << (uintptr_t)frame->addr << ", \"function\": \""
+        << frame->func << "\", \"file\": \"" << frame->file
+        << "\", \"line\": " << frame->line << ", \"exec\": \"" << frame->exec
+        << "\", \"offset\": " << (uintptr_t)offset << ", \"symbol\": \""
+        << frame->symbol << "\", \"inlined_by\": " << frame->inlined_by.size()
+        << "}";
+    if (f < stack.frames.size() - 1) {
+      oss << ", ";
+    }
+  }
+  oss << "]}";
+}
+
+std::string StackFramesToJson(const std::vector<StackFrames>& records) {
+  uint64_t sum = 0;
+  int64_t sum_score = 0;
+  for (const auto& it : records) {
+    sum += it.count;
+    sum_score += it.score;
+  }
+  std::ostringstream oss;
+  oss << "{\"sum\": " << sum << ", \"sum_score\": " << sum_score
+      << ", \"records\": [";
+  for (size_t i = 0; i < records.size(); i++) {
+    StackFrameToJson(oss, records[i]);
+    if (i < records.size() - 1) {
+      oss << ",";
+    }
+  }
+  oss << "]}";
+  return oss.str();
+}
+
+}  // namespace baseline
+
+const size_t kNumFrames = 20000;
+const size_t kNumStacks = 50000;
+
+// frames of a few modules, stacks of depth 16-48 sharing outer frames
+void MakeRecords(std::vector<bttrack::Frame>& frames,
+                 std::vector<bttrack::StackFrames>& records) {
+  std::mt19937_64 rng(42);
+  frames.resize(kNumFrames);
+  for (size_t i = 0; i < kNumFrames; i++) {
+    bttrack::Frame& f = frames[i];
+    uintptr_t base = 0x7f0000000000 + (i % 4) * 0x10000000;
+    f.addr = reinterpret_cast<const void*>(base + 0x1000 + i * 64);
+    f.faddr = i % 50 == 0 ? nullptr : reinterpret_cast<const void*>(base);
+    f.func = "ns::Class" + std::to_string(i % 700) + "::Method" +
+             std::to_string(i) + "(std::vector<int> const&, int)";
+    f.symbol = "_ZN2ns5Class" + std::to_string(i) + "6MethodERKSt6vectorIiEi";
+    f.exec = "/usr/lib/libmodule" + std::to_string(i % 4) + ".so";
+    f.file = "/src/module/class" + std::to_string(i % 700) + ".cpp";
+    f.line = i % 10 == 0 ? -1 : static_cast<int>(rng() % 5000);
+    if (i % 8 == 0) {
+      f.inlined_by.push_back({"ns::Caller()", f.file, f.line + 1});
+    }
+  }
+  records.resize(kNumStacks);
+  for (size_t i = 0; i < kNumStacks; i++) {
+    auto& r = records[i];
+    r.count = 1 + rng() % 100000;
+    r.score = static_cast<int64_t>(rng() % 10000000) - 1000;
+    r.count_error = i % 3 == 0 ? rng() % 100 : 0;
+    r.score_error = r.count_error * 7;
+    size_t depth = 16 + rng() % 33;
+    for (size_t d = 0; d < depth; d++) {
+      // outer frames are shared by most stacks
+      size_t range = d + 8 >= depth ? 64 : kNumFrames;
+      r.frames.push_back(&frames[rng() % range]);
+    }
+  }
+}
+
+std::string ReadFile(int fd) {
+  std::string data;
+  char buf[1 << 16];
+  ssize_t n;
+  for (off_t pos = 0; (n = pread(fd, buf, sizeof(buf), pos)) > 0; pos += n) {
+    data.append(buf, n);
+  }
+  return data;
+}
+
+int main() {
+  std::vector<bttrack::Frame> frames;
+  std::vector<bttrack::StackFrames> records;
+  MakeRecords(frames, records);
+  int fd = memfd_create("bttrack_bench", 0);
+  if (fd < 0) {
+    perror("memfd_create");
+    return 1;
+  }
+
+  // time and heap peak above the live bytes before, size of output
+  auto run = [&](const char* label, const std::function<size_t()>& fn) {
+    int64_t live = live_bytes.load();
+    peak_bytes.store(live);
+    auto start = std::chrono::steady_clock::now();
+    size_t size = fn();
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    printf("%-24s %7.1f ms, %7.1f MB/s, %7.1f MB, peak heap %8.3f MB\n",
+           label, elapsed.count() * 1e3, size / 1048576.0 / elapsed.count(),
+           size / 1048576.0, (peak_bytes.load() - live) / 1048576.0);
+  };
+  auto write_fd = [&](bool json, bttrack::JsonFormat format) {
+    if (ftruncate(fd, 0) != 0 || lseek(fd, 0, SEEK_SET) != 0) {
+      return size_t(0);
+    }
+    bool ok = json ? bttrack::WriteStackFramesJson(fd, records, 0, format)
+                   : bttrack::WriteStackFrames(fd, records);
+    return ok ? static_cast<size_t>(lseek(fd, 0, SEEK_CUR)) : 0;
+  };
+  auto write_binary_fd = [&] {
+    if (ftruncate(fd, 0) != 0 || lseek(fd, 0, SEEK_SET) != 0 ||
+        !bttrack::WriteStackFramesBinary(fd, records)) {
+      return size_t(0);
+    }
+    return static_cast<size_t>(lseek(fd, 0, SEEK_CUR));
+  };
+
+  std::string text, json;
+  printf("%lu stacks of %lu frames\n", records.size(), frames.size());
+  run("ostringstream text", [&] {
+    text = baseline::StackFramesToString(records, true);
+    return text.size();
+  });
+  text.clear();
+  text.shrink_to_fit();
+  run("StackFramesToString", [&] {
+    text = bttrack::StackFramesToString(records);
+    return text.size();
+  });
+  run("WriteStackFrames fd",
+      [&] { return write_fd(false, bttrack::kJsonInline); });
+  bool same = text == ReadFile(fd) &&
+              text == baseline::StackFramesToString(records, true);
+  text.clear();
+  text.shrink_to_fit();
+
+  run("ostringstream json", [&] {
+    json = baseline::StackFramesToJson(records);
+    return json.size();
+  });
+  json.clear();
+  json.shrink_to_fit();
+  run("StackFramesToJson", [&] {
+    json = bttrack::StackFramesToJson(records);
+    return json.size();
+  });
+  run("WriteStackFramesJson fd",
+      [&] { return write_fd(true, bttrack::kJsonInline); });
+  same = same && json == ReadFile(fd) &&
+         json == baseline::StackFramesToJson(records);
+  json.clear();
+  json.shrink_to_fit();
+
+  run("frame table json", [&] {
+    json = bttrack::StackFramesToJson(records, 0, bttrack::kJsonFrameTable);
+    return json.size();
+  });
+  run("frame table json fd",
+      [&] { return write_fd(true, bttrack::kJsonFrameTable); });
+  same = same && json == ReadFile(fd);
+
+  std::string binary;
+  run("binary", [&] {
+    binary = bttrack::StackFramesToBinary(records);
+    return binary.size();
+  });
+  run("binary fd", write_binary_fd);
+  same = same && binary == ReadFile(fd);
+  binary.clear();
+  binary.shrink_to_fit();
+  std::string path = "/proc/self/fd/" + std::to_string(fd);
+  bttrack::StackFramesReader reader;
+  uint64_t frames_read = 0;
+  run("binary mapped, iterate", [&] {
+    bttrack::StackFramesReader::Stack stack;
+    if (!reader.Open(path)) {
+      return size_t(0);
+    }
+    while (reader.Next(stack)) {
+      frames_read += stack.frames.size();
+    }
+    return static_cast<size_t>(lseek(fd, 0, SEEK_END));
+  });
+  std::vector<bttrack::StackFrames> read;
+  run("binary mapped, ReadAll", [&] {
+    reader.ReadAll(read);
+    return static_cast<size_t>(lseek(fd, 0, SEEK_END));
+  });
+  same = same && reader.ok() && read.size() == records.size() &&
+         json == bttrack::StackFramesToJson(read, 0, bttrack::kJsonFrameTable);
+
+  close(fd);
+  printf("output %s\n", same ? "same" : "different");
+  return same ? 0 : 1;
+}
@@ -0,0 +1,107 @@
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "bttrack.h"
+
+// benchmark: folded stacks and SVG flame graph of a large dump, millions of
+// samples in 200k stacks, a tenth of frames with inlined functions
+
+const size_t kNumFrames = 20000;
+const size_t kNumStacks = 200000;
+
+// frames of a few hundred functions, stacks of depth 16-48 sharing outer
+// frames
+void MakeRecords(std::vector<bttrack::Frame>& frames,
+                 std::vector<bttrack::StackFrames>& records) {
+  std::mt19937_64 rng(42);
+  frames.resize(kNumFrames);
+  for (size_t i = 0; i < kNumFrames; i++) {
+    bttrack::Frame& f = frames[i];
+    f.addr = reinterpret_cast<const void*>(0x401000 + i * 64);
+    f.faddr = reinterpret_cast<const void*>(0x400000);
+    f.func = "ns::Class" + std::to_string(i % 700) + "::Method" +
+             std::to_string(i % 300) + "(std::vector<int> const&, int)";
+    f.exec = "/usr/bin/server";
+    f.line = static_cast<int>(rng() % 5000);
+    if (i % 10 == 0) {
+      f.inlined_by.push_back({"ns::Caller()", "caller.h", f.line + 1});
+    }
+  }
+  records.resize(kNumStacks);
+  for (size_t i = 0; i < kNumStacks; i++) {
+    auto& r = records[i];
+    r.count = 1 + rng() % 100;
+    r.score = r.count * 1000;
+    size_t depth = 16 + rng() % 33;
+    for (size_t d = 0; d < depth; d++) {
+      // outer frames are shared by most stacks
+      size_t range = d + 8 >= depth ? 16 + d : kNumFrames;
+      r.frames.push_back(&frames[rng() % range]);
+    }
+  }
+}
+
+int main() {
+  std::vector<bttrack::Frame> frames;
+  std::vector<bttrack::StackFrames> records;
+  MakeRecords(frames, records);
+  uint64_t samples = 0;
+  for (const auto& r : records) {
+    samples += r.count;
+  }
+  int fd = memfd_create("bttrack_bench", 0);
+  if (fd < 0) {
+    perror("memfd_create");
+    return 1;
+  }
+
+  auto run = [&](const char* label, const std::function<size_t()>& fn) {
+    auto start = std::chrono::steady_clock::now();
+    size_t size = fn();
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    printf("%-24s %7.1f ms, %8.3f MB\n", label, elapsed.count() * 1e3,
+           size / 1048576.0);
+    return size;
+  };
+  // bytes written to the memfd
+  auto written = [&](const std::function<bool()>& write_fn) {
+    if (ftruncate(fd, 0) != 0 || lseek(fd, 0, SEEK_SET) != 0 || !write_fn()) {
+      return size_t(0);
+    }
+    return static_cast<size_t>(lseek(fd, 0, SEEK_CUR));
+  };
+
+  printf("%lu samples in %lu stacks of %lu frames\n", samples, records.size(),
+         frames.size());
+  std::string folded;
+  run("StackFramesToFolded", [&] {
+    folded = bttrack::StackFramesToFolded(records);
+    return folded.size();
+  });
+  size_t folded_fd = run("WriteStackFramesFolded fd", [&] {
+    return written(
+        [&] { return bttrack::WriteStackFramesFolded(fd, records); });
+  });
+  std::string svg;
+  run("StackFramesToFlameGraph", [&] {
+    svg = bttrack::StackFramesToFlameGraph(records);
+    return svg.size();
+  });
+  size_t svg_fd = run("WriteFlameGraph fd", [&] {
+    return written([&] { return bttrack::WriteFlameGraph(fd, records); });
+  });
+  close(fd);
+  bool ok = folded_fd == folded.size() && svg_fd == svg.size() &&
+            svg.find("<title>all (" + std::to_string(samples) + " samples") !=
+                std::string::npos;
+  printf("output %s\n", ok ? "ok" : "wrong");
+  return ok ? 0 : 1;
+}
@@ -2,18 +2,43 @@
 
 #include <cxxabi.h>
 #include <dlfcn.h>
+#include <elf.h>
 #include <execinfo.h>
 #include <fcntl.h>
+#include <link.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
+#include <ucontext.h>
 #include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <condition_variable>
 #include <cstdio>
 #include <cstring>
+#include <deque>
+#include <functional>
 #include <map>
+#include <memory>
 #include <mutex>
+#include <new>
+#include <thread>
 #include <unordered_map>
+#include <unordered_set>
 
 #include <sstream>
 
@@ -58,6 +83,7 @@ class Slice {
   }
 
   size_t size() const { return size_; }
+  const char* data() const { return data_; }
 
   bool starts_with(const Slice& s) const {
     if (empty()) return false;
@@ -99,265 +125,1768 @@ static uint64_t get_nanos() {
   return ts.tv_sec * kNanosInSec + ts.tv_nsec;
 }
 
-// array of stack pointers
-struct Stack {
-  const FramePointers addrs;
-  Stack(void** addrs_, int num) : addrs(addrs_, addrs_ + num) {}
-  Stack(const FramePointers& addrs) : addrs(addrs) {}
-  bool operator==(const Stack& other) const { return addrs == other.addrs; }
-  bool operator<(const Stack& other) const {
-    return addrs < other.addrs;  // lexicographical order
+// 64-bit hash of an array of addresses
+static uint64_t hash_stack(const void* const* addrs, size_t size) {
+  uint64_t h = 0x9e3779b97f4a7c15ULL ^ size;
+  for (size_t i = 0; i < size; i++) {
+    h ^= reinterpret_cast<uintptr_t>(addrs[i]);
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 32;
   }
-};
+  // finalizer of murmur3
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
 
 struct StackStat {
   uint64_t count;
   int64_t score;
 };
 
-class Tracker {
+// nodes of a call tree, stored as columns so Match() only touches addrs and
+// parents, nodes[0] is the root
+struct StackNodes {
+  std::vector<const void*> addrs;
+  std::vector<uint32_t> parents;
+  std::vector<StackStat> stats;
+  // only in bounded tables, error of a stack is floor + errors[node] (mod
+  // 2^64), so a stack not in the table has error floor
+  std::vector<StackStat> errors;
+  StackStat floor = {0, 0};
+};
+
+/**
+ * interned call tree of stacks
+ * - each unique (parent, addr) edge is stored once as a node, and a stack is
+ *   the node of its innermost frame, the root is the outermost caller
+ * - stacks are indexed by a precomputed 64-bit hash with linear probing, a hit
+ *   costs one hash and one walk up the parent chain
+ * - node ids are stable, parent id is always less than child id
+ * - nodes are never removed, only cleared all at once, or by Compact() in a
+ *   bounded table
+ * - bounded by set_max_stacks(), it keeps the heavy hitters like Space-Saving,
+ *   see Compact()
+ */
+class StackTable {
  public:
-  // max stack frames to record
-  static const int kMaxStackFrames = 256;
-  // skip Tracker::Record() and Record()
-  static const int kSkipFrames = 2;
+  static const uint32_t kRoot = 0;  // virtual root, no address
 
-  Tracker() = default;
-  ~Tracker() = default;
+  StackTable() { clear(); }
 
-  void Record(int64_t score);
-  void RecordStack(const FramePointers& stack, int64_t score);
-  void Dump(std::vector<StackFrames>&);
+  // find or insert a stack (addrs[0] is the innermost frame), return its
+  // statistics
+  StackStat& Find(const void* const* addrs, size_t size) {
+    return Find(addrs, size, hash_stack(addrs, size));
+  }
 
-  static bool GetBacktrace(FramePointers& stack);
+  StackStat& Find(const void* const* addrs, size_t size, uint64_t hash) {
+    return nodes_.stats[FindNode(addrs, size, hash)];
+  }
+
+  /**
+   * keep at most about 2 * max_stacks stacks, 0 is unbounded
+   * - a new stack starts from the floor, the max count of all evicted stacks,
+   *   so count never underestimates and its error is at most the floor
+   * - a full table is compacted down to max_stacks stacks, amortized O(1) per
+   *   new stack
+   */
+  void set_max_stacks(size_t max_stacks) {
+    max_stacks_ = max_stacks;
+    if (max_stacks_ > 0) {
+      nodes_.errors.resize(nodes_.addrs.size(), StackStat{0, 0});
+      if (num_stacks_ > 2 * max_stacks_) {
+        Compact();
+      }
+    }
+  }
+
+  size_t max_stacks() const { return max_stacks_; }
+
+  // find or insert the edge from parent to addr, return the child node
+  uint32_t Child(uint32_t parent, const void* addr) {
+    if ((nodes_.addrs.size() + 1) * 2 > edges_.size()) {
+      GrowEdges();
+    }
+    const size_t mask = edges_.size() - 1;
+    size_t pos = hash_edge(parent, addr) & mask;
+    while (edges_[pos] != kRoot) {
+      uint32_t node = edges_[pos];
+      if (nodes_.parents[node] == parent && nodes_.addrs[node] == addr) {
+        return node;
+      }
+      pos = (pos + 1) & mask;
+    }
+    uint32_t node = static_cast<uint32_t>(nodes_.addrs.size());
+    nodes_.addrs.emplace_back(addr);
+    nodes_.parents.emplace_back(parent);
+    nodes_.stats.emplace_back(StackStat{0, 0});
+    if (!nodes_.errors.empty()) {
+      nodes_.errors.emplace_back(StackStat{0, 0});
+    }
+    edges_[pos] = node;
+    return node;
+  }
+
+  // add all nodes and statistics of other tree, or subtract statistics,
+  // errors of a bounded tree are added but never subtracted
+  void Merge(const StackNodes& other, bool subtract = false) {
+    const bool merge_errors = !subtract && !other.errors.empty();
+    if (merge_errors) {
+      nodes_.errors.resize(nodes_.addrs.size(), StackStat{0, 0});
+      add_stat(nodes_.floor, other.floor);
+    }
+    std::vector<uint32_t> mapped(other.addrs.size(), kRoot);
+    for (uint32_t i = kRoot + 1; i < other.addrs.size(); i++) {
+      mapped[i] = Child(mapped[other.parents[i]], other.addrs[i]);
+      StackStat& stat = nodes_.stats[mapped[i]];
+      if (subtract) {
+        stat.count -= other.stats[i].count;
+        stat.score -= other.stats[i].score;
+      } else {
+        add_stat(stat, other.stats[i]);
+      }
+      if (merge_errors) {
+        add_stat(nodes_.errors[mapped[i]], other.errors[i]);
+      }
+    }
+  }
+
+  // all nodes, copying it is a cheap snapshot of the table
+  const StackNodes& nodes() const { return nodes_; }
+
+  // number of nodes including root
+  uint32_t size() const { return static_cast<uint32_t>(nodes_.addrs.size()); }
+  const void* addr(uint32_t node) const { return nodes_.addrs[node]; }
+  uint32_t parent(uint32_t node) const { return nodes_.parents[node]; }
+  // exclusive, recorded stacks ending at this node
+  const StackStat& stat(uint32_t node) const { return nodes_.stats[node]; }
+  // max difference between stat(node) and the actual, 0 if never bounded
+  StackStat error(uint32_t node) const {
+    if (nodes_.errors.empty()) {
+      return StackStat{0, 0};
+    }
+    StackStat err = nodes_.floor;
+    add_stat(err, nodes_.errors[node]);
+    return err;
+  }
+
+  // clear all nodes, keep max_stacks()
+  void clear() {
+    nodes_.addrs.assign(1, nullptr);
+    nodes_.parents.assign(1, kRoot);
+    nodes_.stats.assign(1, StackStat{0, 0});
+    nodes_.errors.assign(max_stacks_ > 0 ? 1 : 0, StackStat{0, 0});
+    nodes_.floor = StackStat{0, 0};
+    edges_.clear();
+    stacks_.clear();
+    num_stacks_ = 0;
+  }
 
  private:
-  mutable std::mutex mutex_;
-  // find frame according to addr
-  std::unordered_map<const void*, Frame> all_frames_;
-  // stack frames and its statistics
-  std::map<Stack, StackStat> all_records_;
+  static const size_t kMinSlots = 64;
+
+  // node == kRoot means empty
+  struct StackSlot {
+    uint64_t hash;
+    uint32_t node;
+  };
+
+  StackNodes nodes_;
+  std::vector<uint32_t> edges_;    // node ids, size is power of 2
+  std::vector<StackSlot> stacks_;  // size is power of 2
+  size_t num_stacks_;
+  size_t max_stacks_ = 0;
+
+  static void add_stat(StackStat& stat, const StackStat& other) {
+    stat.count += other.count;
+    stat.score += other.score;
+  }
+
+  uint32_t FindNode(const void* const* addrs, size_t size, uint64_t hash) {
+    if (size == 0) {
+      return kRoot;
+    }
+    if ((num_stacks_ + 1) * 2 > stacks_.size()) {
+      GrowStacks();  // keep load factor <= 0.5
+    }
+    const size_t mask = stacks_.size() - 1;
+    size_t pos = hash & mask;
+    while (stacks_[pos].node != kRoot) {
+      const StackSlot& slot = stacks_[pos];
+      if (slot.hash == hash && Match(slot.node, addrs, size)) {
+        return slot.node;
+      }
+      pos = (pos + 1) & mask;
+    }
+    if (max_stacks_ > 0 && num_stacks_ >= 2 * max_stacks_) {
+      Compact();  // full, find again in the compacted table
+      return FindNode(addrs, size, hash);
+    }
+    // not indexed, intern from the outermost frame
+    uint32_t node = kRoot;
+    for (size_t i = size; i > 0; i--) {
+      node = Child(node, addrs[i - 1]);
+    }
+    stacks_[pos].hash = hash;
+    stacks_[pos].node = node;
+    num_stacks_++;
+    if (max_stacks_ > 0) {
+      // may have been evicted with a count up to the floor, and errors[node]
+      // is 0 as it was not indexed
+      add_stat(nodes_.stats[node], nodes_.floor);
+    }
+    return node;
+  }
+
+  /**
+   * keep max_stacks_ stacks with the largest counts, and rebuild the tree so
+   * nodes only reachable from evicted stacks are freed
+   * - floor is raised to the max count and score of evicted stacks, stored
+   *   errors are rebased so error of kept stacks is unchanged
+   * - score bound assumes scores are not negative
+   */
+  void Compact() {
+    std::vector<StackSlot> slots;
+    slots.reserve(num_stacks_);
+    for (const auto& slot : stacks_) {
+      if (slot.node != kRoot) {
+        slots.emplace_back(slot);
+      }
+    }
+    if (slots.size() <= max_stacks_) {
+      return;
+    }
+    auto by_count = [this](const StackSlot& a, const StackSlot& b) {
+      return nodes_.stats[a.node].count > nodes_.stats[b.node].count;
+    };
+    std::nth_element(slots.begin(), slots.begin() + max_stacks_, slots.end(),
+                     by_count);
+    StackStat floor = nodes_.floor;
+    for (size_t i = max_stacks_; i < slots.size(); i++) {
+      const StackStat& stat = nodes_.stats[slots[i].node];
+      floor.count = std::max(floor.count, stat.count);
+      floor.score = std::max(floor.score, stat.score);
+    }
+
+    StackTable kept;
+    kept.nodes_.errors.assign(1, StackStat{0, 0});
+    kept.nodes_.floor = floor;
+    FramePointers stack;
+    for (size_t i = 0; i < max_stacks_; i++) {
+      stack.clear();
+      for (uint32_t node = slots[i].node; node != kRoot;
+           node = nodes_.parents[node]) {
+        stack.emplace_back(nodes_.addrs[node]);
+      }
+      // unbounded yet, so it is only interned and indexed
+      uint32_t node = kept.FindNode(stack.data(), stack.size(), slots[i].hash);
+      kept.nodes_.stats[node] = nodes_.stats[slots[i].node];
+      StackStat& err = kept.nodes_.errors[node];
+      err = error(slots[i].node);
+      err.count -= floor.count;
+      err.score -= floor.score;
+    }
+    kept.max_stacks_ = max_stacks_;
+    *this = std::move(kept);
+  }
+
+  static uint64_t hash_edge(uint32_t parent, const void* addr) {
+    const void* key[2] = {addr, reinterpret_cast<const void*>(
+                                    static_cast<uintptr_t>(parent))};
+    return hash_stack(key, 2);
+  }
+
+  // match if the path from node to root is exactly addrs
+  bool Match(uint32_t node, const void* const* addrs, size_t size) const {
+    for (size_t i = 0; i < size; i++, node = nodes_.parents[node]) {
+      if (node == kRoot || nodes_.addrs[node] != addrs[i]) {
+        return false;
+      }
+    }
+    return node == kRoot;
+  }
+
+  void GrowEdges() {
+    size_t num_slots = std::max(kMinSlots, edges_.size() * 2);
+    edges_.assign(num_slots, kRoot);
+    const size_t mask = num_slots - 1;
+    for (uint32_t i = kRoot + 1; i < nodes_.addrs.size(); i++) {
+      size_t pos = hash_edge(nodes_.parents[i], nodes_.addrs[i]) & mask;
+      while (edges_[pos] != kRoot) {
+        pos = (pos + 1) & mask;
+      }
+      edges_[pos] = i;
+    }
+  }
 
-  // batch resolve addr to frame, should hold lock
-  void Resolve(const FramePointers&, std::vector<Frame*>&);
+  void GrowStacks() {
+    std::vector<StackSlot> old(std::max(kMinSlots, stacks_.size() * 2),
+                               StackSlot{0, kRoot});
+    old.swap(stacks_);
+    const size_t mask = stacks_.size() - 1;
+    for (const auto& slot : old) {
+      if (slot.node == kRoot) {
+        continue;
+      }
+      size_t pos = slot.hash & mask;
+      while (stacks_[pos].node != kRoot) {
+        pos = (pos + 1) & mask;
+      }
+      stacks_[pos] = slot;
+    }
+  }
 };
 
-static Tracker& GetInstance(uint8_t id) {
-  static Tracker instance[256];
-  return instance[id];
+const uint32_t StackTable::kRoot;
+const size_t StackTable::kMinSlots;
+// selected by SetUnwinder()
+static std::atomic<int> g_unwinder(kUnwindBacktrace);
+
+// stack range [lo, hi) of a thread
+struct StackRange {
+  uintptr_t lo;
+  uintptr_t hi;
+};
+
+// cached per thread, initial-exec so it is safe to read in signal handler
+static thread_local StackRange tls_stack_range
+    __attribute__((tls_model("initial-exec"))) = {0, 0};
+
+// set once init_stack_range() ran on current thread
+static thread_local bool tls_stack_range_tried = false;
+
+// cache stack range of current thread, not async-signal-safe
+// - a failure is cached too, as pthread_getattr_np() of the main thread
+//   reads /proc/self/maps
+static bool init_stack_range() {
+  if (tls_stack_range.hi != 0) {
+    return true;
+  }
+  if (tls_stack_range_tried) {
+    return false;
+  }
+  tls_stack_range_tried = true;
+  pthread_attr_t attr;
+  if (pthread_getattr_np(pthread_self(), &attr) != 0) {
+    return false;
+  }
+  void* addr = nullptr;
+  size_t size = 0;
+  int ret = pthread_attr_getstack(&attr, &addr, &size);
+  pthread_attr_destroy(&attr);
+  if (ret != 0 || addr == nullptr || size == 0) {
+    return false;
+  }
+  tls_stack_range.lo = reinterpret_cast<uintptr_t>(addr);
+  tls_stack_range.hi = tls_stack_range.lo + size;
+  return true;
 }
 
-void Dump(uint8_t id, std::vector<StackFrames>& records) {
-  GetInstance(id).Dump(records);
+// cached stack range of current thread, return false if unknown, as a guess
+// around a garbage fp may fault in signal handler
+static bool get_stack_range(StackRange& range, uintptr_t& max_step) {
+  range = tls_stack_range;
+  if (range.hi == 0) {
+    return false;
+  }
+  max_step = range.hi - range.lo;
+  return true;
 }
 
-// use O2/O3 will break Tracker::kSkipFrames
-#define OPTIMIZE_O1 __attribute__((optimize("O1")))
+// max distance between frames of a stack whose range is unknown
+static const uintptr_t kMaxUnknownFrameStep = 8 << 20;
 
-void OPTIMIZE_O1 Record(uint8_t id, int64_t score) {
-  GetInstance(id).Record(score);
+// read n bytes at addr by a syscall, which fails rather than faults on
+// unmapped memory, async-signal-safe
+static bool checked_read(uintptr_t addr, void* out, size_t n) {
+  struct iovec local = {out, n};
+  struct iovec remote = {reinterpret_cast<void*>(addr), n};
+  return process_vm_readv(getpid(), &local, 1, &remote, 1, 0) ==
+         static_cast<ssize_t>(n);
 }
 
-void OPTIMIZE_O1 Record(uint8_t id, const FramePointers& stack, int64_t score) {
-  GetInstance(id).RecordStack(stack, score);
+/**
+ * walk frame pointers starting from fp, async-signal-safe
+ * - x86_64 and aarch64 frame record: fp[0] is caller fp, fp[1] is return addr
+ * - stop at a fp out of range, misaligned, or not growing toward stack bottom
+ * - frames are read by checked_read() if checked, when the range is a guess
+ */
+static int walk_frame_pointers(uintptr_t fp, const StackRange& range,
+                               uintptr_t max_step, void** addrs,
+                               int max_frames, bool checked = false) {
+  int n = 0;
+  while (n < max_frames) {
+    if (fp < range.lo || fp > range.hi - 2 * sizeof(uintptr_t) ||
+        fp % sizeof(uintptr_t) != 0) {
+      break;
+    }
+    uintptr_t frame[2];
+    if (checked) {
+      if (!checked_read(fp, frame, sizeof(frame))) {
+        break;
+      }
+    } else {
+      memcpy(frame, reinterpret_cast<const void*>(fp), sizeof(frame));
+    }
+    uintptr_t next = frame[0];
+    uintptr_t ret = frame[1];
+    if (ret == 0) {
+      break;
+    }
+    addrs[n++] = reinterpret_cast<void*>(ret);
+    if (next <= fp || next - fp > max_step) {
+      break;  // stack grows down, callers are at higher address
+    }
+    fp = next;
+  }
+  return n;
 }
 
-bool OPTIMIZE_O1 GetBacktrace(FramePointers& stack) {
-  constexpr uint8_t id = std::numeric_limits<uint8_t>::max();
-  return GetInstance(id).GetBacktrace(stack);
+/**
+ * same as backtrace() but walk frame pointers, async-signal-safe
+ * - like backtrace(), addrs[0] is the return address into the caller
+ * - callers need frame pointers, or frames will be skipped
+ * - return 0 if stack range of current thread is unknown
+ */
+static int __attribute__((noinline))
+fp_backtrace(void** addrs, int max_frames) {
+  uintptr_t fp = reinterpret_cast<uintptr_t>(__builtin_frame_address(0));
+  StackRange range;
+  uintptr_t max_step;
+  if (!get_stack_range(range, max_step)) {
+    return 0;
+  }
+  return walk_frame_pointers(fp, range, max_step, addrs, max_frames);
 }
 
-#undef OPTIMIZE_O1
+#if defined(__x86_64__) || defined(__aarch64__)
+#define BTTRACK_HAS_FP_UNWINDER 1
+#else
+#define BTTRACK_HAS_FP_UNWINDER 0
+#endif
 
 /**
- * empty symbol: func = kFuncUnknown, return false
- * demangle success: func = demangled, return true
- * demangle failed: func = symbol, return false
+ * unwind the interrupted stack in a signal handler, async-signal-safe
+ * - context is the third argument of a SA_SIGINFO handler
+ * - addrs[0] is the interrupted pc, others are return addresses
+ * - if stack range of the interrupted thread is unknown, see
+ *   init_stack_range(), frames above the interrupted sp are read by
+ *   checked_read(), a syscall per frame
+ * - without frame pointer unwinder, fall back to backtrace() which includes
+ *   the handler frames and is not guaranteed async-signal-safe
  */
-bool demangle_symbol(std::string& func, const char* symbol) {
-  if (!symbol) {
-    func = kFuncUnknown;
-    return false;
+static int unwind_context(void* context, void** addrs, int max_frames) {
+#if BTTRACK_HAS_FP_UNWINDER
+  const ucontext_t* uc = static_cast<const ucontext_t*>(context);
+#if defined(__x86_64__)
+  uintptr_t pc = uc->uc_mcontext.gregs[REG_RIP];
+  uintptr_t sp = uc->uc_mcontext.gregs[REG_RSP];
+  uintptr_t fp = uc->uc_mcontext.gregs[REG_RBP];
+#else
+  uintptr_t pc = uc->uc_mcontext.pc;
+  uintptr_t sp = uc->uc_mcontext.sp;
+  uintptr_t fp = uc->uc_mcontext.regs[29];
+#endif
+  if (max_frames <= 0) {
+    return 0;
   }
-  int status;
-  char* demangled = abi::__cxa_demangle(symbol, nullptr, nullptr, &status);
-  if (status != 0 || demangled == nullptr) {
-    func.assign(symbol);
-    return false;
+  addrs[0] = reinterpret_cast<void*>(pc);
+  StackRange range;
+  uintptr_t max_step;
+  if (!get_stack_range(range, max_step)) {
+    // a thread never seen by bttrack, frames are above the interrupted sp
+    range.lo = sp;
+    range.hi = UINTPTR_MAX;
+    return 1 + walk_frame_pointers(fp, range, kMaxUnknownFrameStep, addrs + 1,
+                                   max_frames - 1, true);
   }
-  func = demangled;
-  free(demangled);
-  return true;
+  return 1 + walk_frame_pointers(fp, range, max_step, addrs + 1,
+                                 max_frames - 1);
+#else
+  return backtrace(addrs, max_frames);
+#endif
 }
 
-// @ref https://sourceware.org/binutils/docs-2.31/binutils/addr2line.html
-class Addr2lineTool {
- public:
-  struct Context {
-    /**
-     * [in-out] changeable
-     * - frames must not be empty
-     * - frames[]->exec must be the same
-     */
-    std::vector<Frame*> frames;
-    bool display_func;    // [in]
-    bool unwind_inline;   // [in]
-    int ret;              // [out] return code, 0 if success
-    std::string err_msg;  // error message if ret != 0
-  };
+// get backtrace with the selected unwinder, must be inlined into caller so
+// both unwinders skip the same frames
+// - also caches stack range of current thread for later CPU samples
+static inline __attribute__((always_inline)) int unwind(void** addrs,
+                                                        int max_frames) {
+#if BTTRACK_HAS_FP_UNWINDER
+  bool has_range = tls_stack_range.hi != 0 || init_stack_range();
+  if (has_range &&
+      g_unwinder.load(std::memory_order_relaxed) == kUnwindFramePointer) {
+    return fp_backtrace(addrs, max_frames);
+  }
+#endif
+  // @ref https://linux.die.net/man/3/backtrace
+  return backtrace(addrs, max_frames);
+}
+// per thread sampling state of a channel
+struct Sampler {
+  int64_t countdown;  // score or calls until next sample
+  uint32_t epoch;     // reset when not equal to epoch of channel
+};
 
-  static Addr2lineTool* GetInstance() {
-    static Addr2lineTool instance;
-    return &instance;  // singleton
+// xorshift64*, per thread
+static uint64_t next_random() {
+  static thread_local uint64_t state = 0;
+  if (state == 0) {
+    state = get_nanos() ^ reinterpret_cast<uintptr_t>(&state);
+    state |= 1;
   }
+  state ^= state >> 12;
+  state ^= state << 25;
+  state ^= state >> 27;
+  return state * 0x2545f4914f6cdd1dULL;
+}
 
-  static bool is_addr2line_available() {
-    return GetInstance()->is_addr2line_available_;
+// uniform in (0, 1]
+static double next_uniform() {
+  return ((next_random() >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+// exponential interval with given mean, at least 1
+static int64_t next_poisson_interval(int64_t mean) {
+  double interval = -std::log(next_uniform()) * mean;
+  return std::max<int64_t>(1, static_cast<int64_t>(interval));
+}
+
+// round x to an adjacent integer, unbiased in expectation
+static int64_t random_round(double x) {
+  double floor_x = std::floor(x);
+  return static_cast<int64_t>(floor_x) + (next_uniform() <= x - floor_x);
+}
+
+/**
+ * decide if a call with score is sampled, and its unbiased weight
+ * - kSampleScore: like tcmalloc, a call with score s is sampled with
+ *   probability p = 1 - exp(-s / param), and weighted 1/p
+ * - kSampleEveryN: every param-th call is sampled, and weighted param
+ * - return false if not sampled, only decrements countdown
+ */
+static bool sample(Sampler& s, int mode, int64_t param, int64_t score,
+                   StackStat& weight) {
+  if (mode == kSampleEveryN) {
+    if (--s.countdown > 0) {
+      return false;
+    }
+    s.countdown = param;
+    weight.count = param;
+    weight.score = score * param;
+    return true;
+  }
+  // kSampleScore, non-positive score is sampled as 1
+  int64_t size = std::max<int64_t>(score, 1);
+  s.countdown -= size;
+  if (s.countdown > 0) {
+    return false;
+  }
+  s.countdown = next_poisson_interval(param);
+  double scale = 1.0 / -std::expm1(-static_cast<double>(size) / param);
+  weight.count = random_round(scale);
+  weight.score = random_round(score * scale);
+  return true;
+}
+/**
+ * process-wide cache of resolved frames, shared by all channels
+ * - Find() is lock-free, Insert() takes a mutex and is only called for
+ *   addresses never seen before
+ * - frames are never changed or freed after inserted, so Frame* is stable
+ *   for the process lifetime
+ * - open addressing table of frame pointers, a grown table replaces the
+ *   current one, and old tables are kept for readers still probing them
+ */
+class FrameCache {
+ public:
+  static FrameCache* GetInstance() {
+    static FrameCache instance;
+    return &instance;  // singleton
   }
 
-  void Resolve(std::vector<Frame*>& frames) {
-    assert(!frames.empty());
-    auto start = get_nanos();
-    Context ctx;
-    std::vector<bool> resolved(frames.size(), false);
-    size_t i = 0;
-    while (i < frames.size()) {
-      if (resolved[i]) {
-        i++;
-        continue;
-      }
-      // reset states
-      ctx.frames.clear();
-      ctx.unwind_inline = true;              // @todo dynamic option
-      ctx.display_func = ctx.unwind_inline;  // should get inline func name
-      // find all frames with the same exec (no more than batch_size)
-      resolved[i] = true;
-      ctx.frames.push_back(frames[i]);
-      const auto& exec = ctx.frames[0]->exec;
-      int batch_size = 100;
-      for (size_t j = i + 1; j < frames.size(); j++) {
-        if (frames[j]->exec == exec) {
-          ctx.frames.push_back(frames[j]);
-          resolved[j] = true;
-          if (!ctx.display_func && frames[j]->func != kFuncUnknown) {
-            ctx.display_func = true;
-          }
-          if (--batch_size == 0) {
-            break;
-          }
-        }
+  // return the cached frame of addr, or nullptr
+  Frame* Find(const void* addr) const {
+    const Table* table = table_.load(std::memory_order_acquire);
+    const size_t mask = table->size - 1;
+    for (size_t pos = hash_addr(addr) & mask;; pos = (pos + 1) & mask) {
+      Frame* frame = table->slots[pos].load(std::memory_order_acquire);
+      if (frame == nullptr || frame->addr == addr) {
+        return frame;
       }
-      // lookup addr2line
-      BatchResolve(ctx);
-      i++;
-    }
-    double elapsed = (get_nanos() - start) / 1e9;
-    if (elapsed > 1.0) {
-      fprintf(stderr, "Addr2LineTool::Resolve %lu in %.3fs\n", frames.size(),
-              elapsed);
     }
   }
 
-  // all frames should have the same exec path
-  void BatchResolve(Context& ctx) {
-    assert(!ctx.frames.empty());
-    auto& exec = ctx.frames[0]->exec;
-    std::string cmd = "addr2line -e " + exec + " -p";
-    if (ctx.display_func) {
-      cmd += " -f";
-    }
-    if (ctx.unwind_inline) {
-      cmd += " -i";
-    }
-    const auto& base = ctx.frames[0]->faddr;
-    for (auto frame : ctx.frames) {
-      cmd += " ";
-      assert(frame->faddr == base);
-      cmd += to_address(Slice::offset(frame->addr, base));
-    }
-    // fprintf(stderr, " >> cmd: %s\n", cmd.c_str());
-    FILE* pipe = popen(cmd.c_str(), "r");
-    if (!pipe) {
-      ctx.ret = -1;
-      ctx.err_msg = "popen addr2line failed";
-      return;
-    }
-    char buffer[4096];
-    std::string result = "";
-    while (fgets(buffer, sizeof(buffer), pipe) != nullptr) {
-      result += buffer;
+  // cache a resolved frame, or return the frame cached by another thread
+  Frame* Insert(Frame&& frame) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Frame* found = Find(frame.addr);
+    if (found != nullptr) {
+      return found;
     }
-    int status = pclose(pipe);
-    ctx.ret = WEXITSTATUS(status);
-    if (ctx.ret) {
-      ctx.err_msg = "addr2line failed";
-      result.clear();
+    frames_.emplace_back(std::move(frame));
+    Frame* inserted = &frames_.back();
+    Table* table = table_.load(std::memory_order_relaxed);
+    if ((frames_.size() + 1) * 2 > table->size) {
+      table = NewTable(table->size * 2);
+      for (const Frame& f : frames_) {
+        Put(table, const_cast<Frame*>(&f));
+      }
+      table_.store(table, std::memory_order_release);
+    } else {
+      Put(table, inserted);
     }
-    // fprintf(stderr, " >> out: \"%s\"\n", result.c_str());
-    ParseBatch(ctx, result);
+    return inserted;
   }
 
  private:
-  const bool is_addr2line_available_;
+  static const size_t kMinSlots = 1024;
 
-  Addr2lineTool() : is_addr2line_available_(FindAddr2line()) {}
+  struct Table {
+    size_t size;  // power of 2
+    std::unique_ptr<std::atomic<Frame*>[]> slots;
+  };
 
-  // find addr2line using which or whereis
-  static bool FindAddr2line() {
-    FILE* pipe = popen("which addr2line", "r");
-    if (!pipe) {
-      pipe = popen("whereis -b addr2line | grep -q addr2line", "r");
-      if (!pipe) {
-        return false;
-      }
-    }
+  std::mutex mutex_;           // guard insertion
+  std::deque<Frame> frames_;   // stable on emplace_back
+  std::vector<std::unique_ptr<Table>> tables_;  // never freed
+  std::atomic<Table*> table_;  // current table, load factor <= 0.5
 
-    char buffer[256];
-    std::string result = "";
-    while (fgets(buffer, sizeof(buffer), pipe) != nullptr) {
-      result += buffer;
+  FrameCache() { table_.store(NewTable(kMinSlots)); }
+
+  static uint64_t hash_addr(const void* addr) { return hash_stack(&addr, 1); }
+
+  Table* NewTable(size_t size) {
+    tables_.emplace_back(new Table{size, std::unique_ptr<std::atomic<Frame*>[]>(
+                                             new std::atomic<Frame*>[size]())});
+    Table* table = tables_.back().get();
+    for (size_t i = 0; i < size; i++) {
+      table->slots[i].store(nullptr, std::memory_order_relaxed);
     }
-    int status = pclose(pipe);
-    int code = WEXITSTATUS(status);
-    bool ok = code == 0 && !result.empty();
-    if (result[result.size() - 1] != '\n') {
-      result += '\n';
+    return table;
+  }
+
+  static void Put(Table* table, Frame* frame) {
+    const size_t mask = table->size - 1;
+    size_t pos = hash_addr(frame->addr) & mask;
+    while (table->slots[pos].load(std::memory_order_relaxed) != nullptr) {
+      pos = (pos + 1) & mask;
     }
-    if (!ok) {
-      fprintf(stderr, "addr2line not found: returns %d output %s", code,
-              result.c_str());
-    } else {
-      // fprintf(stderr, "addr2line found: %s", result.c_str());
+    table->slots[pos].store(frame, std::memory_order_release);
+  }
+};
+
+const size_t FrameCache::kMinSlots;
+
+/**
+ * demangled names by mangled name, shared by all symbolizer threads
+ * - templated code repeats the same names in thousands of frames and inlined
+ *   frames, and each __cxa_demangle() call allocates its result
+ * - strings are copied into per-shard arenas of large blocks, so a lookup or
+ *   insertion does not allocate per string, shards are picked by hash
+ * - never evicted, bounded by function names of loaded modules
+ */
+class DemangleCache {
+ public:
+  static const size_t kNumShards = 16;
+  static const size_t kBlockSize = 64 << 10;
+
+  static DemangleCache* GetInstance() {
+    static DemangleCache instance;
+    return &instance;  // singleton
+  }
+
+  // set func and demangled if symbol is cached
+  bool Find(const char* symbol, size_t size, std::string& func,
+            bool& demangled) {
+    Key key{Slice(symbol, size), hash_bytes(symbol, size)};
+    Shard& shard = shards_[key.hash % kNumShards];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.names.find(key);
+    if (it == shard.names.end()) {
+      return false;
     }
-    return ok;
+    func.assign(it->second.name.data(), it->second.name.size());
+    demangled = it->second.demangled;
+    return true;
   }
 
-  void ParseBatch(Context& ctx, const std::string& result) {
-    if (result.empty()) {
+  void Insert(const char* symbol, size_t size, const std::string& func,
+              bool demangled) {
+    Key key{Slice(symbol, size), hash_bytes(symbol, size)};
+    Shard& shard = shards_[key.hash % kNumShards];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (shard.names.count(key) > 0) {
       return;
     }
-    Slice data(result);
-    int frame_id = -1;
-    while (frame_id < static_cast<int>(ctx.frames.size()) && !data.empty()) {
-      // find line and shift data
-      Slice line = data.substr(0, data.find('\n'));
-      if (line.empty()) {
-        assert(false);
-        break;
-      }
-      data.pop_front(line.size() + 1);
-      // printf("ParseLine \"%s\", remains %lu\n", line.to_string().c_str(),
-      //        data.size());
-      ParseLine(ctx, frame_id, line);
-    }
+    key.symbol = shard.Copy(symbol, size);
+    Slice name =
+        demangled ? shard.Copy(func.data(), func.size()) : key.symbol;
+    shard.names.emplace(key, Entry{name, demangled});
   }
 
-  /**
-   * always with `-p`, three possible formats:
-   * 1. ` `: no func, no inline
-   *   format "FILE:LINE\n" (1 line), may be trailing with `(discriminator 2)`
-   * 2. `-f`: print func, no inline
-   *   format "FUNC at FILE:LINE\n" (1 line)
+ private:
+  struct Entry {
+    Slice name;
+    bool demangled;
+  };
+
+  // mangled name with its hash, which picks the shard and the bucket
+  struct Key {
+    Slice symbol;
+    uint64_t hash;
+  };
+
+  struct KeyHash {
+    size_t operator()(const Key& key) const { return key.hash; }
+  };
+
+  struct KeyEqual {
+    bool operator()(const Key& a, const Key& b) const {
+      return a.hash == b.hash && a.symbol.size() == b.symbol.size() &&
+             memcmp(a.symbol.data(), b.symbol.data(), a.symbol.size()) == 0;
+    }
+  };
+
+  struct Shard {
+    std::mutex mutex;
+    std::unordered_map<Key, Entry, KeyHash, KeyEqual> names;
+    std::vector<std::unique_ptr<char[]>> blocks;
+    size_t block_used = kBlockSize;  // of blocks.back()
+    std::vector<std::unique_ptr<char[]>> large;  // larger than kBlockSize / 4
+
+    // copy into arena
+    Slice Copy(const char* s, size_t size) {
+      char* dst;
+      if (size > kBlockSize / 4) {
+        large.emplace_back(new char[size]);
+        dst = large.back().get();
+      } else {
+        if (block_used + size > kBlockSize) {
+          blocks.emplace_back(new char[kBlockSize]);
+          block_used = 0;
+        }
+        dst = blocks.back().get() + block_used;
+        block_used += size;
+      }
+      memcpy(dst, s, size);
+      return Slice(dst, size);
+    }
+  };
+
+  Shard shards_[kNumShards];
+
+  DemangleCache() = default;
+
+  // 64-bit hash, 8 bytes per step like hash_stack()
+  static uint64_t hash_bytes(const char* s, size_t size) {
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ size;
+    uint64_t word;
+    for (; size >= 8; s += 8, size -= 8) {
+      memcpy(&word, s, 8);
+      h ^= word;
+      h *= 0xff51afd7ed558ccdULL;
+      h ^= h >> 32;
+    }
+    word = 0;
+    memcpy(&word, s, size);
+    h ^= word;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+  }
+};
+
+const size_t DemangleCache::kNumShards;
+const size_t DemangleCache::kBlockSize;
+
+
+class Tracker;
+static Tracker& GetInstance(uint8_t id);
+
+class Tracker {
+ public:
+  // max stack frames to record
+  static const int kMaxStackFrames = 256;
+  // skip Tracker::Record() and Record()
+  static const int kSkipFrames = 2;
+
+  Tracker() = default;
+  ~Tracker() = default;
+
+  void Record(int64_t score);
+  void RecordStack(const FramePointers& stack, int64_t score);
+  // record a sampled stack with its weight, no sampling applied
+  void RecordWeighted(const void* const* addrs, size_t size,
+                      const StackStat& weight);
+  void SetSampling(Sampling mode, int64_t param);
+  void SetMaxStacks(size_t max_stacks);
+  void Dump(std::vector<StackFrames>&, bool since_last_dump, bool reset);
+  bool DumpRaw(const std::string& path, bool since_last_dump);
+  void DumpCallTree(std::vector<CallNode>&);
+  // append addresses of nodes recorded since last call, for Presymbolizer
+  void CollectNewAddrs(FramePointers& addrs);
+
+  static bool GetBacktrace(FramePointers& stack);
+
+ private:
+  friend Tracker& GetInstance(uint8_t id);
+  friend class Presymbolizer;
+
+  // records of a single thread, all shards are merged in Dump()
+  struct Shard {
+    std::mutex mutex;  // only contended with Dump()
+    StackTable records;
+    bool in_use = false;  // owned by a living thread, guarded by mutex_
+    uint32_t num_collected = 0;  // nodes seen by CollectNewAddrs()
+  };
+
+  // shards of current thread, released to their Tracker on thread exit
+  struct ThreadShards {
+    Shard* shards[256] = {};
+    ~ThreadShards();
+  };
+  // set once ThreadShards of current thread is destroyed, later records of
+  // the exiting thread, like frees in other TLS destructors, go to
+  // exited_shard_
+  static thread_local bool shards_destroyed_;
+
+  uint8_t id_ = 0;
+  // sampling config, epoch is bumped on change to reset per thread state
+  std::atomic<int> sampling_mode_{kSampleAll};
+  std::atomic<int64_t> sampling_param_{1};
+  std::atomic<uint32_t> sampling_epoch_{0};
+  // max stacks of each shard and of dump results, 0 is unbounded
+  std::atomic<size_t> max_stacks_{0};
+  // guard shards_, never held by Record() except a thread's first call
+  mutable std::mutex mutex_;
+  // shared by records of exiting threads, never released
+  std::once_flag exited_once_;
+  Shard* exited_shard_ = nullptr;
+  // serialize dumps, never held by Record()
+  mutable std::mutex dump_mutex_;
+  // records at last Dump(), guarded by dump_mutex_
+  StackNodes last_dump_;
+  // per-thread stack frames and its statistics, never freed
+  std::vector<std::unique_ptr<Shard>> shards_;
+
+  // get shard of current thread, acquire one if not exist
+  Shard* LocalShard();
+  // reuse a released shard or create a new one
+  Shard* AcquireShard();
+  Shard* ExitedShard();
+  void ReleaseShard(Shard* shard);
+  // add to shard, should not hold shard lock
+  static void AddRecord(Shard* shard, const void* const* addrs, size_t size,
+                        const StackStat& weight);
+  // return false if this call is not sampled, otherwise its weight
+  bool Sample(int64_t score, StackStat& weight);
+
+  // merge all shards, and clear them if reset, should hold dump_mutex_
+  void MergeShards(StackTable& records, bool reset);
+  // merge shards for a dump, and sort stacks to report by count, should hold
+  // dump_mutex_
+  void CollectStacks(StackTable& records, bool since_last_dump, bool reset,
+                     std::vector<uint32_t>& stacks);
+  // resolve frame of each node
+  static void ResolveNodes(const StackTable& records,
+                           std::vector<Frame*>& frames);
+  // batch resolve addr to frame, frames are cached by FrameCache
+  static void Resolve(const FramePointers&, std::vector<Frame*>&);
+};
+
+static Tracker& GetInstance(uint8_t id) {
+  static struct Instances {
+    Tracker tracker[256];
+    Instances() {
+      for (int i = 0; i < 256; i++) {
+        tracker[i].id_ = static_cast<uint8_t>(i);
+      }
+    }
+  } instances;
+  return instances.tracker[id];
+}
+
+/**
+ * SIGPROF driven sampling CPU profiler
+ * - setitimer(ITIMER_PROF) delivers SIGPROF to the thread consuming CPU
+ * - signal handler unwinds the interrupted stack into a preallocated ring,
+ *   without locks or allocation
+ * - a drain thread moves samples from the ring into the channel, score of each
+ *   sample is the sampling period in microseconds
+ */
+class CpuProfiler {
+ public:
+  // max stack frames of a sample
+  static const int kMaxSampleFrames = 128;
+  // number of samples in ring
+  static const int kNumSlots = 1024;
+  // interval to drain ring into channel
+  static const int kDrainIntervalMs = 50;
+
+  static CpuProfiler* GetInstance() {
+    static CpuProfiler instance;
+    return &instance;  // singleton
+  }
+
+  bool Start(uint8_t id, int hz) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (running_ || hz <= 0 || hz > 1000000) {
+      return false;
+    }
+    if (!slots_) {
+      slots_.reset(new Slot[kNumSlots]);
+    }
+    if (!handler_installed_) {
+      // never uninstalled, default action of SIGPROF terminates process
+      struct sigaction sa;
+      memset(&sa, 0, sizeof(sa));
+      sa.sa_sigaction = &CpuProfiler::SignalHandler;
+      sa.sa_flags = SA_SIGINFO | SA_RESTART;
+      sigemptyset(&sa.sa_mask);
+      if (sigaction(SIGPROF, &sa, nullptr) != 0) {
+        return false;
+      }
+      handler_installed_ = true;
+    }
+    init_stack_range();  // unwind samples of the starting thread
+    id_ = id;
+    period_us_ = 1000000 / hz;
+    dropped_.store(0, std::memory_order_relaxed);
+    running_ = true;
+    active_.store(this, std::memory_order_release);
+    drain_thread_ = std::thread(&CpuProfiler::DrainLoop, this);
+
+    struct itimerval timer;
+    timer.it_interval.tv_sec = period_us_ / 1000000;
+    timer.it_interval.tv_usec = period_us_ % 1000000;
+    timer.it_value = timer.it_interval;
+    if (setitimer(ITIMER_PROF, &timer, nullptr) != 0) {
+      StopLocked();
+      return false;
+    }
+    return true;
+  }
+
+  void Stop() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (running_) {
+      StopLocked();
+    }
+  }
+
+ private:
+  enum SlotState : uint32_t { kEmpty = 0, kWriting = 1, kFull = 2 };
+
+  struct Slot {
+    std::atomic<uint32_t> state{kEmpty};
+    int depth = 0;
+    void* addrs[kMaxSampleFrames];
+  };
+
+  // set while running, read by signal handler
+  static std::atomic<CpuProfiler*> active_;
+
+  std::mutex mutex_;  // guard Start() and Stop()
+  bool handler_installed_ = false;
+  bool running_ = false;
+  uint8_t id_ = 0;
+  int64_t period_us_ = 0;
+  std::unique_ptr<Slot[]> slots_;
+  std::atomic<uint64_t> write_pos_{0};
+  std::atomic<uint64_t> dropped_{0};  // samples dropped as ring is full
+  std::thread drain_thread_;
+  std::mutex drain_mutex_;
+  std::condition_variable drain_cv_;
+  bool stop_drain_ = false;
+
+  CpuProfiler() = default;
+
+  void StopLocked() {
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, nullptr);
+    active_.store(nullptr, std::memory_order_release);
+    {
+      std::lock_guard<std::mutex> lock(drain_mutex_);
+      stop_drain_ = true;
+    }
+    drain_cv_.notify_all();
+    drain_thread_.join();
+    stop_drain_ = false;
+    running_ = false;
+    Drain();  // samples written after the last round
+    uint64_t dropped = dropped_.load(std::memory_order_relaxed);
+    if (dropped > 0) {
+      fprintf(stderr, "CpuProfiler: %lu samples dropped\n", dropped);
+    }
+  }
+
+  // async-signal-safe, claim a slot of ring or drop the sample
+  static void SignalHandler(int, siginfo_t*, void* context) {
+    CpuProfiler* self = active_.load(std::memory_order_acquire);
+    if (self == nullptr) {
+      return;  // stopped, ignore pending signal
+    }
+    int saved_errno = errno;
+    uint64_t pos = self->write_pos_.fetch_add(1, std::memory_order_relaxed);
+    Slot& slot = self->slots_[pos % kNumSlots];
+    uint32_t expected = kEmpty;
+    if (slot.state.compare_exchange_strong(expected, kWriting,
+                                           std::memory_order_acquire)) {
+      slot.depth = unwind_context(context, slot.addrs, kMaxSampleFrames);
+      slot.state.store(kFull, std::memory_order_release);
+    } else {
+      self->dropped_.fetch_add(1, std::memory_order_relaxed);
+    }
+    errno = saved_errno;
+  }
+
+  void DrainLoop() {
+    std::unique_lock<std::mutex> lock(drain_mutex_);
+    while (!stop_drain_) {
+      drain_cv_.wait_for(lock, std::chrono::milliseconds(kDrainIntervalMs));
+      Drain();
+    }
+  }
+
+  // move all full slots into channel, samples are already taken by timer so
+  // not sampled again by SetSampling() of the channel
+  void Drain() {
+    FramePointers stack;
+    const StackStat weight{1, period_us_};
+    for (int i = 0; i < kNumSlots; i++) {
+      Slot& slot = slots_[i];
+      if (slot.state.load(std::memory_order_acquire) != kFull) {
+        continue;
+      }
+      stack.assign(slot.addrs, slot.addrs + slot.depth);
+      slot.state.store(kEmpty, std::memory_order_release);
+      if (!stack.empty()) {
+        bttrack::GetInstance(id_).RecordWeighted(stack.data(), stack.size(),
+                                                 weight);
+      }
+    }
+  }
+};
+
+std::atomic<CpuProfiler*> CpuProfiler::active_{nullptr};
+// set while running profiler code in current thread, so allocations of
+// profiler itself are neither sampled nor recurse into the hooks
+static thread_local bool tls_in_heap_hook
+    __attribute__((tls_model("initial-exec"))) = false;
+
+// mark current thread as in hook during its scope
+class ScopedHeapHookGuard {
+ public:
+  ScopedHeapHookGuard() : prev_(tls_in_heap_hook) { tls_in_heap_hook = true; }
+  ~ScopedHeapHookGuard() { tls_in_heap_hook = prev_; }
+
+ private:
+  bool prev_;
+};
+
+/**
+ * heap allocation profiler, fed by malloc hooks in malloc_hook.ipp
+ * - allocations are poisson sampled by size, like kSampleScore
+ * - alloc channel: sampled allocations, score is bytes
+ * - live channel: sampled allocations not freed yet, a free debits the count
+ *   and bytes of the allocating stack
+ */
+class HeapProfiler {
+ public:
+  // max stack frames of an allocation
+  static const int kMaxAllocFrames = 64;
+  // skip HeapProfiler::OnAlloc() and the hook
+  static const int kSkipFrames = 2;
+  // live samples are sharded by address
+  static const int kNumShards = 64;
+
+  static bool active() { return active_.load(std::memory_order_relaxed); }
+
+  static bool Start(uint8_t alloc_id, uint8_t live_id, int64_t sample_bytes) {
+    ScopedHeapHookGuard guard;
+    std::lock_guard<std::mutex> lock(GetState().mutex);
+    if (active()) {
+      return false;
+    }
+    alloc_id_ = alloc_id;
+    live_id_ = live_id;
+    sample_bytes_ = std::max<int64_t>(sample_bytes, 1);
+    epoch_.fetch_add(1, std::memory_order_relaxed);
+    active_.store(true, std::memory_order_release);
+    return true;
+  }
+
+  static void Stop() {
+    ScopedHeapHookGuard guard;
+    std::lock_guard<std::mutex> lock(GetState().mutex);
+    active_.store(false, std::memory_order_release);
+    // later frees of sampled allocations are not debited
+    for (auto& shard : GetState().shards) {
+      std::lock_guard<std::mutex> shard_lock(shard.mutex);
+      shard.samples.clear();
+    }
+    num_samples_.store(0, std::memory_order_relaxed);
+  }
+
+  // called by hooks after allocated, ptr may be nullptr
+  static void __attribute__((noinline, optimize("no-omit-frame-pointer")))
+  OnAlloc(void* ptr, size_t size) {
+    if (ptr == nullptr || tls_in_heap_hook) {
+      return;
+    }
+    static thread_local Sampler sampler
+        __attribute__((tls_model("initial-exec"))) = {0, 0};
+    uint32_t epoch = epoch_.load(std::memory_order_relaxed);
+    if (sampler.epoch != epoch) {
+      sampler.epoch = epoch;
+      sampler.countdown = next_poisson_interval(sample_bytes_);
+    }
+    StackStat weight;
+    int64_t bytes = static_cast<int64_t>(size);
+    if (!sample(sampler, kSampleScore, sample_bytes_, bytes, weight)) {
+      return;
+    }
+
+    ScopedHeapHookGuard guard;
+    void* addrs[kMaxAllocFrames];
+    int num_frames = unwind(addrs, kMaxAllocFrames);
+    if (num_frames <= kSkipFrames) {
+      return;
+    }
+    const void* const* stack = addrs + kSkipFrames;
+    size_t depth = num_frames - kSkipFrames;
+    GetInstance(alloc_id_).RecordWeighted(stack, depth, weight);
+    GetInstance(live_id_).RecordWeighted(stack, depth, weight);
+
+    Shard& shard = GetShard(ptr);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto& s = shard.samples[ptr];
+    s.stack.assign(stack, stack + depth);
+    s.weight = weight;
+    num_samples_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // sampled allocation not freed yet
+  struct LiveSample {
+    FramePointers stack;
+    StackStat weight;
+  };
+
+  // called by hooks before freed
+  static void OnFree(void* ptr) {
+    LiveSample s;
+    if (TakeSample(ptr, s)) {
+      Debit(s);
+    }
+  }
+
+  // remove sample of ptr before it is freed, so its address reused by
+  // another thread is not mixed up, return false if not sampled
+  static bool TakeSample(void* ptr, LiveSample& s) {
+    if (ptr == nullptr || tls_in_heap_hook ||
+        num_samples_.load(std::memory_order_relaxed) == 0) {
+      return false;
+    }
+    ScopedHeapHookGuard guard;
+    Shard& shard = GetShard(ptr);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.samples.find(ptr);
+    if (it == shard.samples.end()) {
+      return false;
+    }
+    s = std::move(it->second);
+    shard.samples.erase(it);
+    num_samples_.fetch_sub(1, std::memory_order_relaxed);
+    return true;
+  }
+
+  // put back a sample taken by TakeSample() as ptr is not freed
+  static void RestoreSample(void* ptr, LiveSample& s) {
+    ScopedHeapHookGuard guard;
+    if (!active()) {
+      return;  // samples are cleared by Stop()
+    }
+    Shard& shard = GetShard(ptr);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    shard.samples[ptr] = std::move(s);
+    num_samples_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // debit the allocating stack of a freed sample
+  static void Debit(const LiveSample& s) {
+    ScopedHeapHookGuard guard;
+    // unsigned count wraps back
+    StackStat debit{0 - s.weight.count, -s.weight.score};
+    GetInstance(live_id_).RecordWeighted(s.stack.data(), s.stack.size(),
+                                         debit);
+  }
+
+ private:
+  struct Shard {
+    std::mutex mutex;
+    std::unordered_map<const void*, LiveSample> samples;
+  };
+
+  struct State {
+    std::mutex mutex;  // guard Start() and Stop()
+    Shard shards[kNumShards];
+  };
+
+  static std::atomic<bool> active_;
+  static std::atomic<uint32_t> epoch_;
+  static std::atomic<int64_t> num_samples_;
+  static uint8_t alloc_id_;
+  static uint8_t live_id_;
+  static int64_t sample_bytes_;
+
+  static State& GetState() {
+    static State state;
+    return state;
+  }
+
+  static Shard& GetShard(const void* ptr) {
+    // allocations are at least 16 bytes aligned
+    uintptr_t key = reinterpret_cast<uintptr_t>(ptr) >> 4;
+    return GetState().shards[(key ^ (key >> 7)) % kNumShards];
+  }
+};
+
+std::atomic<bool> HeapProfiler::active_{false};
+std::atomic<uint32_t> HeapProfiler::epoch_{0};
+std::atomic<int64_t> HeapProfiler::num_samples_{0};
+uint8_t HeapProfiler::alloc_id_ = 0;
+uint8_t HeapProfiler::live_id_ = 0;
+int64_t HeapProfiler::sample_bytes_ = 1;
+
+void Dump(uint8_t id, std::vector<StackFrames>& records,
+          bool since_last_dump) {
+  GetInstance(id).Dump(records, since_last_dump, false);
+}
+
+void DumpAndReset(uint8_t id, std::vector<StackFrames>& records) {
+  GetInstance(id).Dump(records, false, true);
+}
+
+bool DumpRaw(uint8_t id, const std::string& path, bool since_last_dump) {
+  return GetInstance(id).DumpRaw(path, since_last_dump);
+}
+
+void DumpCallTree(uint8_t id, std::vector<CallNode>& nodes) {
+  GetInstance(id).DumpCallTree(nodes);
+}
+
+// use O2/O3 will break Tracker::kSkipFrames
+// keep frame pointers so kUnwindFramePointer skips the same frames
+#define OPTIMIZE_O1 \
+  __attribute__((optimize("O1", "no-omit-frame-pointer")))
+
+void OPTIMIZE_O1 Record(uint8_t id, int64_t score) {
+  GetInstance(id).Record(score);
+}
+
+void OPTIMIZE_O1 Record(uint8_t id, const FramePointers& stack, int64_t score) {
+  GetInstance(id).RecordStack(stack, score);
+}
+
+bool OPTIMIZE_O1 GetBacktrace(FramePointers& stack) {
+  constexpr uint8_t id = std::numeric_limits<uint8_t>::max();
+  return GetInstance(id).GetBacktrace(stack);
+}
+
+#undef OPTIMIZE_O1
+
+void SetSampling(uint8_t id, Sampling mode, int64_t param) {
+  GetInstance(id).SetSampling(mode, param);
+}
+
+void SetMaxStacks(uint8_t id, size_t max_stacks) {
+  GetInstance(id).SetMaxStacks(max_stacks);
+}
+
+bool StartCpuProfiler(uint8_t id, int hz) {
+  return CpuProfiler::GetInstance()->Start(id, hz);
+}
+
+void StopCpuProfiler() { CpuProfiler::GetInstance()->Stop(); }
+
+bool RegisterProfiledThread() { return init_stack_range(); }
+
+bool StartHeapProfiler(uint8_t alloc_id, uint8_t live_id,
+                       int64_t sample_bytes) {
+#ifdef BTTRACK_HEAP_PROFILER
+  return HeapProfiler::Start(alloc_id, live_id, sample_bytes);
+#else
+  (void)alloc_id;
+  (void)live_id;
+  (void)sample_bytes;
+  return false;
+#endif
+}
+
+void StopHeapProfiler() { HeapProfiler::Stop(); }
+
+void SetUnwinder(Unwinder unwinder) {
+  g_unwinder.store(unwinder, std::memory_order_relaxed);
+}
+
+/**
+ * empty symbol: func = kFuncUnknown, return false
+ * demangle success: func = demangled, return true
+ * demangle failed: func = symbol, return false
+ */
+bool demangle_symbol(std::string& func, const char* symbol) {
+  if (!symbol) {
+    func = kFuncUnknown;
+    return false;
+  }
+  DemangleCache* cache = DemangleCache::GetInstance();
+  size_t size = strlen(symbol);
+  bool ok;
+  if (cache->Find(symbol, size, func, ok)) {
+    return ok;
+  }
+  int status;
+  char* demangled = abi::__cxa_demangle(symbol, nullptr, nullptr, &status);
+  ok = status == 0 && demangled != nullptr;
+  if (ok) {
+    func = demangled;
+    free(demangled);
+  } else {
+    func.assign(symbol, size);
+  }
+  cache->Insert(symbol, size, func, ok);
+  return ok;
+}
+
+// max threads to resolve frames, including the calling thread
+static const size_t kMaxSymbolizeThreads = 8;
+// set by SetSymbolizeThreads(), 0 is by hardware concurrency
+static std::atomic<size_t> g_symbolize_threads(0);
+// set on a thread whose symbolization must stay on itself, e.g. the
+// Presymbolizer whose CPU budget is of one thread
+static thread_local bool tls_symbolize_serial = false;
+
+/**
+ * run task(0..num_tasks-1) on the calling thread and threads spawned for
+ * this call, return when all are done
+ * - threads are per call rather than a persistent pool, as symbolization is
+ *   rare and takes far longer than spawning a few threads, and the threads
+ *   inherit nice value of the caller
+ */
+static void run_parallel(size_t num_tasks,
+                         const std::function<void(size_t)>& task) {
+  size_t max_threads = g_symbolize_threads.load(std::memory_order_relaxed);
+  if (max_threads == 0) {
+    max_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  if (tls_symbolize_serial) {
+    max_threads = 1;
+  }
+  size_t num_threads =
+      std::min<size_t>({num_tasks, kMaxSymbolizeThreads, max_threads});
+  std::atomic<size_t> next(0);
+  auto worker = [&]() {
+    ScopedHeapHookGuard guard;  // not to profile symbolizer itself
+    for (size_t i; (i = next.fetch_add(1)) < num_tasks;) {
+      task(i);
+    }
+  };
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < num_threads; i++) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+}
+
+// frames of one module resolved by a task of run_parallel()
+struct ModuleChunk {
+  const std::string* exec;
+  Frame** frames;
+  size_t num_frames;
+  uint64_t start_nanos;
+  uint64_t end_nanos;
+};
+
+/**
+ * group frames by exec, and resolve modules concurrently
+ * - a module with many frames is split into chunks of at least
+ *   min_chunk_frames frames, up to one chunk per thread
+ * - time of each module is reported if all take more than 1s
+ */
+static void resolve_by_module(std::vector<Frame*>& frames, const char* tool,
+                              size_t min_chunk_frames,
+                              const std::function<void(ModuleChunk&)>& fn) {
+  auto start = get_nanos();
+  std::unordered_map<std::string, std::vector<Frame*>> modules;
+  for (Frame* frame : frames) {
+    modules[frame->exec].emplace_back(frame);
+  }
+  std::vector<ModuleChunk> chunks;
+  for (auto& it : modules) {
+    auto& module_frames = it.second;
+    size_t num_chunks =
+        std::min(kMaxSymbolizeThreads,
+                 std::max<size_t>(1, module_frames.size() / min_chunk_frames));
+    size_t chunk_size = (module_frames.size() + num_chunks - 1) / num_chunks;
+    for (size_t i = 0; i < module_frames.size(); i += chunk_size) {
+      chunks.push_back(ModuleChunk{
+          &it.first, module_frames.data() + i,
+          std::min(chunk_size, module_frames.size() - i), 0, 0});
+    }
+  }
+  // larger chunks first, so the slowest module starts early
+  std::sort(chunks.begin(), chunks.end(),
+            [](const ModuleChunk& a, const ModuleChunk& b) {
+              return a.num_frames > b.num_frames;
+            });
+  run_parallel(chunks.size(), [&](size_t i) {
+    chunks[i].start_nanos = get_nanos();
+    fn(chunks[i]);
+    chunks[i].end_nanos = get_nanos();
+  });
+
+  double elapsed = (get_nanos() - start) / 1e9;
+  if (elapsed > 1.0) {
+    fprintf(stderr, "%s::Resolve %lu in %.3fs\n", tool, frames.size(),
+            elapsed);
+    for (const auto& it : modules) {
+      uint64_t first = UINT64_MAX, last = 0;
+      size_t num_chunks = 0;
+      for (const auto& chunk : chunks) {
+        if (chunk.exec == &it.first) {
+          first = std::min(first, chunk.start_nanos);
+          last = std::max(last, chunk.end_nanos);
+          num_chunks++;
+        }
+      }
+      fprintf(stderr, "  %s: %lu in %.3fs by %lu threads\n", it.first.c_str(),
+              it.second.size(), (last - first) / 1e9, num_chunks);
+    }
+  }
+}
+
+/**
+ * resolve frames by addr2line, one long-lived coprocess per exec
+ * - `addr2line -e EXEC -f -i -p` reads addresses from stdin, so DWARF of an
+ *   exec is parsed once per process lifetime
+ * - addresses are written in pipelined batches, each batch ends with a
+ *   sentinel address, whose output tells where the last frame ends
+ * - a coprocess failed or timed out is killed, and respawned by next batch
+ * @ref https://sourceware.org/binutils/docs-2.31/binutils/addr2line.html
+ */
+class Addr2lineTool {
+ public:
+  struct Context {
+    /**
+     * [in-out] changeable
+     * - frames must not be empty
+     * - frames[]->exec must be the same
+     */
+    std::vector<Frame*> frames;
+    int ret;              // [out] return code, 0 if success
+    std::string err_msg;  // error message if ret != 0
+  };
+
+  // addresses per batch, and batches written ahead of reading
+  static const size_t kBatchSize = 100;
+  static const size_t kMaxPendingBatches = 2;
+  // max wait for output of a batch
+  static const int kTimeoutMs = 30000;
+  // min frames worth another coprocess, which parses DWARF again
+  static const size_t kMinChunkFrames = 1000;
+
+  static Addr2lineTool* GetInstance() {
+    static Addr2lineTool instance;
+    return &instance;  // singleton
+  }
+
+  static bool is_addr2line_available() {
+    return GetInstance()->is_addr2line_available_;
+  }
+
+  ~Addr2lineTool() {
+    for (auto& it : modules_) {
+      for (auto& cp : it.second.idle) {
+        Stop(*cp);
+      }
+    }
+  }
+
+  // modules are resolved concurrently, a large module by several coprocesses
+  void Resolve(std::vector<Frame*>& frames) {
+    assert(!frames.empty());
+    resolve_by_module(frames, "Addr2LineTool", kMinChunkFrames,
+                      [this](ModuleChunk& chunk) {
+                        Context ctx;
+                        ctx.frames.assign(chunk.frames,
+                                          chunk.frames + chunk.num_frames);
+                        BatchResolve(ctx);
+                      });
+  }
+
+  // all frames should have the same exec path
+  void BatchResolve(Context& ctx) {
+    assert(!ctx.frames.empty());
+    ctx.ret = 0;
+    ctx.err_msg.clear();
+    const auto& exec = ctx.frames[0]->exec;
+    std::unique_ptr<Coprocess> cp_ptr = Acquire(exec, ctx);
+    if (!cp_ptr) {
+      return;
+    }
+    Coprocess& cp = *cp_ptr;
+
+    // write batches ahead, so addr2line keeps busy while output is parsed
+    const size_t num_frames = ctx.frames.size();
+    const auto& base = ctx.frames[0]->faddr;
+    size_t written = 0;
+    for (size_t begin = 0; begin < num_frames; begin += kBatchSize) {
+      while (written < num_frames &&
+             written < begin + kBatchSize * kMaxPendingBatches) {
+        size_t end = std::min(written + kBatchSize, num_frames);
+        std::string input;
+        for (size_t j = written; j < end; j++) {
+          assert(ctx.frames[j]->faddr == base);
+          input += to_address(Slice::offset(ctx.frames[j]->addr, base));
+          input += '\n';
+        }
+        input += kSentinel;
+        if (!Write(cp, input)) {
+          break;
+        }
+        written = end;
+      }
+      size_t end = std::min(begin + kBatchSize, num_frames);
+      if (written < end || !ReadBatch(cp, ctx.frames.data() + begin,
+                                      end - begin)) {
+        // no retry, frames are left unresolved, and not to respawn if it
+        // never worked
+        Stop(cp);
+        std::lock_guard<std::mutex> lock(mutex_);
+        modules_[exec].failed = cp.num_batches == 0;
+        ctx.ret = -1;
+        ctx.err_msg = "addr2line failed";
+        return;
+      }
+      cp.num_batches++;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    modules_[exec].idle.emplace_back(std::move(cp_ptr));
+  }
+
+ private:
+  // its output is the only line of the batch starting with "??"
+  static const char* kSentinel;
+
+  struct Coprocess {
+    pid_t pid = -1;
+    int in = -1;             // write end of its stdin
+    int out = -1;            // read end of its stdout
+    size_t num_batches = 0;  // resolved by this coprocess
+    std::string buffer;      // read but not parsed
+  };
+
+  struct Module {
+    bool failed = false;  // not to respawn, e.g. exec is not readable
+    std::vector<std::unique_ptr<Coprocess>> idle;
+  };
+
+  const bool is_addr2line_available_;
+  std::mutex mutex_;  // guard modules_
+  std::unordered_map<std::string, Module> modules_;
+
+  Addr2lineTool() : is_addr2line_available_(FindAddr2line()) {}
+
+  // take an idle coprocess of exec, or spawn one
+  std::unique_ptr<Coprocess> Acquire(const std::string& exec, Context& ctx) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      Module& module = modules_[exec];
+      if (module.failed) {
+        ctx.ret = -1;
+        ctx.err_msg = "addr2line failed before";
+        return nullptr;
+      }
+      if (!module.idle.empty()) {
+        std::unique_ptr<Coprocess> cp = std::move(module.idle.back());
+        module.idle.pop_back();
+        return cp;
+      }
+    }
+    std::unique_ptr<Coprocess> cp(new Coprocess());
+    if (!Spawn(exec, *cp)) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      modules_[exec].failed = true;
+      ctx.ret = -1;
+      ctx.err_msg = "spawn addr2line failed";
+      return nullptr;
+    }
+    return cp;
+  }
+
+  static bool Spawn(const std::string& exec, Coprocess& cp) {
+    int in[2], out[2];
+    if (pipe2(in, O_CLOEXEC) != 0) {
+      return false;
+    }
+    if (pipe2(out, O_CLOEXEC) != 0) {
+      close(in[0]);
+      close(in[1]);
+      return false;
+    }
+    // posix_spawn does not copy page tables of a large process like fork
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, in[0], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, out[1], STDOUT_FILENO);
+    const char* argv[] = {"addr2line", "-e", exec.c_str(), "-f",
+                          "-i",        "-p", nullptr};
+    int ret = posix_spawnp(&cp.pid, "addr2line", &actions, nullptr,
+                           const_cast<char**>(argv), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(in[0]);
+    close(out[1]);
+    if (ret != 0) {
+      cp.pid = -1;
+      close(in[1]);
+      close(out[0]);
+      return false;
+    }
+    cp.in = in[1];
+    cp.out = out[0];
+    cp.buffer.clear();
+    return true;
+  }
+
+  static void Stop(Coprocess& cp) {
+    if (cp.pid < 0) {
+      return;
+    }
+    close(cp.in);
+    close(cp.out);
+    kill(cp.pid, SIGKILL);
+    waitpid(cp.pid, nullptr, 0);
+    cp.pid = -1;
+    cp.in = cp.out = -1;
+    cp.buffer.clear();
+  }
+
+  // write all, SIGPIPE of an exited coprocess is blocked and consumed
+  static bool Write(Coprocess& cp, const std::string& data) {
+    sigset_t pipe_set, old_set;
+    sigemptyset(&pipe_set);
+    sigaddset(&pipe_set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_set, &old_set);
+    size_t pos = 0;
+    while (pos < data.size()) {
+      ssize_t n = write(cp.in, data.data() + pos, data.size() - pos);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        break;
+      }
+      pos += n;
+    }
+    if (pos < data.size()) {
+      struct timespec zero = {0, 0};
+      sigtimedwait(&pipe_set, nullptr, &zero);
+    }
+    pthread_sigmask(SIG_SETMASK, &old_set, nullptr);
+    return pos == data.size();
+  }
+
+  // read a line without '\n', return false on EOF or timeout
+  static bool ReadLine(Coprocess& cp, std::string& line) {
+    size_t pos;
+    while ((pos = cp.buffer.find('\n')) == std::string::npos) {
+      struct pollfd pfd = {cp.out, POLLIN, 0};
+      int ret = poll(&pfd, 1, kTimeoutMs);
+      if (ret < 0 && errno == EINTR) {
+        continue;
+      }
+      if (ret <= 0) {
+        return false;
+      }
+      char buf[4096];
+      ssize_t n = read(cp.out, buf, sizeof(buf));
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        return false;
+      }
+      cp.buffer.append(buf, n);
+    }
+    line.assign(cp.buffer, 0, pos);
+    cp.buffer.erase(0, pos + 1);
+    return true;
+  }
+
+  // read output of a batch of frames and its sentinel
+  bool ReadBatch(Coprocess& cp, Frame** frames, size_t num_frames) {
+    static const Slice kInlinedBy(" (inlined by) ", 14);
+    std::string buffer;
+    int frame_id = -1;
+    while (ReadLine(cp, buffer)) {
+      Slice line(buffer);
+      if (line.empty()) {
+        continue;
+      }
+      if (!line.starts_with(kInlinedBy) &&
+          frame_id + 1 == static_cast<int>(num_frames)) {
+        return line.starts_with(Slice("??", 2));  // sentinel
+      }
+      if (frame_id < 0 && line.starts_with(kInlinedBy)) {
+        return false;  // out of sync
+      }
+      ParseLine(frames, frame_id, line);
+    }
+    return false;
+  }
+
+  // find addr2line using which or whereis
+  static bool FindAddr2line() {
+    FILE* pipe = popen("which addr2line", "r");
+    if (!pipe) {
+      pipe = popen("whereis -b addr2line | grep -q addr2line", "r");
+      if (!pipe) {
+        return false;
+      }
+    }
+
+    char buffer[256];
+    std::string result = "";
+    while (fgets(buffer, sizeof(buffer), pipe) != nullptr) {
+      result += buffer;
+    }
+    int status = pclose(pipe);
+    int code = WEXITSTATUS(status);
+    bool ok = code == 0 && !result.empty();
+    if (result.empty() || result.back() != '\n') {
+      result += '\n';
+    }
+    if (!ok) {
+      fprintf(stderr, "addr2line not found: returns %d output %s", code,
+              result.c_str());
+    } else {
+      // fprintf(stderr, "addr2line found: %s", result.c_str());
+    }
+    return ok;
+  }
+
+  /**
+   * always with `-p`, three possible formats:
+   * 1. ` `: no func, no inline
+   *   format "FILE:LINE\n" (1 line), may be trailing with `(discriminator 2)`
+   * 2. `-f`: print func, no inline
+   *   format "FUNC at FILE:LINE\n" (1 line)
    * 3. `-i`: unwind inline, no func (deprecated)
    *   - "FILE:LINE\n" (1 line)
    *   - "FILE:LINE\n (inlined by) FILE:LINE\n..." (1+n lines)
@@ -365,437 +1894,5326 @@ class Addr2lineTool {
    *   - "FUNC at FILE:LINE\n" (1 line)
    *   - "FUNC at FILE:LINE\n (inlined by) FUNC at FILE:LINE\n..." (1+n lines)
    */
-  void ParseLine(Context& ctx, int& frame_id, Slice& line) {
-    static const Slice kInlinedBy(" (inlined by) ", 14);
-    static const Slice kAt(" at ", 4);
+  void ParseLine(Frame** frames, int& frame_id, Slice& line) {
+    static const Slice kInlinedBy(" (inlined by) ", 14);
+    static const Slice kAt(" at ", 4);
+
+    // (optional) parse " (inlined by) "
+    bool is_inlined_by = line.starts_with(kInlinedBy);
+    if (is_inlined_by) {
+      line.pop_front(kInlinedBy.size());
+    } else {
+      frame_id++;  // a new frame
+    }
+    assert(frame_id >= 0);  // starts from -1
+    Frame* frame = frames[frame_id];
+
+    // (optional) parse "FUNC at "
+    Slice func;
+    std::string func_str;
+    size_t pos_at = line.find(kAt);
+    if (pos_at != Slice::npos) {
+      func = line.substr(0, pos_at);
+      line.pop_front(pos_at + kAt.size());
+      demangle_symbol(func_str, func.make_cstr());
+    }
+
+    // parse "FILE:LINE"
+    size_t pos_colon = line.find(':');
+    if (pos_colon == Slice::npos) {
+      fprintf(stderr, "ParseLine: no colon found. ERROR!!!");
+      return;
+    }
+    size_t len_file = pos_colon;
+    size_t len_line = line.size() - pos_colon - 1;
+    if (len_file == 0 || len_line == 0) {
+      fprintf(stderr, "ParseLine: file or line length is 0. ERROR!!!");
+      return;
+    }
+    std::string file = line.substr(0, len_file).to_string();
+    int line_no = ParseLineNumber(line.substr(pos_colon + 1, len_line));
+
+    if (is_inlined_by) {
+      Frame::Func f{
+          .name = func.empty() ? kFuncUnknown : std::move(func_str),
+          .file = std::move(file),
+          .line = line_no,
+      };
+      frame->inlined_by.emplace_back(f);
+      // printf("  [inline] %s at %s:%d\n", f.name.c_str(), f.file.c_str(),
+      //        line_no);
+    } else {
+      frame->file = std::move(file);
+      frame->line = line_no;
+      if (!func_str.empty() && frame->func != func_str) {
+        // always overwrite because func_str may be inline function
+        frame->func = std::move(func_str);
+      }
+      // printf("  [new] file '%s' line %d func %s\n", frame->file.c_str(),
+      //        frame->line, func.empty() ? "(null)" : frame->func.c_str());
+    }
+  }
+
+  int ParseLineNumber(const Slice& s) noexcept {
+    int ret = -1;
+    if (s[0] == '?') {
+      return ret;
+    }
+    try {
+      ret = std::stoi(s.to_string());
+    } catch (...) {
+      // ignore parse error
+    }
+    return ret;
+  }
+
+  std::string to_address(uintptr_t addr) {
+    char buf[36];  // 64b "0xFEDCBA9876543210" -> 18, 128b -> 34
+    snprintf(buf, sizeof(buf), "%p", (void*)addr);
+    return std::string(buf);
+  }
+};
+
+const char* Addr2lineTool::kSentinel = "0x0\n";
+const size_t Addr2lineTool::kBatchSize;
+const size_t Addr2lineTool::kMaxPendingBatches;
+const int Addr2lineTool::kTimeoutMs;
+const size_t Addr2lineTool::kMinChunkFrames;
+
+/**
+ * zlib loaded by dlopen(), so it is used if installed without linking -lz
+ * - z_stream is declared here with the layout of zlib.h, stable since 1.0
+ * - gzip of pprof profiles, and compressed debug sections of ELF files
+ */
+class Zlib {
+ public:
+  static const Zlib* Get() {
+    static Zlib instance;
+    return instance.version_ != nullptr ? &instance : nullptr;
+  }
+
+  // gzip by deflate level 6, false if failed
+  bool Gzip(const std::string& in, std::string& out) const {
+    if (deflate_ == nullptr) {
+      return false;
+    }
+    ZStream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflate_init2_(&zs, 6, 8 /* Z_DEFLATED */, 15 + 16 /* gzip */, 8,
+                       0 /* Z_DEFAULT_STRATEGY */, version_(),
+                       static_cast<int>(sizeof(zs))) != 0) {
+      return false;
+    }
+    out.resize(deflate_bound_(&zs, in.size()));
+    zs.next_in = reinterpret_cast<const unsigned char*>(in.data());
+    zs.avail_in = static_cast<unsigned>(in.size());
+    zs.next_out = reinterpret_cast<unsigned char*>(&out[0]);
+    zs.avail_out = static_cast<unsigned>(out.size());
+    int ret = deflate_(&zs, 4 /* Z_FINISH */);
+    out.resize(zs.total_out);
+    deflate_end_(&zs);
+    return ret == 1;  // Z_STREAM_END
+  }
+
+  // inflate a zlib stream into exactly out_size bytes, false if failed
+  bool Uncompress(const uint8_t* in, size_t in_size, uint8_t* out,
+                  size_t out_size) const {
+    unsigned long size = out_size;
+    return uncompress_ != nullptr &&
+           uncompress_(out, &size, in, in_size) == 0 /* Z_OK */ &&
+           size == out_size;
+  }
+
+ private:
+  struct ZStream {
+    const unsigned char* next_in;
+    unsigned avail_in;
+    unsigned long total_in;
+    unsigned char* next_out;
+    unsigned avail_out;
+    unsigned long total_out;
+    const char* msg;
+    void* state;
+    void* zalloc;
+    void* zfree;
+    void* opaque;
+    int data_type;
+    unsigned long adler;
+    unsigned long reserved;
+  };
+
+  const char* (*version_)() = nullptr;
+  int (*deflate_init2_)(ZStream*, int, int, int, int, int, const char*,
+                        int) = nullptr;
+  unsigned long (*deflate_bound_)(ZStream*, unsigned long) = nullptr;
+  int (*deflate_)(ZStream*, int) = nullptr;
+  int (*deflate_end_)(ZStream*) = nullptr;
+  int (*uncompress_)(uint8_t*, unsigned long*, const uint8_t*,
+                     unsigned long) = nullptr;
+
+  Zlib() {
+    void* lib = dlopen("libz.so.1", RTLD_NOW | RTLD_LOCAL);  // never closed
+    if (lib == nullptr) {
+      return;
+    }
+    version_ = reinterpret_cast<const char* (*)()>(dlsym(lib, "zlibVersion"));
+    deflate_init2_ = reinterpret_cast<decltype(deflate_init2_)>(
+        dlsym(lib, "deflateInit2_"));
+    deflate_bound_ = reinterpret_cast<decltype(deflate_bound_)>(
+        dlsym(lib, "deflateBound"));
+    deflate_end_ =
+        reinterpret_cast<decltype(deflate_end_)>(dlsym(lib, "deflateEnd"));
+    deflate_ = reinterpret_cast<decltype(deflate_)>(dlsym(lib, "deflate"));
+    uncompress_ =
+        reinterpret_cast<decltype(uncompress_)>(dlsym(lib, "uncompress"));
+    if (version_ == nullptr || version_()[0] != '1') {
+      version_ = nullptr;
+    }
+    if (deflate_init2_ == nullptr || deflate_bound_ == nullptr ||
+        deflate_end_ == nullptr) {
+      deflate_ = nullptr;
+    }
+  }
+};
+
+// selected by SetSymbolizer()
+static std::atomic<int> g_symbolizer(kSymbolizeElf);
+
+// GNU build-id in notes of an ELF PT_NOTE segment or SHT_NOTE section in
+// hex, empty if not found
+static std::string parse_build_id(const uint8_t* notes, size_t size) {
+  // name and desc of each note are padded to 4 bytes
+  size_t pos = 0;
+  while (pos + sizeof(Elf64_Nhdr) <= size) {
+    Elf64_Nhdr nh;
+    memcpy(&nh, notes + pos, sizeof(nh));
+    size_t name_pos = pos + sizeof(nh);
+    size_t desc_pos = name_pos + ((nh.n_namesz + 3) & ~3u);
+    pos = desc_pos + ((nh.n_descsz + 3) & ~3u);
+    if (pos > size) {
+      break;
+    }
+    if (nh.n_type == NT_GNU_BUILD_ID && nh.n_namesz == 4 &&
+        memcmp(notes + name_pos, "GNU", 4) == 0) {
+      static const char kHex[] = "0123456789abcdef";
+      std::string build_id;
+      for (uint32_t i = 0; i < nh.n_descsz; i++) {
+        build_id += kHex[notes[desc_pos + i] >> 4];
+        build_id += kHex[notes[desc_pos + i] & 15];
+      }
+      return build_id;
+    }
+  }
+  return "";
+}
+
+// bounds checked little endian reader, a read past the end returns 0 and
+// clears ok()
+class ByteReader {
+ public:
+  ByteReader() = default;
+  ByteReader(const uint8_t* data, size_t size)
+      : begin_(data), pos_(data), end_(data + size) {}
+
+  bool ok() const { return ok_; }
+  bool empty() const { return pos_ >= end_; }
+  size_t offset() const { return pos_ - begin_; }
+  size_t size() const { return end_ - begin_; }
+
+  bool seek(uint64_t offset) {
+    if (offset > size()) {
+      return fail();
+    }
+    pos_ = begin_ + offset;
+    return true;
+  }
+
+  bool skip(uint64_t n) {
+    if (n > static_cast<size_t>(end_ - pos_)) {
+      return fail();
+    }
+    pos_ += n;
+    return true;
+  }
+
+  // n bytes unsigned, n <= 8
+  uint64_t fixed(size_t n) {
+    if (n > static_cast<size_t>(end_ - pos_)) {
+      fail();
+      return 0;
+    }
+    uint64_t value = 0;
+    for (size_t i = 0; i < n; i++) {
+      value |= static_cast<uint64_t>(pos_[i]) << (8 * i);
+    }
+    pos_ += n;
+    return value;
+  }
+
+  uint8_t u8() { return static_cast<uint8_t>(fixed(1)); }
+  uint16_t u16() { return static_cast<uint16_t>(fixed(2)); }
+  uint32_t u32() { return static_cast<uint32_t>(fixed(4)); }
+  uint64_t u64() { return fixed(8); }
+  // 4 or 8 bytes section offset
+  uint64_t offset(bool is64) { return fixed(is64 ? 8 : 4); }
+
+  uint64_t uleb() {
+    uint64_t value = 0;
+    for (int shift = 0; pos_ < end_; shift += 7) {
+      uint8_t byte = *pos_++;
+      if (shift < 64) {
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+      }
+      if ((byte & 0x80) == 0) {
+        return value;
+      }
+    }
+    fail();
+    return 0;
+  }
+
+  int64_t sleb() {
+    int64_t value = 0;
+    int shift = 0;
+    while (pos_ < end_) {
+      uint8_t byte = *pos_++;
+      if (shift < 64) {
+        value |= static_cast<int64_t>(byte & 0x7f) << shift;
+      }
+      shift += 7;
+      if ((byte & 0x80) == 0) {
+        if (shift < 64 && (byte & 0x40)) {
+          value |= -(static_cast<int64_t>(1) << shift);
+        }
+        return value;
+      }
+    }
+    fail();
+    return 0;
+  }
+
+  // null-terminated string in place
+  const char* cstr() {
+    const uint8_t* end =
+        static_cast<const uint8_t*>(memchr(pos_, 0, end_ - pos_));
+    if (end == nullptr) {
+      fail();
+      return "";
+    }
+    const char* str = reinterpret_cast<const char*>(pos_);
+    pos_ = end + 1;
+    return str;
+  }
+
+  // string at offset, "" if out of range
+  const char* str_at(uint64_t offset) const {
+    if (offset >= size() || memchr(begin_ + offset, 0, size() - offset) ==
+                                nullptr) {
+      return "";
+    }
+    return reinterpret_cast<const char*>(begin_ + offset);
+  }
+
+ private:
+  const uint8_t* begin_ = nullptr;
+  const uint8_t* pos_ = nullptr;
+  const uint8_t* end_ = nullptr;
+  bool ok_ = true;
+
+  bool fail() {
+    ok_ = false;
+    pos_ = end_;
+    return false;
+  }
+};
+
+/**
+ * index of sorted addresses in Eytzinger (BFS) order, for function lookup
+ * - node k has children 2k and 2k+1, so the top levels of the implicit tree
+ *   share a few cache lines, and the search prefetches 4 levels ahead
+ * - branchless, each level is a compare and a shift
+ */
+class EytzingerIndex {
+ public:
+  // build from addresses sorted ascending
+  void Build(const std::vector<uint64_t>& sorted) {
+    keys_.assign(sorted.size() + 1, 0);
+    ranks_.assign(sorted.size() + 1, 0);
+    size_t i = 0;
+    Fill(sorted, i, 1);
+  }
+
+  // sorted index of the last address <= pc, or -1
+  int64_t Find(uint64_t pc) const {
+    if (keys_.size() <= 1) {
+      return -1;
+    }
+    const size_t n = keys_.size() - 1;
+    const uint64_t* keys = keys_.data();
+    size_t k = 1;
+    while (k <= n) {
+      __builtin_prefetch(keys + std::min(16 * k, n));
+      k = 2 * k + (keys[k] <= pc);
+    }
+    // the path turned left at the first address > pc, 0 if none
+    k >>= __builtin_ffsll(~k);
+    size_t upper = k == 0 ? n : ranks_[k];
+    return static_cast<int64_t>(upper) - 1;
+  }
+
+ private:
+  std::vector<uint64_t> keys_;   // 1-based, keys_[0] is unused
+  std::vector<uint32_t> ranks_;  // sorted index of keys_[k]
+
+  // in-order traversal of the implicit tree visits addresses sorted
+  void Fill(const std::vector<uint64_t>& sorted, size_t& i, size_t k) {
+    if (k < keys_.size()) {
+      Fill(sorted, i, 2 * k);
+      keys_[k] = sorted[i];
+      ranks_[k] = i++;
+      Fill(sorted, i, 2 * k + 1);
+    }
+  }
+};
+
+/**
+ * symbols and debug info of a mmap-ed ELF file
+ * - function names from .symtab, or .dynsym of a stripped file
+ * - file and line from .debug_line, inlined functions from
+ *   DW_TAG_inlined_subroutine in .debug_info, DWARF 2 to 5
+ * - a function without linkage name is qualified by its enclosing
+ *   namespaces and classes, or named by its symbol if not inlined
+ * - only 64-bit little endian ELF, compressed debug sections (SHF_COMPRESSED
+ *   or legacy .zdebug_*) are inflated by zlib, treated as no debug info if
+ *   zlib is not installed
+ * - debug info split by `objcopy --only-keep-debug` is read from the
+ *   separate file found by build-id or .gnu_debuglink, like gdb
+ * - all strings point into the mapping, which lives as long as the module
+ */
+class ElfModule {
+ public:
+  ElfModule() = default;
+  ~ElfModule() {
+    if (data_ != nullptr) {
+      munmap(const_cast<uint8_t*>(data_), size_);
+    }
+  }
+
+  ElfModule(const ElfModule&) = delete;
+  ElfModule& operator=(const ElfModule&) = delete;
+
+  // map and index the file, return false if it is not a supported ELF
+  bool Load(const std::string& path) {
+    if (!LoadFile(path)) {
+      return false;
+    }
+    if (!has_debug_info()) {
+      for (const auto& file : DebugFiles(path)) {
+        std::unique_ptr<ElfModule> debug(new ElfModule());
+        if (debug->LoadFile(file) && debug->has_debug_info() &&
+            debug->build_id_ == build_id_) {
+          debug_file_ = std::move(debug);
+          break;
+        }
+      }
+    }
+    return true;
+  }
+
+  // vaddr of file offset 0, dli_fbase maps to this address
+  uint64_t base_vaddr() const { return base_vaddr_; }
+  bool has_debug_info() const {
+    return !rows_.empty() ||
+           (debug_file_ != nullptr && debug_file_->has_debug_info());
+  }
+
+  // mangled name of the function containing pc, or nullptr, and its address
+  // in start if set
+  const char* FindFunction(uint64_t pc, uint64_t* start = nullptr) const {
+    int64_t i = symbol_index_.Find(pc);
+    if (i < 0) {
+      return nullptr;
+    }
+    const Symbol& sym = symbols_[i];
+    if (start != nullptr) {
+      *start = sym.addr;
+    }
+    return sym.size == 0 || pc < sym.addr + sym.size ? sym.name : nullptr;
+  }
+
+  /**
+   * resolve a file address like `addr2line -f -i`
+   * - func of frame is the innermost inlined function, or the symbol
+   * - file and line from line table, inlined_by from outer inlined callers
+   * - return false if no symbol or line contains pc
+   */
+  bool Symbolize(uint64_t pc, Frame* frame) const {
+    // file addresses are the same in the separate debug file
+    if (debug_file_ != nullptr && debug_file_->Symbolize(pc, frame)) {
+      return true;
+    }
+    bool found = false;
+    auto row = std::upper_bound(
+        rows_.begin(), rows_.end(), pc,
+        [](uint64_t a, const LineRow& r) { return a < r.addr; });
+    if (row != rows_.begin() && (--row)->file != kEndSequence) {
+      frame->file = files_[row->file];
+      frame->line = row->line;
+      found = true;
+    }
+
+    uint32_t scope = FindScope(pc);
+    if (scope != kNoScope) {
+      // like addr2line, a function without linkage name is named by its
+      // symbol, e.g. a template of a lambda
+      const char* name = scopes_[scope].name;
+      const char* symbol = scopes_[scope].parent == kNoScope &&
+                                   strncmp(name, "_Z", 2) != 0
+                               ? FindFunction(pc)
+                               : nullptr;
+      demangle_symbol(frame->func, symbol != nullptr ? symbol : name);
+      frame->inlined_by.clear();
+      for (uint32_t s = scope; scopes_[s].parent != kNoScope;
+           s = scopes_[s].parent) {
+        const Scope& callee = scopes_[s];
+        Frame::Func caller;
+        demangle_symbol(caller.name, scopes_[callee.parent].name);
+        caller.file = callee.call_file < files_.size()
+                          ? files_[callee.call_file]
+                          : std::string("??");
+        caller.line = callee.call_line > 0 ? callee.call_line : -1;
+        frame->inlined_by.emplace_back(std::move(caller));
+      }
+      return true;
+    }
+    const char* name = FindFunction(pc);
+    if (name != nullptr) {
+      demangle_symbol(frame->func, name);
+      found = true;
+    }
+    return found;
+  }
+
+ private:
+  // constants of DWARF 5 and GNU extensions, as dwarf.h is not in libc
+  enum : uint64_t {
+    DW_TAG_class_type = 0x02,
+    DW_TAG_structure_type = 0x13,
+    DW_TAG_union_type = 0x17,
+    DW_TAG_inlined_subroutine = 0x1d,
+    DW_TAG_subprogram = 0x2e,
+    DW_TAG_namespace = 0x39,
+
+    DW_AT_name = 0x03,
+    DW_AT_stmt_list = 0x10,
+    DW_AT_low_pc = 0x11,
+    DW_AT_high_pc = 0x12,
+    DW_AT_comp_dir = 0x1b,
+    DW_AT_abstract_origin = 0x31,
+    DW_AT_specification = 0x47,
+    DW_AT_ranges = 0x55,
+    DW_AT_call_file = 0x58,
+    DW_AT_call_line = 0x59,
+    DW_AT_linkage_name = 0x6e,
+    DW_AT_str_offsets_base = 0x72,
+    DW_AT_addr_base = 0x73,
+    DW_AT_rnglists_base = 0x74,
+    DW_AT_MIPS_linkage_name = 0x2007,
+
+    DW_FORM_addr = 0x01,
+    DW_FORM_block2 = 0x03,
+    DW_FORM_block4 = 0x04,
+    DW_FORM_data2 = 0x05,
+    DW_FORM_data4 = 0x06,
+    DW_FORM_data8 = 0x07,
+    DW_FORM_string = 0x08,
+    DW_FORM_block = 0x09,
+    DW_FORM_block1 = 0x0a,
+    DW_FORM_data1 = 0x0b,
+    DW_FORM_flag = 0x0c,
+    DW_FORM_sdata = 0x0d,
+    DW_FORM_strp = 0x0e,
+    DW_FORM_udata = 0x0f,
+    DW_FORM_ref_addr = 0x10,
+    DW_FORM_ref1 = 0x11,
+    DW_FORM_ref2 = 0x12,
+    DW_FORM_ref4 = 0x13,
+    DW_FORM_ref8 = 0x14,
+    DW_FORM_ref_udata = 0x15,
+    DW_FORM_indirect = 0x16,
+    DW_FORM_sec_offset = 0x17,
+    DW_FORM_exprloc = 0x18,
+    DW_FORM_flag_present = 0x19,
+    DW_FORM_strx = 0x1a,
+    DW_FORM_addrx = 0x1b,
+    DW_FORM_ref_sup4 = 0x1c,
+    DW_FORM_strp_sup = 0x1d,
+    DW_FORM_data16 = 0x1e,
+    DW_FORM_line_strp = 0x1f,
+    DW_FORM_ref_sig8 = 0x20,
+    DW_FORM_implicit_const = 0x21,
+    DW_FORM_loclistx = 0x22,
+    DW_FORM_rnglistx = 0x23,
+    DW_FORM_ref_sup8 = 0x24,
+    DW_FORM_strx1 = 0x25,
+    DW_FORM_strx2 = 0x26,
+    DW_FORM_strx3 = 0x27,
+    DW_FORM_strx4 = 0x28,
+    DW_FORM_addrx1 = 0x29,
+    DW_FORM_addrx2 = 0x2a,
+    DW_FORM_addrx3 = 0x2b,
+    DW_FORM_addrx4 = 0x2c,
+    DW_FORM_GNU_addr_index = 0x1f01,
+    DW_FORM_GNU_str_index = 0x1f02,
+    DW_FORM_GNU_ref_alt = 0x1f20,
+    DW_FORM_GNU_strp_alt = 0x1f21,
+
+    DW_UT_compile = 0x01,
+    DW_UT_type = 0x02,
+    DW_UT_partial = 0x03,
+    DW_UT_skeleton = 0x04,
+    DW_UT_split_compile = 0x05,
+    DW_UT_split_type = 0x06,
+
+    DW_RLE_end_of_list = 0x00,
+    DW_RLE_base_addressx = 0x01,
+    DW_RLE_startx_endx = 0x02,
+    DW_RLE_startx_length = 0x03,
+    DW_RLE_offset_pair = 0x04,
+    DW_RLE_base_address = 0x05,
+    DW_RLE_start_end = 0x06,
+    DW_RLE_start_length = 0x07,
+
+    DW_LNS_copy = 0x01,
+    DW_LNS_advance_pc = 0x02,
+    DW_LNS_advance_line = 0x03,
+    DW_LNS_set_file = 0x04,
+    DW_LNS_const_add_pc = 0x08,
+    DW_LNS_fixed_advance_pc = 0x09,
+    DW_LNE_end_sequence = 0x01,
+    DW_LNE_set_address = 0x02,
+    DW_LNE_define_file = 0x03,
+    DW_LNCT_path = 0x01,
+    DW_LNCT_directory_index = 0x02,
+  };
+
+  static const uint32_t kNoScope = UINT32_MAX;
+  static const uint32_t kEndSequence = UINT32_MAX;
+
+  struct Symbol {
+    uint64_t addr;
+    uint64_t size;
+    const char* name;
+  };
+
+  // row of line table, file is kEndSequence after the end of a sequence
+  struct LineRow {
+    uint64_t addr;
+    uint32_t file;
+    int32_t line;
+  };
+
+  // a function with code, or an inlined call of a function, scopes are in
+  // DIE order so descendants of scope i are (i, end)
+  struct Scope {
+    const char* name;  // linkage name, or name qualified by namespaces
+    uint32_t parent;   // enclosing scope of an inlined call, or kNoScope
+    uint32_t end;
+    uint32_t call_file;
+    int32_t call_line;
+    uint32_t range_begin;  // in ranges_
+    uint32_t range_end;
+  };
+
+  struct Range {
+    uint64_t lo;
+    uint64_t hi;
+    uint32_t scope;
+  };
+
+  // unit header and attributes of its DIE
+  struct Unit {
+    uint64_t offset;
+    uint64_t die_offset;
+    uint64_t end;
+    uint16_t version;
+    uint8_t addr_size;
+    bool is64;
+    uint64_t abbrev_offset;
+    uint64_t low_pc;
+    uint64_t str_offsets_base;
+    uint64_t addr_base;
+    uint64_t rnglists_base;
+  };
+
+  struct AttrSpec {
+    uint64_t name;
+    uint64_t form;
+    int64_t implicit_const;
+  };
+
+  struct Abbrev {
+    uint64_t tag = 0;
+    bool has_children = false;
+    std::vector<AttrSpec> attrs;
+  };
+
+  using AbbrevTable = std::vector<Abbrev>;  // by code
+
+  struct AttrValue {
+    uint64_t form;
+    uint64_t value;  // constant, offset, index or address
+    const char* str;
+  };
+
+  // attributes of a DIE used by symbolizer
+  struct DieInfo {
+    bool has_low_pc = false;
+    bool has_high_pc = false;
+    bool has_ranges = false;
+    uint64_t low_pc = 0;
+    AttrValue high_pc = {};
+    AttrValue ranges = {};
+    const char* name = nullptr;
+    const char* linkage_name = nullptr;
+    uint64_t origin = 0;  // abstract_origin or specification, 0 if none
+    uint64_t call_file = 0;
+    int64_t call_line = 0;
+  };
+
+  struct FuncName {
+    const char* name = nullptr;
+    bool is_linkage = false;
+    uint64_t die = 0;  // DIE of a plain DW_AT_name
+  };
+
+  // a named namespace or type, DIEs in [lo, hi) are nested in it
+  struct NameScope {
+    uint64_t lo;
+    uint64_t hi;
+    const char* name;
+    uint32_t parent;  // enclosing name scope, or kNoScope
+  };
+
+  const uint8_t* data_ = nullptr;
+  size_t size_ = 0;
+  uint64_t base_vaddr_ = 0;
+  ByteReader info_, abbrev_, line_, str_, line_str_, str_offsets_, addr_,
+      ranges_sec_, rnglists_;
+  std::string build_id_;  // hex, empty if none
+  ByteReader debuglink_;  // .gnu_debuglink
+  std::vector<std::unique_ptr<uint8_t[]>> inflated_;  // compressed sections
+  std::unique_ptr<ElfModule> debug_file_;  // separate debug info, or nullptr
+
+  std::vector<Symbol> symbols_;  // sorted by addr
+  EytzingerIndex symbol_index_;  // of symbols_
+  std::vector<std::string> files_;
+  std::unordered_map<std::string, uint32_t> file_ids_;
+  std::vector<LineRow> rows_;  // sorted by addr
+  std::vector<Scope> scopes_;
+  std::unordered_set<std::string> qualified_names_;  // of scopes_
+  std::vector<Range> ranges_;      // of scopes_
+  std::vector<Range> top_ranges_;  // of outermost scopes, sorted by lo
+
+  // only used while loading
+  std::vector<Unit> units_;
+  std::unordered_map<uint64_t, AbbrevTable> abbrevs_;
+  std::vector<NameScope> name_scopes_;  // in DIE order
+  std::vector<std::pair<uint32_t, uint64_t>> unqualified_;  // scope, name DIE
+
+  // map and index the file without looking for a separate debug file
+  bool LoadFile(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(Elf64_Ehdr)) {
+      close(fd);
+      return false;
+    }
+    void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+      return false;
+    }
+    data_ = static_cast<const uint8_t*>(data);
+    size_ = st.st_size;
+    if (!LoadSections()) {
+      return false;
+    }
+    LoadSymbols();
+    LoadDebugInfo();
+    return true;
+  }
+
+  ByteReader Section(const Elf64_Shdr& sh) const {
+    if (sh.sh_type == SHT_NOBITS || sh.sh_offset > size_ ||
+        sh.sh_size > size_ - sh.sh_offset) {
+      return ByteReader();
+    }
+    return ByteReader(data_ + sh.sh_offset, sh.sh_size);
+  }
+
+  bool LoadSections() {
+    const Elf64_Ehdr* eh = reinterpret_cast<const Elf64_Ehdr*>(data_);
+    if (memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0 ||
+        eh->e_ident[EI_CLASS] != ELFCLASS64 ||
+        eh->e_ident[EI_DATA] != ELFDATA2LSB ||
+        eh->e_shentsize != sizeof(Elf64_Shdr) ||
+        eh->e_phentsize != sizeof(Elf64_Phdr) || eh->e_shoff > size_ ||
+        eh->e_shnum > (size_ - eh->e_shoff) / sizeof(Elf64_Shdr) ||
+        eh->e_phoff > size_ ||
+        eh->e_phnum > (size_ - eh->e_phoff) / sizeof(Elf64_Phdr) ||
+        eh->e_shstrndx >= eh->e_shnum) {
+      return false;
+    }
+    const Elf64_Phdr* ph =
+        reinterpret_cast<const Elf64_Phdr*>(data_ + eh->e_phoff);
+    bool found_load = false;
+    for (int i = 0; i < eh->e_phnum; i++) {
+      if (ph[i].p_type == PT_LOAD &&
+          (!found_load || ph[i].p_vaddr - ph[i].p_offset < base_vaddr_)) {
+        base_vaddr_ = ph[i].p_vaddr - ph[i].p_offset;
+        found_load = true;
+      }
+    }
+
+    const Elf64_Shdr* sh =
+        reinterpret_cast<const Elf64_Shdr*>(data_ + eh->e_shoff);
+    ByteReader names = Section(sh[eh->e_shstrndx]);
+    struct {
+      const char* name;
+      ByteReader* reader;
+    } debug_sections[] = {
+        {".debug_info", &info_},
+        {".debug_abbrev", &abbrev_},
+        {".debug_line", &line_},
+        {".debug_str", &str_},
+        {".debug_line_str", &line_str_},
+        {".debug_str_offsets", &str_offsets_},
+        {".debug_addr", &addr_},
+        {".debug_ranges", &ranges_sec_},
+        {".debug_rnglists", &rnglists_},
+    };
+    for (int i = 0; i < eh->e_shnum; i++) {
+      const char* name = names.str_at(sh[i].sh_name);
+      if (sh[i].sh_type == SHT_NOTE && build_id_.empty()) {
+        ByteReader notes = Section(sh[i]);
+        build_id_ = parse_build_id(data_ + sh[i].sh_offset, notes.size());
+      } else if (strcmp(name, ".gnu_debuglink") == 0) {
+        debuglink_ = Section(sh[i]);
+      }
+      // .zdebug_* is a legacy compressed .debug_*
+      bool zdebug = strncmp(name, ".zdebug_", 8) == 0;
+      for (auto& s : debug_sections) {
+        if (zdebug && strcmp(name + 2, s.name + 1) == 0) {
+          *s.reader = Inflate(sh[i], true);
+        } else if (strcmp(name, s.name) == 0) {
+          *s.reader = sh[i].sh_flags & SHF_COMPRESSED ? Inflate(sh[i], false)
+                                                       : Section(sh[i]);
+        }
+      }
+    }
+    return true;
+  }
+
+  // contents of a compressed section, empty if it is not zlib, corrupt or
+  // zlib is not installed
+  ByteReader Inflate(const Elf64_Shdr& sh, bool zdebug) {
+    ByteReader r = Section(sh);
+    uint64_t size = 0;
+    if (zdebug) {
+      // "ZLIB" and big endian size
+      if (r.size() < 12 || memcmp(data_ + sh.sh_offset, "ZLIB", 4) != 0) {
+        return ByteReader();
+      }
+      r.skip(4);
+      for (int i = 0; i < 8; i++) {
+        size = size << 8 | r.u8();
+      }
+    } else {
+      // Elf64_Chdr
+      uint32_t type = r.u32();
+      r.u32();
+      size = r.u64();
+      r.u64();
+      if (type != ELFCOMPRESS_ZLIB) {
+        return ByteReader();
+      }
+    }
+    const Zlib* zlib = Zlib::Get();
+    size_t in_size = r.size() - r.offset();
+    // deflate expands at most 1032 times
+    if (!r.ok() || zlib == nullptr || size == 0 || size / 1032 > in_size) {
+      return ByteReader();
+    }
+    std::unique_ptr<uint8_t[]> out(new uint8_t[size]);
+    if (!zlib->Uncompress(data_ + sh.sh_offset + r.offset(), in_size,
+                          out.get(), size)) {
+      return ByteReader();
+    }
+    inflated_.push_back(std::move(out));
+    return ByteReader(inflated_.back().get(), size);
+  }
+
+  // candidates of the separate debug file like gdb: by build-id under
+  // /usr/lib/debug, then by .gnu_debuglink next to path, in .debug/ of its
+  // directory and under /usr/lib/debug
+  std::vector<std::string> DebugFiles(const std::string& path) const {
+    static const std::string kRoot = "/usr/lib/debug";
+    std::vector<std::string> files;
+    if (build_id_.size() > 2) {
+      files.push_back(kRoot + "/.build-id/" + build_id_.substr(0, 2) + "/" +
+                      build_id_.substr(2) + ".debug");
+    }
+    const char* link = debuglink_.str_at(0);
+    if (link[0] != '\0' && strchr(link, '/') == nullptr) {
+      std::string dir = path.substr(0, path.rfind('/') + 1);
+      files.push_back(dir + link);
+      files.push_back(dir + ".debug/" + link);
+      if (!dir.empty() && dir[0] == '/') {
+        files.push_back(kRoot + dir + link);
+      }
+    }
+    return files;
+  }
+
+  void LoadSymbols() {
+    const Elf64_Ehdr* eh = reinterpret_cast<const Elf64_Ehdr*>(data_);
+    const Elf64_Shdr* sh =
+        reinterpret_cast<const Elf64_Shdr*>(data_ + eh->e_shoff);
+    // prefer .symtab which also has local functions
+    for (uint32_t type : {SHT_SYMTAB, SHT_DYNSYM}) {
+      for (int i = 0; i < eh->e_shnum && symbols_.empty(); i++) {
+        if (sh[i].sh_type != type || sh[i].sh_link >= eh->e_shnum ||
+            sh[i].sh_entsize != sizeof(Elf64_Sym)) {
+          continue;
+        }
+        ByteReader syms = Section(sh[i]);
+        ByteReader strs = Section(sh[sh[i].sh_link]);
+        if (syms.size() == 0) {
+          continue;
+        }
+        const Elf64_Sym* sym =
+            reinterpret_cast<const Elf64_Sym*>(data_ + sh[i].sh_offset);
+        size_t num_syms = syms.size() / sizeof(Elf64_Sym);
+        for (size_t j = 0; j < num_syms; j++) {
+          int sym_type = ELF64_ST_TYPE(sym[j].st_info);
+          if ((sym_type != STT_FUNC && sym_type != STT_GNU_IFUNC) ||
+              sym[j].st_shndx == SHN_UNDEF || sym[j].st_value == 0) {
+            continue;
+          }
+          symbols_.push_back(Symbol{sym[j].st_value, sym[j].st_size,
+                                    strs.str_at(sym[j].st_name)});
+        }
+      }
+      if (!symbols_.empty()) {
+        break;
+      }
+    }
+    std::sort(symbols_.begin(), symbols_.end(),
+              [](const Symbol& a, const Symbol& b) { return a.addr < b.addr; });
+    std::vector<uint64_t> addrs(symbols_.size());
+    for (size_t i = 0; i < symbols_.size(); i++) {
+      addrs[i] = symbols_[i].addr;
+    }
+    symbol_index_.Build(addrs);
+  }
+
+  void LoadDebugInfo() {
+    if (info_.size() == 0 || abbrev_.size() == 0) {
+      return;
+    }
+    // unit headers first, a reference may point to a later unit
+    ByteReader r = info_;
+    while (!r.empty() && r.ok()) {
+      Unit unit;
+      if (!ReadUnitHeader(r, unit)) {
+        break;
+      }
+      units_.emplace_back(unit);
+      r.seek(unit.end);
+    }
+    for (auto& unit : units_) {
+      LoadUnit(unit);
+    }
+    // after all units, a name may be declared in a later one
+    for (const auto& it : unqualified_) {
+      scopes_[it.first].name = Qualify(scopes_[it.first].name, it.second);
+    }
+    units_.clear();
+    abbrevs_.clear();
+    name_scopes_.clear();
+    unqualified_.clear();
+
+    // sort rows by address but keep rows of the same address in order, and
+    // end of a sequence is before start of next one at the same address
+    std::stable_sort(rows_.begin(), rows_.end(),
+                     [](const LineRow& a, const LineRow& b) {
+                       if (a.addr != b.addr) {
+                         return a.addr < b.addr;
+                       }
+                       return a.file == kEndSequence && b.file != kEndSequence;
+                     });
+    std::sort(top_ranges_.begin(), top_ranges_.end(),
+              [](const Range& a, const Range& b) { return a.lo < b.lo; });
+  }
+
+  bool ReadUnitHeader(ByteReader& r, Unit& unit) {
+    unit = Unit();
+    unit.offset = r.offset();
+    uint64_t length = r.u32();
+    unit.is64 = length == 0xffffffff;
+    if (unit.is64) {
+      length = r.u64();
+    }
+    if (!r.ok() || length > info_.size() - r.offset()) {
+      return false;
+    }
+    unit.end = r.offset() + length;
+    unit.version = r.u16();
+    uint8_t unit_type = DW_UT_compile;
+    if (unit.version >= 5) {
+      unit_type = r.u8();
+      unit.addr_size = r.u8();
+      unit.abbrev_offset = r.offset(unit.is64);
+      if (unit_type == DW_UT_skeleton || unit_type == DW_UT_split_compile) {
+        r.skip(8);  // dwo id
+      } else if (unit_type == DW_UT_type || unit_type == DW_UT_split_type) {
+        r.skip(8 + (unit.is64 ? 8 : 4));  // signature and type offset
+      }
+    } else {
+      unit.abbrev_offset = r.offset(unit.is64);
+      unit.addr_size = r.u8();
+    }
+    unit.die_offset = r.offset();
+    if (!r.ok() || unit.version < 2 || unit.version > 5 ||
+        (unit.addr_size != 4 && unit.addr_size != 8)) {
+      return false;
+    }
+    // base addresses of unit DIE, used to resolve its other attributes
+    ByteReader die = info_;
+    die.seek(unit.die_offset);
+    const AbbrevTable& table = GetAbbrevs(unit.abbrev_offset);
+    uint64_t code = die.uleb();
+    if (code == 0 || code >= table.size()) {
+      return true;
+    }
+    AttrValue value;
+    for (const auto& spec : table[code].attrs) {
+      if (!ReadAttr(die, unit, spec, value)) {
+        break;
+      }
+      switch (spec.name) {
+        case DW_AT_low_pc:
+          if (value.form == DW_FORM_addr) {
+            unit.low_pc = value.value;
+          }
+          break;
+        case DW_AT_str_offsets_base:
+          unit.str_offsets_base = value.value;
+          break;
+        case DW_AT_addr_base:
+          unit.addr_base = value.value;
+          break;
+        case DW_AT_rnglists_base:
+          unit.rnglists_base = value.value;
+          break;
+      }
+    }
+    if (unit_type != DW_UT_compile && unit_type != DW_UT_partial) {
+      unit.die_offset = unit.end;  // no code in it
+    }
+    return true;
+  }
+
+  const AbbrevTable& GetAbbrevs(uint64_t offset) {
+    auto it = abbrevs_.find(offset);
+    if (it != abbrevs_.end()) {
+      return it->second;
+    }
+    AbbrevTable& table = abbrevs_[offset];
+    ByteReader r = abbrev_;
+    r.seek(offset);
+    while (r.ok()) {
+      uint64_t code = r.uleb();
+      if (code == 0 || code > (1 << 20)) {
+        break;
+      }
+      if (code >= table.size()) {
+        table.resize(code + 1);
+      }
+      Abbrev& abbrev = table[code];
+      abbrev.tag = r.uleb();
+      abbrev.has_children = r.u8() != 0;
+      while (r.ok()) {
+        AttrSpec spec{r.uleb(), r.uleb(), 0};
+        if (spec.form == DW_FORM_implicit_const) {
+          spec.implicit_const = r.sleb();
+        }
+        if (spec.name == 0 && spec.form == 0) {
+          break;
+        }
+        abbrev.attrs.emplace_back(spec);
+      }
+    }
+    return table;
+  }
+
+  // read or skip value of an attribute
+  bool ReadAttr(ByteReader& r, const Unit& unit, const AttrSpec& spec,
+                AttrValue& v) const {
+    v.form = spec.form;
+    v.value = 0;
+    v.str = nullptr;
+    switch (v.form) {
+      case DW_FORM_addr:
+        v.value = r.fixed(unit.addr_size);
+        break;
+      case DW_FORM_data1:
+      case DW_FORM_ref1:
+      case DW_FORM_flag:
+      case DW_FORM_strx1:
+      case DW_FORM_addrx1:
+        v.value = r.u8();
+        break;
+      case DW_FORM_data2:
+      case DW_FORM_ref2:
+      case DW_FORM_strx2:
+      case DW_FORM_addrx2:
+        v.value = r.u16();
+        break;
+      case DW_FORM_strx3:
+      case DW_FORM_addrx3:
+        v.value = r.fixed(3);
+        break;
+      case DW_FORM_data4:
+      case DW_FORM_ref4:
+      case DW_FORM_ref_sup4:
+      case DW_FORM_strx4:
+      case DW_FORM_addrx4:
+        v.value = r.u32();
+        break;
+      case DW_FORM_data8:
+      case DW_FORM_ref8:
+      case DW_FORM_ref_sig8:
+      case DW_FORM_ref_sup8:
+        v.value = r.u64();
+        break;
+      case DW_FORM_data16:
+        r.skip(16);
+        break;
+      case DW_FORM_sdata:
+        v.value = static_cast<uint64_t>(r.sleb());
+        break;
+      case DW_FORM_udata:
+      case DW_FORM_ref_udata:
+      case DW_FORM_strx:
+      case DW_FORM_addrx:
+      case DW_FORM_loclistx:
+      case DW_FORM_rnglistx:
+      case DW_FORM_GNU_addr_index:
+      case DW_FORM_GNU_str_index:
+        v.value = r.uleb();
+        break;
+      case DW_FORM_string:
+        v.str = r.cstr();
+        break;
+      case DW_FORM_strp:
+        v.value = r.offset(unit.is64);
+        v.str = str_.str_at(v.value);
+        break;
+      case DW_FORM_line_strp:
+        v.value = r.offset(unit.is64);
+        v.str = line_str_.str_at(v.value);
+        break;
+      case DW_FORM_ref_addr:
+        v.value = unit.version <= 2 ? r.fixed(unit.addr_size)
+                                    : r.offset(unit.is64);
+        break;
+      case DW_FORM_sec_offset:
+      case DW_FORM_strp_sup:
+      case DW_FORM_GNU_ref_alt:
+      case DW_FORM_GNU_strp_alt:
+        v.value = r.offset(unit.is64);
+        break;
+      case DW_FORM_block1:
+        r.skip(r.u8());
+        break;
+      case DW_FORM_block2:
+        r.skip(r.u16());
+        break;
+      case DW_FORM_block4:
+        r.skip(r.u32());
+        break;
+      case DW_FORM_block:
+      case DW_FORM_exprloc:
+        r.skip(r.uleb());
+        break;
+      case DW_FORM_flag_present:
+        v.value = 1;
+        break;
+      case DW_FORM_implicit_const:
+        v.value = static_cast<uint64_t>(spec.implicit_const);
+        break;
+      case DW_FORM_indirect: {
+        AttrSpec indirect{spec.name, r.uleb(), 0};
+        if (indirect.form == DW_FORM_implicit_const) {
+          indirect.implicit_const = r.sleb();
+        }
+        return ReadAttr(r, unit, indirect, v);
+      }
+      default:
+        return false;  // unknown size
+    }
+    if (IsStrx(v.form)) {
+      // offsets of unit start after the header of str_offsets table
+      uint64_t size = unit.is64 ? 8 : 4;
+      ByteReader offsets = str_offsets_;
+      if (offsets.seek(unit.str_offsets_base + v.value * size)) {
+        v.str = str_.str_at(offsets.offset(unit.is64));
+      }
+    }
+    return r.ok();
+  }
+
+  static bool IsStrx(uint64_t form) {
+    return form == DW_FORM_strx || form == DW_FORM_strx1 ||
+           form == DW_FORM_strx2 || form == DW_FORM_strx3 ||
+           form == DW_FORM_strx4 || form == DW_FORM_GNU_str_index;
+  }
+
+  static bool IsAddrx(uint64_t form) {
+    return form == DW_FORM_addrx || form == DW_FORM_addrx1 ||
+           form == DW_FORM_addrx2 || form == DW_FORM_addrx3 ||
+           form == DW_FORM_addrx4 || form == DW_FORM_GNU_addr_index;
+  }
+
+  // address of an address class attribute, false if not that class
+  bool AttrAddr(const Unit& unit, const AttrValue& v, uint64_t& addr) const {
+    if (v.form == DW_FORM_addr) {
+      addr = v.value;
+      return true;
+    }
+    if (!IsAddrx(v.form)) {
+      return false;
+    }
+    ByteReader r = addr_;
+    r.seek(unit.addr_base + v.value * unit.addr_size);
+    addr = r.fixed(unit.addr_size);
+    return r.ok();
+  }
+
+  // offset in .debug_info of a reference
+  static uint64_t AttrRef(const Unit& unit, const AttrValue& v) {
+    switch (v.form) {
+      case DW_FORM_ref1:
+      case DW_FORM_ref2:
+      case DW_FORM_ref4:
+      case DW_FORM_ref8:
+      case DW_FORM_ref_udata:
+        return unit.offset + v.value;
+      case DW_FORM_ref_addr:
+        return v.value;
+      default:
+        return 0;  // other file, or type unit
+    }
+  }
+
+  // read attributes of the DIE at r, return its abbrev or nullptr
+  const Abbrev* ReadDie(ByteReader& r, const Unit& unit,
+                        const AbbrevTable& table, DieInfo& die) const {
+    uint64_t code = r.uleb();
+    if (code == 0 || code >= table.size()) {
+      return nullptr;
+    }
+    const Abbrev& abbrev = table[code];
+    AttrValue v;
+    for (const auto& spec : abbrev.attrs) {
+      if (!ReadAttr(r, unit, spec, v)) {
+        return nullptr;
+      }
+      switch (spec.name) {
+        case DW_AT_name:
+          die.name = v.str;
+          break;
+        case DW_AT_linkage_name:
+        case DW_AT_MIPS_linkage_name:
+          die.linkage_name = v.str;
+          break;
+        case DW_AT_low_pc:
+          die.has_low_pc = AttrAddr(unit, v, die.low_pc);
+          break;
+        case DW_AT_high_pc:
+          die.has_high_pc = true;
+          die.high_pc = v;
+          break;
+        case DW_AT_ranges:
+          die.has_ranges = true;
+          die.ranges = v;
+          break;
+        case DW_AT_abstract_origin:
+        case DW_AT_specification:
+          die.origin = AttrRef(unit, v);
+          break;
+        case DW_AT_call_file:
+          die.call_file = v.value;
+          break;
+        case DW_AT_call_line:
+          die.call_line = static_cast<int64_t>(v.value);
+          break;
+      }
+    }
+    return &abbrev;
+  }
+
+  const Unit* FindUnit(uint64_t offset) const {
+    auto it = std::upper_bound(
+        units_.begin(), units_.end(), offset,
+        [](uint64_t a, const Unit& u) { return a < u.offset; });
+    if (it == units_.begin() || offset >= (--it)->end) {
+      return nullptr;
+    }
+    return &*it;
+  }
+
+  // linkage name of a function, or its name and the DIE of it, following
+  // abstract_origin and specification
+  FuncName FunctionName(const DieInfo& die, uint64_t offset, int depth) {
+    FuncName name;
+    if (die.linkage_name != nullptr) {
+      name.name = die.linkage_name;
+      name.is_linkage = true;
+      return name;
+    }
+    if (die.origin != 0 && depth < 8) {
+      const Unit* unit = FindUnit(die.origin);
+      if (unit != nullptr) {
+        ByteReader r = info_;
+        r.seek(die.origin);
+        DieInfo origin;
+        if (ReadDie(r, *unit, GetAbbrevs(unit->abbrev_offset), origin)) {
+          name = FunctionName(origin, die.origin, depth + 1);
+          if (name.name != nullptr) {
+            return name;
+          }
+        }
+      }
+    }
+    name.name = die.name;
+    name.die = offset;
+    return name;
+  }
+
+  // name prefixed by namespaces and types around its DIE, like
+  // "ns::Class::name"
+  const char* Qualify(const char* name, uint64_t die) {
+    auto it = std::upper_bound(
+        name_scopes_.begin(), name_scopes_.end(), die,
+        [](uint64_t a, const NameScope& s) { return a < s.lo; });
+    uint32_t s = it == name_scopes_.begin()
+                     ? kNoScope
+                     : static_cast<uint32_t>(it - name_scopes_.begin() - 1);
+    while (s != kNoScope && name_scopes_[s].hi <= die) {
+      s = name_scopes_[s].parent;
+    }
+    if (s == kNoScope) {
+      return name;
+    }
+    std::string qualified = name;
+    for (; s != kNoScope; s = name_scopes_[s].parent) {
+      qualified = std::string(name_scopes_[s].name) + "::" + qualified;
+    }
+    return qualified_names_.insert(std::move(qualified)).first->c_str();
+  }
+
+  // append address ranges of a DIE, return false if it has no code
+  bool ReadRanges(const Unit& unit, const DieInfo& die, uint32_t scope) {
+    if (die.has_low_pc && die.has_high_pc) {
+      uint64_t hi = 0;
+      if (!AttrAddr(unit, die.high_pc, hi)) {
+        hi = die.low_pc + die.high_pc.value;  // offset from low_pc
+      }
+      if (die.low_pc == 0 || hi <= die.low_pc) {
+        return false;  // discarded by linker
+      }
+      ranges_.push_back(Range{die.low_pc, hi, scope});
+      return true;
+    }
+    if (!die.has_ranges) {
+      return false;
+    }
+    size_t num_ranges = ranges_.size();
+    uint64_t base = unit.low_pc;
+    if (unit.version < 5) {
+      ByteReader r = ranges_sec_;
+      r.seek(die.ranges.value);
+      const uint64_t kMaxAddr =
+          unit.addr_size == 8 ? UINT64_MAX : uint64_t(UINT32_MAX);
+      while (r.ok() && !r.empty()) {
+        uint64_t lo = r.fixed(unit.addr_size);
+        uint64_t hi = r.fixed(unit.addr_size);
+        if (lo == 0 && hi == 0) {
+          break;
+        } else if (lo == kMaxAddr) {
+          base = hi;
+        } else if (base + lo != 0 && hi > lo) {
+          ranges_.push_back(Range{base + lo, base + hi, scope});
+        }
+      }
+      return ranges_.size() > num_ranges;
+    }
+
+    ByteReader r = rnglists_;
+    uint64_t offset = die.ranges.value;
+    if (die.ranges.form == DW_FORM_rnglistx) {
+      r.seek(unit.rnglists_base + offset * (unit.is64 ? 8 : 4));
+      offset = unit.rnglists_base + r.offset(unit.is64);
+    }
+    r.seek(offset);
+    auto addrx = [&](uint64_t index) {
+      AttrValue v{DW_FORM_addrx, index, nullptr};
+      uint64_t addr = 0;
+      AttrAddr(unit, v, addr);
+      return addr;
+    };
+    auto add = [&](uint64_t lo, uint64_t hi) {
+      if (lo != 0 && hi > lo) {
+        ranges_.push_back(Range{lo, hi, scope});
+      }
+    };
+    while (r.ok() && !r.empty()) {
+      uint8_t kind = r.u8();
+      if (kind == DW_RLE_end_of_list) {
+        break;
+      }
+      switch (kind) {
+        case DW_RLE_base_addressx:
+          base = addrx(r.uleb());
+          break;
+        case DW_RLE_startx_endx: {
+          uint64_t lo = addrx(r.uleb());
+          add(lo, addrx(r.uleb()));
+          break;
+        }
+        case DW_RLE_startx_length: {
+          uint64_t lo = addrx(r.uleb());
+          add(lo, lo + r.uleb());
+          break;
+        }
+        case DW_RLE_offset_pair: {
+          uint64_t lo = r.uleb();
+          add(base + lo, base + r.uleb());
+          break;
+        }
+        case DW_RLE_base_address:
+          base = r.fixed(unit.addr_size);
+          break;
+        case DW_RLE_start_end: {
+          uint64_t lo = r.fixed(unit.addr_size);
+          add(lo, r.fixed(unit.addr_size));
+          break;
+        }
+        case DW_RLE_start_length: {
+          uint64_t lo = r.fixed(unit.addr_size);
+          add(lo, lo + r.uleb());
+          break;
+        }
+        default:
+          return ranges_.size() > num_ranges;  // unknown, stop
+      }
+    }
+    return ranges_.size() > num_ranges;
+  }
+
+  uint32_t FileId(const std::string& path) {
+    auto r = file_ids_.emplace(path, static_cast<uint32_t>(files_.size()));
+    if (r.second) {
+      files_.emplace_back(path);
+    }
+    return r.first->second;
+  }
+
+  // walk all DIEs of a unit for its functions and inlined calls
+  void LoadUnit(const Unit& unit) {
+    if (unit.die_offset >= unit.end) {
+      return;
+    }
+    const AbbrevTable& table = GetAbbrevs(unit.abbrev_offset);
+    ByteReader r = info_;
+    r.seek(unit.die_offset);
+
+    // unit DIE, with line table and files of call_file
+    const char* comp_dir = nullptr;
+    uint64_t stmt_list = UINT64_MAX;
+    {
+      ByteReader header = r;
+      uint64_t code = header.uleb();
+      if (code == 0 || code >= table.size()) {
+        return;
+      }
+      AttrValue v;
+      for (const auto& spec : table[code].attrs) {
+        if (!ReadAttr(header, unit, spec, v)) {
+          return;
+        }
+        if (spec.name == DW_AT_comp_dir) {
+          comp_dir = v.str;
+        } else if (spec.name == DW_AT_stmt_list) {
+          stmt_list = v.value;
+        }
+      }
+    }
+    std::vector<uint32_t> files;
+    if (stmt_list != UINT64_MAX) {
+      LoadLineTable(unit, stmt_list, comp_dir, files);
+    }
+
+    // scope of each level, a DIE with children pushes a level
+    struct Level {
+      uint32_t enclosing;  // innermost scope around children
+      uint32_t created;    // scope created by DIE of this level
+      uint32_t enclosing_name;  // innermost name scope around children
+      uint32_t created_name;    // name scope created by DIE of this level
+    };
+    std::vector<Level> levels;
+    while (r.offset() < unit.end && r.ok()) {
+      uint64_t offset = r.offset();
+      DieInfo die;
+      const Abbrev* abbrev = ReadDie(r, unit, table, die);
+      if (abbrev == nullptr) {
+        if (!r.ok() || levels.empty()) {
+          break;  // null entry at top level, or bad data
+        }
+        if (levels.back().created != kNoScope) {
+          scopes_[levels.back().created].end =
+              static_cast<uint32_t>(scopes_.size());
+        }
+        if (levels.back().created_name != kNoScope) {
+          name_scopes_[levels.back().created_name].hi = r.offset();
+        }
+        levels.pop_back();
+        continue;
+      }
+      uint32_t enclosing = levels.empty() ? kNoScope : levels.back().enclosing;
+      uint32_t enclosing_name =
+          levels.empty() ? kNoScope : levels.back().enclosing_name;
+      uint32_t created = kNoScope;
+      uint32_t created_name = kNoScope;
+      if (abbrev->tag == DW_TAG_subprogram ||
+          abbrev->tag == DW_TAG_inlined_subroutine) {
+        uint32_t index = static_cast<uint32_t>(scopes_.size());
+        uint32_t range_begin = static_cast<uint32_t>(ranges_.size());
+        if (ReadRanges(unit, die, index)) {
+          Scope scope;
+          FuncName name = FunctionName(die, offset, 0);
+          scope.name = name.name != nullptr ? name.name : kFuncUnknown;
+          if (name.name != nullptr && !name.is_linkage) {
+            unqualified_.emplace_back(index, name.die);
+          }
+          // a nested function with code is outermost on its own
+          scope.parent = abbrev->tag == DW_TAG_inlined_subroutine
+                             ? enclosing
+                             : kNoScope;
+          scope.end = index + 1;
+          scope.call_file =
+              die.call_file < files.size() ? files[die.call_file] : UINT32_MAX;
+          scope.call_line = static_cast<int32_t>(die.call_line);
+          scope.range_begin = range_begin;
+          scope.range_end = static_cast<uint32_t>(ranges_.size());
+          scopes_.emplace_back(scope);
+          if (scope.parent == kNoScope) {
+            top_ranges_.insert(top_ranges_.end(),
+                               ranges_.begin() + range_begin, ranges_.end());
+          }
+          created = index;
+        }
+      }
+      if (abbrev->has_children &&
+          (abbrev->tag == DW_TAG_namespace ||
+           (die.name != nullptr && (abbrev->tag == DW_TAG_class_type ||
+                                    abbrev->tag == DW_TAG_structure_type ||
+                                    abbrev->tag == DW_TAG_union_type)))) {
+        created_name = static_cast<uint32_t>(name_scopes_.size());
+        const char* name =
+            die.name != nullptr ? die.name : "(anonymous namespace)";
+        name_scopes_.push_back(NameScope{offset, UINT64_MAX, name,
+                                         enclosing_name});
+      }
+      if (abbrev->has_children) {
+        levels.push_back(Level{created != kNoScope ? created : enclosing,
+                               created,
+                               created_name != kNoScope ? created_name
+                                                        : enclosing_name,
+                               created_name});
+      }
+      if (levels.empty()) {
+        break;  // unit DIE without children
+      }
+    }
+  }
+
+  // parse line number program, files are global ids of its file indices
+  void LoadLineTable(const Unit& unit, uint64_t offset, const char* comp_dir,
+                     std::vector<uint32_t>& files) {
+    ByteReader r = line_;
+    if (!r.seek(offset)) {
+      return;
+    }
+    Unit lu = unit;  // forms in header use format of line table
+    uint64_t length = r.u32();
+    lu.is64 = length == 0xffffffff;
+    if (lu.is64) {
+      length = r.u64();
+    }
+    if (!r.ok() || length > r.size() - r.offset()) {
+      return;
+    }
+    uint64_t end = r.offset() + length;
+    uint16_t version = r.u16();
+    if (version < 2 || version > 5) {
+      return;
+    }
+    if (version >= 5) {
+      lu.addr_size = r.u8();
+      r.u8();  // segment selector size
+    }
+    uint64_t header_length = r.offset(lu.is64);
+    uint64_t program = r.offset() + header_length;
+    uint8_t min_inst_length = r.u8();
+    if (version >= 4) {
+      r.u8();  // max ops per instruction, VLIW only
+    }
+    r.u8();  // default is_stmt
+    int8_t line_base = static_cast<int8_t>(r.u8());
+    uint8_t line_range = r.u8();
+    uint8_t opcode_base = r.u8();
+    std::vector<uint8_t> opcode_lengths(opcode_base, 0);
+    for (int i = 1; i < opcode_base; i++) {
+      opcode_lengths[i] = r.u8();
+    }
+    if (!r.ok() || line_range == 0) {
+      return;
+    }
+
+    auto join = [](const std::string& dir, const char* name) {
+      if (name[0] == '/' || dir.empty()) {
+        return std::string(name);
+      }
+      return dir + (dir.back() == '/' ? "" : "/") + name;
+    };
+    std::vector<std::string> dirs;
+    if (version >= 5) {
+      // entries are described by (content type, form) pairs
+      auto read_entries = [&](std::vector<std::pair<const char*, uint64_t>>&
+                                  entries) {
+        std::vector<AttrSpec> format(r.u8());
+        for (auto& spec : format) {
+          spec.name = r.uleb();
+          spec.form = r.uleb();
+        }
+        uint64_t count = r.uleb();
+        for (uint64_t i = 0; i < count && r.ok(); i++) {
+          std::pair<const char*, uint64_t> entry{"", 0};
+          AttrValue v;
+          for (const auto& spec : format) {
+            if (!ReadAttr(r, lu, spec, v)) {
+              return false;
+            }
+            if (spec.name == DW_LNCT_path && v.str) {
+              entry.first = v.str;
+            } else if (spec.name == DW_LNCT_directory_index) {
+              entry.second = v.value;
+            }
+          }
+          entries.emplace_back(entry);
+        }
+        return r.ok();
+      };
+      std::vector<std::pair<const char*, uint64_t>> dir_entries, file_entries;
+      if (!read_entries(dir_entries) || !read_entries(file_entries)) {
+        return;
+      }
+      for (const auto& d : dir_entries) {
+        dirs.emplace_back(dirs.empty() ? std::string(d.first)
+                                       : join(dirs[0], d.first));
+      }
+      for (const auto& f : file_entries) {
+        const std::string& dir = f.second < dirs.size() ? dirs[f.second] : "";
+        files.emplace_back(FileId(join(dir, f.first)));
+      }
+    } else {
+      // directory 0 and file 0 are the unit itself
+      dirs.emplace_back(comp_dir ? comp_dir : "");
+      while (r.ok()) {
+        const char* dir = r.cstr();
+        if (dir[0] == '\0') {
+          break;
+        }
+        dirs.emplace_back(join(dirs[0], dir));
+      }
+      files.emplace_back(UINT32_MAX);
+      while (r.ok()) {
+        const char* name = r.cstr();
+        if (name[0] == '\0') {
+          break;
+        }
+        uint64_t dir = r.uleb();
+        r.uleb();  // mtime
+        r.uleb();  // length
+        files.emplace_back(
+            FileId(join(dir < dirs.size() ? dirs[dir] : "", name)));
+      }
+    }
+    if (!r.seek(program)) {
+      return;
+    }
+
+    // state machine, rows are only kept if the sequence has an address
+    uint64_t address = 0;
+    uint64_t file = 1;
+    int64_t line = 1;
+    size_t sequence_begin = rows_.size();
+    auto reset = [&]() {
+      address = 0;
+      file = 1;
+      line = 1;
+    };
+    auto emit = [&]() {
+      rows_.push_back(LineRow{address,
+                              file < files.size() ? files[file] : UINT32_MAX,
+                              static_cast<int32_t>(line)});
+      if (rows_.back().file == UINT32_MAX) {
+        rows_.back().file = FileId("??");
+      }
+    };
+    auto end_sequence = [&]() {
+      // rows at the end address are empty, and would hide the next sequence
+      while (rows_.size() > sequence_begin && rows_.back().addr >= address) {
+        rows_.pop_back();
+      }
+      if (rows_.size() > sequence_begin && rows_[sequence_begin].addr == 0) {
+        rows_.resize(sequence_begin);  // discarded by linker
+      } else if (rows_.size() > sequence_begin) {
+        rows_.push_back(LineRow{address, kEndSequence, 0});
+      }
+      sequence_begin = rows_.size();
+      reset();
+    };
+    while (r.offset() < end && r.ok()) {
+      uint8_t opcode = r.u8();
+      if (opcode >= opcode_base) {
+        uint8_t adjusted = opcode - opcode_base;
+        address += (adjusted / line_range) * min_inst_length;
+        line += line_base + adjusted % line_range;
+        emit();
+        continue;
+      }
+      switch (opcode) {
+        case 0: {  // extended
+          uint64_t len = r.uleb();
+          uint64_t next = r.offset() + len;
+          uint8_t ext = len > 0 ? r.u8() : 0;
+          if (ext == DW_LNE_end_sequence) {
+            end_sequence();
+          } else if (ext == DW_LNE_set_address) {
+            address = r.fixed(len - 1 <= 8 ? len - 1 : 8);
+          } else if (ext == DW_LNE_define_file && version < 5) {
+            const char* name = r.cstr();
+            uint64_t dir = r.uleb();
+            files.emplace_back(
+                FileId(join(dir < dirs.size() ? dirs[dir] : "", name)));
+          }
+          r.seek(next);
+          break;
+        }
+        case DW_LNS_copy:
+          emit();
+          break;
+        case DW_LNS_advance_pc:
+          address += r.uleb() * min_inst_length;
+          break;
+        case DW_LNS_advance_line:
+          line += r.sleb();
+          break;
+        case DW_LNS_set_file:
+          file = r.uleb();
+          break;
+        case DW_LNS_const_add_pc:
+          address += ((255 - opcode_base) / line_range) * min_inst_length;
+          break;
+        case DW_LNS_fixed_advance_pc:
+          address += r.u16();
+          break;
+        default:
+          // column, stmt, basic block, prologue, isa and unknown opcodes
+          for (int i = 0; i < opcode_lengths[opcode]; i++) {
+            r.uleb();
+          }
+          break;
+      }
+    }
+    rows_.resize(sequence_begin);  // unterminated sequence
+  }
+
+  // innermost scope containing pc, or kNoScope
+  uint32_t FindScope(uint64_t pc) const {
+    auto it = std::upper_bound(
+        top_ranges_.begin(), top_ranges_.end(), pc,
+        [](uint64_t a, const Range& r) { return a < r.lo; });
+    if (it == top_ranges_.begin() || pc >= (--it)->hi) {
+      return kNoScope;
+    }
+    uint32_t found = it->scope;
+    // descendants in DIE order, skip subtrees not containing pc
+    uint32_t i = found + 1;
+    while (i < scopes_[found].end) {
+      if (scopes_[i].parent != kNoScope && Contains(scopes_[i], pc)) {
+        found = i++;
+      } else {
+        i = scopes_[i].end;
+      }
+    }
+    return found;
+  }
+
+  bool Contains(const Scope& scope, uint64_t pc) const {
+    for (uint32_t i = scope.range_begin; i < scope.range_end; i++) {
+      if (ranges_[i].lo <= pc && pc < ranges_[i].hi) {
+        return true;
+      }
+    }
+    return false;
+  }
+};
+
+const uint32_t ElfModule::kNoScope;
+const uint32_t ElfModule::kEndSequence;
+
+/**
+ * in-process symbolizer, modules are loaded once and kept
+ * - frames of a module without debug info, in it or a separate debug file,
+ *   only get function names
+ * - frames of a module failed to load are left to addr2line
+ * - modules are loaded and resolved concurrently, a loaded module is read
+ *   only so its frames are also resolved in parallel chunks
+ */
+class ElfSymbolizer {
+ public:
+  static ElfSymbolizer* GetInstance() {
+    static ElfSymbolizer instance;
+    return &instance;  // singleton
+  }
+
+  // min frames of a parallel chunk of a module
+  static const size_t kMinChunkFrames = 256;
+
+  /**
+   * resolve frames, frames not resolved are left in frames
+   * - symbol "exec(+0xoffset)" of a frame becomes "exec(name+0xoffset)" like
+   *   backtrace_symbols(), by .symtab or .dynsym of the module
+   */
+  void Resolve(std::vector<Frame*>& frames) {
+    std::mutex left_mutex;
+    std::vector<Frame*> left;
+    resolve_by_module(frames, "ElfSymbolizer", kMinChunkFrames,
+                      [&](ModuleChunk& chunk) {
+                        const ElfModule* module = GetModule(*chunk.exec);
+                        for (size_t i = 0; i < chunk.num_frames; i++) {
+                          Frame* frame = chunk.frames[i];
+                          if (module == nullptr || frame->faddr == nullptr) {
+                            std::lock_guard<std::mutex> lock(left_mutex);
+                            left.emplace_back(frame);
+                            continue;
+                          }
+                          uint64_t pc =
+                              Slice::offset(frame->addr, frame->faddr) +
+                              module->base_vaddr();
+                          module->Symbolize(pc, frame);
+                          SetSymbol(*module, pc, frame);
+                        }
+                      });
+    frames.swap(left);
+  }
+
+ private:
+  // loaded once, module is nullptr if failed
+  struct ModuleEntry {
+    std::once_flag loaded;
+    std::unique_ptr<ElfModule> module;
+  };
+
+  std::mutex mutex_;  // guard modules_
+  std::unordered_map<std::string, std::unique_ptr<ModuleEntry>> modules_;
+
+  ElfSymbolizer() = default;
+
+  static void SetSymbol(const ElfModule& module, uint64_t pc, Frame* frame) {
+    uint64_t start = 0;
+    const char* name = module.FindFunction(pc, &start);
+    size_t paren = frame->symbol.rfind('(');
+    if (name != nullptr && paren != std::string::npos) {
+      char offset[32];
+      snprintf(offset, sizeof(offset), "+0x%lx)", pc - start);
+      frame->symbol.replace(paren + 1, std::string::npos,
+                            std::string(name) + offset);
+    }
+  }
+
+  // load on first use, concurrent callers of the same exec wait for it
+  const ElfModule* GetModule(const std::string& exec) {
+    ModuleEntry* entry;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto& ptr = modules_[exec];
+      if (!ptr) {
+        ptr.reset(new ModuleEntry());
+      }
+      entry = ptr.get();
+    }
+    std::call_once(entry->loaded, [&]() {
+      std::unique_ptr<ElfModule> module(new ElfModule());
+      if (exec != "??" && module->Load(exec)) {
+        entry->module = std::move(module);
+      }
+    });
+    return entry->module.get();
+  }
+};
+
+const size_t ElfSymbolizer::kMinChunkFrames;
+
+void SetSymbolizer(Symbolizer symbolizer) {
+  g_symbolizer.store(symbolizer, std::memory_order_relaxed);
+}
+
+void SetSymbolizeThreads(size_t num_threads) {
+  g_symbolize_threads.store(num_threads, std::memory_order_relaxed);
+}
+
+// GNU build-id of an ELF file in hex, empty if it has none
+static std::string read_build_id(const std::string& path) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return "";
+  }
+  std::string build_id;
+  Elf64_Ehdr eh;
+  if (pread(fd, &eh, sizeof(eh), 0) != sizeof(eh) ||
+      memcmp(eh.e_ident, ELFMAG, SELFMAG) != 0 ||
+      eh.e_ident[EI_CLASS] != ELFCLASS64 ||
+      eh.e_phentsize != sizeof(Elf64_Phdr)) {
+    close(fd);
+    return "";
+  }
+  std::vector<uint8_t> notes;
+  for (int i = 0; i < eh.e_phnum && build_id.empty(); i++) {
+    Elf64_Phdr ph;
+    if (pread(fd, &ph, sizeof(ph), eh.e_phoff + i * sizeof(ph)) !=
+        sizeof(ph)) {
+      break;
+    }
+    if (ph.p_type != PT_NOTE || ph.p_filesz > (1 << 16)) {
+      continue;
+    }
+    notes.resize(ph.p_filesz);
+    if (pread(fd, notes.data(), notes.size(), ph.p_offset) ==
+        static_cast<ssize_t>(notes.size())) {
+      build_id = parse_build_id(notes.data(), notes.size());
+    }
+  }
+  close(fd);
+  return build_id;
+}
+
+/**
+ * symbol cache file of a module, mapped read only
+ * - header, entries sorted by offset, inlined functions, then '\0'
+ *   terminated strings, all in native byte order
+ * - strings of entries are offsets into the string table
+ */
+class SymbolCacheFile {
+ public:
+  struct Header {
+    char magic[8];
+    uint32_t num_entries;
+    uint32_t num_inlined;
+    uint64_t strings_size;
+  };
+
+  struct Entry {
+    uint64_t offset;  // address - file base address
+    uint32_t func;
+    uint32_t file;
+    int32_t line;
+    uint32_t inlined_begin;
+    uint32_t num_inlined;
+    uint32_t reserved;
+  };
+
+  struct Inlined {
+    uint32_t name;
+    uint32_t file;
+    int32_t line;
+  };
+
+  static const char kMagic[8];
+
+  ~SymbolCacheFile() {
+    if (data_ != nullptr) {
+      munmap(const_cast<uint8_t*>(data_), size_);
+    }
+  }
+
+  // map a cache file, nullptr if missing or malformed
+  static std::unique_ptr<SymbolCacheFile> Open(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(Header)) {
+      close(fd);
+      return nullptr;
+    }
+    void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+      return nullptr;
+    }
+    std::unique_ptr<SymbolCacheFile> file(new SymbolCacheFile());
+    file->data_ = static_cast<const uint8_t*>(data);
+    file->size_ = st.st_size;
+    const Header* h = reinterpret_cast<const Header*>(file->data_);
+    // each table is checked against the bytes left, so no sum overflows
+    uint64_t left = file->size_ - sizeof(Header);
+    uint64_t entries_size = uint64_t(h->num_entries) * sizeof(Entry);
+    uint64_t inlined_size = uint64_t(h->num_inlined) * sizeof(Inlined);
+    if (memcmp(h->magic, kMagic, sizeof(kMagic)) != 0 ||
+        entries_size > left || inlined_size > left - entries_size ||
+        h->strings_size != left - entries_size - inlined_size ||
+        (h->strings_size > 0 && file->data_[file->size_ - 1] != '\0')) {
+      return nullptr;
+    }
+    file->entries_ = reinterpret_cast<const Entry*>(h + 1);
+    file->inlined_ =
+        reinterpret_cast<const Inlined*>(file->entries_ + h->num_entries);
+    file->strings_ =
+        reinterpret_cast<const char*>(file->inlined_ + h->num_inlined);
+    file->header_ = h;
+    return file;
+  }
+
+  size_t size() const { return header_->num_entries; }
+
+  // index of entry at offset, or -1
+  int64_t Find(uint64_t offset) const {
+    const Entry* end = entries_ + size();
+    const Entry* it = std::lower_bound(
+        entries_, end, offset,
+        [](const Entry& e, uint64_t o) { return e.offset < o; });
+    return it != end && it->offset == offset ? it - entries_ : -1;
+  }
+
+  uint64_t offset(size_t i) const { return entries_[i].offset; }
+
+  // fill func, file, line and inlined_by of frame, false if malformed
+  bool Get(size_t i, Frame* frame) const {
+    const Entry& e = entries_[i];
+    if (e.inlined_begin > header_->num_inlined ||
+        e.num_inlined > header_->num_inlined - e.inlined_begin ||
+        !Valid(e.func) || !Valid(e.file)) {
+      return false;
+    }
+    for (uint32_t j = 0; j < e.num_inlined; j++) {
+      const Inlined& f = inlined_[e.inlined_begin + j];
+      if (!Valid(f.name) || !Valid(f.file)) {
+        return false;
+      }
+    }
+    frame->func = strings_ + e.func;
+    frame->file = strings_ + e.file;
+    frame->line = e.line;
+    frame->inlined_by.clear();
+    for (uint32_t j = 0; j < e.num_inlined; j++) {
+      const Inlined& f = inlined_[e.inlined_begin + j];
+      frame->inlined_by.push_back(
+          Frame::Func{strings_ + f.name, strings_ + f.file, f.line});
+    }
+    return true;
+  }
+
+  // write frames sorted by offset to path, replaced by rename so readers
+  // never see a partial file
+  static bool Write(const std::string& path,
+                    const std::vector<std::pair<uint64_t, Frame>>& frames) {
+    std::vector<Entry> entries;
+    std::vector<Inlined> inlined;
+    std::string strings;
+    std::unordered_map<std::string, uint32_t> string_ids;
+    auto add_string = [&](const std::string& s) {
+      auto it = string_ids.emplace(s, strings.size());
+      if (it.second) {
+        strings.append(s.c_str(), s.size() + 1);
+      }
+      return it.first->second;
+    };
+    for (const auto& it : frames) {
+      const Frame& frame = it.second;
+      Entry e = {it.first,
+                 add_string(frame.func),
+                 add_string(frame.file),
+                 frame.line,
+                 static_cast<uint32_t>(inlined.size()),
+                 static_cast<uint32_t>(frame.inlined_by.size()),
+                 0};
+      for (const auto& f : frame.inlined_by) {
+        inlined.push_back(Inlined{add_string(f.name), add_string(f.file),
+                                  f.line});
+      }
+      entries.push_back(e);
+    }
+    Header h;
+    memcpy(h.magic, kMagic, sizeof(kMagic));
+    h.num_entries = entries.size();
+    h.num_inlined = inlined.size();
+    h.strings_size = strings.size();
+
+    std::string tmp_path = path + ".tmp" + std::to_string(getpid());
+    FILE* fp = fopen(tmp_path.c_str(), "wbe");
+    if (fp == nullptr) {
+      return false;
+    }
+    bool ok =
+        fwrite(&h, sizeof(h), 1, fp) == 1 &&
+        fwrite(entries.data(), sizeof(Entry), entries.size(), fp) ==
+            entries.size() &&
+        fwrite(inlined.data(), sizeof(Inlined), inlined.size(), fp) ==
+            inlined.size() &&
+        fwrite(strings.data(), 1, strings.size(), fp) == strings.size();
+    ok = fclose(fp) == 0 && ok;
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+      unlink(tmp_path.c_str());
+      return false;
+    }
+    return true;
+  }
+
+ private:
+  const uint8_t* data_ = nullptr;
+  size_t size_ = 0;
+  const Header* header_ = nullptr;
+  const Entry* entries_ = nullptr;
+  const Inlined* inlined_ = nullptr;
+  const char* strings_ = nullptr;
+
+  SymbolCacheFile() = default;
+
+  bool Valid(uint32_t str) const { return str < header_->strings_size; }
+};
+
+const char SymbolCacheFile::kMagic[8] = {'B', 'T', 'S', 'Y', 'M', '0', '1', 0};
+
+/**
+ * on-disk cache of resolved frames, set by SetSymbolCacheDir()
+ * - one file per module named by its GNU build-id, so later processes and
+ *   other processes of the same binary share it, and a rebuilt binary never
+ *   reads stale entries
+ * - cached frames are found by binary search in the mapped file, with no
+ *   DWARF work or addr2line
+ * - new frames are merged with the latest file, concurrent writers may lose
+ *   entries of each other, which are resolved and written again later
+ * - only frames with a source line are cached, modules without build-id are
+ *   not cached
+ */
+class SymbolCache {
+ public:
+  static SymbolCache* GetInstance() {
+    static SymbolCache instance;
+    return &instance;  // singleton
+  }
+
+  bool enabled() const { return enabled_.load(std::memory_order_relaxed); }
+
+  // empty dir disables the cache
+  bool SetDir(const std::string& dir) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!dir.empty()) {
+      struct stat st;
+      if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+        return false;
+      }
+      if (stat(dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+        return false;
+      }
+    }
+    dir_ = dir;
+    modules_.clear();
+    enabled_.store(!dir.empty(), std::memory_order_relaxed);
+    return true;
+  }
+
+  // resolve frames in cache, frames not found are left in frames
+  void Lookup(std::vector<Frame*>& frames) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<Frame*> left;
+    for (Frame* frame : frames) {
+      const SymbolCacheFile* file = nullptr;
+      if (frame->faddr != nullptr) {
+        file = GetModule(frame->exec).file.get();
+      }
+      int64_t i = -1;
+      if (file != nullptr) {
+        i = file->Find(Slice::offset(frame->addr, frame->faddr));
+      }
+      if (i < 0 || !file->Get(i, frame)) {
+        left.emplace_back(frame);
+      }
+    }
+    frames.swap(left);
+  }
+
+  // save frames resolved by symbolizers
+  void Store(const std::vector<Frame*>& frames) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::unordered_map<std::string, std::vector<const Frame*>> by_exec;
+    for (const Frame* frame : frames) {
+      if (frame->line >= 0 && frame->faddr != nullptr) {
+        by_exec[frame->exec].emplace_back(frame);
+      }
+    }
+    for (auto& it : by_exec) {
+      Module& module = GetModule(it.first);
+      if (!module.path.empty()) {
+        Merge(module, it.second);
+      }
+    }
+  }
+
+ private:
+  struct Module {
+    std::string path;  // empty if not cached
+    std::unique_ptr<SymbolCacheFile> file;
+  };
+
+  std::atomic<bool> enabled_{false};
+  std::mutex mutex_;  // guard all below
+  std::string dir_;
+  std::unordered_map<std::string, Module> modules_;  // by exec
+
+  SymbolCache() = default;
+
+  Module& GetModule(const std::string& exec) {
+    auto it = modules_.find(exec);
+    if (it != modules_.end()) {
+      return it->second;
+    }
+    Module& module = modules_[exec];
+    std::string build_id = exec == "??" ? "" : read_build_id(exec);
+    if (!build_id.empty()) {
+      module.path = dir_ + "/" + build_id + ".sym";
+      module.file = SymbolCacheFile::Open(module.path);
+    }
+    return module;
+  }
+
+  // rewrite file of module with entries of the latest file and new frames
+  void Merge(Module& module, const std::vector<const Frame*>& frames) {
+    std::vector<std::pair<uint64_t, Frame>> merged;
+    std::unique_ptr<SymbolCacheFile> latest =
+        SymbolCacheFile::Open(module.path);
+    if (latest) {
+      merged.reserve(latest->size() + frames.size());
+      Frame frame;
+      for (size_t i = 0; i < latest->size(); i++) {
+        if (latest->Get(i, &frame)) {
+          merged.emplace_back(latest->offset(i), frame);
+        }
+      }
+    }
+    size_t num_old = merged.size();
+    for (const Frame* frame : frames) {
+      uint64_t offset = Slice::offset(frame->addr, frame->faddr);
+      if (!latest || latest->Find(offset) < 0) {
+        merged.emplace_back(offset, *frame);
+      }
+    }
+    if (merged.size() == num_old) {
+      module.file = std::move(latest);
+      return;
+    }
+    auto by_offset = [](const std::pair<uint64_t, Frame>& a,
+                        const std::pair<uint64_t, Frame>& b) {
+      return a.first < b.first;
+    };
+    std::sort(merged.begin() + num_old, merged.end(), by_offset);
+    std::inplace_merge(merged.begin(), merged.begin() + num_old, merged.end(),
+                       by_offset);
+    merged.erase(std::unique(merged.begin(), merged.end(),
+                             [](const std::pair<uint64_t, Frame>& a,
+                                const std::pair<uint64_t, Frame>& b) {
+                               return a.first == b.first;
+                             }),
+                 merged.end());
+    if (SymbolCacheFile::Write(module.path, merged)) {
+      module.file = SymbolCacheFile::Open(module.path);
+    } else {
+      fprintf(stderr, "SymbolCache: failed to write %s\n",
+              module.path.c_str());
+      module.path.clear();  // not to retry
+    }
+  }
+};
+
+
+bool SetSymbolCacheDir(const std::string& dir) {
+  return SymbolCache::GetInstance()->SetDir(dir);
+}
+
+// fill source of frames by symbol cache and symbolizers, frames are taken
+// by value as resolved ones are removed
+static void symbolize(std::vector<Frame*> frames) {
+  SymbolCache* symbol_cache = SymbolCache::GetInstance();
+  bool use_symbol_cache = symbol_cache->enabled();
+  if (use_symbol_cache) {
+    symbol_cache->Lookup(frames);  // seen by earlier processes
+  }
+  std::vector<Frame*> symbolized(frames);
+  if (g_symbolizer.load(std::memory_order_relaxed) == kSymbolizeElf &&
+      !frames.empty()) {
+    ElfSymbolizer::GetInstance()->Resolve(frames);
+  }
+  if (!frames.empty()) {
+    Addr2lineTool::GetInstance()->Resolve(frames);
+  }
+  if (use_symbol_cache) {
+    symbol_cache->Store(symbolized);
+  }
+}
+
+/**
+ * snapshot of loaded modules by dl_iterate_phdr(), without symbol lookup
+ * - an address belongs to the module whose PT_LOAD segment contains it,
+ *   found by binary search on sorted segments
+ * - build-id is read from PT_NOTE in memory, the file is not opened
+ * - Snapshot() is shared and only reloaded when the loader generation
+ *   changes, modules unloaded since the last snapshot are kept unless their
+ *   range is reused, so their frames still resolve after dlclose()
+ * - Refresh() on each new recorded address keeps the snapshot up to date
+ *   before a module of it can be unloaded
+ */
+class ModuleMap {
+ public:
+  struct Module {
+    std::string path;      // the executable is resolved by /proc/self/exe
+    std::string build_id;  // hex, empty if none
+    uintptr_t base;        // address of file offset 0, like dli_fbase
+  };
+
+  // current modules, reloaded if any module was loaded or unloaded
+  static std::shared_ptr<const ModuleMap> Snapshot() {
+    static std::mutex mutex;
+    static std::shared_ptr<const ModuleMap> current;
+    static uint64_t current_generation = 0;
+    uint64_t generation = Generation();
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!current || generation != current_generation) {
+      std::shared_ptr<ModuleMap> map = std::make_shared<ModuleMap>();
+      map->Load();
+      if (current) {
+        map->Retain(*current);
+      }
+      current = std::move(map);
+      current_generation = generation;
+      LoadedGeneration().store(generation, std::memory_order_release);
+    }
+    return current;
+  }
+
+  // reload the snapshot if any module was loaded or unloaded since, without
+  // locking if not
+  static void Refresh() {
+    if (Generation() != LoadedGeneration().load(std::memory_order_acquire)) {
+      Snapshot();
+    }
+  }
+
+  // number of modules loaded and unloaded by the dynamic loader
+  static uint64_t Generation() {
+    uint64_t generation = 0;
+    dl_iterate_phdr(
+        [](struct dl_phdr_info* info, size_t size, void* data) {
+          if (size >= offsetof(struct dl_phdr_info, dlpi_subs) +
+                          sizeof(info->dlpi_subs)) {
+            *static_cast<uint64_t*>(data) = info->dlpi_adds + info->dlpi_subs;
+          }
+          return 1;  // the same for all modules
+        },
+        &generation);
+    return generation;
+  }
+
+  // take a snapshot of modules loaded now
+  void Load() {
+    modules_.clear();
+    segments_.clear();
+    dl_iterate_phdr(&ModuleMap::AddModule, this);
+    std::sort(segments_.begin(), segments_.end(),
+              [](const Segment& a, const Segment& b) { return a.lo < b.lo; });
+  }
+
+  // keep modules of an older snapshot which are unloaded now, if no loaded
+  // module took their address range
+  void Retain(const ModuleMap& old) {
+    std::vector<Segment> retained;
+    for (const Segment& seg : old.segments_) {
+      auto it = std::lower_bound(
+          segments_.begin(), segments_.end(), seg.hi,
+          [](const Segment& s, uintptr_t hi) { return s.lo < hi; });
+      // segments are disjoint, so the last one starting below seg.hi also
+      // ends the highest
+      if (it != segments_.begin() && (--it)->hi > seg.lo) {
+        continue;
+      }
+      retained.push_back(seg);
+    }
+    std::vector<int> module_ids(old.modules_.size(), -1);
+    for (Segment& seg : retained) {
+      int& id = module_ids[seg.module];
+      if (id < 0) {
+        id = modules_.size();
+        modules_.push_back(old.modules_[seg.module]);
+      }
+      seg.module = id;
+      segments_.push_back(seg);
+    }
+    std::sort(segments_.begin(), segments_.end(),
+              [](const Segment& a, const Segment& b) { return a.lo < b.lo; });
+  }
+
+  size_t size() const { return modules_.size(); }
+  const Module& module(size_t i) const { return modules_[i]; }
+
+  // index of module containing addr, or -1
+  int Find(const void* addr) const {
+    uintptr_t pc = reinterpret_cast<uintptr_t>(addr);
+    auto it = std::upper_bound(
+        segments_.begin(), segments_.end(), pc,
+        [](uintptr_t a, const Segment& s) { return a < s.lo; });
+    if (it == segments_.begin() || pc >= (--it)->hi) {
+      return -1;
+    }
+    return it->module;
+  }
+
+ private:
+  struct Segment {
+    uintptr_t lo;
+    uintptr_t hi;
+    int module;
+  };
+
+  std::vector<Module> modules_;
+  std::vector<Segment> segments_;  // sorted by lo
+
+  // generation of the latest snapshot, 0 if none
+  static std::atomic<uint64_t>& LoadedGeneration() {
+    static std::atomic<uint64_t> generation(0);
+    return generation;
+  }
+
+  static int AddModule(struct dl_phdr_info* info, size_t, void* data) {
+    ModuleMap* self = static_cast<ModuleMap*>(data);
+    Module module;
+    if (info->dlpi_name != nullptr && info->dlpi_name[0] != '\0') {
+      module.path = info->dlpi_name;
+    } else {
+      char buf[4096];
+      ssize_t n = readlink("/proc/self/exe", buf, sizeof(buf));
+      module.path = n > 0 ? std::string(buf, n) : std::string("??");
+    }
+    // lowest vaddr of file offset 0, as ElfModule::base_vaddr()
+    bool found_load = false;
+    uintptr_t base_vaddr = 0;
+    int id = self->modules_.size();
+    for (int i = 0; i < info->dlpi_phnum; i++) {
+      const ElfW(Phdr)& ph = info->dlpi_phdr[i];
+      uintptr_t lo = info->dlpi_addr + ph.p_vaddr;
+      if (ph.p_type == PT_LOAD) {
+        if (!found_load || ph.p_vaddr - ph.p_offset < base_vaddr) {
+          base_vaddr = ph.p_vaddr - ph.p_offset;
+          found_load = true;
+        }
+        self->segments_.push_back(Segment{lo, lo + ph.p_memsz, id});
+      } else if (ph.p_type == PT_NOTE && module.build_id.empty()) {
+        module.build_id = parse_build_id(
+            reinterpret_cast<const uint8_t*>(lo), ph.p_memsz);
+      }
+    }
+    if (!found_load) {
+      return 0;
+    }
+    module.base = info->dlpi_addr + base_vaddr;
+    self->modules_.emplace_back(std::move(module));
+    return 0;
+  }
+};
+
+/**
+ * raw dump file written by DumpRaw(), symbolized by SymbolizeRawDump()
+ * - header, modules, call tree nodes, then stacks, in native byte order
+ * - a module is its load base, followed by its path and hex build-id
+ * - a node is an address as module index and offset in module, nodes of the
+ *   stack table are stored as is, so a stack is its innermost node
+ */
+struct RawDump {
+  struct Header {
+    char magic[8];
+    uint32_t num_modules;
+    uint32_t num_nodes;
+    uint32_t num_stacks;
+    uint32_t reserved;
+  };
+
+  struct Module {
+    uint64_t base;
+    uint32_t path_size;
+    uint32_t build_id_size;
+  };
+
+  struct Node {
+    uint64_t offset;  // address if module is kNoModule
+    uint32_t module;
+    uint32_t parent;  // kNoParent for root
+  };
+
+  struct Stack {
+    uint64_t count;
+    int64_t score;
+    uint64_t count_error;
+    int64_t score_error;
+    uint32_t node;
+    uint32_t reserved;
+  };
+
+  static const char kMagic[8];
+  static const uint32_t kNoModule = UINT32_MAX;
+  static const uint32_t kNoParent = UINT32_MAX;
+};
+
+const char RawDump::kMagic[8] = {'B', 'T', 'R', 'A', 'W', '0', '1', 0};
+const uint32_t RawDump::kNoModule;
+const uint32_t RawDump::kNoParent;
+
+// write nodes of records and the stacks to report as a raw dump
+static bool write_raw_dump(const std::string& path, const StackTable& records,
+                           const std::vector<uint32_t>& stacks) {
+  std::shared_ptr<const ModuleMap> snapshot = ModuleMap::Snapshot();
+  const ModuleMap& modules = *snapshot;
+  std::vector<uint32_t> module_ids(modules.size(), RawDump::kNoModule);
+  std::vector<uint32_t> used_modules;
+  std::vector<RawDump::Node> nodes(records.size());
+  for (uint32_t i = 0; i < records.size(); i++) {
+    RawDump::Node& node = nodes[i];
+    node.parent = i == StackTable::kRoot ? RawDump::kNoParent
+                                         : records.parent(i);
+    node.module = RawDump::kNoModule;
+    node.offset = reinterpret_cast<uintptr_t>(records.addr(i));
+    int m = i == StackTable::kRoot ? -1 : modules.Find(records.addr(i));
+    if (m >= 0) {
+      if (module_ids[m] == RawDump::kNoModule) {
+        module_ids[m] = used_modules.size();
+        used_modules.push_back(m);
+      }
+      node.module = module_ids[m];
+      node.offset -= modules.module(m).base;
+    }
+  }
+
+  FILE* fp = fopen(path.c_str(), "wbe");
+  if (fp == nullptr) {
+    return false;
+  }
+  RawDump::Header h;
+  memcpy(h.magic, RawDump::kMagic, sizeof(RawDump::kMagic));
+  h.num_modules = used_modules.size();
+  h.num_nodes = nodes.size();
+  h.num_stacks = stacks.size();
+  h.reserved = 0;
+  bool ok = fwrite(&h, sizeof(h), 1, fp) == 1;
+  for (uint32_t m : used_modules) {
+    const ModuleMap::Module& module = modules.module(m);
+    RawDump::Module rm = {module.base,
+                          static_cast<uint32_t>(module.path.size()),
+                          static_cast<uint32_t>(module.build_id.size())};
+    ok = ok && fwrite(&rm, sizeof(rm), 1, fp) == 1 &&
+         fwrite(module.path.data(), 1, module.path.size(), fp) ==
+             module.path.size() &&
+         fwrite(module.build_id.data(), 1, module.build_id.size(), fp) ==
+             module.build_id.size();
+  }
+  ok = ok &&
+       fwrite(nodes.data(), sizeof(RawDump::Node), nodes.size(), fp) ==
+           nodes.size();
+  for (uint32_t node : stacks) {
+    StackStat error = records.error(node);
+    RawDump::Stack s = {records.stat(node).count,
+                        records.stat(node).score,
+                        error.count,
+                        error.score,
+                        node,
+                        0};
+    ok = ok && fwrite(&s, sizeof(s), 1, fp) == 1;
+  }
+  return fclose(fp) == 0 && ok;
+}
+
+// file to symbolize a module with, found by build-id in debug_dir, or its
+// recorded path, empty if none matches the build-id
+static std::string find_module_file(const std::string& path,
+                                    const std::string& build_id,
+                                    const std::string& debug_dir) {
+  std::vector<std::string> candidates;
+  if (!debug_dir.empty()) {
+    if (build_id.size() > 2) {
+      // layout of /usr/lib/debug/.build-id
+      std::string prefix = debug_dir + "/.build-id/" + build_id.substr(0, 2) +
+                           "/" + build_id.substr(2);
+      candidates.push_back(prefix + ".debug");
+      candidates.push_back(prefix);
+    }
+    size_t slash = path.rfind('/');
+    candidates.push_back(debug_dir + "/" +
+                         (slash == std::string::npos ? path
+                                                     : path.substr(slash + 1)));
+  }
+  candidates.push_back(path);
+  for (const auto& file : candidates) {
+    if (access(file.c_str(), R_OK) == 0 &&
+        (build_id.empty() || read_build_id(file) == build_id)) {
+      return file;
+    }
+  }
+  return "";
+}
+
+// frames of symbolized raw dumps, never freed
+static std::mutex g_raw_frames_mutex;
+static std::deque<Frame> g_raw_frames;
+
+// bytes of fp after current position, bound allocations sized by the file
+static uint64_t remaining_bytes(FILE* fp) {
+  struct stat st;
+  long pos = ftell(fp);
+  if (pos < 0 || fstat(fileno(fp), &st) != 0 || st.st_size < pos) {
+    return 0;
+  }
+  return st.st_size - pos;
+}
+
+static bool read_raw_dump(FILE* fp, std::vector<StackFrames>& result,
+                          const std::string& debug_dir) {
+  RawDump::Header h;
+  if (fread(&h, sizeof(h), 1, fp) != 1 ||
+      memcmp(h.magic, RawDump::kMagic, sizeof(RawDump::kMagic)) != 0 ||
+      h.num_modules > remaining_bytes(fp) / sizeof(RawDump::Module)) {
+    return false;
+  }
+  struct ModuleInfo {
+    uint64_t base;
+    std::string path;
+    std::string build_id;
+  };
+  std::vector<ModuleInfo> modules(h.num_modules);
+  for (auto& module : modules) {
+    RawDump::Module rm;
+    if (fread(&rm, sizeof(rm), 1, fp) != 1 || rm.path_size > PATH_MAX ||
+        rm.build_id_size > 128 ||
+        rm.path_size + rm.build_id_size > remaining_bytes(fp)) {
+      return false;
+    }
+    module.base = rm.base;
+    module.path.resize(rm.path_size);
+    module.build_id.resize(rm.build_id_size);
+    if (fread(&module.path[0], 1, rm.path_size, fp) != rm.path_size ||
+        fread(&module.build_id[0], 1, rm.build_id_size, fp) !=
+            rm.build_id_size) {
+      return false;
+    }
+  }
+  // counts are 32 bits, no overflow
+  uint64_t tables_size = h.num_nodes * uint64_t(sizeof(RawDump::Node)) +
+                         h.num_stacks * uint64_t(sizeof(RawDump::Stack));
+  if (tables_size > remaining_bytes(fp)) {
+    return false;
+  }
+  std::vector<RawDump::Node> nodes(h.num_nodes);
+  std::vector<RawDump::Stack> stacks(h.num_stacks);
+  if (fread(nodes.data(), sizeof(RawDump::Node), nodes.size(), fp) !=
+          nodes.size() ||
+      fread(stacks.data(), sizeof(RawDump::Stack), stacks.size(), fp) !=
+          stacks.size()) {
+    return false;
+  }
+  // parents are before children in a stack table
+  for (uint32_t i = 0; i < nodes.size(); i++) {
+    if ((nodes[i].parent != RawDump::kNoParent && nodes[i].parent >= i) ||
+        (nodes[i].module != RawDump::kNoModule &&
+         nodes[i].module >= modules.size())) {
+      return false;
+    }
+  }
+  for (const auto& s : stacks) {
+    if (s.node >= nodes.size() || nodes[s.node].parent == RawDump::kNoParent) {
+      return false;
+    }
+  }
+
+  // one frame per address, as frames of Dump()
+  std::vector<Frame*> frames(nodes.size(), nullptr);
+  std::vector<std::vector<Frame*>> by_module(modules.size());
+  {
+    std::lock_guard<std::mutex> lock(g_raw_frames_mutex);
+    std::map<std::pair<uint32_t, uint64_t>, Frame*> unique_frames;
+    for (uint32_t i = 0; i < nodes.size(); i++) {
+      const RawDump::Node& node = nodes[i];
+      if (node.parent == RawDump::kNoParent) {
+        continue;
+      }
+      Frame*& frame = unique_frames[std::make_pair(node.module, node.offset)];
+      if (frame == nullptr) {
+        g_raw_frames.emplace_back();
+        frame = &g_raw_frames.back();
+        frame->func = kFuncUnknown;
+        frame->file = "??";
+        frame->line = -1;
+        char offset[32];
+        snprintf(offset, sizeof(offset), "(+0x%lx)", node.offset);
+        if (node.module == RawDump::kNoModule) {
+          frame->addr = reinterpret_cast<const void*>(node.offset);
+          frame->faddr = nullptr;
+          frame->exec = "??";
+          frame->symbol = "??";
+        } else {
+          const ModuleInfo& module = modules[node.module];
+          frame->addr =
+              reinterpret_cast<const void*>(module.base + node.offset);
+          frame->faddr = reinterpret_cast<const void*>(module.base);
+          frame->exec = module.path;
+          frame->symbol = module.path + offset;
+          by_module[node.module].push_back(frame);
+        }
+      }
+      frames[i] = frame;
+    }
+  }
+
+  // symbolize with files found here, then restore the recorded paths
+  std::vector<Frame*> to_resolve;
+  for (size_t m = 0; m < modules.size(); m++) {
+    std::string file =
+        find_module_file(modules[m].path, modules[m].build_id, debug_dir);
+    if (file.empty()) {
+      fprintf(stderr, "SymbolizeRawDump: %s (build-id %s) not found\n",
+              modules[m].path.c_str(), modules[m].build_id.c_str());
+      continue;
+    }
+    for (Frame* frame : by_module[m]) {
+      frame->exec = file;
+      to_resolve.push_back(frame);
+    }
+  }
+  if (!to_resolve.empty()) {
+    symbolize(to_resolve);
+  }
+  for (size_t m = 0; m < modules.size(); m++) {
+    for (Frame* frame : by_module[m]) {
+      frame->exec = modules[m].path;
+    }
+  }
+
+  result.resize(stacks.size());
+  for (size_t i = 0; i < stacks.size(); i++) {
+    const RawDump::Stack& s = stacks[i];
+    result[i].count = s.count;
+    result[i].score = s.score;
+    result[i].count_error = s.count_error;
+    result[i].score_error = s.score_error;
+    result[i].frames.clear();
+    for (uint32_t node = s.node; nodes[node].parent != RawDump::kNoParent;
+         node = nodes[node].parent) {
+      result[i].frames.push_back(frames[node]);
+    }
+  }
+  return true;
+}
+
+/**
+ * background thread resolving addresses newly recorded by any channel
+ * - new nodes of all shards are collected every kScanIntervalMs, addresses
+ *   already in FrameCache are skipped
+ * - resolved in batches of kBatchSize by Tracker::Resolve(), so a later
+ *   Dump() only looks them up in FrameCache
+ * - runs at the lowest priority on this thread only, and idles after each
+ *   batch so it is busy at most cpu_budget of the time, busy time of a batch
+ *   is its wall time, which also covers waiting for addr2line
+ */
+class Presymbolizer {
+ public:
+  // interval to collect new addresses
+  static const int kScanIntervalMs = 200;
+  // max addresses resolved at a time
+  static const size_t kBatchSize = 256;
+
+  static Presymbolizer* GetInstance() {
+    static Presymbolizer instance;
+    return &instance;  // singleton
+  }
+
+  bool Start(double cpu_budget) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (running_ || !(cpu_budget > 0)) {
+      return false;
+    }
+    cpu_budget_ = std::min(cpu_budget, 1.0);
+    running_ = true;
+    thread_ = std::thread(&Presymbolizer::Loop, this);
+    return true;
+  }
+
+  void Stop() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (running_) {
+      {
+        std::lock_guard<std::mutex> wait_lock(wait_mutex_);
+        stop_ = true;
+      }
+      wait_cv_.notify_all();
+      thread_.join();
+      stop_ = false;
+      running_ = false;
+    }
+  }
+
+ private:
+  std::mutex mutex_;  // guard Start() and Stop()
+  bool running_ = false;
+  double cpu_budget_ = 1.0;
+  std::thread thread_;
+  std::mutex wait_mutex_;
+  std::condition_variable wait_cv_;
+  bool stop_ = false;  // guarded by wait_mutex_
+
+  Presymbolizer() {
+    // singletons used by the thread are destroyed after this one, which
+    // stops the thread at exit
+    bttrack::GetInstance(0);
+    FrameCache::GetInstance();
+    DemangleCache::GetInstance();
+    SymbolCache::GetInstance();
+    ElfSymbolizer::GetInstance();
+    Addr2lineTool::GetInstance();
+    ModuleMap::Snapshot();
+  }
+
+  ~Presymbolizer() { Stop(); }
+
+  // return false if stopped while waiting
+  bool Wait(uint64_t nanos) {
+    std::unique_lock<std::mutex> lock(wait_mutex_);
+    return !wait_cv_.wait_for(lock, std::chrono::nanoseconds(nanos),
+                              [this] { return stop_; });
+  }
+
+  // addresses recorded since last call and not resolved yet, sorted
+  static void Collect(FramePointers& addrs) {
+    addrs.clear();
+    for (int i = 0; i < 256; i++) {
+      bttrack::GetInstance(static_cast<uint8_t>(i)).CollectNewAddrs(addrs);
+    }
+    FrameCache* cache = FrameCache::GetInstance();
+    addrs.erase(std::remove_if(addrs.begin(), addrs.end(),
+                               [cache](const void* addr) {
+                                 return cache->Find(addr) != nullptr;
+                               }),
+                addrs.end());
+    std::sort(addrs.begin(), addrs.end());
+    addrs.erase(std::unique(addrs.begin(), addrs.end()), addrs.end());
+  }
+
+  void Loop() {
+    ScopedHeapHookGuard guard;  // not to profile symbolizer itself
+    setpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)), 19);
+    // no threads of run_parallel(), so wall time bounds the CPU time
+    tls_symbolize_serial = true;
+    FramePointers pending;
+    FramePointers batch;
+    std::vector<Frame*> frames;
+    while (Wait(pending.empty() ? kScanIntervalMs * 1000000ULL : 0)) {
+      if (pending.empty()) {
+        Collect(pending);
+        continue;
+      }
+      // sorted, so a batch is likely a few modules
+      size_t n = std::min(kBatchSize, pending.size());
+      batch.assign(pending.end() - n, pending.end());
+      pending.resize(pending.size() - n);
+      uint64_t start = get_nanos();
+      Tracker::Resolve(batch, frames);
+      uint64_t busy = get_nanos() - start;
+      // busy / (busy + idle) <= cpu_budget
+      if (!Wait(static_cast<uint64_t>(busy * (1 - cpu_budget_) /
+                                      cpu_budget_))) {
+        break;
+      }
+    }
+  }
+};
+
+const int Presymbolizer::kScanIntervalMs;
+const size_t Presymbolizer::kBatchSize;
+
+
+bool StartPresymbolizer(double cpu_budget) {
+  return Presymbolizer::GetInstance()->Start(cpu_budget);
+}
+
+void StopPresymbolizer() { Presymbolizer::GetInstance()->Stop(); }
+
+bool SymbolizeRawDump(const std::string& path,
+                      std::vector<StackFrames>& result,
+                      const std::string& debug_dir) {
+  result.clear();
+  FILE* fp = fopen(path.c_str(), "rbe");
+  if (fp == nullptr) {
+    return false;
+  }
+  bool ok = read_raw_dump(fp, result, debug_dir);
+  fclose(fp);
+  if (!ok) {
+    result.clear();
+  }
+  return ok;
+}
+
+// frame of address with exec and its base address from the module map, and
+// symbol "exec(+0xoffset)", func and source are left to symbolizers
+Frame resolve_module(const void* address, const ModuleMap& modules) {
+  Frame frame;
+  frame.addr = address;
+  frame.faddr = nullptr;
+  frame.exec = "??";
+  frame.symbol = "??";
+  frame.func = kFuncUnknown;
+  frame.file = "??";
+  frame.line = -1;
+  int m = modules.Find(address);
+  if (m >= 0) {
+    const ModuleMap::Module& module = modules.module(m);
+    char offset[32];
+    snprintf(offset, sizeof(offset), "(+0x%lx)",
+             Slice::offset(address, module.base));
+    frame.exec = module.path;
+    frame.faddr = reinterpret_cast<const void*>(module.base);
+    frame.symbol = module.path + offset;
+  }
+  return frame;
+}
+
+#define KEEP_FRAME_POINTER __attribute__((optimize("no-omit-frame-pointer")))
+
+void KEEP_FRAME_POINTER Tracker::Record(int64_t score) {
+  StackStat weight;
+  if (!Sample(score, weight)) {
+    return;
+  }
+  void* addrs[kMaxStackFrames];
+  int num_frames = unwind(addrs, kMaxStackFrames);
+  if (num_frames <= kSkipFrames) {
+    assert(false);
+    return;
+  }
+  AddRecord(LocalShard(), addrs + kSkipFrames, num_frames - kSkipFrames,
+            weight);
+}
+
+void Tracker::RecordStack(const FramePointers& stack, int64_t score) {
+  StackStat weight;
+  if (!Sample(score, weight)) {
+    return;
+  }
+  AddRecord(LocalShard(), stack.data(), stack.size(), weight);
+}
+
+void Tracker::RecordWeighted(const void* const* addrs, size_t size,
+                             const StackStat& weight) {
+  AddRecord(LocalShard(), addrs, size, weight);
+}
+
+void Tracker::AddRecord(Shard* shard, const void* const* addrs, size_t size,
+                        const StackStat& weight) {
+  // growth of records allocates under shard lock, which a sampled allocation
+  // recorded into the same shard would take again
+  ScopedHeapHookGuard guard;
+  // hash outside the lock
+  uint64_t hash = hash_stack(addrs, size);
+  bool new_addrs;
+  {
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    uint32_t num_nodes = shard->records.size();
+    // find or create
+    StackStat& stat = shard->records.Find(addrs, size, hash);
+    stat.count += weight.count;
+    stat.score += weight.score;
+    new_addrs = shard->records.size() != num_nodes;
+  }
+  // a new address may be in a module loaded since the last snapshot, which
+  // is kept in the map only if seen before it is unloaded
+  if (new_addrs) {
+    ModuleMap::Refresh();
+  }
+}
+
+bool Tracker::Sample(int64_t score, StackStat& weight) {
+  uint32_t epoch = sampling_epoch_.load(std::memory_order_acquire);
+  int mode = sampling_mode_.load(std::memory_order_relaxed);
+  if (mode == kSampleAll) {
+    weight.count = 1;
+    weight.score = score;
+    return true;
+  }
+  static thread_local Sampler samplers[256];
+  Sampler& s = samplers[id_];
+  int64_t param = sampling_param_.load(std::memory_order_relaxed);
+  if (s.epoch != epoch) {
+    // config changed or first call of this thread
+    s.epoch = epoch;
+    s.countdown = mode == kSampleEveryN ? param : next_poisson_interval(param);
+  }
+  return sample(s, mode, param, score, weight);
+}
+
+void Tracker::SetSampling(Sampling mode, int64_t param) {
+  sampling_param_.store(std::max<int64_t>(param, 1), std::memory_order_relaxed);
+  sampling_mode_.store(mode, std::memory_order_relaxed);
+  sampling_epoch_.fetch_add(1, std::memory_order_release);
+}
+
+void Tracker::SetMaxStacks(size_t max_stacks) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  max_stacks_.store(max_stacks, std::memory_order_relaxed);
+  for (auto& shard : shards_) {
+    std::lock_guard<std::mutex> shard_lock(shard->mutex);
+    shard->records.set_max_stacks(max_stacks);
+  }
+}
+
+thread_local bool Tracker::shards_destroyed_
+    __attribute__((tls_model("initial-exec"))) = false;
+
+Tracker::Shard* Tracker::LocalShard() {
+  ScopedHeapHookGuard guard;  // not to profile tracker itself
+  if (shards_destroyed_) {
+    return ExitedShard();
+  }
+  static thread_local ThreadShards local;
+  Shard*& shard = local.shards[id_];
+  if (shard == nullptr) {
+    shard = AcquireShard();
+  }
+  return shard;
+}
+
+Tracker::Shard* Tracker::AcquireShard() {
+  ScopedHeapHookGuard guard;  // not to profile tracker itself
+  std::lock_guard<std::mutex> lock(mutex_);
+  // records of exited threads are kept, new thread just continues on them
+  for (auto& shard : shards_) {
+    if (!shard->in_use) {
+      shard->in_use = true;
+      return shard.get();
+    }
+  }
+  shards_.emplace_back(new Shard());
+  shards_.back()->in_use = true;
+  shards_.back()->records.set_max_stacks(
+      max_stacks_.load(std::memory_order_relaxed));
+  return shards_.back().get();
+}
+
+Tracker::Shard* Tracker::ExitedShard() {
+  std::call_once(exited_once_, [this] { exited_shard_ = AcquireShard(); });
+  return exited_shard_;
+}
+
+void Tracker::ReleaseShard(Shard* shard) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  shard->in_use = false;
+}
+
+Tracker::ThreadShards::~ThreadShards() {
+  shards_destroyed_ = true;
+  for (int i = 0; i < 256; i++) {
+    if (shards[i] != nullptr) {
+      GetInstance(static_cast<uint8_t>(i)).ReleaseShard(shards[i]);
+      shards[i] = nullptr;
+    }
+  }
+}
+
+bool KEEP_FRAME_POINTER Tracker::GetBacktrace(FramePointers& stack) {
+  void* addrs[kMaxStackFrames];
+  stack.clear();
+  int num_frames = unwind(addrs, kMaxStackFrames);
+  if (num_frames <= kSkipFrames) {
+    return false;
+  }
+  stack.assign(addrs + kSkipFrames, addrs + num_frames);
+  return true;
+}
+
+void Tracker::Dump(std::vector<StackFrames>& result, bool since_last_dump,
+                   bool reset) {
+  ScopedHeapHookGuard guard;  // not to profile dump itself
+  std::lock_guard<std::mutex> lock(dump_mutex_);
+  result.clear();
+
+  StackTable all_records;
+  std::vector<uint32_t> sort_idx;
+  CollectStacks(all_records, since_last_dump, reset, sort_idx);
+  std::vector<Frame*> frames;
+  ResolveNodes(all_records, frames);
+
+  // convert nodes to StackFrames, innermost frame first
+  result.resize(sort_idx.size());
+  for (size_t i = 0; i < sort_idx.size(); i++) {
+    uint32_t node = sort_idx[i];
+    result[i].count = all_records.stat(node).count;
+    result[i].score = all_records.stat(node).score;
+    StackStat error = all_records.error(node);
+    result[i].count_error = error.count;
+    result[i].score_error = error.score;
+    for (; node != StackTable::kRoot; node = all_records.parent(node)) {
+      result[i].frames.emplace_back(frames[node]);
+    }
+  }
+}
+
+bool Tracker::DumpRaw(const std::string& path, bool since_last_dump) {
+  ScopedHeapHookGuard guard;  // not to profile dump itself
+  std::lock_guard<std::mutex> lock(dump_mutex_);
+  StackTable all_records;
+  std::vector<uint32_t> sort_idx;
+  CollectStacks(all_records, since_last_dump, false, sort_idx);
+  return write_raw_dump(path, all_records, sort_idx);
+}
+
+void Tracker::CollectStacks(StackTable& all_records, bool since_last_dump,
+                            bool reset, std::vector<uint32_t>& sort_idx) {
+  MergeShards(all_records, reset);
+  if (reset) {
+    // next dump starts from an empty table
+    last_dump_ = StackNodes();
+  } else if (since_last_dump) {
+    StackNodes records = all_records.nodes();
+    all_records.Merge(last_dump_, true);
+    last_dump_ = std::move(records);
+  } else {
+    last_dump_ = all_records.nodes();
+  }
+
+  // sort recorded stacks by count, tie by node id, a delta or a debited
+  // count may wrap below 0
+  sort_idx.clear();
+  for (uint32_t i = StackTable::kRoot + 1; i < all_records.size(); i++) {
+    if (static_cast<int64_t>(all_records.stat(i).count) > 0) {
+      sort_idx.emplace_back(i);
+    }
+  }
+  std::sort(sort_idx.begin(), sort_idx.end(), [&](uint32_t a, uint32_t b) {
+    const uint64_t& ca = all_records.stat(a).count;
+    const uint64_t& cb = all_records.stat(b).count;
+    return (ca == cb) ? (a < b) : (ca > cb);
+  });
+  // merged shards may hold more stacks than asked, keep the heavy hitters
+  size_t max_stacks = max_stacks_.load(std::memory_order_relaxed);
+  if (max_stacks > 0 && sort_idx.size() > max_stacks) {
+    sort_idx.resize(max_stacks);
+  }
+}
+
+void Tracker::DumpCallTree(std::vector<CallNode>& result) {
+  ScopedHeapHookGuard guard;  // not to profile dump itself
+  std::lock_guard<std::mutex> lock(dump_mutex_);
+  result.clear();
+
+  StackTable all_records;
+  MergeShards(all_records, false);
+  std::vector<Frame*> frames;
+  ResolveNodes(all_records, frames);
+
+  result.resize(all_records.size());
+  for (uint32_t i = 0; i < all_records.size(); i++) {
+    const auto& stat = all_records.stat(i);
+    int64_t parent = all_records.parent(i);
+    result[i] = CallNode{frames[i],
+                         i == StackTable::kRoot ? -1 : parent,
+                         stat.count,
+                         stat.score,
+                         stat.count,
+                         stat.score};
+  }
+  // children are always after parent, so inclusive totals in one pass
+  for (size_t i = result.size() - 1; i > StackTable::kRoot; i--) {
+    auto& parent = result[result[i].parent];
+    parent.total_count += result[i].total_count;
+    parent.total_score += result[i].total_score;
+  }
+}
+
+void Tracker::MergeShards(StackTable& records, bool reset) {
+  // shards are never freed, so a copy of the list is safe to iterate
+  std::vector<Shard*> shards;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& shard : shards_) {
+      shards.emplace_back(shard.get());
+    }
+  }
+
+  if (reset) {
+    // rotate, shard lock is held only to swap with an empty table, and the
+    // cleared table is swapped into next shard
+    StackTable rotated;
+    for (Shard* shard : shards) {
+      {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        rotated.set_max_stacks(shard->records.max_stacks());
+        std::swap(shard->records, rotated);
+        shard->num_collected = 0;
+      }
+      records.Merge(rotated.nodes());
+      rotated.clear();
+    }
+    return;
+  }
+
+  // shard lock is held only to copy its nodes, merge and resolve are done
+  // without blocking Record()
+  StackNodes snapshot;
+  for (Shard* shard : shards) {
+    {
+      std::lock_guard<std::mutex> lock(shard->mutex);
+      snapshot = shard->records.nodes();  // reuse capacity of last copy
+    }
+    records.Merge(snapshot);
+  }
+}
+
+void Tracker::CollectNewAddrs(FramePointers& addrs) {
+  std::vector<Shard*> shards;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& shard : shards_) {
+      shards.emplace_back(shard.get());
+    }
+  }
+  for (Shard* shard : shards) {
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    const StackTable& records = shard->records;
+    // a compacted table is renumbered, collect it again
+    uint32_t begin = shard->num_collected <= records.size()
+                         ? shard->num_collected
+                         : StackTable::kRoot;
+    for (uint32_t i = std::max(begin, StackTable::kRoot + 1);
+         i < records.size(); i++) {
+      addrs.emplace_back(records.addr(i));
+    }
+    shard->num_collected = records.size();
+  }
+}
+
+void Tracker::ResolveNodes(const StackTable& records,
+                           std::vector<Frame*>& frames) {
+  // resolve all nodes at once, root has no frame
+  FramePointers addrs(records.size() - 1);
+  for (uint32_t i = StackTable::kRoot + 1; i < records.size(); i++) {
+    addrs[i - 1] = records.addr(i);
+  }
+  Resolve(addrs, frames);
+  frames.insert(frames.begin(), nullptr);
+}
+
+void Tracker::Resolve(const FramePointers& addr, std::vector<Frame*>& frames) {
+  FrameCache* cache = FrameCache::GetInstance();
+  frames.clear();
+  frames.resize(addr.size());
+
+  // lock-free lookup in cache, each missed addr is resolved once
+  std::vector<size_t> not_found;
+  std::unordered_map<const void*, size_t> lookup_index;
+  std::vector<const void*> addr_lookup;
+  for (size_t i = 0; i < addr.size(); i++) {
+    frames[i] = cache->Find(addr[i]);
+    if (frames[i] == nullptr) {
+      not_found.emplace_back(i);
+      if (lookup_index.emplace(addr[i], addr_lookup.size()).second) {
+        addr_lookup.emplace_back(addr[i]);
+      }
+    }
+  }
+
+  // batch lookup for not found
+  if (!addr_lookup.empty()) {
+    // modules by the module map, not backtrace_symbols() which takes a
+    // dladdr() per frame
+    const size_t num_lookup = addr_lookup.size();
+    std::shared_ptr<const ModuleMap> modules = ModuleMap::Snapshot();
+    std::vector<Frame> resolved;
+    resolved.reserve(num_lookup);
+    for (size_t i = 0; i < num_lookup; i++) {
+      resolved.emplace_back(resolve_module(addr_lookup[i], *modules));
+    }
+
+    // resolve in process, modules failed to load are left to addr2line
+    std::vector<Frame*> to_resolve(num_lookup);
+    for (size_t i = 0; i < num_lookup; i++) {
+      to_resolve[i] = &resolved[i];
+    }
+    symbolize(to_resolve);
+
+    // publish resolved frames, a frame resolved by another channel at the
+    // same time wins
+    std::vector<Frame*> cached(num_lookup);
+    for (size_t i = 0; i < num_lookup; i++) {
+      cached[i] = cache->Insert(std::move(resolved[i]));
+    }
+    for (size_t i : not_found) {
+      frames[i] = cached[lookup_index[addr[i]]];
+    }
+  }
+
+  // check all set
+  for (auto* frame : frames) {
+    assert(frame != nullptr);
+  }
+}
+
+/**
+ * buffered writer of reports to a fd, a FILE* or a string
+ * - fixed size buffer flushed when full, so writing a report to a file takes
+ *   O(buffer) memory however large it is
+ * - integers and pointers are formatted by hand, the same as std::ostream
+ *   prints them, without locale or stream state
+ * - write errors are sticky, see ok()
+ */
+class OutputWriter {
+ public:
+  static const size_t kBufferSize = 64 << 10;
+
+  explicit OutputWriter(int fd) : fd_(fd) {}
+  explicit OutputWriter(FILE* fp) : fp_(fp) {}
+  explicit OutputWriter(std::string* str) : str_(str) {}
+  ~OutputWriter() { Flush(); }
+
+  OutputWriter(const OutputWriter&) = delete;
+  OutputWriter& operator=(const OutputWriter&) = delete;
+
+  // true if all flushed bytes are written
+  bool ok() const { return ok_; }
+
+  bool Flush() {
+    if (size_ > 0) {
+      Write(buf_.get(), size_);
+      size_ = 0;
+    }
+    if (fp_ != nullptr && fflush(fp_) != 0) {
+      ok_ = false;
+    }
+    return ok_;
+  }
+
+  OutputWriter& Append(const char* s, size_t n) {
+    if (size_ + n > kBufferSize) {
+      Write(buf_.get(), size_);
+      size_ = 0;
+      if (n > kBufferSize) {
+        Write(s, n);
+        return *this;
+      }
+    }
+    memcpy(buf_.get() + size_, s, n);
+    size_ += n;
+    return *this;
+  }
+
+  OutputWriter& operator<<(char c) {
+    if (size_ == kBufferSize) {
+      Write(buf_.get(), size_);
+      size_ = 0;
+    }
+    buf_[size_++] = c;
+    return *this;
+  }
+
+  OutputWriter& operator<<(const char* s) { return Append(s, strlen(s)); }
+  OutputWriter& operator<<(const std::string& s) {
+    return Append(s.data(), s.size());
+  }
+
+  OutputWriter& operator<<(unsigned long long v) {
+    char tmp[20];
+    char* p = tmp + sizeof(tmp);
+    do {
+      *--p = static_cast<char>('0' + v % 10);
+      v /= 10;
+    } while (v != 0);
+    return Append(p, tmp + sizeof(tmp) - p);
+  }
+
+  OutputWriter& operator<<(long long v) {
+    if (v < 0) {
+      *this << '-';
+      // well defined for LLONG_MIN
+      return *this << (0ULL - static_cast<unsigned long long>(v));
+    }
+    return *this << static_cast<unsigned long long>(v);
+  }
+
+  OutputWriter& operator<<(unsigned long v) {
+    return *this << static_cast<unsigned long long>(v);
+  }
+  OutputWriter& operator<<(long v) {
+    return *this << static_cast<long long>(v);
+  }
+  OutputWriter& operator<<(unsigned v) {
+    return *this << static_cast<unsigned long long>(v);
+  }
+  OutputWriter& operator<<(int v) { return *this << static_cast<long long>(v); }
+
+  // "0x" and lowercase hex, "0" for nullptr, as std::ostream
+  OutputWriter& operator<<(const void* ptr) {
+    uintptr_t v = reinterpret_cast<uintptr_t>(ptr);
+    if (v == 0) {
+      return *this << '0';
+    }
+    char tmp[2 + 2 * sizeof(v)];
+    char* p = tmp + sizeof(tmp);
+    for (; v != 0; v >>= 4) {
+      *--p = "0123456789abcdef"[v & 0xf];
+    }
+    *--p = 'x';
+    *--p = '0';
+    return Append(p, tmp + sizeof(tmp) - p);
+  }
+
+  // 6 significant digits, as std::ostream
+  OutputWriter& operator<<(double v) {
+    char tmp[32];
+    int n = snprintf(tmp, sizeof(tmp), "%g", v);
+    return Append(tmp, std::min<size_t>(std::max(n, 0), sizeof(tmp) - 1));
+  }
+
+  // quoted JSON string, '"', '\\' and control characters are escaped, other
+  // bytes are copied as is
+  OutputWriter& JsonString(const std::string& str) {
+    *this << '"';
+    const char* s = str.data();
+    const char* end = s + str.size();
+    while (s < end) {
+      const char* run = s;
+      while (s < end && !NeedsEscape(*s)) {
+        s++;
+      }
+      Append(run, s - run);
+      if (s == end) {
+        break;
+      }
+      unsigned char c = static_cast<unsigned char>(*s++);
+      switch (c) {
+        case '"':
+          Append("\\\"", 2);
+          break;
+        case '\\':
+          Append("\\\\", 2);
+          break;
+        case '\n':
+          Append("\\n", 2);
+          break;
+        case '\r':
+          Append("\\r", 2);
+          break;
+        case '\t':
+          Append("\\t", 2);
+          break;
+        default: {
+          char u[6] = {'\\', 'u', '0', '0', "0123456789abcdef"[c >> 4],
+                       "0123456789abcdef"[c & 0xf]};
+          Append(u, sizeof(u));
+        }
+      }
+    }
+    return *this << '"';
+  }
+
+  // XML character data or attribute value, '&', '<', '>' and '"' are
+  // escaped, control characters not allowed in XML are '?'
+  OutputWriter& XmlText(const char* s, size_t n) {
+    const char* end = s + n;
+    while (s < end) {
+      const char* run = s;
+      while (s < end && !NeedsXmlEscape(*s)) {
+        s++;
+      }
+      Append(run, s - run);
+      if (s == end) {
+        break;
+      }
+      switch (*s++) {
+        case '&':
+          Append("&amp;", 5);
+          break;
+        case '<':
+          Append("&lt;", 4);
+          break;
+        case '>':
+          Append("&gt;", 4);
+          break;
+        case '"':
+          Append("&quot;", 6);
+          break;
+        default:
+          *this << '?';
+      }
+    }
+    return *this;
+  }
+  OutputWriter& XmlText(const std::string& str) {
+    return XmlText(str.data(), str.size());
+  }
+
+  // unsigned LEB128, 7 bits per byte, low bits first
+  OutputWriter& Varint(uint64_t v) {
+    char tmp[10];
+    size_t n = 0;
+    for (; v >= 0x80; v >>= 7) {
+      tmp[n++] = static_cast<char>(v | 0x80);
+    }
+    tmp[n++] = static_cast<char>(v);
+    return Append(tmp, n);
+  }
+
+  // n spaces
+  OutputWriter& Indent(size_t n) {
+    static const char kSpaces[] = "                                ";
+    for (; n > sizeof(kSpaces) - 1; n -= sizeof(kSpaces) - 1) {
+      Append(kSpaces, sizeof(kSpaces) - 1);
+    }
+    return Append(kSpaces, n);
+  }
+
+ private:
+  int fd_ = -1;
+  FILE* fp_ = nullptr;
+  std::string* str_ = nullptr;
+  std::unique_ptr<char[]> buf_{new char[kBufferSize]};
+  size_t size_ = 0;
+  bool ok_ = true;
+
+  // control characters, '"' and '\\'
+  static bool NeedsEscape(char c) {
+    unsigned char u = static_cast<unsigned char>(c);
+    return u < 64 ? (0x4ffffffffULL >> u) & 1 : u == '\\';
+  }
+
+  // control characters but '\t', '\n' and '\r', '"', '&', '<' and '>'
+  static bool NeedsXmlEscape(char c) {
+    unsigned char u = static_cast<unsigned char>(c);
+    return u < 64 && ((0x50000044ffffd9ffULL >> u) & 1);
+  }
+
+  void Write(const char* s, size_t n) {
+    if (!ok_ || n == 0) {
+      return;
+    }
+    if (str_ != nullptr) {
+      str_->append(s, n);
+    } else if (fp_ != nullptr) {
+      ok_ = fwrite(s, 1, n, fp_) == n;
+    } else {
+      while (n > 0) {
+        ssize_t written = write(fd_, s, n);
+        if (written < 0 && errno == EINTR) {
+          continue;
+        }
+        if (written <= 0) {
+          ok_ = false;
+          return;
+        }
+        s += written;
+        n -= written;
+      }
+    }
+  }
+};
+
+const size_t OutputWriter::kBufferSize;
+
+void StackFrameToString(OutputWriter& out, const StackFrames& stack,
+                        double sum, double sum_score, bool print_symbol) {
+  out << "recorded " << stack.count << " times (" << (stack.count / sum * 100.0)
+      << "%), score " << stack.score << " ("
+      << (stack.score / sum_score * 100.0) << "%)";
+  if (stack.count_error > 0 || stack.score_error > 0) {
+    out << ", error +-" << stack.count_error << " times, score +-"
+        << stack.score_error;
+  }
+  out << ", stack:" << '\n';
+  for (size_t f = 0; f < stack.frames.size(); f++) {
+    auto* frame = stack.frames[f];
+    out << "#" << f << (f < 10 ? "  " : " ") << frame->func;
+    out << " at " << frame->file << ":";
+    if (frame->line >= 0) {
+      out << frame->line;
+    } else {
+      out << "?";
+    }
+    if (frame->faddr) {
+      void* offset = (void*)((char*)frame->addr - (char*)frame->faddr);
+      out << " (" << frame->exec << "+" << offset << ")";
+    } else {
+      out << " (" << frame->exec << "+?)";
+    }
+    if (!frame->inlined_by.empty()) {
+      out << " (inlined by " << frame->inlined_by.size() << ")";
+    }
+    if (print_symbol) {
+      out << " <symbol=" << frame->symbol << ">";
+    }
+    out << '\n';
+  }
+}
+
+void StackFramesToString(OutputWriter& out,
+                         const std::vector<StackFrames>& records,
+                         bool print_symbol) {
+  if (records.empty()) {
+    out << "Report: no records.";
+    return;
+  }
+  uint64_t sum = 0;
+  int64_t sum_score = 0;
+  for (const auto& it : records) {
+    sum += it.count;
+    sum_score += it.score;
+  }
+  out << "Stack format: #N func at file:line (exec+offset)";
+  if (print_symbol) {
+    out << " <symbol=...>";
+  }
+  out << '\n'
+      << "Report: total " << sum << " records, score " << sum_score << ", in "
+      << records.size() << " different stack frames:" << '\n';
+  for (size_t i = 0; i < records.size(); i++) {
+    const auto& it = records[i];
+    out << "[" << i << "] ";
+    StackFrameToString(out, it, (double)sum, (double)sum_score, print_symbol);
+    out << '\n';
+  }
+}
+
+// frame as a JSON object, with the inlined functions if inlined, otherwise
+// only their number
+void FrameToJson(OutputWriter& out, const Frame& frame, bool inlined) {
+  void* offset =
+      frame.faddr ? (void*)((char*)frame.addr - (char*)frame.faddr) : 0;
+  out << "{\"address\": " << (uintptr_t)frame.addr << ", \"function\": ";
+  out.JsonString(frame.func) << ", \"file\": ";
+  out.JsonString(frame.file) << ", \"line\": " << frame.line << ", \"exec\": ";
+  out.JsonString(frame.exec) << ", \"offset\": " << (uintptr_t)offset
+                             << ", \"symbol\": ";
+  out.JsonString(frame.symbol) << ", \"inlined_by\": ";
+  if (!inlined) {
+    out << frame.inlined_by.size() << "}";
+    return;
+  }
+  out << "[";
+  for (size_t i = 0; i < frame.inlined_by.size(); i++) {
+    const Frame::Func& func = frame.inlined_by[i];
+    out << (i > 0 ? ", " : "") << "{\"function\": ";
+    out.JsonString(func.name) << ", \"file\": ";
+    out.JsonString(func.file) << ", \"line\": " << func.line << "}";
+  }
+  out << "]}";
+}
+
+// stack statistics of a record, without frames
+void StackStatToJson(OutputWriter& out, const StackFrames& stack) {
+  out << "\"count\": " << stack.count << ", \"score\": " << stack.score;
+  if (stack.count_error > 0 || stack.score_error > 0) {
+    out << ", \"count_error\": " << stack.count_error
+        << ", \"score_error\": " << stack.score_error;
+  }
+}
+
+void StackFrameToJson(OutputWriter& out, const StackFrames& stack,
+                      int indent) {
+  const size_t ind3 = 3 * indent;
+  const size_t ind4 = 4 * indent;
+  if (indent > 0) {
+    out << "{" << '\n';
+    out.Indent(ind3) << "\"count\": " << stack.count << "," << '\n';
+    out.Indent(ind3) << "\"score\": " << stack.score << "," << '\n';
+    if (stack.count_error > 0 || stack.score_error > 0) {
+      out.Indent(ind3) << "\"count_error\": " << stack.count_error << ","
+                       << '\n';
+      out.Indent(ind3) << "\"score_error\": " << stack.score_error << ","
+                       << '\n';
+    }
+    out.Indent(ind3) << "\"frames\": [";
+  } else {
+    out << "{";
+    StackStatToJson(out, stack);
+    out << ", \"frames\": [";
+  }
+  for (size_t f = 0; f < stack.frames.size(); f++) {
+    if (indent > 0) {
+      out << '\n';
+      out.Indent(ind4);
+    }
+    FrameToJson(out, *stack.frames[f], false);
+    if (f < stack.frames.size() - 1) {
+      out << ", ";
+    }
+  }
+  if (indent > 0) {
+    out << '\n';
+    out.Indent(ind3) << "]" << '\n';
+    out.Indent(2 * indent) << "}";
+  } else {
+    out << "]}";
+  }
+}
+
+/**
+ * kJsonFrameTable, each frame is written once in "frames", and frames of a
+ * record are indices into it, innermost first
+ * - frames are deduplicated by Frame*, which is unique per address in the
+ *   results of a dump, in the order first seen
+ * - one frame or record per line if indent > 0
+ */
+void StackFramesToJsonTable(OutputWriter& out,
+                            const std::vector<StackFrames>& records,
+                            int indent) {
+  uint64_t sum = 0;
+  int64_t sum_score = 0;
+  std::vector<const Frame*> frames;
+  std::unordered_map<const Frame*, uint32_t> frame_ids;
+  std::vector<uint32_t> frame_refs;  // frame indices of all records
+  for (const auto& it : records) {
+    sum += it.count;
+    sum_score += it.score;
+    for (const Frame* frame : it.frames) {
+      auto found = frame_ids.emplace(frame, frames.size());
+      if (found.second) {
+        frames.push_back(frame);
+      }
+      frame_refs.push_back(found.first->second);
+    }
+  }
+  // start an element of an object or array at depth, one per line if
+  // indent > 0
+  auto next = [&](size_t i, int depth) {
+    if (i > 0) {
+      out << ",";
+    }
+    if (indent > 0) {
+      out << '\n';
+      out.Indent(depth * indent);
+    } else if (i > 0) {
+      out << ' ';
+    }
+  };
+  // end an object or array at depth
+  auto close = [&](char c, int depth, bool empty) {
+    if (indent > 0 && !empty) {
+      out << '\n';
+      out.Indent(depth * indent);
+    }
+    out << c;
+  };
+  out << "{";
+  next(0, 1);
+  out << "\"version\": " << static_cast<int>(kJsonFrameTable);
+  next(1, 1);
+  out << "\"sum\": " << sum;
+  next(2, 1);
+  out << "\"sum_score\": " << sum_score;
+  next(3, 1);
+  out << "\"frames\": [";
+  for (size_t i = 0; i < frames.size(); i++) {
+    next(i, 2);
+    FrameToJson(out, *frames[i], true);
+  }
+  close(']', 1, frames.empty());
+  next(4, 1);
+  out << "\"records\": [";
+  const uint32_t* ref = frame_refs.data();
+  for (size_t i = 0; i < records.size(); i++) {
+    next(i, 2);
+    out << "{";
+    StackStatToJson(out, records[i]);
+    out << ", \"frames\": [";
+    for (size_t f = 0; f < records[i].frames.size(); f++) {
+      out << (f > 0 ? ", " : "") << *ref++;
+    }
+    out << "]}";
+  }
+  close(']', 1, records.empty());
+  close('}', 0, false);
+}
+
+void StackFramesToJson(OutputWriter& out,
+                       const std::vector<StackFrames>& records, int indent,
+                       JsonFormat format) {
+  if (format == kJsonFrameTable) {
+    StackFramesToJsonTable(out, records, indent);
+    return;
+  }
+  if (records.empty()) {
+    out << "{\"sum\": 0, \"sum_score\": 0, \"records\": []}";
+    return;
+  }
+  uint64_t sum = 0;
+  int64_t sum_score = 0;
+  for (const auto& it : records) {
+    sum += it.count;
+    sum_score += it.score;
+  }
+  if (indent > 0) {
+    out << "{" << '\n';
+    out.Indent(indent) << "\"sum\": " << sum << "," << '\n';
+    out.Indent(indent) << "\"sum_score\": " << sum_score << "," << '\n';
+    out.Indent(indent) << "\"records\": [";
+  } else {
+    out << "{\"sum\": " << sum << ", \"sum_score\": " << sum_score
+        << ", \"records\": [";
+  }
+  for (size_t i = 0; i < records.size(); i++) {
+    const auto& it = records[i];
+    if (indent > 0) {
+      out << '\n';
+      out.Indent(2 * indent);
+    }
+    StackFrameToJson(out, it, indent);
+    if (i < records.size() - 1) {
+      out << ",";
+    }
+  }
+  if (indent > 0) {
+    out << '\n';
+    out.Indent(indent) << "]" << '\n' << "}";
+  } else {
+    out << "]}";
+  }
+}
 
-    // (optional) parse " (inlined by) "
-    bool is_inlined_by = line.starts_with(kInlinedBy);
-    if (is_inlined_by) {
-      line.pop_front(kInlinedBy.size());
+std::string StackFramesToString(const std::vector<StackFrames>& records,
+                                bool print_symbol) {
+  std::string str;
+  OutputWriter out(&str);
+  StackFramesToString(out, records, print_symbol);
+  out.Flush();
+  return str;
+}
+
+std::string StackFramesToJson(const std::vector<StackFrames>& records,
+                              int indent, JsonFormat format) {
+  std::string str;
+  OutputWriter out(&str);
+  StackFramesToJson(out, records, indent, format);
+  out.Flush();
+  return str;
+}
+
+bool WriteStackFrames(int fd, const std::vector<StackFrames>& records,
+                      bool print_symbol) {
+  OutputWriter out(fd);
+  StackFramesToString(out, records, print_symbol);
+  return out.Flush();
+}
+
+bool WriteStackFrames(FILE* fp, const std::vector<StackFrames>& records,
+                      bool print_symbol) {
+  OutputWriter out(fp);
+  StackFramesToString(out, records, print_symbol);
+  return out.Flush();
+}
+
+bool WriteStackFramesJson(int fd, const std::vector<StackFrames>& records,
+                          int indent, JsonFormat format) {
+  OutputWriter out(fd);
+  StackFramesToJson(out, records, indent, format);
+  return out.Flush();
+}
+
+bool WriteStackFramesJson(FILE* fp, const std::vector<StackFrames>& records,
+                          int indent, JsonFormat format) {
+  OutputWriter out(fp);
+  StackFramesToJson(out, records, indent, format);
+  return out.Flush();
+}
+
+/**
+ * protobuf wire format encoder, enough for profile.proto
+ * - fields are appended in the order written, zero varints are omitted as
+ *   proto3 defaults
+ * - a nested message is encoded by its own encoder and appended with its
+ *   length
+ */
+class ProtoEncoder {
+ public:
+  const std::string& data() const { return data_; }
+  void clear() { data_.clear(); }
+
+  void Varint(uint64_t v) {
+    char buf[10];
+    size_t n = 0;
+    for (; v >= 0x80; v >>= 7) {
+      buf[n++] = static_cast<char>(v | 0x80);
+    }
+    buf[n++] = static_cast<char>(v);
+    data_.append(buf, n);
+  }
+
+  // uint64, int64 (negative is 10 bytes) or bool
+  void Int(int field, uint64_t v) {
+    if (v != 0) {
+      Varint(static_cast<uint64_t>(field) << 3);  // wire type 0
+      Varint(v);
+    }
+  }
+
+  void Bytes(int field, const char* data, size_t size) {
+    Varint(static_cast<uint64_t>(field) << 3 | 2);  // wire type 2
+    Varint(size);
+    data_.append(data, size);
+  }
+
+  void String(int field, const std::string& s) {
+    Bytes(field, s.data(), s.size());
+  }
+
+  void Message(int field, const ProtoEncoder& msg) {
+    Bytes(field, msg.data_.data(), msg.data_.size());
+  }
+
+  // packed repeated varints
+  void Packed(int field, const std::vector<uint64_t>& values) {
+    if (values.empty()) {
+      return;
+    }
+    ProtoEncoder packed;
+    for (uint64_t v : values) {
+      packed.Varint(v);
+    }
+    Message(field, packed);
+  }
+
+ private:
+  std::string data_;
+};
+
+/**
+ * pprof profile of dumped records, see
+ * https://github.com/google/pprof/blob/main/proto/profile.proto
+ * - sample types are count and score, values of a sample are count and score
+ *   of its record
+ * - a location per Frame*, its lines are the frame then inlined_by, so the
+ *   last line is the function the others are inlined into
+ * - a function per name and file, a mapping per exec with a load base,
+ *   build-id is taken from loaded modules if the same file is still loaded
+ */
+class PprofBuilder {
+ public:
+  // fields of profile.proto
+  enum ProfileField {
+    kSampleType = 1,
+    kSample = 2,
+    kMapping = 3,
+    kLocation = 4,
+    kFunction = 5,
+    kStringTable = 6,
+    kTimeNanos = 9,
+  };
+
+  explicit PprofBuilder(const std::string& score_unit) {
+    strings_.push_back("");  // string_table[0] must be ""
+    string_ids_[""] = 0;
+    ProtoEncoder value_type;
+    value_type.Int(1, String("count"));
+    value_type.Int(2, String("count"));
+    profile_.Message(kSampleType, value_type);
+    value_type.clear();
+    value_type.Int(1, String("score"));
+    value_type.Int(2, String(score_unit));
+    profile_.Message(kSampleType, value_type);
+  }
+
+  void AddSample(const StackFrames& record) {
+    location_ids_.clear();
+    for (const Frame* frame : record.frames) {
+      location_ids_.push_back(Location(frame));
+    }
+    ProtoEncoder sample;
+    sample.Packed(1, location_ids_);
+    values_.assign({record.count, static_cast<uint64_t>(record.score)});
+    sample.Packed(2, values_);
+    profile_.Message(kSample, sample);
+  }
+
+  // encoded profile, called once after all samples are added
+  std::string Finish() {
+    std::shared_ptr<const ModuleMap> modules = ModuleMap::Snapshot();
+    ProtoEncoder mappings;
+    ProtoEncoder msg;
+    for (size_t i = 0; i < mappings_.size(); i++) {
+      const Mapping& m = mappings_[i];
+      std::string build_id;
+      int found = modules->Find(reinterpret_cast<const void*>(m.start));
+      if (found >= 0 && modules->module(found).base == m.start &&
+          modules->module(found).path == *m.exec) {
+        build_id = modules->module(found).build_id;
+      }
+      msg.clear();
+      msg.Int(1, i + 1);
+      msg.Int(2, m.start);
+      msg.Int(3, m.limit);
+      msg.Int(5, String(*m.exec));
+      msg.Int(6, String(build_id));
+      msg.Int(7, m.has_functions);
+      msg.Int(8, m.has_lines);
+      msg.Int(9, m.has_lines);
+      msg.Int(10, m.has_inlined);
+      mappings.Message(kMapping, msg);
+    }
+    ProtoEncoder tail;
+    for (const std::string& s : strings_) {
+      tail.String(kStringTable, s);
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    tail.Int(kTimeNanos, ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+    // fields of a message may be in any order, repeated ones keep theirs
+    return profile_.data() + mappings.data() + locations_.data() +
+           functions_.data() + tail.data();
+  }
+
+ private:
+  struct Mapping {
+    const std::string* exec;
+    uint64_t start;
+    uint64_t limit;  // past the highest address seen
+    bool has_functions;
+    bool has_lines;
+    bool has_inlined;
+  };
+
+  ProtoEncoder profile_;    // sample types and samples
+  ProtoEncoder locations_;  // repeated Location fields of profile
+  ProtoEncoder functions_;  // repeated Function fields of profile
+  std::vector<std::string> strings_;
+  std::unordered_map<std::string, uint64_t> string_ids_;
+  std::unordered_map<const Frame*, uint64_t> location_ids_by_frame_;
+  std::map<std::pair<uint64_t, uint64_t>, uint64_t> function_ids_;
+  std::map<std::pair<std::string, uint64_t>, uint64_t> mapping_ids_;
+  std::vector<Mapping> mappings_;
+  std::vector<uint64_t> location_ids_;  // of current sample
+  std::vector<uint64_t> values_;        // of current sample
+
+  uint64_t String(const std::string& s) {
+    auto it = string_ids_.emplace(s, strings_.size());
+    if (it.second) {
+      strings_.push_back(s);
+    }
+    return it.first->second;
+  }
+
+  uint64_t Function(const std::string& name, const std::string& file) {
+    uint64_t name_id = String(name);
+    uint64_t file_id = String(file);
+    auto it = function_ids_.emplace(std::make_pair(name_id, file_id),
+                                    function_ids_.size() + 1);
+    if (it.second) {
+      ProtoEncoder msg;
+      msg.Int(1, it.first->second);
+      msg.Int(2, name_id);
+      msg.Int(3, name_id);  // system_name
+      msg.Int(4, file_id);
+      functions_.Message(kFunction, msg);
+    }
+    return it.first->second;
+  }
+
+  // 0 if frame has no module
+  uint64_t MappingOf(const Frame& frame) {
+    if (frame.faddr == nullptr) {
+      return 0;
+    }
+    uint64_t start = reinterpret_cast<uintptr_t>(frame.faddr);
+    auto it = mapping_ids_.emplace(std::make_pair(frame.exec, start),
+                                   mappings_.size() + 1);
+    if (it.second) {
+      mappings_.push_back(
+          Mapping{&it.first->first.first, start, start, false, false, false});
+    }
+    Mapping& m = mappings_[it.first->second - 1];
+    m.limit = std::max<uint64_t>(m.limit,
+                                 reinterpret_cast<uintptr_t>(frame.addr) + 1);
+    m.has_functions |= frame.func != kFuncUnknown;
+    m.has_lines |= frame.line >= 0;
+    m.has_inlined |= !frame.inlined_by.empty();
+    return it.first->second;
+  }
+
+  uint64_t Location(const Frame* frame) {
+    auto it = location_ids_by_frame_.emplace(
+        frame, location_ids_by_frame_.size() + 1);
+    if (!it.second) {
+      return it.first->second;
+    }
+    ProtoEncoder msg;
+    ProtoEncoder line;
+    msg.Int(1, it.first->second);
+    msg.Int(2, MappingOf(*frame));
+    msg.Int(3, reinterpret_cast<uintptr_t>(frame->addr));
+    // an unknown function is left to pprof, which shows its address
+    if (frame->func != kFuncUnknown || !frame->inlined_by.empty()) {
+      line.Int(1, Function(frame->func, frame->file));
+      line.Int(2, std::max(frame->line, 0));
+      msg.Message(4, line);
+      for (const Frame::Func& caller : frame->inlined_by) {
+        line.clear();
+        line.Int(1, Function(caller.name, caller.file));
+        line.Int(2, std::max(caller.line, 0));
+        msg.Message(4, line);
+      }
+    }
+    locations_.Message(kLocation, msg);
+    return it.first->second;
+  }
+};
+
+static const uint32_t* crc32_table() {
+  static uint32_t table[256];
+  static std::once_flag once;
+  std::call_once(once, [] {
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; k++) {
+        c = c & 1 ? 0xedb88320U ^ (c >> 1) : c >> 1;
+      }
+      table[i] = c;
+    }
+  });
+  return table;
+}
+
+// CRC-32 of gzip trailer
+static uint32_t crc32(const std::string& data) {
+  const uint32_t* table = crc32_table();
+  uint32_t c = 0xffffffffU;
+  for (unsigned char b : data) {
+    c = table[(c ^ b) & 0xff] ^ (c >> 8);
+  }
+  return c ^ 0xffffffffU;
+}
+
+/**
+ * deflate with fixed Huffman codes, in a single block
+ * - greedy LZ77 matching on a 32KB window, candidates by hash of 3 bytes
+ *   with a bounded chain, so it is linear in input size
+ * - about half the ratio of zlib on profiles, only used without zlib
+ */
+class FixedDeflate {
+ public:
+  static const int kWindowSize = 32768;
+  static const int kHashBits = 15;
+  static const int kMaxChain = 16;
+  static const int kMinMatch = 3;
+  static const int kMaxMatch = 258;
+
+  static void Compress(const std::string& in, std::string& out) {
+    FixedDeflate d(out);
+    d.Put(1, 1);  // BFINAL
+    d.Put(1, 2);  // BTYPE fixed Huffman
+    const unsigned char* s = reinterpret_cast<const unsigned char*>(in.data());
+    const int n = static_cast<int>(in.size());
+    std::vector<int> head(1 << kHashBits, -1);
+    std::vector<int> prev(kWindowSize, -1);
+    auto insert = [&](int pos) {
+      if (pos + kMinMatch <= n) {
+        uint32_t h = Hash(s + pos);
+        prev[pos & (kWindowSize - 1)] = head[h];
+        head[h] = pos;
+      }
+    };
+    for (int pos = 0; pos < n;) {
+      int best_len = 0;
+      int best_dist = 0;
+      if (pos + kMinMatch <= n) {
+        int max_len = std::min(kMaxMatch, n - pos);
+        int cand = head[Hash(s + pos)];
+        for (int chain = 0; cand >= 0 && pos - cand <= kWindowSize &&
+                            chain < kMaxChain;
+             chain++) {
+          if (s[cand + best_len] == s[pos + best_len]) {
+            int len = 0;
+            while (len < max_len && s[cand + len] == s[pos + len]) {
+              len++;
+            }
+            if (len > best_len) {
+              best_len = len;
+              best_dist = pos - cand;
+              if (len == max_len) {
+                break;
+              }
+            }
+          }
+          int next = prev[cand & (kWindowSize - 1)];
+          if (next >= cand) {
+            break;  // overwritten by a later position
+          }
+          cand = next;
+        }
+      }
+      if (best_len >= kMinMatch) {
+        d.Match(best_len, best_dist);
+        for (int end = pos + best_len; pos < end; pos++) {
+          insert(pos);
+        }
+      } else {
+        d.Symbol(s[pos]);
+        insert(pos++);
+      }
+    }
+    d.Symbol(256);  // end of block
+    d.Flush();
+  }
+
+ private:
+  std::string& out_;
+  uint64_t bits_ = 0;
+  int num_bits_ = 0;
+
+  explicit FixedDeflate(std::string& out) : out_(out) {}
+
+  static uint32_t Hash(const unsigned char* p) {
+    uint32_t v = p[0] | p[1] << 8 | p[2] << 16;
+    return (v * 0x9e3779b1U) >> (32 - kHashBits);
+  }
+
+  // n bits of v, least significant first
+  void Put(uint32_t v, int n) {
+    bits_ |= static_cast<uint64_t>(v) << num_bits_;
+    num_bits_ += n;
+    while (num_bits_ >= 8) {
+      out_ += static_cast<char>(bits_ & 0xff);
+      bits_ >>= 8;
+      num_bits_ -= 8;
+    }
+  }
+
+  void Flush() {
+    if (num_bits_ > 0) {
+      out_ += static_cast<char>(bits_ & 0xff);
+    }
+    bits_ = 0;
+    num_bits_ = 0;
+  }
+
+  // Huffman codes are stored most significant bit first
+  void Code(uint32_t code, int n) {
+    uint32_t reversed = 0;
+    for (int i = 0; i < n; i++) {
+      reversed = reversed << 1 | ((code >> i) & 1);
+    }
+    Put(reversed, n);
+  }
+
+  // literal, end of block or length code
+  void Symbol(int sym) {
+    if (sym < 144) {
+      Code(0x30 + sym, 8);
+    } else if (sym < 256) {
+      Code(0x190 + sym - 144, 9);
+    } else if (sym < 280) {
+      Code(sym - 256, 7);
     } else {
-      frame_id++;  // a new frame
+      Code(0xc0 + sym - 280, 8);
     }
-    assert(frame_id >= 0);  // starts from -1
-    Frame* frame = ctx.frames[frame_id];
+  }
 
-    // (optional) parse "FUNC at "
-    Slice func;
-    std::string func_str;
-    size_t pos_at = line.find(kAt);
-    if (pos_at != Slice::npos) {
-      func = line.substr(0, pos_at);
-      line.pop_front(pos_at + kAt.size());
-      demangle_symbol(func_str, func.make_cstr());
+  void Match(int len, int dist) {
+    static const uint16_t kLenBase[29] = {
+        3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+        31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+    static const uint8_t kLenExtra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+                                          1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                                          4, 4, 4, 4, 5, 5, 5, 5, 0};
+    static const uint16_t kDistBase[30] = {
+        1,    2,    3,    4,    5,    7,     9,     13,    17,  25,
+        33,   49,   65,   97,   129,  193,   257,   385,   513, 769,
+        1025, 1537, 2049, 3073, 4097, 6145,  8193,  12289, 16385, 24577};
+    static const uint8_t kDistExtra[30] = {0, 0, 0,  0,  1,  1,  2,  2,
+                                           3, 3, 4,  4,  5,  5,  6,  6,
+                                           7, 7, 8,  8,  9,  9,  10, 10,
+                                           11, 11, 12, 12, 13, 13};
+    int l = 28;
+    while (kLenBase[l] > len) {
+      l--;
+    }
+    Symbol(257 + l);
+    Put(len - kLenBase[l], kLenExtra[l]);
+    int d = 29;
+    while (kDistBase[d] > dist) {
+      d--;
+    }
+    Code(d, 5);
+    Put(dist - kDistBase[d], kDistExtra[d]);
+  }
+};
+
+const int FixedDeflate::kWindowSize;
+const int FixedDeflate::kHashBits;
+const int FixedDeflate::kMaxChain;
+const int FixedDeflate::kMinMatch;
+const int FixedDeflate::kMaxMatch;
+
+// gzip by the built-in deflate
+bool gzip_builtin(const std::string& in, std::string& out) {
+  static const char kHeader[10] = {'\x1f', '\x8b', 8, 0, 0, 0, 0, 0, 0, 3};
+  out.assign(kHeader, sizeof(kHeader));
+  FixedDeflate::Compress(in, out);
+  // CRC-32 and size mod 2^32, little endian whatever the host is
+  for (uint32_t v : {crc32(in), static_cast<uint32_t>(in.size())}) {
+    for (int i = 0; i < 4; i++) {
+      out.push_back(static_cast<char>(v >> (8 * i)));
+    }
+  }
+  return true;
+}
+
+std::string StackFramesToPprof(const std::vector<StackFrames>& records,
+                               const std::string& score_unit, bool gzip) {
+  PprofBuilder builder(score_unit);
+  for (const auto& record : records) {
+    builder.AddSample(record);
+  }
+  std::string profile = builder.Finish();
+  if (!gzip) {
+    return profile;
+  }
+  std::string compressed;
+  const Zlib* zlib = Zlib::Get();
+  if (zlib == nullptr || !zlib->Gzip(profile, compressed)) {
+    gzip_builtin(profile, compressed);
+  }
+  return compressed;
+}
+
+/**
+ * function names of frames for flame graphs, each name and frame is interned
+ * once, so a stack is a list of name ids
+ * - a frame with inlined_by is expanded to its functions, outermost first,
+ *   and the functions inlined into another are suffixed "_[i]" as
+ *   flamegraph.pl annotates them
+ * - an unknown function is "[exec]", so unknown frames of a module merge
+ * - ';' and line breaks are '_', they would break the folded format
+ */
+class FlameNames {
+ public:
+  const std::string& name(uint32_t id) const { return names_[id]; }
+
+  // name ids of a record, outermost first, records are innermost first
+  void Stack(const StackFrames& record, std::vector<uint32_t>& ids) {
+    ids.clear();
+    for (size_t f = record.frames.size(); f-- > 0;) {
+      auto range = Expand(record.frames[f]);
+      ids.insert(ids.end(), frame_names_.begin() + range.first,
+                 frame_names_.begin() + range.second);
+    }
+  }
+
+ private:
+  std::vector<std::string> names_;
+  std::unordered_map<std::string, uint32_t> name_ids_;
+  // [begin, end) in frame_names_ of each frame
+  std::unordered_map<const Frame*, std::pair<uint32_t, uint32_t>> frames_;
+  std::vector<uint32_t> frame_names_;
+
+  std::pair<uint32_t, uint32_t> Expand(const Frame* frame) {
+    auto found = frames_.emplace(frame, std::make_pair(0, 0));
+    if (!found.second) {
+      return found.first->second;
+    }
+    uint32_t begin = frame_names_.size();
+    for (size_t i = frame->inlined_by.size(); i-- > 0;) {
+      frame_names_.push_back(Intern(frame->inlined_by[i].name,
+                                    i + 1 < frame->inlined_by.size()));
+    }
+    if (frame->func == kFuncUnknown) {
+      frame_names_.push_back(Intern("[" + frame->exec + "]", false));
+    } else {
+      frame_names_.push_back(Intern(frame->func, !frame->inlined_by.empty()));
+    }
+    found.first->second = std::make_pair(begin, frame_names_.size());
+    return found.first->second;
+  }
+
+  uint32_t Intern(std::string name, bool inlined) {
+    std::replace_if(
+        name.begin(), name.end(),
+        [](char c) { return c == ';' || c == '\n' || c == '\r'; }, '_');
+    if (inlined) {
+      name += "_[i]";
+    }
+    auto found = name_ids_.emplace(name, names_.size());
+    if (found.second) {
+      names_.push_back(std::move(name));
+    }
+    return found.first->second;
+  }
+};
+
+// weight of a record, negative scores are 0
+static uint64_t flame_weight(const StackFrames& record, FlameWeight weight) {
+  if (weight == kFlameScore) {
+    return record.score > 0 ? record.score : 0;
+  }
+  return record.count;
+}
+
+void StackFramesToFolded(OutputWriter& out,
+                         const std::vector<StackFrames>& records,
+                         FlameWeight weight) {
+  FlameNames names;
+  std::vector<uint32_t> stack;
+  for (const auto& it : records) {
+    uint64_t value = flame_weight(it, weight);
+    if (value == 0 || it.frames.empty()) {
+      continue;
+    }
+    names.Stack(it, stack);
+    for (size_t i = 0; i < stack.size(); i++) {
+      if (i > 0) {
+        out << ';';
+      }
+      out << names.name(stack[i]);
+    }
+    out << ' ' << value << '\n';
+  }
+}
+
+/**
+ * SVG flame graph of records, merged into a call tree by name in a single
+ * pass over the records, the tree is a StackTable of name ids
+ * - the root "all" is at the bottom, callees above their callers, children
+ *   are sorted by name and as wide as their weight, like flamegraph.pl
+ * - frames narrower than kMinWidth are not drawn, nor their callees, so the
+ *   size of the SVG is bounded by its width whatever the number of samples
+ * - colors are hashed from names, warm for functions, aqua if inlined
+ * - a static SVG, the name and weight of a frame are in its <title> tooltip
+ */
+class FlameGraph {
+ public:
+  static constexpr double kWidth = 1200;
+  static constexpr double kPadX = 10;
+  static constexpr double kPadTop = 36;  // for the title
+  static constexpr double kPadBottom = 10;
+  static constexpr double kFrameHeight = 16;
+  static constexpr double kFontSize = 12;
+  static constexpr double kFontWidth = 0.59;  // of kFontSize, Verdana
+  static constexpr double kMinWidth = 0.1;
+
+  FlameGraph() : totals_(1, 0) {}
+
+  void Add(const std::vector<StackFrames>& records, FlameWeight weight) {
+    std::vector<uint32_t> stack;
+    for (const auto& it : records) {
+      uint64_t value = flame_weight(it, weight);
+      if (value == 0 || it.frames.empty()) {
+        continue;
+      }
+      names_.Stack(it, stack);
+      uint32_t node = StackTable::kRoot;
+      totals_[node] += value;
+      for (uint32_t name : stack) {
+        node = tree_.Child(node, reinterpret_cast<const void*>(
+                                     static_cast<uintptr_t>(name)));
+        if (node == totals_.size()) {
+          totals_.push_back(0);
+        }
+        totals_[node] += value;
+      }
+    }
+  }
+
+  void Render(OutputWriter& out, const std::string& title,
+              const char* unit) {
+    std::vector<Rect> rects;
+    Layout(rects);
+    uint32_t max_depth = 0;
+    for (const Rect& r : rects) {
+      max_depth = std::max(max_depth, r.depth);
+    }
+    const double height =
+        kPadTop + (max_depth + 1) * kFrameHeight + kPadBottom;
+    out << "<?xml version=\"1.0\" standalone=\"no\"?>\n"
+        << "<svg version=\"1.1\" width=\"" << kWidth << "\" height=\""
+        << height << "\" viewBox=\"0 0 " << kWidth << ' ' << height
+        << "\" xmlns=\"http://www.w3.org/2000/svg\">\n"
+        << "<style>text { font-family: Verdana, sans-serif; font-size: "
+        << kFontSize << "px; } rect:hover { stroke: black; }</style>\n"
+        << "<rect x=\"0\" y=\"0\" width=\"100%\" height=\"100%\" "
+           "fill=\"rgb(248,248,248)\"/>\n"
+        << "<text x=\"" << kWidth / 2 << "\" y=\"24\" text-anchor=\"middle\" "
+        << "style=\"font-size: 17px\">";
+    out.XmlText(title) << "</text>\n";
+
+    for (const Rect& r : rects) {
+      const std::string& name = r.node == StackTable::kRoot
+                                    ? kRootName
+                                    : names_.name(name_id(r.node));
+      double y = height - kPadBottom - (r.depth + 1) * kFrameHeight;
+      out << "<g><title>";
+      out.XmlText(name) << " (" << totals_[r.node] << ' ' << unit << ", "
+                        << Round(totals_[r.node] * 100.0 / totals_[0])
+                        << "%)</title>"
+                        << "<rect x=\"" << Round(r.x) << "\" y=\"" << y
+                        << "\" width=\"" << Round(r.width) << "\" height=\""
+                        << kFrameHeight - 1 << "\" fill=\"";
+      Color(out, name) << "\" rx=\"2\" ry=\"2\"/>";
+      size_t chars = r.width / (kFontSize * kFontWidth);
+      if (chars >= 3) {
+        out << "<text x=\"" << Round(r.x + 3) << "\" y=\""
+            << y + kFrameHeight - 4.5 << "\">";
+        if (name.size() <= chars) {
+          out.XmlText(name);
+        } else {
+          // no partial UTF-8 sequence
+          size_t n = chars - 2;
+          while (n > 0 && (name[n] & 0xc0) == 0x80) {
+            n--;
+          }
+          out.XmlText(name.data(), n) << "..";
+        }
+        out << "</text>";
+      }
+      out << "</g>\n";
+    }
+    out << "</svg>\n";
+  }
+
+ private:
+  static const std::string kRootName;
+
+  struct Rect {
+    uint32_t node;
+    uint32_t depth;
+    double x;
+    double width;
+  };
+
+  FlameNames names_;
+  StackTable tree_;  // addr of a node is its name id
+  std::vector<uint64_t> totals_;  // inclusive weight of each node
+
+  uint32_t name_id(uint32_t node) const {
+    return static_cast<uint32_t>(reinterpret_cast<uintptr_t>(tree_.addr(node)));
+  }
+
+  static double Round(double v) { return std::round(v * 100) / 100; }
+
+  // rects of nodes wide enough to draw, callers before callees
+  void Layout(std::vector<Rect>& rects) {
+    if (totals_[StackTable::kRoot] == 0) {
+      return;
+    }
+    // children of node i are children[first[i], first[i + 1]), sorted by
+    // name when the node is drawn
+    const uint32_t size = tree_.size();
+    std::vector<uint32_t> first(size + 1, 0);
+    for (uint32_t i = StackTable::kRoot + 1; i < size; i++) {
+      first[tree_.parent(i) + 1]++;
+    }
+    for (uint32_t i = 1; i <= size; i++) {
+      first[i] += first[i - 1];
+    }
+    std::vector<uint32_t> children(size);
+    std::vector<uint32_t> filled(first.begin(), first.end() - 1);
+    for (uint32_t i = StackTable::kRoot + 1; i < size; i++) {
+      children[filled[tree_.parent(i)]++] = i;
+    }
+    const double scale = (kWidth - 2 * kPadX) / totals_[StackTable::kRoot];
+    std::vector<Rect> pending = {
+        Rect{StackTable::kRoot, 0, kPadX, kWidth - 2 * kPadX}};
+    while (!pending.empty()) {
+      Rect r = pending.back();
+      pending.pop_back();
+      rects.push_back(r);
+      auto begin = children.begin() + first[r.node];
+      auto end = children.begin() + first[r.node + 1];
+      std::sort(begin, end, [this](uint32_t a, uint32_t b) {
+        return names_.name(name_id(a)) < names_.name(name_id(b));
+      });
+      double x = r.x;
+      for (auto it = begin; it != end; ++it) {
+        double width = totals_[*it] * scale;
+        if (width >= kMinWidth) {
+          pending.push_back(Rect{*it, r.depth + 1, x, width});
+        }
+        x += width;
+      }
+    }
+  }
+
+  // flamegraph.pl "hot" palette, and "aqua" for inlined functions
+  static OutputWriter& Color(OutputWriter& out, const std::string& name) {
+    uint64_t h = 14695981039346656037ULL;  // FNV-1a
+    for (char c : name) {
+      h = (h ^ static_cast<unsigned char>(c)) * 1099511628211ULL;
+    }
+    double v1 = (h & 0xff) / 255.0;
+    double v2 = (h >> 8 & 0xff) / 255.0;
+    double v3 = (h >> 16 & 0xff) / 255.0;
+    int r, g, b;
+    if (name.size() > 4 && name.compare(name.size() - 4, 4, "_[i]") == 0) {
+      r = 50 + 60 * v1;
+      g = 165 + 55 * v1;
+      b = 165 + 55 * v1;
+    } else {
+      r = 205 + 50 * v3;
+      g = 230 * v1;
+      b = 55 * v2;
+    }
+    return out << "rgb(" << r << ',' << g << ',' << b << ')';
+  }
+};
+
+constexpr double FlameGraph::kWidth;
+constexpr double FlameGraph::kPadX;
+constexpr double FlameGraph::kPadTop;
+constexpr double FlameGraph::kPadBottom;
+constexpr double FlameGraph::kFrameHeight;
+constexpr double FlameGraph::kFontSize;
+constexpr double FlameGraph::kFontWidth;
+constexpr double FlameGraph::kMinWidth;
+const std::string FlameGraph::kRootName = "all";
+
+void StackFramesToFlameGraph(OutputWriter& out,
+                             const std::vector<StackFrames>& records,
+                             FlameWeight weight, const std::string& title) {
+  FlameGraph graph;
+  graph.Add(records, weight);
+  graph.Render(out, title, weight == kFlameScore ? "score" : "samples");
+}
+
+std::string StackFramesToFolded(const std::vector<StackFrames>& records,
+                                FlameWeight weight) {
+  std::string str;
+  OutputWriter out(&str);
+  StackFramesToFolded(out, records, weight);
+  out.Flush();
+  return str;
+}
+
+bool WriteStackFramesFolded(int fd, const std::vector<StackFrames>& records,
+                            FlameWeight weight) {
+  OutputWriter out(fd);
+  StackFramesToFolded(out, records, weight);
+  return out.Flush();
+}
+
+bool WriteStackFramesFolded(FILE* fp, const std::vector<StackFrames>& records,
+                            FlameWeight weight) {
+  OutputWriter out(fp);
+  StackFramesToFolded(out, records, weight);
+  return out.Flush();
+}
+
+std::string StackFramesToFlameGraph(const std::vector<StackFrames>& records,
+                                    FlameWeight weight,
+                                    const std::string& title) {
+  std::string str;
+  OutputWriter out(&str);
+  StackFramesToFlameGraph(out, records, weight, title);
+  out.Flush();
+  return str;
+}
+
+bool WriteFlameGraph(int fd, const std::vector<StackFrames>& records,
+                     FlameWeight weight, const std::string& title) {
+  OutputWriter out(fd);
+  StackFramesToFlameGraph(out, records, weight, title);
+  return out.Flush();
+}
+
+bool WriteFlameGraph(FILE* fp, const std::vector<StackFrames>& records,
+                     FlameWeight weight, const std::string& title) {
+  OutputWriter out(fp);
+  StackFramesToFlameGraph(out, records, weight, title);
+  return out.Flush();
+}
+
+bool DumpFlameGraph(uint8_t id, const std::string& path, FlameWeight weight,
+                    bool since_last_dump) {
+  std::vector<StackFrames> records;
+  Dump(id, records, since_last_dump);
+  FILE* fp = fopen(path.c_str(), "we");
+  if (fp == nullptr) {
+    return false;
+  }
+  bool ok = WriteFlameGraph(fp, records, weight);
+  return fclose(fp) == 0 && ok;
+}
+
+/**
+ * compact binary of records written by StackFramesToBinary(), read by
+ * StackFramesReader
+ * - header, modules, frames, inlined functions, string offsets, strings,
+ *   then stacks, in native byte order, each table is 8 bytes aligned in the
+ *   file
+ * - a module is an exec and its load base, a frame is its module and the
+ *   offset in it, so addr and faddr of frames are kept as is
+ * - string i is [offsets[i], offsets[i + 1] - 1) of strings, followed by
+ *   '\0', the same string is stored once
+ * - a stack is varints of count, zigzag score, count_error, zigzag
+ *   score_error and the number of frames, then zigzag deltas of its frame
+ *   indices, innermost first, each from the previous one, frames are
+ *   indexed in the order first seen so callers shared by stacks are near
+ * - the version is in the magic, a reader never reads other versions
+ */
+struct BinaryDump {
+  struct Header {
+    char magic[8];
+    uint32_t num_modules;
+    uint32_t num_frames;
+    uint32_t num_inlined;
+    uint32_t num_strings;
+    uint32_t num_stacks;
+    uint32_t reserved;
+    uint64_t strings_size;
+    uint64_t stacks_size;
+  };
+
+  struct Module {
+    uint64_t base;
+    uint32_t path;
+    uint32_t build_id;
+  };
+
+  struct Entry {
+    uint64_t offset;  // addr - base of module
+    uint32_t module;
+    uint32_t symbol;
+    uint32_t func;
+    uint32_t file;
+    int32_t line;
+    uint32_t inlined_begin;
+    uint32_t num_inlined;
+    uint32_t reserved;
+  };
+
+  struct Inlined {
+    uint32_t name;
+    uint32_t file;
+    int32_t line;
+  };
+
+  static const char kMagic[8];
+
+  static size_t Align(size_t size) { return (size + 7) & ~size_t(7); }
+
+  static uint64_t ZigZag(int64_t v) {
+    return (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63);
+  }
+  static int64_t UnZigZag(uint64_t v) {
+    return static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1);
+  }
+
+  static size_t VarintSize(uint64_t v) {
+    size_t n = 1;
+    for (; v >= 0x80; v >>= 7) {
+      n++;
     }
+    return n;
+  }
+};
 
-    // parse "FILE:LINE"
-    size_t pos_colon = line.find(':');
-    if (pos_colon == Slice::npos) {
-      fprintf(stderr, "ParseLine: no colon found. ERROR!!!");
-      return;
+const char BinaryDump::kMagic[8] = {'B', 'T', 'S', 'T', 'K', '0', '1', 0};
+
+// index of each Frame* in the order first seen, by linear probing, a dump
+// refers to each frame from many stacks
+class FrameIndex {
+ public:
+  // index of frame, and whether it is new
+  std::pair<uint32_t, bool> Insert(const Frame* frame) {
+    if ((frames_.size() + 1) * 2 > slots_.size()) {
+      Grow();
     }
-    size_t len_file = pos_colon;
-    size_t len_line = line.size() - pos_colon - 1;
-    if (len_file == 0 || len_line == 0) {
-      fprintf(stderr, "ParseLine: file or line length is 0. ERROR!!!");
-      return;
+    const size_t mask = slots_.size() - 1;
+    const void* key = frame;
+    for (size_t pos = hash_stack(&key, 1) & mask;; pos = (pos + 1) & mask) {
+      if (slots_[pos] == kEmpty) {
+        slots_[pos] = frames_.size();
+        frames_.push_back(frame);
+        return std::make_pair(slots_[pos], true);
+      }
+      if (frames_[slots_[pos]] == frame) {
+        return std::make_pair(slots_[pos], false);
+      }
     }
-    std::string file = line.substr(0, len_file).to_string();
-    int line_no = ParseLineNumber(line.substr(pos_colon + 1, len_line));
+  }
 
-    if (is_inlined_by) {
-      Frame::Func f{
-          .name = func.empty() ? kFuncUnknown : std::move(func_str),
-          .file = std::move(file),
-          .line = line_no,
-      };
-      frame->inlined_by.emplace_back(f);
-      // printf("  [inline] %s at %s:%d\n", f.name.c_str(), f.file.c_str(),
-      //        line_no);
-    } else {
-      frame->file = std::move(file);
-      frame->line = line_no;
-      if (!func_str.empty() && frame->func != func_str) {
-        // always overwrite because func_str may be inline function
-        frame->func = std::move(func_str);
+ private:
+  static const uint32_t kEmpty = UINT32_MAX;
+  std::vector<const Frame*> frames_;
+  std::vector<uint32_t> slots_;  // size is power of 2
+
+  void Grow() {
+    slots_.assign(std::max<size_t>(64, slots_.size() * 2), kEmpty);
+    const size_t mask = slots_.size() - 1;
+    for (uint32_t i = 0; i < frames_.size(); i++) {
+      const void* key = frames_[i];
+      size_t pos = hash_stack(&key, 1) & mask;
+      while (slots_[pos] != kEmpty) {
+        pos = (pos + 1) & mask;
       }
-      // printf("  [new] file '%s' line %d func %s\n", frame->file.c_str(),
-      //        frame->line, func.empty() ? "(null)" : frame->func.c_str());
+      slots_[pos] = i;
     }
   }
+};
 
-  int ParseLineNumber(const Slice& s) noexcept {
-    int ret = -1;
-    if (s[0] == '?') {
-      return ret;
+const uint32_t FrameIndex::kEmpty;
+
+// tables of records, then stacks encoded while written
+static bool stack_frames_to_binary(OutputWriter& out,
+                                   const std::vector<StackFrames>& records) {
+  std::vector<BinaryDump::Module> modules;
+  std::map<std::pair<std::string, uintptr_t>, uint32_t> module_ids;
+  std::vector<BinaryDump::Entry> entries;
+  FrameIndex frame_ids;
+  std::vector<BinaryDump::Inlined> inlined;
+  std::vector<uint32_t> string_offsets;
+  std::string strings;
+  std::unordered_map<std::string, uint32_t> string_ids;
+  auto add_string = [&](const std::string& s) {
+    auto it = string_ids.emplace(s, string_offsets.size());
+    if (it.second) {
+      string_offsets.push_back(strings.size());
+      strings.append(s.c_str(), s.size() + 1);
     }
-    try {
-      ret = std::stoi(s.to_string());
-    } catch (...) {
-      // ignore parse error
+    return it.first->second;
+  };
+
+  std::shared_ptr<const ModuleMap> loaded = ModuleMap::Snapshot();
+  std::vector<uint32_t> frame_refs;  // frame indices of all records
+  uint64_t stacks_size = 0;
+  for (const auto& it : records) {
+    stacks_size +=
+        BinaryDump::VarintSize(it.count) +
+        BinaryDump::VarintSize(BinaryDump::ZigZag(it.score)) +
+        BinaryDump::VarintSize(it.count_error) +
+        BinaryDump::VarintSize(BinaryDump::ZigZag(it.score_error)) +
+        BinaryDump::VarintSize(it.frames.size());
+    uint32_t prev = 0;
+    for (const Frame* frame : it.frames) {
+      auto found = frame_ids.Insert(frame);
+      if (found.second) {
+        uintptr_t base = reinterpret_cast<uintptr_t>(frame->faddr);
+        auto m = module_ids.emplace(std::make_pair(frame->exec, base),
+                                    modules.size());
+        if (m.second) {
+          int loaded_id = loaded->Find(frame->faddr);
+          bool same = frame->faddr != nullptr && loaded_id >= 0 &&
+                      loaded->module(loaded_id).base == base &&
+                      loaded->module(loaded_id).path == frame->exec;
+          modules.push_back(BinaryDump::Module{
+              base, add_string(frame->exec),
+              add_string(same ? loaded->module(loaded_id).build_id : "")});
+        }
+        entries.push_back(BinaryDump::Entry{
+            reinterpret_cast<uintptr_t>(frame->addr) - base,
+            m.first->second,
+            add_string(frame->symbol),
+            add_string(frame->func),
+            add_string(frame->file),
+            frame->line,
+            static_cast<uint32_t>(inlined.size()),
+            static_cast<uint32_t>(frame->inlined_by.size()),
+            0});
+        for (const auto& f : frame->inlined_by) {
+          inlined.push_back(BinaryDump::Inlined{add_string(f.name),
+                                                add_string(f.file), f.line});
+        }
+      }
+      uint32_t id = found.first;
+      stacks_size += BinaryDump::VarintSize(
+          BinaryDump::ZigZag(static_cast<int64_t>(id) - prev));
+      prev = id;
+      frame_refs.push_back(id);
     }
-    return ret;
   }
+  if (strings.size() > UINT32_MAX || records.size() > UINT32_MAX) {
+    return false;
+  }
+  string_offsets.push_back(strings.size());
 
-  std::string to_address(uintptr_t addr) {
-    char buf[36];  // 64b "0xFEDCBA9876543210" -> 18, 128b -> 34
-    snprintf(buf, sizeof(buf), "%p", (void*)addr);
-    return std::string(buf);
+  BinaryDump::Header h;
+  memcpy(h.magic, BinaryDump::kMagic, sizeof(BinaryDump::kMagic));
+  h.num_modules = modules.size();
+  h.num_frames = entries.size();
+  h.num_inlined = inlined.size();
+  h.num_strings = string_offsets.size() - 1;
+  h.num_stacks = records.size();
+  h.reserved = 0;
+  h.strings_size = strings.size();
+  h.stacks_size = stacks_size;
+  // pad each table to 8 bytes
+  static const char kZeros[8] = {};
+  auto table = [&](const void* data, size_t size) {
+    out.Append(static_cast<const char*>(data), size);
+    out.Append(kZeros, BinaryDump::Align(size) - size);
+  };
+  table(&h, sizeof(h));
+  table(modules.data(), modules.size() * sizeof(BinaryDump::Module));
+  table(entries.data(), entries.size() * sizeof(BinaryDump::Entry));
+  table(inlined.data(), inlined.size() * sizeof(BinaryDump::Inlined));
+  table(string_offsets.data(), string_offsets.size() * sizeof(uint32_t));
+  table(strings.data(), strings.size());
+  const uint32_t* ref = frame_refs.data();
+  for (const auto& it : records) {
+    out.Varint(it.count)
+        .Varint(BinaryDump::ZigZag(it.score))
+        .Varint(it.count_error)
+        .Varint(BinaryDump::ZigZag(it.score_error))
+        .Varint(it.frames.size());
+    uint32_t prev = 0;
+    for (size_t f = 0; f < it.frames.size(); f++, ref++) {
+      out.Varint(BinaryDump::ZigZag(static_cast<int64_t>(*ref) - prev));
+      prev = *ref;
+    }
   }
-};
+  return true;
+}
 
-/**
- * find "__libc_start_main" in
- * "/lib/x86_64-linux-gnu/libc.so.6(__libc_start_main+0xeb) [0x7f059d5a809b]"
- * `start` points to next char of '(', `end` points to '+'
- */
-bool find_func_in_symbol(const char* symbol, size_t& start, size_t& end) {
-  if (!symbol) {
-    return false;
+std::string StackFramesToBinary(const std::vector<StackFrames>& records) {
+  std::string str;
+  OutputWriter out(&str);
+  if (!stack_frames_to_binary(out, records)) {
+    return "";
+  }
+  out.Flush();
+  return str;
+}
+
+bool WriteStackFramesBinary(int fd, const std::vector<StackFrames>& records) {
+  OutputWriter out(fd);
+  return stack_frames_to_binary(out, records) && out.Flush();
+}
+
+bool WriteStackFramesBinary(FILE* fp, const std::vector<StackFrames>& records) {
+  OutputWriter out(fp);
+  return stack_frames_to_binary(out, records) && out.Flush();
+}
+
+StackFramesReader::~StackFramesReader() { Close(); }
+
+void StackFramesReader::Close() {
+  if (mapped_) {
+    munmap(const_cast<uint8_t*>(data_), size_);
   }
-  start = 0;
-  while (symbol[start] && symbol[start] != '(') {
-    start++;
+  data_ = nullptr;
+  size_ = 0;
+  mapped_ = false;
+  ok_ = false;
+  num_stacks_ = num_frames_ = num_inlined_ = num_strings_ = 0;
+  stacks_ = end_ = pos_ = nullptr;
+  stacks_read_ = 0;
+  owned_frames_.clear();
+}
+
+bool StackFramesReader::Open(const std::string& path) {
+  Close();
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
   }
-  if (!symbol[start]) {
+  struct stat st;
+  if (fstat(fd, &st) != 0 ||
+      st.st_size < (off_t)sizeof(BinaryDump::Header)) {
+    close(fd);
     return false;
   }
-  end = ++start;  // '(' found, move to next char
-  while (symbol[end] && symbol[end] != '+') {
-    end++;
+  void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return false;
   }
-  if (!symbol[end]) {
+  if (!Open(data, st.st_size)) {
+    munmap(data, st.st_size);
     return false;
   }
-  return end > start;  // substr not empty
+  mapped_ = true;
+  return true;
 }
 
-// resolve address to frame information
-Frame resolve_symbol(void* address, char* symbol) {
-  Frame frame;
-  frame.addr = address;
-  frame.faddr = nullptr;
+bool StackFramesReader::Open(const void* data, size_t size) {
+  Close();
+  using BD = BinaryDump;
+  if (size < sizeof(BD::Header) || reinterpret_cast<uintptr_t>(data) % 8) {
+    return false;
+  }
+  const uint8_t* p = static_cast<const uint8_t*>(data);
+  const BD::Header* h = reinterpret_cast<const BD::Header*>(p);
+  if (memcmp(h->magic, BD::kMagic, sizeof(BD::kMagic)) != 0 ||
+      h->strings_size > UINT32_MAX || h->num_strings == UINT32_MAX) {
+    return false;
+  }
+  // offsets of tables, each at most 2^32 times 40 bytes, no overflow
+  const uint64_t modules = BD::Align(sizeof(BD::Header));
+  const uint64_t frames =
+      modules + BD::Align(h->num_modules * sizeof(BD::Module));
+  const uint64_t inlined =
+      frames + BD::Align(h->num_frames * sizeof(BD::Entry));
+  const uint64_t offsets =
+      inlined + BD::Align(h->num_inlined * sizeof(BD::Inlined));
+  const uint64_t strings =
+      offsets + BD::Align((h->num_strings + 1ULL) * sizeof(uint32_t));
+  const uint64_t stacks = strings + BD::Align(h->strings_size);
+  // each stack is at least 5 varints of a byte, ReadAll() sizes by num_stacks
+  if (stacks > size || h->stacks_size != size - stacks ||
+      h->num_stacks > h->stacks_size / 5) {
+    return false;
+  }
 
-  size_t start = std::string::npos;
-  size_t end = std::string::npos;
-  bool found = find_func_in_symbol(symbol, start, end);
-  if (found) {
-    // found function name in symbols
-    assert(start != std::string::npos);
-    frame.exec.assign(symbol, start - 1);
-    frame.symbol = symbol;
-    symbol[end] = '\0';  // null-terminate the substr
-    demangle_symbol(frame.func, symbol + start);
-  } else if (symbol) {
-    // no function name in symbol, however, it could be "prog(+0xabcd)"
-    if (start > 1) {
-      frame.exec.assign(symbol, start - 1);
-    } else {
-      frame.exec = "??";
+  // strings are '\0' terminated in order, so every string id below
+  // num_strings is safe to read as a C string
+  const uint32_t* string_offsets =
+      reinterpret_cast<const uint32_t*>(p + offsets);
+  const char* chars = reinterpret_cast<const char*>(p + strings);
+  if (string_offsets[0] != 0 ||
+      string_offsets[h->num_strings] != h->strings_size) {
+    return false;
+  }
+  for (uint32_t i = 0; i < h->num_strings; i++) {
+    if (string_offsets[i + 1] <= string_offsets[i] ||
+        chars[string_offsets[i + 1] - 1] != '\0') {
+      return false;
     }
-    frame.symbol = symbol;
-    frame.func = kFuncUnknown;
-  } else {
-    frame.exec = "??";
-    frame.symbol = "(nil)";
-    frame.func = kFuncUnknown;
   }
-
-  // remove ending " [0x7f64639e009b]"
-  size_t addr_start = frame.symbol.find(") [0x");
-  if (addr_start != std::string::npos) {
-    frame.symbol.erase(addr_start + 1);
+  for (uint32_t i = 0; i < h->num_modules; i++) {
+    const BD::Module& m = reinterpret_cast<const BD::Module*>(p + modules)[i];
+    if (m.path >= h->num_strings || m.build_id >= h->num_strings) {
+      return false;
+    }
   }
-
-  // get binary and its base address using dladdr()
-  Dl_info dl_info;
-  auto ret = dladdr(address, &dl_info);
-  if (ret) {
-    if (start > 1) {
-      // check exec name
-      assert(strncmp(dl_info.dli_fname, symbol, start - 1) == 0);
+  for (uint32_t i = 0; i < h->num_frames; i++) {
+    const BD::Entry& e = reinterpret_cast<const BD::Entry*>(p + frames)[i];
+    if (e.module >= h->num_modules || e.symbol >= h->num_strings ||
+        e.func >= h->num_strings || e.file >= h->num_strings ||
+        e.inlined_begin > h->num_inlined ||
+        e.num_inlined > h->num_inlined - e.inlined_begin) {
+      return false;
+    }
+  }
+  for (uint32_t i = 0; i < h->num_inlined; i++) {
+    const BD::Inlined& f = reinterpret_cast<const BD::Inlined*>(p + inlined)[i];
+    if (f.name >= h->num_strings || f.file >= h->num_strings) {
+      return false;
     }
-    // printf("dladdr: %s@%p, %s@%p(+0x%lx)\n", dl_info.dli_fname,
-    //        dl_info.dli_fbase, dl_info.dli_sname, dl_info.dli_saddr,
-    //        (char*)dl_info.dli_saddr - (char*)dl_info.dli_fbase);
-    frame.faddr = dl_info.dli_fbase;
   }
 
-  // later get source code using addr2line
-  frame.file = "??";
-  frame.line = -1;
+  data_ = p;
+  size_ = size;
+  ok_ = true;
+  num_stacks_ = h->num_stacks;
+  num_frames_ = h->num_frames;
+  num_inlined_ = h->num_inlined;
+  num_strings_ = h->num_strings;
+  modules_ = p + modules;
+  frames_ = p + frames;
+  inlined_ = p + inlined;
+  string_offsets_ = string_offsets;
+  strings_ = chars;
+  stacks_ = p + stacks;
+  end_ = p + size;
+  Rewind();
+  return true;
+}
 
-  // printf("[resolve] \"%s\" -> %s at %s:%d @ %p \n", frame.symbol.c_str(),
-  //        frame.func_name.c_str(), frame.file_name.c_str(), frame.line,
-  //        frame.addr);
-  return frame;
+StackFramesReader::FrameRef StackFramesReader::frame(uint32_t i) const {
+  const BinaryDump::Entry& e =
+      reinterpret_cast<const BinaryDump::Entry*>(frames_)[i];
+  const BinaryDump::Module& m =
+      reinterpret_cast<const BinaryDump::Module*>(modules_)[e.module];
+  return FrameRef{reinterpret_cast<const void*>(m.base + e.offset),
+                  reinterpret_cast<const void*>(m.base),
+                  strings_ + string_offsets_[e.symbol],
+                  strings_ + string_offsets_[e.func],
+                  strings_ + string_offsets_[m.path],
+                  strings_ + string_offsets_[e.file],
+                  strings_ + string_offsets_[m.build_id],
+                  e.line,
+                  e.num_inlined};
 }
 
-void Tracker::Record(int64_t score) {
-  void* addrs[kMaxStackFrames];
-  // @ref https://linux.die.net/man/3/backtrace
-  int num_frames = backtrace(addrs, kMaxStackFrames);
-  if (num_frames <= kSkipFrames) {
-    assert(false);
-    return;
+StackFramesReader::FuncRef StackFramesReader::inlined(uint32_t i,
+                                                      uint32_t j) const {
+  const BinaryDump::Entry& e =
+      reinterpret_cast<const BinaryDump::Entry*>(frames_)[i];
+  const BinaryDump::Inlined& f = reinterpret_cast<const BinaryDump::Inlined*>(
+      inlined_)[e.inlined_begin + j];
+  return FuncRef{strings_ + string_offsets_[f.name],
+                 strings_ + string_offsets_[f.file], f.line};
+}
+
+void StackFramesReader::Rewind() {
+  pos_ = stacks_;
+  stacks_read_ = 0;
+  ok_ = data_ != nullptr;
+}
+
+bool StackFramesReader::Next(Stack& stack) {
+  if (!ok_ || stacks_read_ == num_stacks_) {
+    return false;
   }
-  Stack stack_frames(addrs + kSkipFrames, num_frames - kSkipFrames);
-  {
-    std::lock_guard<std::mutex> lock(mutex_);
-    // find or create
-    auto it = all_records_.find(stack_frames);
-    if (it == all_records_.end()) {
-      all_records_.emplace(stack_frames, StackStat{1, score});
-    } else {
-      it->second.count++;
-      it->second.score += score;
+  // false if truncated or longer than 64 bits
+  auto varint = [this](uint64_t& v) {
+    v = 0;
+    for (int shift = 0; pos_ < end_ && shift < 64; shift += 7) {
+      uint8_t b = *pos_++;
+      v |= static_cast<uint64_t>(b & 0x7f) << shift;
+      if ((b & 0x80) == 0) {
+        return true;
+      }
     }
+    return false;
+  };
+  uint64_t score = 0, score_error = 0, size = 0, delta = 0;
+  ok_ = varint(stack.count) && varint(score) && varint(stack.count_error) &&
+        varint(score_error) && varint(size) &&
+        size <= static_cast<uint64_t>(end_ - pos_);  // a byte per frame
+  stack.score = BinaryDump::UnZigZag(score);
+  stack.score_error = BinaryDump::UnZigZag(score_error);
+  stack.frames.clear();
+  int64_t id = 0;
+  for (uint64_t f = 0; ok_ && f < size; f++) {
+    // frame indices are below 2^32, larger deltas are malformed
+    ok_ = varint(delta) && delta < (1ULL << 34);
+    id += BinaryDump::UnZigZag(delta);
+    ok_ = ok_ && id >= 0 && id < num_frames_;
+    stack.frames.push_back(static_cast<uint32_t>(id));
+  }
+  if (!ok_) {
+    stack.frames.clear();
+    return false;
   }
+  stacks_read_++;
+  return true;
 }
 
-void Tracker::RecordStack(const FramePointers& stack, int64_t score) {
-  std::lock_guard<std::mutex> lock(mutex_);
-  // find or create
-  Stack stack_frames(stack);
-  auto it = all_records_.find(stack_frames);
-  if (it == all_records_.end()) {
-    all_records_.emplace(stack_frames, StackStat{1, score});
-  } else {
-    it->second.count++;
-    it->second.score += score;
-  }
+std::string StackFramesReader::String(uint32_t id) const {
+  return std::string(strings_ + string_offsets_[id],
+                     string_offsets_[id + 1] - string_offsets_[id] - 1);
 }
 
-bool Tracker::GetBacktrace(FramePointers& stack) {
-  void* addrs[kMaxStackFrames];
-  stack.clear();
-  // @ref https://linux.die.net/man/3/backtrace
-  int num_frames = backtrace(addrs, kMaxStackFrames);
-  if (num_frames <= kSkipFrames) {
+bool StackFramesReader::ReadAll(std::vector<StackFrames>& result) {
+  result.clear();
+  if (data_ == nullptr) {
     return false;
   }
-  stack.assign(addrs + kSkipFrames, addrs + num_frames);
+  if (owned_frames_.empty()) {
+    owned_frames_.resize(num_frames_);
+    for (uint32_t i = 0; i < num_frames_; i++) {
+      const BinaryDump::Entry& e =
+          reinterpret_cast<const BinaryDump::Entry*>(frames_)[i];
+      const BinaryDump::Module& m =
+          reinterpret_cast<const BinaryDump::Module*>(modules_)[e.module];
+      Frame& frame = owned_frames_[i];
+      frame.addr = reinterpret_cast<const void*>(m.base + e.offset);
+      frame.faddr = reinterpret_cast<const void*>(m.base);
+      frame.symbol = String(e.symbol);
+      frame.func = String(e.func);
+      frame.exec = String(m.path);
+      frame.file = String(e.file);
+      frame.line = e.line;
+      for (uint32_t j = 0; j < e.num_inlined; j++) {
+        const BinaryDump::Inlined& f =
+            reinterpret_cast<const BinaryDump::Inlined*>(
+                inlined_)[e.inlined_begin + j];
+        frame.inlined_by.push_back(
+            Frame::Func{String(f.name), String(f.file), f.line});
+      }
+    }
+  }
+  Rewind();
+  result.resize(num_stacks_);
+  Stack stack;
+  for (auto& it : result) {
+    if (!Next(stack)) {
+      result.clear();
+      return false;
+    }
+    it.count = stack.count;
+    it.score = stack.score;
+    it.count_error = stack.count_error;
+    it.score_error = stack.score_error;
+    it.frames.resize(stack.frames.size());
+    for (size_t f = 0; f < stack.frames.size(); f++) {
+      it.frames[f] = &owned_frames_[stack.frames[f]];
+    }
+  }
   return true;
 }
 
-void Tracker::Dump(std::vector<StackFrames>& result) {
-  std::lock_guard<std::mutex> lock(mutex_);
-  result.clear();
 
-  // sort Stack* by count, tuple[count, Stack*, score]
-  using Tuple = std::tuple<uint64_t, const Stack*, int64_t>;
-  std::vector<Tuple> sort_idx;
-  sort_idx.reserve(all_records_.size());
-  for (const auto& it : all_records_) {
-    sort_idx.emplace_back(it.second.count, &it.first, it.second.score);
-  }
-  std::sort(sort_idx.begin(), sort_idx.end(),
-            [](const Tuple& a, const Tuple& b) {
-              const uint64_t& ca = std::get<0>(a);
-              const uint64_t& cb = std::get<0>(b);
-              return (ca == cb) ? (std::get<1>(a) < std::get<1>(b)) : (ca > cb);
-            });
+}  // namespace bttrack
 
-  // convert Stack* to StackFrames
-  result.resize(sort_idx.size());
-  for (size_t i = 0; i < sort_idx.size(); i++) {
-    result[i].count = std::get<0>(sort_idx[i]);
-    const auto* sf = std::get<1>(sort_idx[i]);
-    result[i].score = std::get<2>(sort_idx[i]);
-    Resolve(sf->addrs, result[i].frames);
-  }
+// interpose malloc/free/new/delete for HeapProfiler, only built with
+// -DBTTRACK_HEAP_PROFILER, nothing is sampled until the program calls
+// StartHeapProfiler()
+#ifdef BTTRACK_HEAP_PROFILER
+
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t n, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+void __libc_free(void* ptr);
 }
 
-void Tracker::Resolve(const FramePointers& addr, std::vector<Frame*>& frames) {
-  std::vector<size_t> not_found;
-  not_found.reserve(addr.size());
+namespace {
 
-  frames.clear();
-  frames.resize(addr.size());
+using bttrack::HeapProfiler;
 
-  // find if in all_frames_
-  for (size_t i = 0; i < addr.size(); i++) {
-    auto it = all_frames_.find(addr[i]);
-    if (it == all_frames_.end()) {
-      frames[i] = nullptr;
-      not_found.emplace_back(i);
-    } else {
-      frames[i] = &it->second;
-    }
-  }
+// keep frame pointer so HeapProfiler::kSkipFrames works
+#define HOOK_FRAME_POINTER \
+  __attribute__((noinline, optimize("no-omit-frame-pointer")))
 
-  // batch lookup for not found
-  if (!not_found.empty()) {
-    const size_t num_lookup = not_found.size();
-    void* addr_lookup[num_lookup];
-    for (size_t i = 0; i < num_lookup; i++) {
-      addr_lookup[i] = (void*)addr[not_found[i]];
-    }
-    // @ref https://linux.die.net/man/3/backtrace_symbols
-    // current address to symbol, internal malloc-ed
-    char** symbols = backtrace_symbols(addr_lookup, num_lookup);
-    if (symbols) {
-      std::vector<Frame*> to_call_addr2line;
-      to_call_addr2line.reserve(num_lookup);
-      for (size_t i = 0; i < num_lookup; i++) {
-        void* a = addr_lookup[i];
-        auto r = all_frames_.emplace(a, resolve_symbol(a, symbols[i]));
-        Frame* f = &(r.first->second);
-        frames[not_found[i]] = f;
-        to_call_addr2line.emplace_back(f);
-      }
-      free(symbols);
-
-      // call addr2line
-      Addr2lineTool::GetInstance()->Resolve(to_call_addr2line);
-    } else {
-      fprintf(stderr, "backtrace_symbols() call failed\n");
-    }
+void* HOOK_FRAME_POINTER hooked_alloc(size_t size) {
+  void* ptr = __libc_malloc(size);
+  if (HeapProfiler::active()) {
+    HeapProfiler::OnAlloc(ptr, size);
   }
+  return ptr;
+}
 
-  // check all set
-  for (auto* frame : frames) {
-    assert(frame != nullptr);
+void* HOOK_FRAME_POINTER hooked_memalign(size_t alignment, size_t size) {
+  void* ptr = __libc_memalign(alignment, size);
+  if (HeapProfiler::active()) {
+    HeapProfiler::OnAlloc(ptr, size);
   }
+  return ptr;
 }
 
-void StackFrameToString(std::ostringstream& oss, const StackFrames& stack,
-                        double sum, double sum_score, bool print_symbol) {
-  oss << "recorded " << stack.count << " times (" << (stack.count / sum * 100.0)
-      << "%), score " << stack.score << " ("
-      << (stack.score / sum_score * 100.0) << "%), stack:" << std::endl;
-  for (size_t f = 0; f < stack.frames.size(); f++) {
-    auto* frame = stack.frames[f];
-    oss << "#" << f << (f < 10 ? "  " : " ") << frame->func;
-    oss << " at " << frame->file << ":";
-    if (frame->line >= 0) {
-      oss << frame->line;
-    } else {
-      oss << "?";
-    }
-    if (frame->faddr) {
-      void* offset = (void*)((char*)frame->addr - (char*)frame->faddr);
-      oss << " (" << frame->exec << "+" << offset << ")";
-    } else {
-      oss << " (" << frame->exec << "+?)";
-    }
-    if (!frame->inlined_by.empty()) {
-      oss << " (inlined by " << frame->inlined_by.size() << ")";
-    }
-    if (print_symbol) {
-      oss << " <symbol=" << frame->symbol << ">";
-    }
-    oss << std::endl;
-  }
+inline void hooked_free(void* ptr) {
+  HeapProfiler::OnFree(ptr);
+  __libc_free(ptr);
 }
 
-std::string StackFramesToString(const std::vector<StackFrames>& records,
-                                bool print_symbol) {
-  if (records.empty()) {
-    return "Report: no records.";
-  }
-  uint64_t sum = 0;
-  int64_t sum_score = 0;
-  for (const auto& it : records) {
-    sum += it.count;
-    sum_score += it.score;
-  }
-  std::ostringstream oss;
-  oss << "Stack format: #N func at file:line (exec+offset)";
-  if (print_symbol) {
-    oss << " <symbol=...>";
-  }
-  oss << std::endl
-      << "Report: total " << sum << " records, score " << sum_score << ", in "
-      << records.size() << " different stack frames:" << std::endl;
-  for (size_t i = 0; i < records.size(); i++) {
-    const auto& it = records[i];
-    oss << "[" << i << "] ";
-    StackFrameToString(oss, it, (double)sum, (double)sum_score, print_symbol);
-    oss << std::endl;
+}  // namespace
+
+extern "C" {
+
+void* HOOK_FRAME_POINTER malloc(size_t size) {
+  void* ptr = __libc_malloc(size);
+  if (HeapProfiler::active()) {
+    HeapProfiler::OnAlloc(ptr, size);
   }
-  return oss.str();
+  return ptr;
 }
 
-void StackFrameToJson(std::ostringstream& oss, const StackFrames& stack,
-                      int indent) {
-  const std::string ind3(3 * indent, ' ');
-  const std::string ind4(4 * indent, ' ');
-  if (indent > 0) {
-    oss << "{" << std::endl
-        << ind3 << "\"count\": " << stack.count << "," << std::endl
-        << ind3 << "\"score\": " << stack.score << "," << std::endl
-        << ind3 << "\"frames\": [";
-  } else {
-    oss << "{\"count\": " << stack.count << ", \"score\": " << stack.score
-        << ", \"frames\": [";
+void* HOOK_FRAME_POINTER calloc(size_t n, size_t size) {
+  void* ptr = __libc_calloc(n, size);
+  if (HeapProfiler::active()) {
+    HeapProfiler::OnAlloc(ptr, n * size);
   }
-  for (size_t f = 0; f < stack.frames.size(); f++) {
-    auto* frame = stack.frames[f];
-    void* offset =
-        frame->faddr ? (void*)((char*)frame->addr - (char*)frame->faddr) : 0;
-    if (indent > 0) {
-      oss << std::endl << ind4;
-    }
-    oss << "{\"address\": " << (uintptr_t)frame->addr << ", \"function\": \""
-        << frame->func << "\", \"file\": \"" << frame->file
-        << "\", \"line\": " << frame->line << ", \"exec\": \"" << frame->exec
-        << "\", \"offset\": " << (uintptr_t)offset << ", \"symbol\": \""
-        << frame->symbol << "\", \"inlined_by\": " << frame->inlined_by.size()
-        << "}";
-    if (f < stack.frames.size() - 1) {
-      oss << ", ";
+  return ptr;
+}
+
+void* HOOK_FRAME_POINTER realloc(void* old_ptr, size_t size) {
+  // take the old sample first, once freed its address may be sampled by
+  // another thread
+  HeapProfiler::LiveSample old_sample;
+  bool sampled = HeapProfiler::TakeSample(old_ptr, old_sample);
+  void* ptr = __libc_realloc(old_ptr, size);
+  // old block is still allocated if failed, freed by realloc(ptr, 0)
+  if (ptr == nullptr && size != 0) {
+    if (sampled) {
+      HeapProfiler::RestoreSample(old_ptr, old_sample);
     }
+    return ptr;
   }
-  if (indent > 0) {
-    oss << std::endl
-        << ind3 << "]" << std::endl
-        << std::string(2 * indent, ' ') << "}";
-  } else {
-    oss << "]}";
+  if (sampled) {
+    HeapProfiler::Debit(old_sample);
   }
+  if (HeapProfiler::active()) {
+    HeapProfiler::OnAlloc(ptr, size);
+  }
+  return ptr;
 }
 
-std::string StackFramesToJson(const std::vector<StackFrames>& records,
-                              int indent) {
-  if (records.empty()) {
-    return "{\"sum\": 0, \"sum_score\": 0, \"records\": []}";
-  }
-  uint64_t sum = 0;
-  int64_t sum_score = 0;
-  for (const auto& it : records) {
-    sum += it.count;
-    sum_score += it.score;
-  }
-  std::ostringstream oss;
-  if (indent > 0) {
-    const std::string ind(indent, ' ');
-    oss << "{" << std::endl
-        << ind << "\"sum\": " << sum << "," << std::endl
-        << ind << "\"sum_score\": " << sum_score << "," << std::endl
-        << ind << "\"records\": [";
-  } else {
-    oss << "{\"sum\": " << sum << ", \"sum_score\": " << sum_score
-        << ", \"records\": [";
+void free(void* ptr) { hooked_free(ptr); }
+
+void* memalign(size_t alignment, size_t size) {
+  return hooked_memalign(alignment, size);
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+  return hooked_memalign(alignment, size);
+}
+
+int posix_memalign(void** out, size_t alignment, size_t size) {
+  if (alignment % sizeof(void*) != 0 ||
+      (alignment & (alignment - 1)) != 0) {
+    return EINVAL;
   }
-  for (size_t i = 0; i < records.size(); i++) {
-    const auto& it = records[i];
-    if (indent > 0) {
-      oss << std::endl << std::string(2 * indent, ' ');
-    }
-    StackFrameToJson(oss, it, indent);
-    if (i < records.size() - 1) {
-      oss << ",";
-    }
+  void* ptr = hooked_memalign(alignment, size);
+  if (ptr == nullptr) {
+    return ENOMEM;
   }
-  if (indent > 0) {
-    oss << std::endl << std::string(indent, ' ') << "]" << std::endl << "}";
-  } else {
-    oss << "]}";
+  *out = ptr;
+  return 0;
+}
+
+}  // extern "C"
+
+void* operator new(size_t size) {
+  void* ptr = hooked_alloc(size);
+  if (ptr == nullptr) {
+    throw std::bad_alloc();
   }
-  return oss.str();
+  return ptr;
 }
 
+void* operator new[](size_t size) { return operator new(size); }
 
-}  // namespace bttrack
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+  return hooked_alloc(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+  return hooked_alloc(size);
+}
+
+void operator delete(void* ptr) noexcept { hooked_free(ptr); }
+void operator delete[](void* ptr) noexcept { hooked_free(ptr); }
+void operator delete(void* ptr, size_t) noexcept { hooked_free(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { hooked_free(ptr); }
+
+#undef HOOK_FRAME_POINTER
+
+#endif  // BTTRACK_HEAP_PROFILER
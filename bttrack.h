@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cstdint>
+#include <cstdio>
 #include <string>
 #include <vector>
 
@@ -34,6 +35,51 @@ struct StackFrames {
   std::vector<Frame*> frames;
   uint64_t count;
   int64_t score;
+  // error bound set by SetMaxStacks(), the actual count is within
+  // count +- count_error, 0 if the channel is unbounded
+  uint64_t count_error;
+  int64_t score_error;  // same as count_error, if scores are not negative
+};
+
+// node of call tree, root is the outermost caller
+struct CallNode {
+  Frame* frame;          // nullptr for root
+  int64_t parent;        // index of parent node, -1 for root
+  uint64_t self_count;   // exclusive, recorded stacks ending at this node
+  int64_t self_score;    // exclusive
+  uint64_t total_count;  // inclusive, including all children
+  int64_t total_score;   // inclusive
+};
+
+// stack unwinder used by Record() and GetBacktrace()
+enum Unwinder {
+  kUnwindBacktrace = 0,     // glibc backtrace(), default
+  kUnwindFramePointer = 1,  // walk frame pointers, async-signal-safe
+};
+
+// symbolizer for source file, line and inlined functions of frames
+enum Symbolizer {
+  kSymbolizeElf = 0,        // read ELF and DWARF in process, default
+  kSymbolizeAddr2line = 1,  // run addr2line for each batch of frames
+};
+
+// JSON schema of StackFramesToJson(), the value is its "version"
+enum JsonFormat {
+  kJsonInline = 1,      // each record has its frames, no "version", default
+  kJsonFrameTable = 2,  // frames once in "frames", records have their indices
+};
+
+// weight of a stack in flame graphs, see StackFramesToFolded()
+enum FlameWeight {
+  kFlameCount = 0,  // count of records, default
+  kFlameScore = 1,  // score, stacks of negative score are omitted
+};
+
+// sampling mode of a channel, set by SetSampling()
+enum Sampling {
+  kSampleAll = 0,     // record every call, default
+  kSampleScore = 1,   // poisson sampled by score, once per `param` score
+  kSampleEveryN = 2,  // record every `param`-th call of each thread
 };
 
 // track all calls, we preserve 256 slots for different callers
@@ -45,15 +91,263 @@ void Record(uint8_t id, const FramePointers& stack, int64_t score = 1);
 // get current backtrace, return true if success
 bool GetBacktrace(FramePointers& stack);
 
-// dump all records
-void Dump(uint8_t id, std::vector<StackFrames>& result);
+// start SIGPROF based CPU profiler, running threads are sampled at hz into
+// channel id, score of a sample is its CPU time in microseconds, return false
+// if already started, only one profiler can run at a time
+// - signal handler always walks frame pointers, should be built with
+//   -fno-omit-frame-pointer
+// - frames of a thread whose stack range is unknown are read by a syscall
+//   each, see RegisterProfiledThread()
+bool StartCpuProfiler(uint8_t id, int hz = 100);
+
+// cache stack range of current thread so CPU samples of it are unwound
+// without syscalls, done by StartCpuProfiler(), Record() and GetBacktrace()
+// for their caller, return false if the range can not be found
+bool RegisterProfiledThread();
+
+// stop CPU profiler, all samples are in the channel when it returns
+void StopCpuProfiler();
+
+// start heap profiler, allocations are sampled once per sample_bytes on
+// average, return false if already started or not built with
+// -DBTTRACK_HEAP_PROFILER
+// - alloc_id: sampled allocations, score is bytes
+// - live_id: sampled allocations not freed yet, score is live bytes
+bool StartHeapProfiler(uint8_t alloc_id, uint8_t live_id,
+                       int64_t sample_bytes = 512 * 1024);
+
+// stop heap profiler, later frees of sampled allocations are not debited
+void StopHeapProfiler();
+
+// select unwinder for all channels, kUnwindFramePointer only works if built
+// with -fno-omit-frame-pointer, and falls back to kUnwindBacktrace on
+// architectures other than x86_64 and aarch64
+void SetUnwinder(Unwinder unwinder);
+
+// select symbolizer used by later dumps, kSymbolizeElf falls back to
+// addr2line for files it cannot read, frames already resolved are kept
+void SetSymbolizer(Symbolizer symbolizer);
+
+// max threads of a dump to resolve modules concurrently, including the
+// calling thread and at most 8, 0 is by hardware concurrency (default)
+void SetSymbolizeThreads(size_t num_threads);
+
+// cache resolved frames in dir, created if missing, so later processes of
+// the same binaries skip symbolization of addresses seen before, empty dir
+// disables it (default), return false if dir is not usable
+// - one file per module named by its GNU build-id, keyed by offset in module
+// - only frames with source lines are cached
+bool SetSymbolCacheDir(const std::string& dir);
+
+// start a thread resolving addresses newly recorded by any channel in the
+// background, so later dumps find their frames resolved, return false if
+// already started or cpu_budget is not positive
+// - runs at the lowest priority in small batches, and idles between batches
+//   so it is busy at most cpu_budget of the time, 1.0 never idles
+bool StartPresymbolizer(double cpu_budget = 0.1);
+
+// stop background symbolization, a running batch is finished first
+void StopPresymbolizer();
+
+// set sampling mode of a channel, recorded count and score are scaled so
+// they are unbiased estimates of all calls
+void SetSampling(uint8_t id, Sampling mode, int64_t param = 1);
+
+// bound memory of a channel to about max_stacks stacks per thread, 0 is
+// unbounded (default), heavy hitters are kept and Dump() returns at most
+// max_stacks stacks with their error bounds
+// - a new stack takes over the count of evicted ones like Space-Saving, so
+//   light stacks may be reported with large count_error
+// - errors of Dump(since_last_dump = true) are those of the whole records
+void SetMaxStacks(uint8_t id, size_t max_stacks);
+
+// dump all records, or only records since last Dump() of this channel
+void Dump(uint8_t id, std::vector<StackFrames>& result,
+          bool since_last_dump = false);
+
+// dump all records and clear the channel, Frame* in results remain valid
+void DumpAndReset(uint8_t id, std::vector<StackFrames>& result);
+
+// write records to a binary file without symbolization, each frame is the
+// build-id, path and load base of its module and the offset in it, return
+// false if failed to write, see SymbolizeRawDump()
+bool DumpRaw(uint8_t id, const std::string& path,
+             bool since_last_dump = false);
+
+// read a file written by DumpRaw() and symbolize it like Dump(), e.g. on
+// another machine by bttrack-symbolize, return false if it is malformed
+// - a module is read from debug_dir/.build-id/xx/yyyy[.debug] or
+//   debug_dir/<file name> if debug_dir is set, or its recorded path, only
+//   if the build-id matches
+// - Frame* in results remain valid
+bool SymbolizeRawDump(const std::string& path,
+                      std::vector<StackFrames>& result,
+                      const std::string& debug_dir = "");
+
+// dump all records as call tree, nodes[0] is the root, parent is always
+// before its children
+void DumpCallTree(uint8_t id, std::vector<CallNode>& nodes);
 
 // human readable string
 std::string StackFramesToString(const std::vector<StackFrames>& records,
                                 bool print_symbol = true);
 
-// json string
+// json string, see JsonFormat for its schema, strings are escaped
 std::string StackFramesToJson(const std::vector<StackFrames>& records,
-                              int indent = 0);
+                              int indent = 0,
+                              JsonFormat format = kJsonInline);
+
+// write the same as StackFramesToString() to fd or fp through a fixed size
+// buffer, without building the report in memory, return false if failed to
+// write, fd is not closed and fp is flushed
+bool WriteStackFrames(int fd, const std::vector<StackFrames>& records,
+                      bool print_symbol = true);
+bool WriteStackFrames(FILE* fp, const std::vector<StackFrames>& records,
+                      bool print_symbol = true);
+
+// write the same as StackFramesToJson() to fd or fp, see WriteStackFrames()
+bool WriteStackFramesJson(int fd, const std::vector<StackFrames>& records,
+                          int indent = 0, JsonFormat format = kJsonInline);
+bool WriteStackFramesJson(FILE* fp, const std::vector<StackFrames>& records,
+                          int indent = 0, JsonFormat format = kJsonInline);
+
+// pprof profile (profile.proto) for `go tool pprof`, gzip compressed if gzip
+// - sample types are count and score, score_unit is like "microseconds" of
+//   StartCpuProfiler() or "bytes" of StartHeapProfiler()
+// - a location per frame with inlined_by as its inline lines, a mapping per
+//   exec, with build-id if the module is loaded
+// - compressed by libz.so.1 if it can be loaded by dlopen(), otherwise by a
+//   built-in deflate with a lower ratio
+std::string StackFramesToPprof(const std::vector<StackFrames>& records,
+                               const std::string& score_unit = "count",
+                               bool gzip = true);
+
+// folded stacks of flamegraph.pl, a line "outer;...;inner weight" per record
+// - functions in inlined_by are expanded as frames of their own, suffixed
+//   "_[i]" if inlined into another
+// - unknown functions are "[exec]", stacks of weight 0 are omitted
+std::string StackFramesToFolded(const std::vector<StackFrames>& records,
+                                FlameWeight weight = kFlameCount);
+bool WriteStackFramesFolded(int fd, const std::vector<StackFrames>& records,
+                            FlameWeight weight = kFlameCount);
+bool WriteStackFramesFolded(FILE* fp, const std::vector<StackFrames>& records,
+                            FlameWeight weight = kFlameCount);
+
+// SVG flame graph of the same stacks as StackFramesToFolded(), merged by
+// function name, frames too narrow to see are omitted
+std::string StackFramesToFlameGraph(const std::vector<StackFrames>& records,
+                                    FlameWeight weight = kFlameCount,
+                                    const std::string& title = "Flame Graph");
+bool WriteFlameGraph(int fd, const std::vector<StackFrames>& records,
+                     FlameWeight weight = kFlameCount,
+                     const std::string& title = "Flame Graph");
+bool WriteFlameGraph(FILE* fp, const std::vector<StackFrames>& records,
+                     FlameWeight weight = kFlameCount,
+                     const std::string& title = "Flame Graph");
+
+// dump records and write them as an SVG flame graph to path, return false if
+// failed to write
+bool DumpFlameGraph(uint8_t id, const std::string& path,
+                    FlameWeight weight = kFlameCount,
+                    bool since_last_dump = false);
+
+// compact binary of records, read by StackFramesReader, many times smaller
+// and faster to write than StackFramesToJson()
+// - tables of modules, frames with their inlined functions and interned
+//   strings, then stacks as delta and varint encoded frame indices
+// - every field of records and frames is kept, with build-id of modules if
+//   still loaded
+std::string StackFramesToBinary(const std::vector<StackFrames>& records);
+bool WriteStackFramesBinary(int fd, const std::vector<StackFrames>& records);
+bool WriteStackFramesBinary(FILE* fp, const std::vector<StackFrames>& records);
+
+/**
+ * reader of StackFramesToBinary() output, mapped or in memory
+ * - Open() validates the tables once, frames and strings are then read in
+ *   place, stacks are decoded one by one by Next() without allocation once
+ *   the frame buffer of the stack is large enough
+ * - strings are '\0' terminated in the file, ReadAll() keeps embedded '\0'
+ * - not thread safe, Next() is a cursor
+ */
+class StackFramesReader {
+ public:
+  // a record, frames are indices of frame(), innermost first
+  struct Stack {
+    uint64_t count;
+    int64_t score;
+    uint64_t count_error;
+    int64_t score_error;
+    std::vector<uint32_t> frames;  // reused by Next()
+  };
+
+  // a frame, strings point into the data
+  struct FrameRef {
+    const void* addr;
+    const void* faddr;
+    const char* symbol;
+    const char* func;
+    const char* exec;
+    const char* file;
+    const char* build_id;  // of exec, empty if unknown
+    int line;
+    uint32_t num_inlined;  // see inlined()
+  };
+
+  struct FuncRef {
+    const char* name;
+    const char* file;
+    int line;
+  };
+
+  StackFramesReader() = default;
+  ~StackFramesReader();
+  StackFramesReader(const StackFramesReader&) = delete;
+  StackFramesReader& operator=(const StackFramesReader&) = delete;
+
+  // map a file, return false if missing or malformed
+  bool Open(const std::string& path);
+  // read data of size in memory, not copied and 8 bytes aligned
+  bool Open(const void* data, size_t size);
+
+  size_t num_stacks() const { return num_stacks_; }
+  size_t num_frames() const { return num_frames_; }
+  FrameRef frame(uint32_t i) const;
+  // j-th function frame(i) is inlined by, outward
+  FuncRef inlined(uint32_t i, uint32_t j) const;
+
+  // next record, false at the end or if malformed, see ok()
+  bool Next(Stack& stack);
+  // iterate from the first record again
+  void Rewind();
+  // false if a record is malformed
+  bool ok() const { return ok_; }
+
+  // all records from the first, the same as written, Frame* are valid until
+  // the reader is closed or opened again
+  bool ReadAll(std::vector<StackFrames>& result);
+
+ private:
+  void Close();
+  std::string String(uint32_t id) const;
+
+  const uint8_t* data_ = nullptr;
+  size_t size_ = 0;
+  bool mapped_ = false;
+  bool ok_ = true;
+  uint32_t num_stacks_ = 0;
+  uint32_t num_frames_ = 0;
+  uint32_t num_inlined_ = 0;
+  uint32_t num_strings_ = 0;
+  const uint8_t* modules_ = nullptr;
+  const uint8_t* frames_ = nullptr;
+  const uint8_t* inlined_ = nullptr;
+  const uint32_t* string_offsets_ = nullptr;
+  const char* strings_ = nullptr;
+  const uint8_t* stacks_ = nullptr;
+  const uint8_t* end_ = nullptr;
+  const uint8_t* pos_ = nullptr;
+  uint32_t stacks_read_ = 0;
+  std::vector<Frame> owned_frames_;  // of ReadAll()
+};
 
 }  // namespace bttrack
@@ -0,0 +1,96 @@
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include "bttrack.h"
+
+// bttrack-symbolize: symbolize a file written by bttrack::DumpRaw(), built by
+// g++ -O2 -std=c++14 -o bttrack-symbolize bttrack_symbolize.cpp bttrack.cpp
+//     -ldl -lpthread
+
+void Usage(const char* prog) {
+  fprintf(stderr,
+          "Usage: %s [-j indent] [-t] [-f] [-g] [-w weight] [-b] "
+          "[-d debug_dir] [-c cache_dir] [-S] <dump>\n"
+          "  -j indent     print json, indent 0 is one line\n"
+          "  -t            print json with a frame table, see kJsonFrameTable\n"
+          "  -f            print folded stacks of flamegraph.pl\n"
+          "  -g            print an SVG flame graph\n"
+          "  -w weight     count (default) or score, of -f and -g\n"
+          "  -b            write the binary format, see StackFramesReader\n"
+          "  -d debug_dir  find modules by build-id or file name in it\n"
+          "  -c cache_dir  symbol cache, see SetSymbolCacheDir()\n"
+          "  -S            omit symbols in text output\n",
+          prog);
+}
+
+int main(int argc, char** argv) {
+  int json_indent = -1;
+  bttrack::JsonFormat json_format = bttrack::kJsonInline;
+  bool print_symbol = true;
+  char format = 0;  // -f, -g or -b
+  bttrack::FlameWeight weight = bttrack::kFlameCount;
+  std::string debug_dir;
+  int opt;
+  while ((opt = getopt(argc, argv, "j:tfgw:bd:c:Sh")) != -1) {
+    switch (opt) {
+      case 'j':
+        json_indent = atoi(optarg);
+        break;
+      case 't':
+        json_format = bttrack::kJsonFrameTable;
+        json_indent = std::max(json_indent, 0);
+        break;
+      case 'f':
+      case 'g':
+      case 'b':
+        format = opt;
+        break;
+      case 'w':
+        weight = std::string(optarg) == "score" ? bttrack::kFlameScore
+                                                : bttrack::kFlameCount;
+        break;
+      case 'd':
+        debug_dir = optarg;
+        break;
+      case 'c':
+        if (!bttrack::SetSymbolCacheDir(optarg)) {
+          fprintf(stderr, "cannot use symbol cache dir %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 'S':
+        print_symbol = false;
+        break;
+      default:
+        Usage(argv[0]);
+        return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (optind + 1 != argc) {
+    Usage(argv[0]);
+    return 1;
+  }
+
+  std::vector<bttrack::StackFrames> records;
+  if (!bttrack::SymbolizeRawDump(argv[optind], records, debug_dir)) {
+    fprintf(stderr, "cannot read raw dump %s\n", argv[optind]);
+    return 1;
+  }
+  if (format == 'f') {
+    return bttrack::WriteStackFramesFolded(stdout, records, weight) ? 0 : 1;
+  } else if (format == 'g') {
+    return bttrack::WriteFlameGraph(stdout, records, weight) ? 0 : 1;
+  } else if (format == 'b') {
+    return bttrack::WriteStackFramesBinary(stdout, records) ? 0 : 1;
+  }
+  bool ok = json_indent >= 0
+                ? bttrack::WriteStackFramesJson(stdout, records, json_indent,
+                                                json_format)
+                : bttrack::WriteStackFrames(stdout, records, print_symbol);
+  printf("\n");
+  return ok ? 0 : 1;
+}
@@ -63,7 +63,14 @@ function Build() {
   let src = fs.readFileSync(GetFileName('bttrack.cpp'))
   console.log(`bttrack.cpp length: ${src.length}`)
 
-  const ipps = ["ipp_inc.ipp", "output.ipp", "slice.ipp", "utils.ipp"]
+  const ipps = [
+    "ipp_inc.ipp", "output.ipp", "slice.ipp", "utils.ipp", "stack_table.ipp",
+    "unwind.ipp", "sampler.ipp", "cpu_profiler.ipp", "heap_profiler.ipp",
+    "malloc_hook.ipp", "elf_symbolizer.ipp", "frame_cache.ipp",
+    "symbol_cache.ipp", "module_map.ipp", "raw_dump.ipp",
+    "demangle_cache.ipp", "presymbolizer.ipp", "pprof.ipp",
+    "flamegraph.ipp", "binary_dump.ipp", "zlib.ipp",
+  ]
   for (const i of ipps) {
     src = ReplaceFile(src, `#include "${i}"`, GetFileName(i))
   }
@@ -0,0 +1,501 @@
+#include "ipp_inc.h"
+
+/**
+ * compact binary of records written by StackFramesToBinary(), read by
+ * StackFramesReader
+ * - header, modules, frames, inlined functions, string offsets, strings,
+ *   then stacks, in native byte order, each table is 8 bytes aligned in the
+ *   file
+ * - a module is an exec and its load base, a frame is its module and the
+ *   offset in it, so addr and faddr of frames are kept as is
+ * - string i is [offsets[i], offsets[i + 1] - 1) of strings, followed by
+ *   '\0', the same string is stored once
+ * - a stack is varints of count, zigzag score, count_error, zigzag
+ *   score_error and the number of frames, then zigzag deltas of its frame
+ *   indices, innermost first, each from the previous one, frames are
+ *   indexed in the order first seen so callers shared by stacks are near
+ * - the version is in the magic, a reader never reads other versions
+ */
+struct BinaryDump {
+  struct Header {
+    char magic[8];
+    uint32_t num_modules;
+    uint32_t num_frames;
+    uint32_t num_inlined;
+    uint32_t num_strings;
+    uint32_t num_stacks;
+    uint32_t reserved;
+    uint64_t strings_size;
+    uint64_t stacks_size;
+  };
+
+  struct Module {
+    uint64_t base;
+    uint32_t path;
+    uint32_t build_id;
+  };
+
+  struct Entry {
+    uint64_t offset;  // addr - base of module
+    uint32_t module;
+    uint32_t symbol;
+    uint32_t func;
+    uint32_t file;
+    int32_t line;
+    uint32_t inlined_begin;
+    uint32_t num_inlined;
+    uint32_t reserved;
+  };
+
+  struct Inlined {
+    uint32_t name;
+    uint32_t file;
+    int32_t line;
+  };
+
+  static const char kMagic[8];
+
+  static size_t Align(size_t size) { return (size + 7) & ~size_t(7); }
+
+  static uint64_t ZigZag(int64_t v) {
+    return (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63);
+  }
+  static int64_t UnZigZag(uint64_t v) {
+    return static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1);
+  }
+
+  static size_t VarintSize(uint64_t v) {
+    size_t n = 1;
+    for (; v >= 0x80; v >>= 7) {
+      n++;
+    }
+    return n;
+  }
+};
+
+const char BinaryDump::kMagic[8] = {'B', 'T', 'S', 'T', 'K', '0', '1', 0};
+
+// index of each Frame* in the order first seen, by linear probing, a dump
+// refers to each frame from many stacks
+class FrameIndex {
+ public:
+  // index of frame, and whether it is new
+  std::pair<uint32_t, bool> Insert(const Frame* frame) {
+    if ((frames_.size() + 1) * 2 > slots_.size()) {
+      Grow();
+    }
+    const size_t mask = slots_.size() - 1;
+    const void* key = frame;
+    for (size_t pos = hash_stack(&key, 1) & mask;; pos = (pos + 1) & mask) {
+      if (slots_[pos] == kEmpty) {
+        slots_[pos] = frames_.size();
+        frames_.push_back(frame);
+        return std::make_pair(slots_[pos], true);
+      }
+      if (frames_[slots_[pos]] == frame) {
+        return std::make_pair(slots_[pos], false);
+      }
+    }
+  }
+
+ private:
+  static const uint32_t kEmpty = UINT32_MAX;
+  std::vector<const Frame*> frames_;
+  std::vector<uint32_t> slots_;  // size is power of 2
+
+  void Grow() {
+    slots_.assign(std::max<size_t>(64, slots_.size() * 2), kEmpty);
+    const size_t mask = slots_.size() - 1;
+    for (uint32_t i = 0; i < frames_.size(); i++) {
+      const void* key = frames_[i];
+      size_t pos = hash_stack(&key, 1) & mask;
+      while (slots_[pos] != kEmpty) {
+        pos = (pos + 1) & mask;
+      }
+      slots_[pos] = i;
+    }
+  }
+};
+
+const uint32_t FrameIndex::kEmpty;
+
+// tables of records, then stacks encoded while written
+static bool stack_frames_to_binary(OutputWriter& out,
+                                   const std::vector<StackFrames>& records) {
+  std::vector<BinaryDump::Module> modules;
+  std::map<std::pair<std::string, uintptr_t>, uint32_t> module_ids;
+  std::vector<BinaryDump::Entry> entries;
+  FrameIndex frame_ids;
+  std::vector<BinaryDump::Inlined> inlined;
+  std::vector<uint32_t> string_offsets;
+  std::string strings;
+  std::unordered_map<std::string, uint32_t> string_ids;
+  auto add_string = [&](const std::string& s) {
+    auto it = string_ids.emplace(s, string_offsets.size());
+    if (it.second) {
+      string_offsets.push_back(strings.size());
+      strings.append(s.c_str(), s.size() + 1);
+    }
+    return it.first->second;
+  };
+
+  std::shared_ptr<const ModuleMap> loaded = ModuleMap::Snapshot();
+  std::vector<uint32_t> frame_refs;  // frame indices of all records
+  uint64_t stacks_size = 0;
+  for (const auto& it : records) {
+    stacks_size +=
+        BinaryDump::VarintSize(it.count) +
+        BinaryDump::VarintSize(BinaryDump::ZigZag(it.score)) +
+        BinaryDump::VarintSize(it.count_error) +
+        BinaryDump::VarintSize(BinaryDump::ZigZag(it.score_error)) +
+        BinaryDump::VarintSize(it.frames.size());
+    uint32_t prev = 0;
+    for (const Frame* frame : it.frames) {
+      auto found = frame_ids.Insert(frame);
+      if (found.second) {
+        uintptr_t base = reinterpret_cast<uintptr_t>(frame->faddr);
+        auto m = module_ids.emplace(std::make_pair(frame->exec, base),
+                                    modules.size());
+        if (m.second) {
+          int loaded_id = loaded->Find(frame->faddr);
+          bool same = frame->faddr != nullptr && loaded_id >= 0 &&
+                      loaded->module(loaded_id).base == base &&
+                      loaded->module(loaded_id).path == frame->exec;
+          modules.push_back(BinaryDump::Module{
+              base, add_string(frame->exec),
+              add_string(same ? loaded->module(loaded_id).build_id : "")});
+        }
+        entries.push_back(BinaryDump::Entry{
+            reinterpret_cast<uintptr_t>(frame->addr) - base,
+            m.first->second,
+            add_string(frame->symbol),
+            add_string(frame->func),
+            add_string(frame->file),
+            frame->line,
+            static_cast<uint32_t>(inlined.size()),
+            static_cast<uint32_t>(frame->inlined_by.size()),
+            0});
+        for (const auto& f : frame->inlined_by) {
+          inlined.push_back(BinaryDump::Inlined{add_string(f.name),
+                                                add_string(f.file), f.line});
+        }
+      }
+      uint32_t id = found.first;
+      stacks_size += BinaryDump::VarintSize(
+          BinaryDump::ZigZag(static_cast<int64_t>(id) - prev));
+      prev = id;
+      frame_refs.push_back(id);
+    }
+  }
+  if (strings.size() > UINT32_MAX || records.size() > UINT32_MAX) {
+    return false;
+  }
+  string_offsets.push_back(strings.size());
+
+  BinaryDump::Header h;
+  memcpy(h.magic, BinaryDump::kMagic, sizeof(BinaryDump::kMagic));
+  h.num_modules = modules.size();
+  h.num_frames = entries.size();
+  h.num_inlined = inlined.size();
+  h.num_strings = string_offsets.size() - 1;
+  h.num_stacks = records.size();
+  h.reserved = 0;
+  h.strings_size = strings.size();
+  h.stacks_size = stacks_size;
+  // pad each table to 8 bytes
+  static const char kZeros[8] = {};
+  auto table = [&](const void* data, size_t size) {
+    out.Append(static_cast<const char*>(data), size);
+    out.Append(kZeros, BinaryDump::Align(size) - size);
+  };
+  table(&h, sizeof(h));
+  table(modules.data(), modules.size() * sizeof(BinaryDump::Module));
+  table(entries.data(), entries.size() * sizeof(BinaryDump::Entry));
+  table(inlined.data(), inlined.size() * sizeof(BinaryDump::Inlined));
+  table(string_offsets.data(), string_offsets.size() * sizeof(uint32_t));
+  table(strings.data(), strings.size());
+  const uint32_t* ref = frame_refs.data();
+  for (const auto& it : records) {
+    out.Varint(it.count)
+        .Varint(BinaryDump::ZigZag(it.score))
+        .Varint(it.count_error)
+        .Varint(BinaryDump::ZigZag(it.score_error))
+        .Varint(it.frames.size());
+    uint32_t prev = 0;
+    for (size_t f = 0; f < it.frames.size(); f++, ref++) {
+      out.Varint(BinaryDump::ZigZag(static_cast<int64_t>(*ref) - prev));
+      prev = *ref;
+    }
+  }
+  return true;
+}
+
+std::string StackFramesToBinary(const std::vector<StackFrames>& records) {
+  std::string str;
+  OutputWriter out(&str);
+  if (!stack_frames_to_binary(out, records)) {
+    return "";
+  }
+  out.Flush();
+  return str;
+}
+
+bool WriteStackFramesBinary(int fd, const std::vector<StackFrames>& records) {
+  OutputWriter out(fd);
+  return stack_frames_to_binary(out, records) && out.Flush();
+}
+
+bool WriteStackFramesBinary(FILE* fp, const std::vector<StackFrames>& records) {
+  OutputWriter out(fp);
+  return stack_frames_to_binary(out, records) && out.Flush();
+}
+
+StackFramesReader::~StackFramesReader() { Close(); }
+
+void StackFramesReader::Close() {
+  if (mapped_) {
+    munmap(const_cast<uint8_t*>(data_), size_);
+  }
+  data_ = nullptr;
+  size_ = 0;
+  mapped_ = false;
+  ok_ = false;
+  num_stacks_ = num_frames_ = num_inlined_ = num_strings_ = 0;
+  stacks_ = end_ = pos_ = nullptr;
+  stacks_read_ = 0;
+  owned_frames_.clear();
+}
+
+bool StackFramesReader::Open(const std::string& path) {
+  Close();
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 ||
+      st.st_size < (off_t)sizeof(BinaryDump::Header)) {
+    close(fd);
+    return false;
+  }
+  void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return false;
+  }
+  if (!Open(data, st.st_size)) {
+    munmap(data, st.st_size);
+    return false;
+  }
+  mapped_ = true;
+  return true;
+}
+
+bool StackFramesReader::Open(const void* data, size_t size) {
+  Close();
+  using BD = BinaryDump;
+  if (size < sizeof(BD::Header) || reinterpret_cast<uintptr_t>(data) % 8) {
+    return false;
+  }
+  const uint8_t* p = static_cast<const uint8_t*>(data);
+  const BD::Header* h = reinterpret_cast<const BD::Header*>(p);
+  if (memcmp(h->magic, BD::kMagic, sizeof(BD::kMagic)) != 0 ||
+      h->strings_size > UINT32_MAX || h->num_strings == UINT32_MAX) {
+    return false;
+  }
+  // offsets of tables, each at most 2^32 times 40 bytes, no overflow
+  const uint64_t modules = BD::Align(sizeof(BD::Header));
+  const uint64_t frames =
+      modules + BD::Align(h->num_modules * sizeof(BD::Module));
+  const uint64_t inlined =
+      frames + BD::Align(h->num_frames * sizeof(BD::Entry));
+  const uint64_t offsets =
+      inlined + BD::Align(h->num_inlined * sizeof(BD::Inlined));
+  const uint64_t strings =
+      offsets + BD::Align((h->num_strings + 1ULL) * sizeof(uint32_t));
+  const uint64_t stacks = strings + BD::Align(h->strings_size);
+  // each stack is at least 5 varints of a byte, ReadAll() sizes by num_stacks
+  if (stacks > size || h->stacks_size != size - stacks ||
+      h->num_stacks > h->stacks_size / 5) {
+    return false;
+  }
+
+  // strings are '\0' terminated in order, so every string id below
+  // num_strings is safe to read as a C string
+  const uint32_t* string_offsets =
+      reinterpret_cast<const uint32_t*>(p + offsets);
+  const char* chars = reinterpret_cast<const char*>(p + strings);
+  if (string_offsets[0] != 0 ||
+      string_offsets[h->num_strings] != h->strings_size) {
+    return false;
+  }
+  for (uint32_t i = 0; i < h->num_strings; i++) {
+    if (string_offsets[i + 1] <= string_offsets[i] ||
+        chars[string_offsets[i + 1] - 1] != '\0') {
+      return false;
+    }
+  }
+  for (uint32_t i = 0; i < h->num_modules; i++) {
+    const BD::Module& m = reinterpret_cast<const BD::Module*>(p + modules)[i];
+    if (m.path >= h->num_strings || m.build_id >= h->num_strings) {
+      return false;
+    }
+  }
+  for (uint32_t i = 0; i < h->num_frames; i++) {
+    const BD::Entry& e = reinterpret_cast<const BD::Entry*>(p + frames)[i];
+    if (e.module >= h->num_modules || e.symbol >= h->num_strings ||
+        e.func >= h->num_strings || e.file >= h->num_strings ||
+        e.inlined_begin > h->num_inlined ||
+        e.num_inlined > h->num_inlined - e.inlined_begin) {
+      return false;
+    }
+  }
+  for (uint32_t i = 0; i < h->num_inlined; i++) {
+    const BD::Inlined& f = reinterpret_cast<const BD::Inlined*>(p + inlined)[i];
+    if (f.name >= h->num_strings || f.file >= h->num_strings) {
+      return false;
+    }
+  }
+
+  data_ = p;
+  size_ = size;
+  ok_ = true;
+  num_stacks_ = h->num_stacks;
+  num_frames_ = h->num_frames;
+  num_inlined_ = h->num_inlined;
+  num_strings_ = h->num_strings;
+  modules_ = p + modules;
+  frames_ = p + frames;
+  inlined_ = p + inlined;
+  string_offsets_ = string_offsets;
+  strings_ = chars;
+  stacks_ = p + stacks;
+  end_ = p + size;
+  Rewind();
+  return true;
+}
+
+StackFramesReader::FrameRef StackFramesReader::frame(uint32_t i) const {
+  const BinaryDump::Entry& e =
+      reinterpret_cast<const BinaryDump::Entry*>(frames_)[i];
+  const BinaryDump::Module& m =
+      reinterpret_cast<const BinaryDump::Module*>(modules_)[e.module];
+  return FrameRef{reinterpret_cast<const void*>(m.base + e.offset),
+                  reinterpret_cast<const void*>(m.base),
+                  strings_ + string_offsets_[e.symbol],
+                  strings_ + string_offsets_[e.func],
+                  strings_ + string_offsets_[m.path],
+                  strings_ + string_offsets_[e.file],
+                  strings_ + string_offsets_[m.build_id],
+                  e.line,
+                  e.num_inlined};
+}
+
+StackFramesReader::FuncRef StackFramesReader::inlined(uint32_t i,
+                                                      uint32_t j) const {
+  const BinaryDump::Entry& e =
+      reinterpret_cast<const BinaryDump::Entry*>(frames_)[i];
+  const BinaryDump::Inlined& f = reinterpret_cast<const BinaryDump::Inlined*>(
+      inlined_)[e.inlined_begin + j];
+  return FuncRef{strings_ + string_offsets_[f.name],
+                 strings_ + string_offsets_[f.file], f.line};
+}
+
+void StackFramesReader::Rewind() {
+  pos_ = stacks_;
+  stacks_read_ = 0;
+  ok_ = data_ != nullptr;
+}
+
+bool StackFramesReader::Next(Stack& stack) {
+  if (!ok_ || stacks_read_ == num_stacks_) {
+    return false;
+  }
+  // false if truncated or longer than 64 bits
+  auto varint = [this](uint64_t& v) {
+    v = 0;
+    for (int shift = 0; pos_ < end_ && shift < 64; shift += 7) {
+      uint8_t b = *pos_++;
+      v |= static_cast<uint64_t>(b & 0x7f) << shift;
+      if ((b & 0x80) == 0) {
+        return true;
+      }
+    }
+    return false;
+  };
+  uint64_t score = 0, score_error = 0, size = 0, delta = 0;
+  ok_ = varint(stack.count) && varint(score) && varint(stack.count_error) &&
+        varint(score_error) && varint(size) &&
+        size <= static_cast<uint64_t>(end_ - pos_);  // a byte per frame
+  stack.score = BinaryDump::UnZigZag(score);
+  stack.score_error = BinaryDump::UnZigZag(score_error);
+  stack.frames.clear();
+  int64_t id = 0;
+  for (uint64_t f = 0; ok_ && f < size; f++) {
+    // frame indices are below 2^32, larger deltas are malformed
+    ok_ = varint(delta) && delta < (1ULL << 34);
+    id += BinaryDump::UnZigZag(delta);
+    ok_ = ok_ && id >= 0 && id < num_frames_;
+    stack.frames.push_back(static_cast<uint32_t>(id));
+  }
+  if (!ok_) {
+    stack.frames.clear();
+    return false;
+  }
+  stacks_read_++;
+  return true;
+}
+
+std::string StackFramesReader::String(uint32_t id) const {
+  return std::string(strings_ + string_offsets_[id],
+                     string_offsets_[id + 1] - string_offsets_[id] - 1);
+}
+
+bool StackFramesReader::ReadAll(std::vector<StackFrames>& result) {
+  result.clear();
+  if (data_ == nullptr) {
+    return false;
+  }
+  if (owned_frames_.empty()) {
+    owned_frames_.resize(num_frames_);
+    for (uint32_t i = 0; i < num_frames_; i++) {
+      const BinaryDump::Entry& e =
+          reinterpret_cast<const BinaryDump::Entry*>(frames_)[i];
+      const BinaryDump::Module& m =
+          reinterpret_cast<const BinaryDump::Module*>(modules_)[e.module];
+      Frame& frame = owned_frames_[i];
+      frame.addr = reinterpret_cast<const void*>(m.base + e.offset);
+      frame.faddr = reinterpret_cast<const void*>(m.base);
+      frame.symbol = String(e.symbol);
+      frame.func = String(e.func);
+      frame.exec = String(m.path);
+      frame.file = String(e.file);
+      frame.line = e.line;
+      for (uint32_t j = 0; j < e.num_inlined; j++) {
+        const BinaryDump::Inlined& f =
+            reinterpret_cast<const BinaryDump::Inlined*>(
+                inlined_)[e.inlined_begin + j];
+        frame.inlined_by.push_back(
+            Frame::Func{String(f.name), String(f.file), f.line});
+      }
+    }
+  }
+  Rewind();
+  result.resize(num_stacks_);
+  Stack stack;
+  for (auto& it : result) {
+    if (!Next(stack)) {
+      result.clear();
+      return false;
+    }
+    it.count = stack.count;
+    it.score = stack.score;
+    it.count_error = stack.count_error;
+    it.score_error = stack.score_error;
+    it.frames.resize(stack.frames.size());
+    for (size_t f = 0; f < stack.frames.size(); f++) {
+      it.frames[f] = &owned_frames_[stack.frames[f]];
+    }
+  }
+  return true;
+}
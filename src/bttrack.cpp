@@ -2,18 +2,43 @@
 
 #include <cxxabi.h>
 #include <dlfcn.h>
+#include <elf.h>
 #include <execinfo.h>
 #include <fcntl.h>
+#include <link.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
+#include <ucontext.h>
 #include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <condition_variable>
 #include <cstdio>
 #include <cstring>
+#include <deque>
+#include <functional>
 #include <map>
+#include <memory>
 #include <mutex>
+#include <new>
+#include <thread>
 #include <unordered_map>
+#include <unordered_set>
 
 #include "ipp_inc.ipp"
 
@@ -24,21 +49,14 @@ const char* kFuncUnknown = "<unknown>";
 #include "slice.ipp"
 #include "utils.ipp"
 
-// array of stack pointers
-struct Stack {
-  const FramePointers addrs;
-  Stack(void** addrs_, int num) : addrs(addrs_, addrs_ + num) {}
-  Stack(const FramePointers& addrs) : addrs(addrs) {}
-  bool operator==(const Stack& other) const { return addrs == other.addrs; }
-  bool operator<(const Stack& other) const {
-    return addrs < other.addrs;  // lexicographical order
-  }
-};
+#include "stack_table.ipp"
+#include "unwind.ipp"
+#include "sampler.ipp"
+#include "frame_cache.ipp"
+#include "demangle_cache.ipp"
 
-struct StackStat {
-  uint64_t count;
-  int64_t score;
-};
+class Tracker;
+static Tracker& GetInstance(uint8_t id);
 
 class Tracker {
  public:
@@ -52,32 +70,121 @@ class Tracker {
 
   void Record(int64_t score);
   void RecordStack(const FramePointers& stack, int64_t score);
-  void Dump(std::vector<StackFrames>&);
+  // record a sampled stack with its weight, no sampling applied
+  void RecordWeighted(const void* const* addrs, size_t size,
+                      const StackStat& weight);
+  void SetSampling(Sampling mode, int64_t param);
+  void SetMaxStacks(size_t max_stacks);
+  void Dump(std::vector<StackFrames>&, bool since_last_dump, bool reset);
+  bool DumpRaw(const std::string& path, bool since_last_dump);
+  void DumpCallTree(std::vector<CallNode>&);
+  // append addresses of nodes recorded since last call, for Presymbolizer
+  void CollectNewAddrs(FramePointers& addrs);
 
   static bool GetBacktrace(FramePointers& stack);
 
  private:
+  friend Tracker& GetInstance(uint8_t id);
+  friend class Presymbolizer;
+
+  // records of a single thread, all shards are merged in Dump()
+  struct Shard {
+    std::mutex mutex;  // only contended with Dump()
+    StackTable records;
+    bool in_use = false;  // owned by a living thread, guarded by mutex_
+    uint32_t num_collected = 0;  // nodes seen by CollectNewAddrs()
+  };
+
+  // shards of current thread, released to their Tracker on thread exit
+  struct ThreadShards {
+    Shard* shards[256] = {};
+    ~ThreadShards();
+  };
+  // set once ThreadShards of current thread is destroyed, later records of
+  // the exiting thread, like frees in other TLS destructors, go to
+  // exited_shard_
+  static thread_local bool shards_destroyed_;
+
+  uint8_t id_ = 0;
+  // sampling config, epoch is bumped on change to reset per thread state
+  std::atomic<int> sampling_mode_{kSampleAll};
+  std::atomic<int64_t> sampling_param_{1};
+  std::atomic<uint32_t> sampling_epoch_{0};
+  // max stacks of each shard and of dump results, 0 is unbounded
+  std::atomic<size_t> max_stacks_{0};
+  // guard shards_, never held by Record() except a thread's first call
   mutable std::mutex mutex_;
-  // find frame according to addr
-  std::unordered_map<const void*, Frame> all_frames_;
-  // stack frames and its statistics
-  std::map<Stack, StackStat> all_records_;
+  // shared by records of exiting threads, never released
+  std::once_flag exited_once_;
+  Shard* exited_shard_ = nullptr;
+  // serialize dumps, never held by Record()
+  mutable std::mutex dump_mutex_;
+  // records at last Dump(), guarded by dump_mutex_
+  StackNodes last_dump_;
+  // per-thread stack frames and its statistics, never freed
+  std::vector<std::unique_ptr<Shard>> shards_;
+
+  // get shard of current thread, acquire one if not exist
+  Shard* LocalShard();
+  // reuse a released shard or create a new one
+  Shard* AcquireShard();
+  Shard* ExitedShard();
+  void ReleaseShard(Shard* shard);
+  // add to shard, should not hold shard lock
+  static void AddRecord(Shard* shard, const void* const* addrs, size_t size,
+                        const StackStat& weight);
+  // return false if this call is not sampled, otherwise its weight
+  bool Sample(int64_t score, StackStat& weight);
 
-  // batch resolve addr to frame, should hold lock
-  void Resolve(const FramePointers&, std::vector<Frame*>&);
+  // merge all shards, and clear them if reset, should hold dump_mutex_
+  void MergeShards(StackTable& records, bool reset);
+  // merge shards for a dump, and sort stacks to report by count, should hold
+  // dump_mutex_
+  void CollectStacks(StackTable& records, bool since_last_dump, bool reset,
+                     std::vector<uint32_t>& stacks);
+  // resolve frame of each node
+  static void ResolveNodes(const StackTable& records,
+                           std::vector<Frame*>& frames);
+  // batch resolve addr to frame, frames are cached by FrameCache
+  static void Resolve(const FramePointers&, std::vector<Frame*>&);
 };
 
 static Tracker& GetInstance(uint8_t id) {
-  static Tracker instance[256];
-  return instance[id];
+  static struct Instances {
+    Tracker tracker[256];
+    Instances() {
+      for (int i = 0; i < 256; i++) {
+        tracker[i].id_ = static_cast<uint8_t>(i);
+      }
+    }
+  } instances;
+  return instances.tracker[id];
+}
+
+#include "cpu_profiler.ipp"
+#include "heap_profiler.ipp"
+
+void Dump(uint8_t id, std::vector<StackFrames>& records,
+          bool since_last_dump) {
+  GetInstance(id).Dump(records, since_last_dump, false);
+}
+
+void DumpAndReset(uint8_t id, std::vector<StackFrames>& records) {
+  GetInstance(id).Dump(records, false, true);
+}
+
+bool DumpRaw(uint8_t id, const std::string& path, bool since_last_dump) {
+  return GetInstance(id).DumpRaw(path, since_last_dump);
 }
 
-void Dump(uint8_t id, std::vector<StackFrames>& records) {
-  GetInstance(id).Dump(records);
+void DumpCallTree(uint8_t id, std::vector<CallNode>& nodes) {
+  GetInstance(id).DumpCallTree(nodes);
 }
 
 // use O2/O3 will break Tracker::kSkipFrames
-#define OPTIMIZE_O1 __attribute__((optimize("O1")))
+// keep frame pointers so kUnwindFramePointer skips the same frames
+#define OPTIMIZE_O1 \
+  __attribute__((optimize("O1", "no-omit-frame-pointer")))
 
 void OPTIMIZE_O1 Record(uint8_t id, int64_t score) {
   GetInstance(id).Record(score);
@@ -94,6 +201,40 @@ bool OPTIMIZE_O1 GetBacktrace(FramePointers& stack) {
 
 #undef OPTIMIZE_O1
 
+void SetSampling(uint8_t id, Sampling mode, int64_t param) {
+  GetInstance(id).SetSampling(mode, param);
+}
+
+void SetMaxStacks(uint8_t id, size_t max_stacks) {
+  GetInstance(id).SetMaxStacks(max_stacks);
+}
+
+bool StartCpuProfiler(uint8_t id, int hz) {
+  return CpuProfiler::GetInstance()->Start(id, hz);
+}
+
+void StopCpuProfiler() { CpuProfiler::GetInstance()->Stop(); }
+
+bool RegisterProfiledThread() { return init_stack_range(); }
+
+bool StartHeapProfiler(uint8_t alloc_id, uint8_t live_id,
+                       int64_t sample_bytes) {
+#ifdef BTTRACK_HEAP_PROFILER
+  return HeapProfiler::Start(alloc_id, live_id, sample_bytes);
+#else
+  (void)alloc_id;
+  (void)live_id;
+  (void)sample_bytes;
+  return false;
+#endif
+}
+
+void StopHeapProfiler() { HeapProfiler::Stop(); }
+
+void SetUnwinder(Unwinder unwinder) {
+  g_unwinder.store(unwinder, std::memory_order_relaxed);
+}
+
 /**
  * empty symbol: func = kFuncUnknown, return false
  * demangle success: func = demangled, return true
@@ -104,18 +245,144 @@ bool demangle_symbol(std::string& func, const char* symbol) {
     func = kFuncUnknown;
     return false;
   }
+  DemangleCache* cache = DemangleCache::GetInstance();
+  size_t size = strlen(symbol);
+  bool ok;
+  if (cache->Find(symbol, size, func, ok)) {
+    return ok;
+  }
   int status;
   char* demangled = abi::__cxa_demangle(symbol, nullptr, nullptr, &status);
-  if (status != 0 || demangled == nullptr) {
-    func.assign(symbol);
-    return false;
+  ok = status == 0 && demangled != nullptr;
+  if (ok) {
+    func = demangled;
+    free(demangled);
+  } else {
+    func.assign(symbol, size);
   }
-  func = demangled;
-  free(demangled);
-  return true;
+  cache->Insert(symbol, size, func, ok);
+  return ok;
 }
 
-// @ref https://sourceware.org/binutils/docs-2.31/binutils/addr2line.html
+// max threads to resolve frames, including the calling thread
+static const size_t kMaxSymbolizeThreads = 8;
+// set by SetSymbolizeThreads(), 0 is by hardware concurrency
+static std::atomic<size_t> g_symbolize_threads(0);
+// set on a thread whose symbolization must stay on itself, e.g. the
+// Presymbolizer whose CPU budget is of one thread
+static thread_local bool tls_symbolize_serial = false;
+
+/**
+ * run task(0..num_tasks-1) on the calling thread and threads spawned for
+ * this call, return when all are done
+ * - threads are per call rather than a persistent pool, as symbolization is
+ *   rare and takes far longer than spawning a few threads, and the threads
+ *   inherit nice value of the caller
+ */
+static void run_parallel(size_t num_tasks,
+                         const std::function<void(size_t)>& task) {
+  size_t max_threads = g_symbolize_threads.load(std::memory_order_relaxed);
+  if (max_threads == 0) {
+    max_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  if (tls_symbolize_serial) {
+    max_threads = 1;
+  }
+  size_t num_threads =
+      std::min<size_t>({num_tasks, kMaxSymbolizeThreads, max_threads});
+  std::atomic<size_t> next(0);
+  auto worker = [&]() {
+    ScopedHeapHookGuard guard;  // not to profile symbolizer itself
+    for (size_t i; (i = next.fetch_add(1)) < num_tasks;) {
+      task(i);
+    }
+  };
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < num_threads; i++) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+}
+
+// frames of one module resolved by a task of run_parallel()
+struct ModuleChunk {
+  const std::string* exec;
+  Frame** frames;
+  size_t num_frames;
+  uint64_t start_nanos;
+  uint64_t end_nanos;
+};
+
+/**
+ * group frames by exec, and resolve modules concurrently
+ * - a module with many frames is split into chunks of at least
+ *   min_chunk_frames frames, up to one chunk per thread
+ * - time of each module is reported if all take more than 1s
+ */
+static void resolve_by_module(std::vector<Frame*>& frames, const char* tool,
+                              size_t min_chunk_frames,
+                              const std::function<void(ModuleChunk&)>& fn) {
+  auto start = get_nanos();
+  std::unordered_map<std::string, std::vector<Frame*>> modules;
+  for (Frame* frame : frames) {
+    modules[frame->exec].emplace_back(frame);
+  }
+  std::vector<ModuleChunk> chunks;
+  for (auto& it : modules) {
+    auto& module_frames = it.second;
+    size_t num_chunks =
+        std::min(kMaxSymbolizeThreads,
+                 std::max<size_t>(1, module_frames.size() / min_chunk_frames));
+    size_t chunk_size = (module_frames.size() + num_chunks - 1) / num_chunks;
+    for (size_t i = 0; i < module_frames.size(); i += chunk_size) {
+      chunks.push_back(ModuleChunk{
+          &it.first, module_frames.data() + i,
+          std::min(chunk_size, module_frames.size() - i), 0, 0});
+    }
+  }
+  // larger chunks first, so the slowest module starts early
+  std::sort(chunks.begin(), chunks.end(),
+            [](const ModuleChunk& a, const ModuleChunk& b) {
+              return a.num_frames > b.num_frames;
+            });
+  run_parallel(chunks.size(), [&](size_t i) {
+    chunks[i].start_nanos = get_nanos();
+    fn(chunks[i]);
+    chunks[i].end_nanos = get_nanos();
+  });
+
+  double elapsed = (get_nanos() - start) / 1e9;
+  if (elapsed > 1.0) {
+    fprintf(stderr, "%s::Resolve %lu in %.3fs\n", tool, frames.size(),
+            elapsed);
+    for (const auto& it : modules) {
+      uint64_t first = UINT64_MAX, last = 0;
+      size_t num_chunks = 0;
+      for (const auto& chunk : chunks) {
+        if (chunk.exec == &it.first) {
+          first = std::min(first, chunk.start_nanos);
+          last = std::max(last, chunk.end_nanos);
+          num_chunks++;
+        }
+      }
+      fprintf(stderr, "  %s: %lu in %.3fs by %lu threads\n", it.first.c_str(),
+              it.second.size(), (last - first) / 1e9, num_chunks);
+    }
+  }
+}
+
+/**
+ * resolve frames by addr2line, one long-lived coprocess per exec
+ * - `addr2line -e EXEC -f -i -p` reads addresses from stdin, so DWARF of an
+ *   exec is parsed once per process lifetime
+ * - addresses are written in pipelined batches, each batch ends with a
+ *   sentinel address, whose output tells where the last frame ends
+ * - a coprocess failed or timed out is killed, and respawned by next batch
+ * @ref https://sourceware.org/binutils/docs-2.31/binutils/addr2line.html
+ */
 class Addr2lineTool {
  public:
   struct Context {
@@ -125,12 +392,18 @@ class Addr2lineTool {
      * - frames[]->exec must be the same
      */
     std::vector<Frame*> frames;
-    bool display_func;    // [in]
-    bool unwind_inline;   // [in]
     int ret;              // [out] return code, 0 if success
     std::string err_msg;  // error message if ret != 0
   };
 
+  // addresses per batch, and batches written ahead of reading
+  static const size_t kBatchSize = 100;
+  static const size_t kMaxPendingBatches = 2;
+  // max wait for output of a batch
+  static const int kTimeoutMs = 30000;
+  // min frames worth another coprocess, which parses DWARF again
+  static const size_t kMinChunkFrames = 1000;
+
   static Addr2lineTool* GetInstance() {
     static Addr2lineTool instance;
     return &instance;  // singleton
@@ -140,92 +413,246 @@ class Addr2lineTool {
     return GetInstance()->is_addr2line_available_;
   }
 
-  void Resolve(std::vector<Frame*>& frames) {
-    assert(!frames.empty());
-    auto start = get_nanos();
-    Context ctx;
-    std::vector<bool> resolved(frames.size(), false);
-    size_t i = 0;
-    while (i < frames.size()) {
-      if (resolved[i]) {
-        i++;
-        continue;
-      }
-      // reset states
-      ctx.frames.clear();
-      ctx.unwind_inline = true;              // @todo dynamic option
-      ctx.display_func = ctx.unwind_inline;  // should get inline func name
-      // find all frames with the same exec (no more than batch_size)
-      resolved[i] = true;
-      ctx.frames.push_back(frames[i]);
-      const auto& exec = ctx.frames[0]->exec;
-      int batch_size = 100;
-      for (size_t j = i + 1; j < frames.size(); j++) {
-        if (frames[j]->exec == exec) {
-          ctx.frames.push_back(frames[j]);
-          resolved[j] = true;
-          if (!ctx.display_func && frames[j]->func != kFuncUnknown) {
-            ctx.display_func = true;
-          }
-          if (--batch_size == 0) {
-            break;
-          }
-        }
+  ~Addr2lineTool() {
+    for (auto& it : modules_) {
+      for (auto& cp : it.second.idle) {
+        Stop(*cp);
       }
-      // lookup addr2line
-      BatchResolve(ctx);
-      i++;
-    }
-    double elapsed = (get_nanos() - start) / 1e9;
-    if (elapsed > 1.0) {
-      fprintf(stderr, "Addr2LineTool::Resolve %lu in %.3fs\n", frames.size(),
-              elapsed);
     }
   }
 
+  // modules are resolved concurrently, a large module by several coprocesses
+  void Resolve(std::vector<Frame*>& frames) {
+    assert(!frames.empty());
+    resolve_by_module(frames, "Addr2LineTool", kMinChunkFrames,
+                      [this](ModuleChunk& chunk) {
+                        Context ctx;
+                        ctx.frames.assign(chunk.frames,
+                                          chunk.frames + chunk.num_frames);
+                        BatchResolve(ctx);
+                      });
+  }
+
   // all frames should have the same exec path
   void BatchResolve(Context& ctx) {
     assert(!ctx.frames.empty());
-    auto& exec = ctx.frames[0]->exec;
-    std::string cmd = "addr2line -e " + exec + " -p";
-    if (ctx.display_func) {
-      cmd += " -f";
-    }
-    if (ctx.unwind_inline) {
-      cmd += " -i";
+    ctx.ret = 0;
+    ctx.err_msg.clear();
+    const auto& exec = ctx.frames[0]->exec;
+    std::unique_ptr<Coprocess> cp_ptr = Acquire(exec, ctx);
+    if (!cp_ptr) {
+      return;
     }
+    Coprocess& cp = *cp_ptr;
+
+    // write batches ahead, so addr2line keeps busy while output is parsed
+    const size_t num_frames = ctx.frames.size();
     const auto& base = ctx.frames[0]->faddr;
-    for (auto frame : ctx.frames) {
-      cmd += " ";
-      assert(frame->faddr == base);
-      cmd += to_address(Slice::offset(frame->addr, base));
+    size_t written = 0;
+    for (size_t begin = 0; begin < num_frames; begin += kBatchSize) {
+      while (written < num_frames &&
+             written < begin + kBatchSize * kMaxPendingBatches) {
+        size_t end = std::min(written + kBatchSize, num_frames);
+        std::string input;
+        for (size_t j = written; j < end; j++) {
+          assert(ctx.frames[j]->faddr == base);
+          input += to_address(Slice::offset(ctx.frames[j]->addr, base));
+          input += '\n';
+        }
+        input += kSentinel;
+        if (!Write(cp, input)) {
+          break;
+        }
+        written = end;
+      }
+      size_t end = std::min(begin + kBatchSize, num_frames);
+      if (written < end || !ReadBatch(cp, ctx.frames.data() + begin,
+                                      end - begin)) {
+        // no retry, frames are left unresolved, and not to respawn if it
+        // never worked
+        Stop(cp);
+        std::lock_guard<std::mutex> lock(mutex_);
+        modules_[exec].failed = cp.num_batches == 0;
+        ctx.ret = -1;
+        ctx.err_msg = "addr2line failed";
+        return;
+      }
+      cp.num_batches++;
     }
-    // fprintf(stderr, " >> cmd: %s\n", cmd.c_str());
-    FILE* pipe = popen(cmd.c_str(), "r");
-    if (!pipe) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    modules_[exec].idle.emplace_back(std::move(cp_ptr));
+  }
+
+ private:
+  // its output is the only line of the batch starting with "??"
+  static const char* kSentinel;
+
+  struct Coprocess {
+    pid_t pid = -1;
+    int in = -1;             // write end of its stdin
+    int out = -1;            // read end of its stdout
+    size_t num_batches = 0;  // resolved by this coprocess
+    std::string buffer;      // read but not parsed
+  };
+
+  struct Module {
+    bool failed = false;  // not to respawn, e.g. exec is not readable
+    std::vector<std::unique_ptr<Coprocess>> idle;
+  };
+
+  const bool is_addr2line_available_;
+  std::mutex mutex_;  // guard modules_
+  std::unordered_map<std::string, Module> modules_;
+
+  Addr2lineTool() : is_addr2line_available_(FindAddr2line()) {}
+
+  // take an idle coprocess of exec, or spawn one
+  std::unique_ptr<Coprocess> Acquire(const std::string& exec, Context& ctx) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      Module& module = modules_[exec];
+      if (module.failed) {
+        ctx.ret = -1;
+        ctx.err_msg = "addr2line failed before";
+        return nullptr;
+      }
+      if (!module.idle.empty()) {
+        std::unique_ptr<Coprocess> cp = std::move(module.idle.back());
+        module.idle.pop_back();
+        return cp;
+      }
+    }
+    std::unique_ptr<Coprocess> cp(new Coprocess());
+    if (!Spawn(exec, *cp)) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      modules_[exec].failed = true;
       ctx.ret = -1;
-      ctx.err_msg = "popen addr2line failed";
+      ctx.err_msg = "spawn addr2line failed";
+      return nullptr;
+    }
+    return cp;
+  }
+
+  static bool Spawn(const std::string& exec, Coprocess& cp) {
+    int in[2], out[2];
+    if (pipe2(in, O_CLOEXEC) != 0) {
+      return false;
+    }
+    if (pipe2(out, O_CLOEXEC) != 0) {
+      close(in[0]);
+      close(in[1]);
+      return false;
+    }
+    // posix_spawn does not copy page tables of a large process like fork
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, in[0], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, out[1], STDOUT_FILENO);
+    const char* argv[] = {"addr2line", "-e", exec.c_str(), "-f",
+                          "-i",        "-p", nullptr};
+    int ret = posix_spawnp(&cp.pid, "addr2line", &actions, nullptr,
+                           const_cast<char**>(argv), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(in[0]);
+    close(out[1]);
+    if (ret != 0) {
+      cp.pid = -1;
+      close(in[1]);
+      close(out[0]);
+      return false;
+    }
+    cp.in = in[1];
+    cp.out = out[0];
+    cp.buffer.clear();
+    return true;
+  }
+
+  static void Stop(Coprocess& cp) {
+    if (cp.pid < 0) {
       return;
     }
-    char buffer[4096];
-    std::string result = "";
-    while (fgets(buffer, sizeof(buffer), pipe) != nullptr) {
-      result += buffer;
+    close(cp.in);
+    close(cp.out);
+    kill(cp.pid, SIGKILL);
+    waitpid(cp.pid, nullptr, 0);
+    cp.pid = -1;
+    cp.in = cp.out = -1;
+    cp.buffer.clear();
+  }
+
+  // write all, SIGPIPE of an exited coprocess is blocked and consumed
+  static bool Write(Coprocess& cp, const std::string& data) {
+    sigset_t pipe_set, old_set;
+    sigemptyset(&pipe_set);
+    sigaddset(&pipe_set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_set, &old_set);
+    size_t pos = 0;
+    while (pos < data.size()) {
+      ssize_t n = write(cp.in, data.data() + pos, data.size() - pos);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        break;
+      }
+      pos += n;
     }
-    int status = pclose(pipe);
-    ctx.ret = WEXITSTATUS(status);
-    if (ctx.ret) {
-      ctx.err_msg = "addr2line failed";
-      result.clear();
+    if (pos < data.size()) {
+      struct timespec zero = {0, 0};
+      sigtimedwait(&pipe_set, nullptr, &zero);
     }
-    // fprintf(stderr, " >> out: \"%s\"\n", result.c_str());
-    ParseBatch(ctx, result);
+    pthread_sigmask(SIG_SETMASK, &old_set, nullptr);
+    return pos == data.size();
   }
 
- private:
-  const bool is_addr2line_available_;
+  // read a line without '\n', return false on EOF or timeout
+  static bool ReadLine(Coprocess& cp, std::string& line) {
+    size_t pos;
+    while ((pos = cp.buffer.find('\n')) == std::string::npos) {
+      struct pollfd pfd = {cp.out, POLLIN, 0};
+      int ret = poll(&pfd, 1, kTimeoutMs);
+      if (ret < 0 && errno == EINTR) {
+        continue;
+      }
+      if (ret <= 0) {
+        return false;
+      }
+      char buf[4096];
+      ssize_t n = read(cp.out, buf, sizeof(buf));
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        return false;
+      }
+      cp.buffer.append(buf, n);
+    }
+    line.assign(cp.buffer, 0, pos);
+    cp.buffer.erase(0, pos + 1);
+    return true;
+  }
 
-  Addr2lineTool() : is_addr2line_available_(FindAddr2line()) {}
+  // read output of a batch of frames and its sentinel
+  bool ReadBatch(Coprocess& cp, Frame** frames, size_t num_frames) {
+    static const Slice kInlinedBy(" (inlined by) ", 14);
+    std::string buffer;
+    int frame_id = -1;
+    while (ReadLine(cp, buffer)) {
+      Slice line(buffer);
+      if (line.empty()) {
+        continue;
+      }
+      if (!line.starts_with(kInlinedBy) &&
+          frame_id + 1 == static_cast<int>(num_frames)) {
+        return line.starts_with(Slice("??", 2));  // sentinel
+      }
+      if (frame_id < 0 && line.starts_with(kInlinedBy)) {
+        return false;  // out of sync
+      }
+      ParseLine(frames, frame_id, line);
+    }
+    return false;
+  }
 
   // find addr2line using which or whereis
   static bool FindAddr2line() {
@@ -245,7 +672,7 @@ class Addr2lineTool {
     int status = pclose(pipe);
     int code = WEXITSTATUS(status);
     bool ok = code == 0 && !result.empty();
-    if (result[result.size() - 1] != '\n') {
+    if (result.empty() || result.back() != '\n') {
       result += '\n';
     }
     if (!ok) {
@@ -257,26 +684,6 @@ class Addr2lineTool {
     return ok;
   }
 
-  void ParseBatch(Context& ctx, const std::string& result) {
-    if (result.empty()) {
-      return;
-    }
-    Slice data(result);
-    int frame_id = -1;
-    while (frame_id < static_cast<int>(ctx.frames.size()) && !data.empty()) {
-      // find line and shift data
-      Slice line = data.substr(0, data.find('\n'));
-      if (line.empty()) {
-        assert(false);
-        break;
-      }
-      data.pop_front(line.size() + 1);
-      // printf("ParseLine \"%s\", remains %lu\n", line.to_string().c_str(),
-      //        data.size());
-      ParseLine(ctx, frame_id, line);
-    }
-  }
-
   /**
    * always with `-p`, three possible formats:
    * 1. ` `: no func, no inline
@@ -290,7 +697,7 @@ class Addr2lineTool {
    *   - "FUNC at FILE:LINE\n" (1 line)
    *   - "FUNC at FILE:LINE\n (inlined by) FUNC at FILE:LINE\n..." (1+n lines)
    */
-  void ParseLine(Context& ctx, int& frame_id, Slice& line) {
+  void ParseLine(Frame** frames, int& frame_id, Slice& line) {
     static const Slice kInlinedBy(" (inlined by) ", 14);
     static const Slice kAt(" at ", 4);
 
@@ -302,7 +709,7 @@ class Addr2lineTool {
       frame_id++;  // a new frame
     }
     assert(frame_id >= 0);  // starts from -1
-    Frame* frame = ctx.frames[frame_id];
+    Frame* frame = frames[frame_id];
 
     // (optional) parse "FUNC at "
     Slice func;
@@ -370,133 +777,245 @@ class Addr2lineTool {
   }
 };
 
-/**
- * find "__libc_start_main" in
- * "/lib/x86_64-linux-gnu/libc.so.6(__libc_start_main+0xeb) [0x7f059d5a809b]"
- * `start` points to next char of '(', `end` points to '+'
- */
-bool find_func_in_symbol(const char* symbol, size_t& start, size_t& end) {
-  if (!symbol) {
-    return false;
-  }
-  start = 0;
-  while (symbol[start] && symbol[start] != '(') {
-    start++;
+const char* Addr2lineTool::kSentinel = "0x0\n";
+const size_t Addr2lineTool::kBatchSize;
+const size_t Addr2lineTool::kMaxPendingBatches;
+const int Addr2lineTool::kTimeoutMs;
+const size_t Addr2lineTool::kMinChunkFrames;
+
+#include "zlib.ipp"
+#include "elf_symbolizer.ipp"
+
+void SetSymbolizer(Symbolizer symbolizer) {
+  g_symbolizer.store(symbolizer, std::memory_order_relaxed);
+}
+
+void SetSymbolizeThreads(size_t num_threads) {
+  g_symbolize_threads.store(num_threads, std::memory_order_relaxed);
+}
+
+#include "symbol_cache.ipp"
+
+bool SetSymbolCacheDir(const std::string& dir) {
+  return SymbolCache::GetInstance()->SetDir(dir);
+}
+
+// fill source of frames by symbol cache and symbolizers, frames are taken
+// by value as resolved ones are removed
+static void symbolize(std::vector<Frame*> frames) {
+  SymbolCache* symbol_cache = SymbolCache::GetInstance();
+  bool use_symbol_cache = symbol_cache->enabled();
+  if (use_symbol_cache) {
+    symbol_cache->Lookup(frames);  // seen by earlier processes
   }
-  if (!symbol[start]) {
-    return false;
+  std::vector<Frame*> symbolized(frames);
+  if (g_symbolizer.load(std::memory_order_relaxed) == kSymbolizeElf &&
+      !frames.empty()) {
+    ElfSymbolizer::GetInstance()->Resolve(frames);
   }
-  end = ++start;  // '(' found, move to next char
-  while (symbol[end] && symbol[end] != '+') {
-    end++;
+  if (!frames.empty()) {
+    Addr2lineTool::GetInstance()->Resolve(frames);
   }
-  if (!symbol[end]) {
-    return false;
+  if (use_symbol_cache) {
+    symbol_cache->Store(symbolized);
   }
-  return end > start;  // substr not empty
 }
 
-// resolve address to frame information
-Frame resolve_symbol(void* address, char* symbol) {
-  Frame frame;
-  frame.addr = address;
-  frame.faddr = nullptr;
+#include "module_map.ipp"
+#include "raw_dump.ipp"
+#include "presymbolizer.ipp"
 
-  size_t start = std::string::npos;
-  size_t end = std::string::npos;
-  bool found = find_func_in_symbol(symbol, start, end);
-  if (found) {
-    // found function name in symbols
-    assert(start != std::string::npos);
-    frame.exec.assign(symbol, start - 1);
-    frame.symbol = symbol;
-    symbol[end] = '\0';  // null-terminate the substr
-    demangle_symbol(frame.func, symbol + start);
-  } else if (symbol) {
-    // no function name in symbol, however, it could be "prog(+0xabcd)"
-    if (start > 1) {
-      frame.exec.assign(symbol, start - 1);
-    } else {
-      frame.exec = "??";
-    }
-    frame.symbol = symbol;
-    frame.func = kFuncUnknown;
-  } else {
-    frame.exec = "??";
-    frame.symbol = "(nil)";
-    frame.func = kFuncUnknown;
-  }
+bool StartPresymbolizer(double cpu_budget) {
+  return Presymbolizer::GetInstance()->Start(cpu_budget);
+}
 
-  // remove ending " [0x7f64639e009b]"
-  size_t addr_start = frame.symbol.find(") [0x");
-  if (addr_start != std::string::npos) {
-    frame.symbol.erase(addr_start + 1);
-  }
+void StopPresymbolizer() { Presymbolizer::GetInstance()->Stop(); }
 
-  // get binary and its base address using dladdr()
-  Dl_info dl_info;
-  auto ret = dladdr(address, &dl_info);
-  if (ret) {
-    if (start > 1) {
-      // check exec name
-      assert(strncmp(dl_info.dli_fname, symbol, start - 1) == 0);
-    }
-    // printf("dladdr: %s@%p, %s@%p(+0x%lx)\n", dl_info.dli_fname,
-    //        dl_info.dli_fbase, dl_info.dli_sname, dl_info.dli_saddr,
-    //        (char*)dl_info.dli_saddr - (char*)dl_info.dli_fbase);
-    frame.faddr = dl_info.dli_fbase;
+bool SymbolizeRawDump(const std::string& path,
+                      std::vector<StackFrames>& result,
+                      const std::string& debug_dir) {
+  result.clear();
+  FILE* fp = fopen(path.c_str(), "rbe");
+  if (fp == nullptr) {
+    return false;
+  }
+  bool ok = read_raw_dump(fp, result, debug_dir);
+  fclose(fp);
+  if (!ok) {
+    result.clear();
   }
+  return ok;
+}
 
-  // later get source code using addr2line
+// frame of address with exec and its base address from the module map, and
+// symbol "exec(+0xoffset)", func and source are left to symbolizers
+Frame resolve_module(const void* address, const ModuleMap& modules) {
+  Frame frame;
+  frame.addr = address;
+  frame.faddr = nullptr;
+  frame.exec = "??";
+  frame.symbol = "??";
+  frame.func = kFuncUnknown;
   frame.file = "??";
   frame.line = -1;
-
-  // printf("[resolve] \"%s\" -> %s at %s:%d @ %p \n", frame.symbol.c_str(),
-  //        frame.func_name.c_str(), frame.file_name.c_str(), frame.line,
-  //        frame.addr);
+  int m = modules.Find(address);
+  if (m >= 0) {
+    const ModuleMap::Module& module = modules.module(m);
+    char offset[32];
+    snprintf(offset, sizeof(offset), "(+0x%lx)",
+             Slice::offset(address, module.base));
+    frame.exec = module.path;
+    frame.faddr = reinterpret_cast<const void*>(module.base);
+    frame.symbol = module.path + offset;
+  }
   return frame;
 }
 
-void Tracker::Record(int64_t score) {
+#define KEEP_FRAME_POINTER __attribute__((optimize("no-omit-frame-pointer")))
+
+void KEEP_FRAME_POINTER Tracker::Record(int64_t score) {
+  StackStat weight;
+  if (!Sample(score, weight)) {
+    return;
+  }
   void* addrs[kMaxStackFrames];
-  // @ref https://linux.die.net/man/3/backtrace
-  int num_frames = backtrace(addrs, kMaxStackFrames);
+  int num_frames = unwind(addrs, kMaxStackFrames);
   if (num_frames <= kSkipFrames) {
     assert(false);
     return;
   }
-  Stack stack_frames(addrs + kSkipFrames, num_frames - kSkipFrames);
+  AddRecord(LocalShard(), addrs + kSkipFrames, num_frames - kSkipFrames,
+            weight);
+}
+
+void Tracker::RecordStack(const FramePointers& stack, int64_t score) {
+  StackStat weight;
+  if (!Sample(score, weight)) {
+    return;
+  }
+  AddRecord(LocalShard(), stack.data(), stack.size(), weight);
+}
+
+void Tracker::RecordWeighted(const void* const* addrs, size_t size,
+                             const StackStat& weight) {
+  AddRecord(LocalShard(), addrs, size, weight);
+}
+
+void Tracker::AddRecord(Shard* shard, const void* const* addrs, size_t size,
+                        const StackStat& weight) {
+  // growth of records allocates under shard lock, which a sampled allocation
+  // recorded into the same shard would take again
+  ScopedHeapHookGuard guard;
+  // hash outside the lock
+  uint64_t hash = hash_stack(addrs, size);
+  bool new_addrs;
   {
-    std::lock_guard<std::mutex> lock(mutex_);
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    uint32_t num_nodes = shard->records.size();
     // find or create
-    auto it = all_records_.find(stack_frames);
-    if (it == all_records_.end()) {
-      all_records_.emplace(stack_frames, StackStat{1, score});
-    } else {
-      it->second.count++;
-      it->second.score += score;
+    StackStat& stat = shard->records.Find(addrs, size, hash);
+    stat.count += weight.count;
+    stat.score += weight.score;
+    new_addrs = shard->records.size() != num_nodes;
+  }
+  // a new address may be in a module loaded since the last snapshot, which
+  // is kept in the map only if seen before it is unloaded
+  if (new_addrs) {
+    ModuleMap::Refresh();
+  }
+}
+
+bool Tracker::Sample(int64_t score, StackStat& weight) {
+  uint32_t epoch = sampling_epoch_.load(std::memory_order_acquire);
+  int mode = sampling_mode_.load(std::memory_order_relaxed);
+  if (mode == kSampleAll) {
+    weight.count = 1;
+    weight.score = score;
+    return true;
+  }
+  static thread_local Sampler samplers[256];
+  Sampler& s = samplers[id_];
+  int64_t param = sampling_param_.load(std::memory_order_relaxed);
+  if (s.epoch != epoch) {
+    // config changed or first call of this thread
+    s.epoch = epoch;
+    s.countdown = mode == kSampleEveryN ? param : next_poisson_interval(param);
+  }
+  return sample(s, mode, param, score, weight);
+}
+
+void Tracker::SetSampling(Sampling mode, int64_t param) {
+  sampling_param_.store(std::max<int64_t>(param, 1), std::memory_order_relaxed);
+  sampling_mode_.store(mode, std::memory_order_relaxed);
+  sampling_epoch_.fetch_add(1, std::memory_order_release);
+}
+
+void Tracker::SetMaxStacks(size_t max_stacks) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  max_stacks_.store(max_stacks, std::memory_order_relaxed);
+  for (auto& shard : shards_) {
+    std::lock_guard<std::mutex> shard_lock(shard->mutex);
+    shard->records.set_max_stacks(max_stacks);
+  }
+}
+
+thread_local bool Tracker::shards_destroyed_
+    __attribute__((tls_model("initial-exec"))) = false;
+
+Tracker::Shard* Tracker::LocalShard() {
+  ScopedHeapHookGuard guard;  // not to profile tracker itself
+  if (shards_destroyed_) {
+    return ExitedShard();
+  }
+  static thread_local ThreadShards local;
+  Shard*& shard = local.shards[id_];
+  if (shard == nullptr) {
+    shard = AcquireShard();
+  }
+  return shard;
+}
+
+Tracker::Shard* Tracker::AcquireShard() {
+  ScopedHeapHookGuard guard;  // not to profile tracker itself
+  std::lock_guard<std::mutex> lock(mutex_);
+  // records of exited threads are kept, new thread just continues on them
+  for (auto& shard : shards_) {
+    if (!shard->in_use) {
+      shard->in_use = true;
+      return shard.get();
     }
   }
+  shards_.emplace_back(new Shard());
+  shards_.back()->in_use = true;
+  shards_.back()->records.set_max_stacks(
+      max_stacks_.load(std::memory_order_relaxed));
+  return shards_.back().get();
 }
 
-void Tracker::RecordStack(const FramePointers& stack, int64_t score) {
+Tracker::Shard* Tracker::ExitedShard() {
+  std::call_once(exited_once_, [this] { exited_shard_ = AcquireShard(); });
+  return exited_shard_;
+}
+
+void Tracker::ReleaseShard(Shard* shard) {
   std::lock_guard<std::mutex> lock(mutex_);
-  // find or create
-  Stack stack_frames(stack);
-  auto it = all_records_.find(stack_frames);
-  if (it == all_records_.end()) {
-    all_records_.emplace(stack_frames, StackStat{1, score});
-  } else {
-    it->second.count++;
-    it->second.score += score;
+  shard->in_use = false;
+}
+
+Tracker::ThreadShards::~ThreadShards() {
+  shards_destroyed_ = true;
+  for (int i = 0; i < 256; i++) {
+    if (shards[i] != nullptr) {
+      GetInstance(static_cast<uint8_t>(i)).ReleaseShard(shards[i]);
+      shards[i] = nullptr;
+    }
   }
 }
 
-bool Tracker::GetBacktrace(FramePointers& stack) {
+bool KEEP_FRAME_POINTER Tracker::GetBacktrace(FramePointers& stack) {
   void* addrs[kMaxStackFrames];
   stack.clear();
-  // @ref https://linux.die.net/man/3/backtrace
-  int num_frames = backtrace(addrs, kMaxStackFrames);
+  int num_frames = unwind(addrs, kMaxStackFrames);
   if (num_frames <= kSkipFrames) {
     return false;
   }
@@ -504,78 +1023,224 @@ bool Tracker::GetBacktrace(FramePointers& stack) {
   return true;
 }
 
-void Tracker::Dump(std::vector<StackFrames>& result) {
-  std::lock_guard<std::mutex> lock(mutex_);
+void Tracker::Dump(std::vector<StackFrames>& result, bool since_last_dump,
+                   bool reset) {
+  ScopedHeapHookGuard guard;  // not to profile dump itself
+  std::lock_guard<std::mutex> lock(dump_mutex_);
   result.clear();
 
-  // sort Stack* by count, tuple[count, Stack*, score]
-  using Tuple = std::tuple<uint64_t, const Stack*, int64_t>;
-  std::vector<Tuple> sort_idx;
-  sort_idx.reserve(all_records_.size());
-  for (const auto& it : all_records_) {
-    sort_idx.emplace_back(it.second.count, &it.first, it.second.score);
-  }
-  std::sort(sort_idx.begin(), sort_idx.end(),
-            [](const Tuple& a, const Tuple& b) {
-              const uint64_t& ca = std::get<0>(a);
-              const uint64_t& cb = std::get<0>(b);
-              return (ca == cb) ? (std::get<1>(a) < std::get<1>(b)) : (ca > cb);
-            });
+  StackTable all_records;
+  std::vector<uint32_t> sort_idx;
+  CollectStacks(all_records, since_last_dump, reset, sort_idx);
+  std::vector<Frame*> frames;
+  ResolveNodes(all_records, frames);
 
-  // convert Stack* to StackFrames
+  // convert nodes to StackFrames, innermost frame first
   result.resize(sort_idx.size());
   for (size_t i = 0; i < sort_idx.size(); i++) {
-    result[i].count = std::get<0>(sort_idx[i]);
-    const auto* sf = std::get<1>(sort_idx[i]);
-    result[i].score = std::get<2>(sort_idx[i]);
-    Resolve(sf->addrs, result[i].frames);
+    uint32_t node = sort_idx[i];
+    result[i].count = all_records.stat(node).count;
+    result[i].score = all_records.stat(node).score;
+    StackStat error = all_records.error(node);
+    result[i].count_error = error.count;
+    result[i].score_error = error.score;
+    for (; node != StackTable::kRoot; node = all_records.parent(node)) {
+      result[i].frames.emplace_back(frames[node]);
+    }
   }
 }
 
-void Tracker::Resolve(const FramePointers& addr, std::vector<Frame*>& frames) {
-  std::vector<size_t> not_found;
-  not_found.reserve(addr.size());
+bool Tracker::DumpRaw(const std::string& path, bool since_last_dump) {
+  ScopedHeapHookGuard guard;  // not to profile dump itself
+  std::lock_guard<std::mutex> lock(dump_mutex_);
+  StackTable all_records;
+  std::vector<uint32_t> sort_idx;
+  CollectStacks(all_records, since_last_dump, false, sort_idx);
+  return write_raw_dump(path, all_records, sort_idx);
+}
 
+void Tracker::CollectStacks(StackTable& all_records, bool since_last_dump,
+                            bool reset, std::vector<uint32_t>& sort_idx) {
+  MergeShards(all_records, reset);
+  if (reset) {
+    // next dump starts from an empty table
+    last_dump_ = StackNodes();
+  } else if (since_last_dump) {
+    StackNodes records = all_records.nodes();
+    all_records.Merge(last_dump_, true);
+    last_dump_ = std::move(records);
+  } else {
+    last_dump_ = all_records.nodes();
+  }
+
+  // sort recorded stacks by count, tie by node id, a delta or a debited
+  // count may wrap below 0
+  sort_idx.clear();
+  for (uint32_t i = StackTable::kRoot + 1; i < all_records.size(); i++) {
+    if (static_cast<int64_t>(all_records.stat(i).count) > 0) {
+      sort_idx.emplace_back(i);
+    }
+  }
+  std::sort(sort_idx.begin(), sort_idx.end(), [&](uint32_t a, uint32_t b) {
+    const uint64_t& ca = all_records.stat(a).count;
+    const uint64_t& cb = all_records.stat(b).count;
+    return (ca == cb) ? (a < b) : (ca > cb);
+  });
+  // merged shards may hold more stacks than asked, keep the heavy hitters
+  size_t max_stacks = max_stacks_.load(std::memory_order_relaxed);
+  if (max_stacks > 0 && sort_idx.size() > max_stacks) {
+    sort_idx.resize(max_stacks);
+  }
+}
+
+void Tracker::DumpCallTree(std::vector<CallNode>& result) {
+  ScopedHeapHookGuard guard;  // not to profile dump itself
+  std::lock_guard<std::mutex> lock(dump_mutex_);
+  result.clear();
+
+  StackTable all_records;
+  MergeShards(all_records, false);
+  std::vector<Frame*> frames;
+  ResolveNodes(all_records, frames);
+
+  result.resize(all_records.size());
+  for (uint32_t i = 0; i < all_records.size(); i++) {
+    const auto& stat = all_records.stat(i);
+    int64_t parent = all_records.parent(i);
+    result[i] = CallNode{frames[i],
+                         i == StackTable::kRoot ? -1 : parent,
+                         stat.count,
+                         stat.score,
+                         stat.count,
+                         stat.score};
+  }
+  // children are always after parent, so inclusive totals in one pass
+  for (size_t i = result.size() - 1; i > StackTable::kRoot; i--) {
+    auto& parent = result[result[i].parent];
+    parent.total_count += result[i].total_count;
+    parent.total_score += result[i].total_score;
+  }
+}
+
+void Tracker::MergeShards(StackTable& records, bool reset) {
+  // shards are never freed, so a copy of the list is safe to iterate
+  std::vector<Shard*> shards;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& shard : shards_) {
+      shards.emplace_back(shard.get());
+    }
+  }
+
+  if (reset) {
+    // rotate, shard lock is held only to swap with an empty table, and the
+    // cleared table is swapped into next shard
+    StackTable rotated;
+    for (Shard* shard : shards) {
+      {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        rotated.set_max_stacks(shard->records.max_stacks());
+        std::swap(shard->records, rotated);
+        shard->num_collected = 0;
+      }
+      records.Merge(rotated.nodes());
+      rotated.clear();
+    }
+    return;
+  }
+
+  // shard lock is held only to copy its nodes, merge and resolve are done
+  // without blocking Record()
+  StackNodes snapshot;
+  for (Shard* shard : shards) {
+    {
+      std::lock_guard<std::mutex> lock(shard->mutex);
+      snapshot = shard->records.nodes();  // reuse capacity of last copy
+    }
+    records.Merge(snapshot);
+  }
+}
+
+void Tracker::CollectNewAddrs(FramePointers& addrs) {
+  std::vector<Shard*> shards;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& shard : shards_) {
+      shards.emplace_back(shard.get());
+    }
+  }
+  for (Shard* shard : shards) {
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    const StackTable& records = shard->records;
+    // a compacted table is renumbered, collect it again
+    uint32_t begin = shard->num_collected <= records.size()
+                         ? shard->num_collected
+                         : StackTable::kRoot;
+    for (uint32_t i = std::max(begin, StackTable::kRoot + 1);
+         i < records.size(); i++) {
+      addrs.emplace_back(records.addr(i));
+    }
+    shard->num_collected = records.size();
+  }
+}
+
+void Tracker::ResolveNodes(const StackTable& records,
+                           std::vector<Frame*>& frames) {
+  // resolve all nodes at once, root has no frame
+  FramePointers addrs(records.size() - 1);
+  for (uint32_t i = StackTable::kRoot + 1; i < records.size(); i++) {
+    addrs[i - 1] = records.addr(i);
+  }
+  Resolve(addrs, frames);
+  frames.insert(frames.begin(), nullptr);
+}
+
+void Tracker::Resolve(const FramePointers& addr, std::vector<Frame*>& frames) {
+  FrameCache* cache = FrameCache::GetInstance();
   frames.clear();
   frames.resize(addr.size());
 
-  // find if in all_frames_
+  // lock-free lookup in cache, each missed addr is resolved once
+  std::vector<size_t> not_found;
+  std::unordered_map<const void*, size_t> lookup_index;
+  std::vector<const void*> addr_lookup;
   for (size_t i = 0; i < addr.size(); i++) {
-    auto it = all_frames_.find(addr[i]);
-    if (it == all_frames_.end()) {
-      frames[i] = nullptr;
+    frames[i] = cache->Find(addr[i]);
+    if (frames[i] == nullptr) {
       not_found.emplace_back(i);
-    } else {
-      frames[i] = &it->second;
+      if (lookup_index.emplace(addr[i], addr_lookup.size()).second) {
+        addr_lookup.emplace_back(addr[i]);
+      }
     }
   }
 
   // batch lookup for not found
-  if (!not_found.empty()) {
-    const size_t num_lookup = not_found.size();
-    void* addr_lookup[num_lookup];
+  if (!addr_lookup.empty()) {
+    // modules by the module map, not backtrace_symbols() which takes a
+    // dladdr() per frame
+    const size_t num_lookup = addr_lookup.size();
+    std::shared_ptr<const ModuleMap> modules = ModuleMap::Snapshot();
+    std::vector<Frame> resolved;
+    resolved.reserve(num_lookup);
     for (size_t i = 0; i < num_lookup; i++) {
-      addr_lookup[i] = (void*)addr[not_found[i]];
-    }
-    // @ref https://linux.die.net/man/3/backtrace_symbols
-    // current address to symbol, internal malloc-ed
-    char** symbols = backtrace_symbols(addr_lookup, num_lookup);
-    if (symbols) {
-      std::vector<Frame*> to_call_addr2line;
-      to_call_addr2line.reserve(num_lookup);
-      for (size_t i = 0; i < num_lookup; i++) {
-        void* a = addr_lookup[i];
-        auto r = all_frames_.emplace(a, resolve_symbol(a, symbols[i]));
-        Frame* f = &(r.first->second);
-        frames[not_found[i]] = f;
-        to_call_addr2line.emplace_back(f);
-      }
-      free(symbols);
+      resolved.emplace_back(resolve_module(addr_lookup[i], *modules));
+    }
 
-      // call addr2line
-      Addr2lineTool::GetInstance()->Resolve(to_call_addr2line);
-    } else {
-      fprintf(stderr, "backtrace_symbols() call failed\n");
+    // resolve in process, modules failed to load are left to addr2line
+    std::vector<Frame*> to_resolve(num_lookup);
+    for (size_t i = 0; i < num_lookup; i++) {
+      to_resolve[i] = &resolved[i];
+    }
+    symbolize(to_resolve);
+
+    // publish resolved frames, a frame resolved by another channel at the
+    // same time wins
+    std::vector<Frame*> cached(num_lookup);
+    for (size_t i = 0; i < num_lookup; i++) {
+      cached[i] = cache->Insert(std::move(resolved[i]));
+    }
+    for (size_t i : not_found) {
+      frames[i] = cached[lookup_index[addr[i]]];
     }
   }
 
@@ -586,5 +1251,10 @@ void Tracker::Resolve(const FramePointers& addr, std::vector<Frame*>& frames) {
 }
 
 #include "output.ipp"
+#include "pprof.ipp"
+#include "flamegraph.ipp"
+#include "binary_dump.ipp"
 
 }  // namespace bttrack
+
+#include "malloc_hook.ipp"
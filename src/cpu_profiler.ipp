@@ -0,0 +1,166 @@
+#include "ipp_inc.h"
+
+/**
+ * SIGPROF driven sampling CPU profiler
+ * - setitimer(ITIMER_PROF) delivers SIGPROF to the thread consuming CPU
+ * - signal handler unwinds the interrupted stack into a preallocated ring,
+ *   without locks or allocation
+ * - a drain thread moves samples from the ring into the channel, score of each
+ *   sample is the sampling period in microseconds
+ */
+class CpuProfiler {
+ public:
+  // max stack frames of a sample
+  static const int kMaxSampleFrames = 128;
+  // number of samples in ring
+  static const int kNumSlots = 1024;
+  // interval to drain ring into channel
+  static const int kDrainIntervalMs = 50;
+
+  static CpuProfiler* GetInstance() {
+    static CpuProfiler instance;
+    return &instance;  // singleton
+  }
+
+  bool Start(uint8_t id, int hz) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (running_ || hz <= 0 || hz > 1000000) {
+      return false;
+    }
+    if (!slots_) {
+      slots_.reset(new Slot[kNumSlots]);
+    }
+    if (!handler_installed_) {
+      // never uninstalled, default action of SIGPROF terminates process
+      struct sigaction sa;
+      memset(&sa, 0, sizeof(sa));
+      sa.sa_sigaction = &CpuProfiler::SignalHandler;
+      sa.sa_flags = SA_SIGINFO | SA_RESTART;
+      sigemptyset(&sa.sa_mask);
+      if (sigaction(SIGPROF, &sa, nullptr) != 0) {
+        return false;
+      }
+      handler_installed_ = true;
+    }
+    init_stack_range();  // unwind samples of the starting thread
+    id_ = id;
+    period_us_ = 1000000 / hz;
+    dropped_.store(0, std::memory_order_relaxed);
+    running_ = true;
+    active_.store(this, std::memory_order_release);
+    drain_thread_ = std::thread(&CpuProfiler::DrainLoop, this);
+
+    struct itimerval timer;
+    timer.it_interval.tv_sec = period_us_ / 1000000;
+    timer.it_interval.tv_usec = period_us_ % 1000000;
+    timer.it_value = timer.it_interval;
+    if (setitimer(ITIMER_PROF, &timer, nullptr) != 0) {
+      StopLocked();
+      return false;
+    }
+    return true;
+  }
+
+  void Stop() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (running_) {
+      StopLocked();
+    }
+  }
+
+ private:
+  enum SlotState : uint32_t { kEmpty = 0, kWriting = 1, kFull = 2 };
+
+  struct Slot {
+    std::atomic<uint32_t> state{kEmpty};
+    int depth = 0;
+    void* addrs[kMaxSampleFrames];
+  };
+
+  // set while running, read by signal handler
+  static std::atomic<CpuProfiler*> active_;
+
+  std::mutex mutex_;  // guard Start() and Stop()
+  bool handler_installed_ = false;
+  bool running_ = false;
+  uint8_t id_ = 0;
+  int64_t period_us_ = 0;
+  std::unique_ptr<Slot[]> slots_;
+  std::atomic<uint64_t> write_pos_{0};
+  std::atomic<uint64_t> dropped_{0};  // samples dropped as ring is full
+  std::thread drain_thread_;
+  std::mutex drain_mutex_;
+  std::condition_variable drain_cv_;
+  bool stop_drain_ = false;
+
+  CpuProfiler() = default;
+
+  void StopLocked() {
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, nullptr);
+    active_.store(nullptr, std::memory_order_release);
+    {
+      std::lock_guard<std::mutex> lock(drain_mutex_);
+      stop_drain_ = true;
+    }
+    drain_cv_.notify_all();
+    drain_thread_.join();
+    stop_drain_ = false;
+    running_ = false;
+    Drain();  // samples written after the last round
+    uint64_t dropped = dropped_.load(std::memory_order_relaxed);
+    if (dropped > 0) {
+      fprintf(stderr, "CpuProfiler: %lu samples dropped\n", dropped);
+    }
+  }
+
+  // async-signal-safe, claim a slot of ring or drop the sample
+  static void SignalHandler(int, siginfo_t*, void* context) {
+    CpuProfiler* self = active_.load(std::memory_order_acquire);
+    if (self == nullptr) {
+      return;  // stopped, ignore pending signal
+    }
+    int saved_errno = errno;
+    uint64_t pos = self->write_pos_.fetch_add(1, std::memory_order_relaxed);
+    Slot& slot = self->slots_[pos % kNumSlots];
+    uint32_t expected = kEmpty;
+    if (slot.state.compare_exchange_strong(expected, kWriting,
+                                           std::memory_order_acquire)) {
+      slot.depth = unwind_context(context, slot.addrs, kMaxSampleFrames);
+      slot.state.store(kFull, std::memory_order_release);
+    } else {
+      self->dropped_.fetch_add(1, std::memory_order_relaxed);
+    }
+    errno = saved_errno;
+  }
+
+  void DrainLoop() {
+    std::unique_lock<std::mutex> lock(drain_mutex_);
+    while (!stop_drain_) {
+      drain_cv_.wait_for(lock, std::chrono::milliseconds(kDrainIntervalMs));
+      Drain();
+    }
+  }
+
+  // move all full slots into channel, samples are already taken by timer so
+  // not sampled again by SetSampling() of the channel
+  void Drain() {
+    FramePointers stack;
+    const StackStat weight{1, period_us_};
+    for (int i = 0; i < kNumSlots; i++) {
+      Slot& slot = slots_[i];
+      if (slot.state.load(std::memory_order_acquire) != kFull) {
+        continue;
+      }
+      stack.assign(slot.addrs, slot.addrs + slot.depth);
+      slot.state.store(kEmpty, std::memory_order_release);
+      if (!stack.empty()) {
+        bttrack::GetInstance(id_).RecordWeighted(stack.data(), stack.size(),
+                                                 weight);
+      }
+    }
+  }
+};
+
+std::atomic<CpuProfiler*> CpuProfiler::active_{nullptr};
\ No newline at end of file
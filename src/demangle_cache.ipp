@@ -0,0 +1,123 @@
+#include "ipp_inc.h"
+
+/**
+ * demangled names by mangled name, shared by all symbolizer threads
+ * - templated code repeats the same names in thousands of frames and inlined
+ *   frames, and each __cxa_demangle() call allocates its result
+ * - strings are copied into per-shard arenas of large blocks, so a lookup or
+ *   insertion does not allocate per string, shards are picked by hash
+ * - never evicted, bounded by function names of loaded modules
+ */
+class DemangleCache {
+ public:
+  static const size_t kNumShards = 16;
+  static const size_t kBlockSize = 64 << 10;
+
+  static DemangleCache* GetInstance() {
+    static DemangleCache instance;
+    return &instance;  // singleton
+  }
+
+  // set func and demangled if symbol is cached
+  bool Find(const char* symbol, size_t size, std::string& func,
+            bool& demangled) {
+    Key key{Slice(symbol, size), hash_bytes(symbol, size)};
+    Shard& shard = shards_[key.hash % kNumShards];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.names.find(key);
+    if (it == shard.names.end()) {
+      return false;
+    }
+    func.assign(it->second.name.data(), it->second.name.size());
+    demangled = it->second.demangled;
+    return true;
+  }
+
+  void Insert(const char* symbol, size_t size, const std::string& func,
+              bool demangled) {
+    Key key{Slice(symbol, size), hash_bytes(symbol, size)};
+    Shard& shard = shards_[key.hash % kNumShards];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (shard.names.count(key) > 0) {
+      return;
+    }
+    key.symbol = shard.Copy(symbol, size);
+    Slice name =
+        demangled ? shard.Copy(func.data(), func.size()) : key.symbol;
+    shard.names.emplace(key, Entry{name, demangled});
+  }
+
+ private:
+  struct Entry {
+    Slice name;
+    bool demangled;
+  };
+
+  // mangled name with its hash, which picks the shard and the bucket
+  struct Key {
+    Slice symbol;
+    uint64_t hash;
+  };
+
+  struct KeyHash {
+    size_t operator()(const Key& key) const { return key.hash; }
+  };
+
+  struct KeyEqual {
+    bool operator()(const Key& a, const Key& b) const {
+      return a.hash == b.hash && a.symbol.size() == b.symbol.size() &&
+             memcmp(a.symbol.data(), b.symbol.data(), a.symbol.size()) == 0;
+    }
+  };
+
+  struct Shard {
+    std::mutex mutex;
+    std::unordered_map<Key, Entry, KeyHash, KeyEqual> names;
+    std::vector<std::unique_ptr<char[]>> blocks;
+    size_t block_used = kBlockSize;  // of blocks.back()
+    std::vector<std::unique_ptr<char[]>> large;  // larger than kBlockSize / 4
+
+    // copy into arena
+    Slice Copy(const char* s, size_t size) {
+      char* dst;
+      if (size > kBlockSize / 4) {
+        large.emplace_back(new char[size]);
+        dst = large.back().get();
+      } else {
+        if (block_used + size > kBlockSize) {
+          blocks.emplace_back(new char[kBlockSize]);
+          block_used = 0;
+        }
+        dst = blocks.back().get() + block_used;
+        block_used += size;
+      }
+      memcpy(dst, s, size);
+      return Slice(dst, size);
+    }
+  };
+
+  Shard shards_[kNumShards];
+
+  DemangleCache() = default;
+
+  // 64-bit hash, 8 bytes per step like hash_stack()
+  static uint64_t hash_bytes(const char* s, size_t size) {
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ size;
+    uint64_t word;
+    for (; size >= 8; s += 8, size -= 8) {
+      memcpy(&word, s, 8);
+      h ^= word;
+      h *= 0xff51afd7ed558ccdULL;
+      h ^= h >> 32;
+    }
+    word = 0;
+    memcpy(&word, s, size);
+    h ^= word;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+  }
+};
+
+const size_t DemangleCache::kNumShards;
+const size_t DemangleCache::kBlockSize;
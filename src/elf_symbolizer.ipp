@@ -0,0 +1,1709 @@
+#include "ipp_inc.h"
+
+// selected by SetSymbolizer()
+static std::atomic<int> g_symbolizer(kSymbolizeElf);
+
+// GNU build-id in notes of an ELF PT_NOTE segment or SHT_NOTE section in
+// hex, empty if not found
+static std::string parse_build_id(const uint8_t* notes, size_t size) {
+  // name and desc of each note are padded to 4 bytes
+  size_t pos = 0;
+  while (pos + sizeof(Elf64_Nhdr) <= size) {
+    Elf64_Nhdr nh;
+    memcpy(&nh, notes + pos, sizeof(nh));
+    size_t name_pos = pos + sizeof(nh);
+    size_t desc_pos = name_pos + ((nh.n_namesz + 3) & ~3u);
+    pos = desc_pos + ((nh.n_descsz + 3) & ~3u);
+    if (pos > size) {
+      break;
+    }
+    if (nh.n_type == NT_GNU_BUILD_ID && nh.n_namesz == 4 &&
+        memcmp(notes + name_pos, "GNU", 4) == 0) {
+      static const char kHex[] = "0123456789abcdef";
+      std::string build_id;
+      for (uint32_t i = 0; i < nh.n_descsz; i++) {
+        build_id += kHex[notes[desc_pos + i] >> 4];
+        build_id += kHex[notes[desc_pos + i] & 15];
+      }
+      return build_id;
+    }
+  }
+  return "";
+}
+
+// bounds checked little endian reader, a read past the end returns 0 and
+// clears ok()
+class ByteReader {
+ public:
+  ByteReader() = default;
+  ByteReader(const uint8_t* data, size_t size)
+      : begin_(data), pos_(data), end_(data + size) {}
+
+  bool ok() const { return ok_; }
+  bool empty() const { return pos_ >= end_; }
+  size_t offset() const { return pos_ - begin_; }
+  size_t size() const { return end_ - begin_; }
+
+  bool seek(uint64_t offset) {
+    if (offset > size()) {
+      return fail();
+    }
+    pos_ = begin_ + offset;
+    return true;
+  }
+
+  bool skip(uint64_t n) {
+    if (n > static_cast<size_t>(end_ - pos_)) {
+      return fail();
+    }
+    pos_ += n;
+    return true;
+  }
+
+  // n bytes unsigned, n <= 8
+  uint64_t fixed(size_t n) {
+    if (n > static_cast<size_t>(end_ - pos_)) {
+      fail();
+      return 0;
+    }
+    uint64_t value = 0;
+    for (size_t i = 0; i < n; i++) {
+      value |= static_cast<uint64_t>(pos_[i]) << (8 * i);
+    }
+    pos_ += n;
+    return value;
+  }
+
+  uint8_t u8() { return static_cast<uint8_t>(fixed(1)); }
+  uint16_t u16() { return static_cast<uint16_t>(fixed(2)); }
+  uint32_t u32() { return static_cast<uint32_t>(fixed(4)); }
+  uint64_t u64() { return fixed(8); }
+  // 4 or 8 bytes section offset
+  uint64_t offset(bool is64) { return fixed(is64 ? 8 : 4); }
+
+  uint64_t uleb() {
+    uint64_t value = 0;
+    for (int shift = 0; pos_ < end_; shift += 7) {
+      uint8_t byte = *pos_++;
+      if (shift < 64) {
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+      }
+      if ((byte & 0x80) == 0) {
+        return value;
+      }
+    }
+    fail();
+    return 0;
+  }
+
+  int64_t sleb() {
+    int64_t value = 0;
+    int shift = 0;
+    while (pos_ < end_) {
+      uint8_t byte = *pos_++;
+      if (shift < 64) {
+        value |= static_cast<int64_t>(byte & 0x7f) << shift;
+      }
+      shift += 7;
+      if ((byte & 0x80) == 0) {
+        if (shift < 64 && (byte & 0x40)) {
+          value |= -(static_cast<int64_t>(1) << shift);
+        }
+        return value;
+      }
+    }
+    fail();
+    return 0;
+  }
+
+  // null-terminated string in place
+  const char* cstr() {
+    const uint8_t* end =
+        static_cast<const uint8_t*>(memchr(pos_, 0, end_ - pos_));
+    if (end == nullptr) {
+      fail();
+      return "";
+    }
+    const char* str = reinterpret_cast<const char*>(pos_);
+    pos_ = end + 1;
+    return str;
+  }
+
+  // string at offset, "" if out of range
+  const char* str_at(uint64_t offset) const {
+    if (offset >= size() || memchr(begin_ + offset, 0, size() - offset) ==
+                                nullptr) {
+      return "";
+    }
+    return reinterpret_cast<const char*>(begin_ + offset);
+  }
+
+ private:
+  const uint8_t* begin_ = nullptr;
+  const uint8_t* pos_ = nullptr;
+  const uint8_t* end_ = nullptr;
+  bool ok_ = true;
+
+  bool fail() {
+    ok_ = false;
+    pos_ = end_;
+    return false;
+  }
+};
+
+/**
+ * index of sorted addresses in Eytzinger (BFS) order, for function lookup
+ * - node k has children 2k and 2k+1, so the top levels of the implicit tree
+ *   share a few cache lines, and the search prefetches 4 levels ahead
+ * - branchless, each level is a compare and a shift
+ */
+class EytzingerIndex {
+ public:
+  // build from addresses sorted ascending
+  void Build(const std::vector<uint64_t>& sorted) {
+    keys_.assign(sorted.size() + 1, 0);
+    ranks_.assign(sorted.size() + 1, 0);
+    size_t i = 0;
+    Fill(sorted, i, 1);
+  }
+
+  // sorted index of the last address <= pc, or -1
+  int64_t Find(uint64_t pc) const {
+    if (keys_.size() <= 1) {
+      return -1;
+    }
+    const size_t n = keys_.size() - 1;
+    const uint64_t* keys = keys_.data();
+    size_t k = 1;
+    while (k <= n) {
+      __builtin_prefetch(keys + std::min(16 * k, n));
+      k = 2 * k + (keys[k] <= pc);
+    }
+    // the path turned left at the first address > pc, 0 if none
+    k >>= __builtin_ffsll(~k);
+    size_t upper = k == 0 ? n : ranks_[k];
+    return static_cast<int64_t>(upper) - 1;
+  }
+
+ private:
+  std::vector<uint64_t> keys_;   // 1-based, keys_[0] is unused
+  std::vector<uint32_t> ranks_;  // sorted index of keys_[k]
+
+  // in-order traversal of the implicit tree visits addresses sorted
+  void Fill(const std::vector<uint64_t>& sorted, size_t& i, size_t k) {
+    if (k < keys_.size()) {
+      Fill(sorted, i, 2 * k);
+      keys_[k] = sorted[i];
+      ranks_[k] = i++;
+      Fill(sorted, i, 2 * k + 1);
+    }
+  }
+};
+
+/**
+ * symbols and debug info of a mmap-ed ELF file
+ * - function names from .symtab, or .dynsym of a stripped file
+ * - file and line from .debug_line, inlined functions from
+ *   DW_TAG_inlined_subroutine in .debug_info, DWARF 2 to 5
+ * - a function without linkage name is qualified by its enclosing
+ *   namespaces and classes, or named by its symbol if not inlined
+ * - only 64-bit little endian ELF, compressed debug sections (SHF_COMPRESSED
+ *   or legacy .zdebug_*) are inflated by zlib, treated as no debug info if
+ *   zlib is not installed
+ * - debug info split by `objcopy --only-keep-debug` is read from the
+ *   separate file found by build-id or .gnu_debuglink, like gdb
+ * - all strings point into the mapping, which lives as long as the module
+ */
+class ElfModule {
+ public:
+  ElfModule() = default;
+  ~ElfModule() {
+    if (data_ != nullptr) {
+      munmap(const_cast<uint8_t*>(data_), size_);
+    }
+  }
+
+  ElfModule(const ElfModule&) = delete;
+  ElfModule& operator=(const ElfModule&) = delete;
+
+  // map and index the file, return false if it is not a supported ELF
+  bool Load(const std::string& path) {
+    if (!LoadFile(path)) {
+      return false;
+    }
+    if (!has_debug_info()) {
+      for (const auto& file : DebugFiles(path)) {
+        std::unique_ptr<ElfModule> debug(new ElfModule());
+        if (debug->LoadFile(file) && debug->has_debug_info() &&
+            debug->build_id_ == build_id_) {
+          debug_file_ = std::move(debug);
+          break;
+        }
+      }
+    }
+    return true;
+  }
+
+  // vaddr of file offset 0, dli_fbase maps to this address
+  uint64_t base_vaddr() const { return base_vaddr_; }
+  bool has_debug_info() const {
+    return !rows_.empty() ||
+           (debug_file_ != nullptr && debug_file_->has_debug_info());
+  }
+
+  // mangled name of the function containing pc, or nullptr, and its address
+  // in start if set
+  const char* FindFunction(uint64_t pc, uint64_t* start = nullptr) const {
+    int64_t i = symbol_index_.Find(pc);
+    if (i < 0) {
+      return nullptr;
+    }
+    const Symbol& sym = symbols_[i];
+    if (start != nullptr) {
+      *start = sym.addr;
+    }
+    return sym.size == 0 || pc < sym.addr + sym.size ? sym.name : nullptr;
+  }
+
+  /**
+   * resolve a file address like `addr2line -f -i`
+   * - func of frame is the innermost inlined function, or the symbol
+   * - file and line from line table, inlined_by from outer inlined callers
+   * - return false if no symbol or line contains pc
+   */
+  bool Symbolize(uint64_t pc, Frame* frame) const {
+    // file addresses are the same in the separate debug file
+    if (debug_file_ != nullptr && debug_file_->Symbolize(pc, frame)) {
+      return true;
+    }
+    bool found = false;
+    auto row = std::upper_bound(
+        rows_.begin(), rows_.end(), pc,
+        [](uint64_t a, const LineRow& r) { return a < r.addr; });
+    if (row != rows_.begin() && (--row)->file != kEndSequence) {
+      frame->file = files_[row->file];
+      frame->line = row->line;
+      found = true;
+    }
+
+    uint32_t scope = FindScope(pc);
+    if (scope != kNoScope) {
+      // like addr2line, a function without linkage name is named by its
+      // symbol, e.g. a template of a lambda
+      const char* name = scopes_[scope].name;
+      const char* symbol = scopes_[scope].parent == kNoScope &&
+                                   strncmp(name, "_Z", 2) != 0
+                               ? FindFunction(pc)
+                               : nullptr;
+      demangle_symbol(frame->func, symbol != nullptr ? symbol : name);
+      frame->inlined_by.clear();
+      for (uint32_t s = scope; scopes_[s].parent != kNoScope;
+           s = scopes_[s].parent) {
+        const Scope& callee = scopes_[s];
+        Frame::Func caller;
+        demangle_symbol(caller.name, scopes_[callee.parent].name);
+        caller.file = callee.call_file < files_.size()
+                          ? files_[callee.call_file]
+                          : std::string("??");
+        caller.line = callee.call_line > 0 ? callee.call_line : -1;
+        frame->inlined_by.emplace_back(std::move(caller));
+      }
+      return true;
+    }
+    const char* name = FindFunction(pc);
+    if (name != nullptr) {
+      demangle_symbol(frame->func, name);
+      found = true;
+    }
+    return found;
+  }
+
+ private:
+  // constants of DWARF 5 and GNU extensions, as dwarf.h is not in libc
+  enum : uint64_t {
+    DW_TAG_class_type = 0x02,
+    DW_TAG_structure_type = 0x13,
+    DW_TAG_union_type = 0x17,
+    DW_TAG_inlined_subroutine = 0x1d,
+    DW_TAG_subprogram = 0x2e,
+    DW_TAG_namespace = 0x39,
+
+    DW_AT_name = 0x03,
+    DW_AT_stmt_list = 0x10,
+    DW_AT_low_pc = 0x11,
+    DW_AT_high_pc = 0x12,
+    DW_AT_comp_dir = 0x1b,
+    DW_AT_abstract_origin = 0x31,
+    DW_AT_specification = 0x47,
+    DW_AT_ranges = 0x55,
+    DW_AT_call_file = 0x58,
+    DW_AT_call_line = 0x59,
+    DW_AT_linkage_name = 0x6e,
+    DW_AT_str_offsets_base = 0x72,
+    DW_AT_addr_base = 0x73,
+    DW_AT_rnglists_base = 0x74,
+    DW_AT_MIPS_linkage_name = 0x2007,
+
+    DW_FORM_addr = 0x01,
+    DW_FORM_block2 = 0x03,
+    DW_FORM_block4 = 0x04,
+    DW_FORM_data2 = 0x05,
+    DW_FORM_data4 = 0x06,
+    DW_FORM_data8 = 0x07,
+    DW_FORM_string = 0x08,
+    DW_FORM_block = 0x09,
+    DW_FORM_block1 = 0x0a,
+    DW_FORM_data1 = 0x0b,
+    DW_FORM_flag = 0x0c,
+    DW_FORM_sdata = 0x0d,
+    DW_FORM_strp = 0x0e,
+    DW_FORM_udata = 0x0f,
+    DW_FORM_ref_addr = 0x10,
+    DW_FORM_ref1 = 0x11,
+    DW_FORM_ref2 = 0x12,
+    DW_FORM_ref4 = 0x13,
+    DW_FORM_ref8 = 0x14,
+    DW_FORM_ref_udata = 0x15,
+    DW_FORM_indirect = 0x16,
+    DW_FORM_sec_offset = 0x17,
+    DW_FORM_exprloc = 0x18,
+    DW_FORM_flag_present = 0x19,
+    DW_FORM_strx = 0x1a,
+    DW_FORM_addrx = 0x1b,
+    DW_FORM_ref_sup4 = 0x1c,
+    DW_FORM_strp_sup = 0x1d,
+    DW_FORM_data16 = 0x1e,
+    DW_FORM_line_strp = 0x1f,
+    DW_FORM_ref_sig8 = 0x20,
+    DW_FORM_implicit_const = 0x21,
+    DW_FORM_loclistx = 0x22,
+    DW_FORM_rnglistx = 0x23,
+    DW_FORM_ref_sup8 = 0x24,
+    DW_FORM_strx1 = 0x25,
+    DW_FORM_strx2 = 0x26,
+    DW_FORM_strx3 = 0x27,
+    DW_FORM_strx4 = 0x28,
+    DW_FORM_addrx1 = 0x29,
+    DW_FORM_addrx2 = 0x2a,
+    DW_FORM_addrx3 = 0x2b,
+    DW_FORM_addrx4 = 0x2c,
+    DW_FORM_GNU_addr_index = 0x1f01,
+    DW_FORM_GNU_str_index = 0x1f02,
+    DW_FORM_GNU_ref_alt = 0x1f20,
+    DW_FORM_GNU_strp_alt = 0x1f21,
+
+    DW_UT_compile = 0x01,
+    DW_UT_type = 0x02,
+    DW_UT_partial = 0x03,
+    DW_UT_skeleton = 0x04,
+    DW_UT_split_compile = 0x05,
+    DW_UT_split_type = 0x06,
+
+    DW_RLE_end_of_list = 0x00,
+    DW_RLE_base_addressx = 0x01,
+    DW_RLE_startx_endx = 0x02,
+    DW_RLE_startx_length = 0x03,
+    DW_RLE_offset_pair = 0x04,
+    DW_RLE_base_address = 0x05,
+    DW_RLE_start_end = 0x06,
+    DW_RLE_start_length = 0x07,
+
+    DW_LNS_copy = 0x01,
+    DW_LNS_advance_pc = 0x02,
+    DW_LNS_advance_line = 0x03,
+    DW_LNS_set_file = 0x04,
+    DW_LNS_const_add_pc = 0x08,
+    DW_LNS_fixed_advance_pc = 0x09,
+    DW_LNE_end_sequence = 0x01,
+    DW_LNE_set_address = 0x02,
+    DW_LNE_define_file = 0x03,
+    DW_LNCT_path = 0x01,
+    DW_LNCT_directory_index = 0x02,
+  };
+
+  static const uint32_t kNoScope = UINT32_MAX;
+  static const uint32_t kEndSequence = UINT32_MAX;
+
+  struct Symbol {
+    uint64_t addr;
+    uint64_t size;
+    const char* name;
+  };
+
+  // row of line table, file is kEndSequence after the end of a sequence
+  struct LineRow {
+    uint64_t addr;
+    uint32_t file;
+    int32_t line;
+  };
+
+  // a function with code, or an inlined call of a function, scopes are in
+  // DIE order so descendants of scope i are (i, end)
+  struct Scope {
+    const char* name;  // linkage name, or name qualified by namespaces
+    uint32_t parent;   // enclosing scope of an inlined call, or kNoScope
+    uint32_t end;
+    uint32_t call_file;
+    int32_t call_line;
+    uint32_t range_begin;  // in ranges_
+    uint32_t range_end;
+  };
+
+  struct Range {
+    uint64_t lo;
+    uint64_t hi;
+    uint32_t scope;
+  };
+
+  // unit header and attributes of its DIE
+  struct Unit {
+    uint64_t offset;
+    uint64_t die_offset;
+    uint64_t end;
+    uint16_t version;
+    uint8_t addr_size;
+    bool is64;
+    uint64_t abbrev_offset;
+    uint64_t low_pc;
+    uint64_t str_offsets_base;
+    uint64_t addr_base;
+    uint64_t rnglists_base;
+  };
+
+  struct AttrSpec {
+    uint64_t name;
+    uint64_t form;
+    int64_t implicit_const;
+  };
+
+  struct Abbrev {
+    uint64_t tag = 0;
+    bool has_children = false;
+    std::vector<AttrSpec> attrs;
+  };
+
+  using AbbrevTable = std::vector<Abbrev>;  // by code
+
+  struct AttrValue {
+    uint64_t form;
+    uint64_t value;  // constant, offset, index or address
+    const char* str;
+  };
+
+  // attributes of a DIE used by symbolizer
+  struct DieInfo {
+    bool has_low_pc = false;
+    bool has_high_pc = false;
+    bool has_ranges = false;
+    uint64_t low_pc = 0;
+    AttrValue high_pc = {};
+    AttrValue ranges = {};
+    const char* name = nullptr;
+    const char* linkage_name = nullptr;
+    uint64_t origin = 0;  // abstract_origin or specification, 0 if none
+    uint64_t call_file = 0;
+    int64_t call_line = 0;
+  };
+
+  struct FuncName {
+    const char* name = nullptr;
+    bool is_linkage = false;
+    uint64_t die = 0;  // DIE of a plain DW_AT_name
+  };
+
+  // a named namespace or type, DIEs in [lo, hi) are nested in it
+  struct NameScope {
+    uint64_t lo;
+    uint64_t hi;
+    const char* name;
+    uint32_t parent;  // enclosing name scope, or kNoScope
+  };
+
+  const uint8_t* data_ = nullptr;
+  size_t size_ = 0;
+  uint64_t base_vaddr_ = 0;
+  ByteReader info_, abbrev_, line_, str_, line_str_, str_offsets_, addr_,
+      ranges_sec_, rnglists_;
+  std::string build_id_;  // hex, empty if none
+  ByteReader debuglink_;  // .gnu_debuglink
+  std::vector<std::unique_ptr<uint8_t[]>> inflated_;  // compressed sections
+  std::unique_ptr<ElfModule> debug_file_;  // separate debug info, or nullptr
+
+  std::vector<Symbol> symbols_;  // sorted by addr
+  EytzingerIndex symbol_index_;  // of symbols_
+  std::vector<std::string> files_;
+  std::unordered_map<std::string, uint32_t> file_ids_;
+  std::vector<LineRow> rows_;  // sorted by addr
+  std::vector<Scope> scopes_;
+  std::unordered_set<std::string> qualified_names_;  // of scopes_
+  std::vector<Range> ranges_;      // of scopes_
+  std::vector<Range> top_ranges_;  // of outermost scopes, sorted by lo
+
+  // only used while loading
+  std::vector<Unit> units_;
+  std::unordered_map<uint64_t, AbbrevTable> abbrevs_;
+  std::vector<NameScope> name_scopes_;  // in DIE order
+  std::vector<std::pair<uint32_t, uint64_t>> unqualified_;  // scope, name DIE
+
+  // map and index the file without looking for a separate debug file
+  bool LoadFile(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(Elf64_Ehdr)) {
+      close(fd);
+      return false;
+    }
+    void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+      return false;
+    }
+    data_ = static_cast<const uint8_t*>(data);
+    size_ = st.st_size;
+    if (!LoadSections()) {
+      return false;
+    }
+    LoadSymbols();
+    LoadDebugInfo();
+    return true;
+  }
+
+  ByteReader Section(const Elf64_Shdr& sh) const {
+    if (sh.sh_type == SHT_NOBITS || sh.sh_offset > size_ ||
+        sh.sh_size > size_ - sh.sh_offset) {
+      return ByteReader();
+    }
+    return ByteReader(data_ + sh.sh_offset, sh.sh_size);
+  }
+
+  bool LoadSections() {
+    const Elf64_Ehdr* eh = reinterpret_cast<const Elf64_Ehdr*>(data_);
+    if (memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0 ||
+        eh->e_ident[EI_CLASS] != ELFCLASS64 ||
+        eh->e_ident[EI_DATA] != ELFDATA2LSB ||
+        eh->e_shentsize != sizeof(Elf64_Shdr) ||
+        eh->e_phentsize != sizeof(Elf64_Phdr) || eh->e_shoff > size_ ||
+        eh->e_shnum > (size_ - eh->e_shoff) / sizeof(Elf64_Shdr) ||
+        eh->e_phoff > size_ ||
+        eh->e_phnum > (size_ - eh->e_phoff) / sizeof(Elf64_Phdr) ||
+        eh->e_shstrndx >= eh->e_shnum) {
+      return false;
+    }
+    const Elf64_Phdr* ph =
+        reinterpret_cast<const Elf64_Phdr*>(data_ + eh->e_phoff);
+    bool found_load = false;
+    for (int i = 0; i < eh->e_phnum; i++) {
+      if (ph[i].p_type == PT_LOAD &&
+          (!found_load || ph[i].p_vaddr - ph[i].p_offset < base_vaddr_)) {
+        base_vaddr_ = ph[i].p_vaddr - ph[i].p_offset;
+        found_load = true;
+      }
+    }
+
+    const Elf64_Shdr* sh =
+        reinterpret_cast<const Elf64_Shdr*>(data_ + eh->e_shoff);
+    ByteReader names = Section(sh[eh->e_shstrndx]);
+    struct {
+      const char* name;
+      ByteReader* reader;
+    } debug_sections[] = {
+        {".debug_info", &info_},
+        {".debug_abbrev", &abbrev_},
+        {".debug_line", &line_},
+        {".debug_str", &str_},
+        {".debug_line_str", &line_str_},
+        {".debug_str_offsets", &str_offsets_},
+        {".debug_addr", &addr_},
+        {".debug_ranges", &ranges_sec_},
+        {".debug_rnglists", &rnglists_},
+    };
+    for (int i = 0; i < eh->e_shnum; i++) {
+      const char* name = names.str_at(sh[i].sh_name);
+      if (sh[i].sh_type == SHT_NOTE && build_id_.empty()) {
+        ByteReader notes = Section(sh[i]);
+        build_id_ = parse_build_id(data_ + sh[i].sh_offset, notes.size());
+      } else if (strcmp(name, ".gnu_debuglink") == 0) {
+        debuglink_ = Section(sh[i]);
+      }
+      // .zdebug_* is a legacy compressed .debug_*
+      bool zdebug = strncmp(name, ".zdebug_", 8) == 0;
+      for (auto& s : debug_sections) {
+        if (zdebug && strcmp(name + 2, s.name + 1) == 0) {
+          *s.reader = Inflate(sh[i], true);
+        } else if (strcmp(name, s.name) == 0) {
+          *s.reader = sh[i].sh_flags & SHF_COMPRESSED ? Inflate(sh[i], false)
+                                                       : Section(sh[i]);
+        }
+      }
+    }
+    return true;
+  }
+
+  // contents of a compressed section, empty if it is not zlib, corrupt or
+  // zlib is not installed
+  ByteReader Inflate(const Elf64_Shdr& sh, bool zdebug) {
+    ByteReader r = Section(sh);
+    uint64_t size = 0;
+    if (zdebug) {
+      // "ZLIB" and big endian size
+      if (r.size() < 12 || memcmp(data_ + sh.sh_offset, "ZLIB", 4) != 0) {
+        return ByteReader();
+      }
+      r.skip(4);
+      for (int i = 0; i < 8; i++) {
+        size = size << 8 | r.u8();
+      }
+    } else {
+      // Elf64_Chdr
+      uint32_t type = r.u32();
+      r.u32();
+      size = r.u64();
+      r.u64();
+      if (type != ELFCOMPRESS_ZLIB) {
+        return ByteReader();
+      }
+    }
+    const Zlib* zlib = Zlib::Get();
+    size_t in_size = r.size() - r.offset();
+    // deflate expands at most 1032 times
+    if (!r.ok() || zlib == nullptr || size == 0 || size / 1032 > in_size) {
+      return ByteReader();
+    }
+    std::unique_ptr<uint8_t[]> out(new uint8_t[size]);
+    if (!zlib->Uncompress(data_ + sh.sh_offset + r.offset(), in_size,
+                          out.get(), size)) {
+      return ByteReader();
+    }
+    inflated_.push_back(std::move(out));
+    return ByteReader(inflated_.back().get(), size);
+  }
+
+  // candidates of the separate debug file like gdb: by build-id under
+  // /usr/lib/debug, then by .gnu_debuglink next to path, in .debug/ of its
+  // directory and under /usr/lib/debug
+  std::vector<std::string> DebugFiles(const std::string& path) const {
+    static const std::string kRoot = "/usr/lib/debug";
+    std::vector<std::string> files;
+    if (build_id_.size() > 2) {
+      files.push_back(kRoot + "/.build-id/" + build_id_.substr(0, 2) + "/" +
+                      build_id_.substr(2) + ".debug");
+    }
+    const char* link = debuglink_.str_at(0);
+    if (link[0] != '\0' && strchr(link, '/') == nullptr) {
+      std::string dir = path.substr(0, path.rfind('/') + 1);
+      files.push_back(dir + link);
+      files.push_back(dir + ".debug/" + link);
+      if (!dir.empty() && dir[0] == '/') {
+        files.push_back(kRoot + dir + link);
+      }
+    }
+    return files;
+  }
+
+  void LoadSymbols() {
+    const Elf64_Ehdr* eh = reinterpret_cast<const Elf64_Ehdr*>(data_);
+    const Elf64_Shdr* sh =
+        reinterpret_cast<const Elf64_Shdr*>(data_ + eh->e_shoff);
+    // prefer .symtab which also has local functions
+    for (uint32_t type : {SHT_SYMTAB, SHT_DYNSYM}) {
+      for (int i = 0; i < eh->e_shnum && symbols_.empty(); i++) {
+        if (sh[i].sh_type != type || sh[i].sh_link >= eh->e_shnum ||
+            sh[i].sh_entsize != sizeof(Elf64_Sym)) {
+          continue;
+        }
+        ByteReader syms = Section(sh[i]);
+        ByteReader strs = Section(sh[sh[i].sh_link]);
+        if (syms.size() == 0) {
+          continue;
+        }
+        const Elf64_Sym* sym =
+            reinterpret_cast<const Elf64_Sym*>(data_ + sh[i].sh_offset);
+        size_t num_syms = syms.size() / sizeof(Elf64_Sym);
+        for (size_t j = 0; j < num_syms; j++) {
+          int sym_type = ELF64_ST_TYPE(sym[j].st_info);
+          if ((sym_type != STT_FUNC && sym_type != STT_GNU_IFUNC) ||
+              sym[j].st_shndx == SHN_UNDEF || sym[j].st_value == 0) {
+            continue;
+          }
+          symbols_.push_back(Symbol{sym[j].st_value, sym[j].st_size,
+                                    strs.str_at(sym[j].st_name)});
+        }
+      }
+      if (!symbols_.empty()) {
+        break;
+      }
+    }
+    std::sort(symbols_.begin(), symbols_.end(),
+              [](const Symbol& a, const Symbol& b) { return a.addr < b.addr; });
+    std::vector<uint64_t> addrs(symbols_.size());
+    for (size_t i = 0; i < symbols_.size(); i++) {
+      addrs[i] = symbols_[i].addr;
+    }
+    symbol_index_.Build(addrs);
+  }
+
+  void LoadDebugInfo() {
+    if (info_.size() == 0 || abbrev_.size() == 0) {
+      return;
+    }
+    // unit headers first, a reference may point to a later unit
+    ByteReader r = info_;
+    while (!r.empty() && r.ok()) {
+      Unit unit;
+      if (!ReadUnitHeader(r, unit)) {
+        break;
+      }
+      units_.emplace_back(unit);
+      r.seek(unit.end);
+    }
+    for (auto& unit : units_) {
+      LoadUnit(unit);
+    }
+    // after all units, a name may be declared in a later one
+    for (const auto& it : unqualified_) {
+      scopes_[it.first].name = Qualify(scopes_[it.first].name, it.second);
+    }
+    units_.clear();
+    abbrevs_.clear();
+    name_scopes_.clear();
+    unqualified_.clear();
+
+    // sort rows by address but keep rows of the same address in order, and
+    // end of a sequence is before start of next one at the same address
+    std::stable_sort(rows_.begin(), rows_.end(),
+                     [](const LineRow& a, const LineRow& b) {
+                       if (a.addr != b.addr) {
+                         return a.addr < b.addr;
+                       }
+                       return a.file == kEndSequence && b.file != kEndSequence;
+                     });
+    std::sort(top_ranges_.begin(), top_ranges_.end(),
+              [](const Range& a, const Range& b) { return a.lo < b.lo; });
+  }
+
+  bool ReadUnitHeader(ByteReader& r, Unit& unit) {
+    unit = Unit();
+    unit.offset = r.offset();
+    uint64_t length = r.u32();
+    unit.is64 = length == 0xffffffff;
+    if (unit.is64) {
+      length = r.u64();
+    }
+    if (!r.ok() || length > info_.size() - r.offset()) {
+      return false;
+    }
+    unit.end = r.offset() + length;
+    unit.version = r.u16();
+    uint8_t unit_type = DW_UT_compile;
+    if (unit.version >= 5) {
+      unit_type = r.u8();
+      unit.addr_size = r.u8();
+      unit.abbrev_offset = r.offset(unit.is64);
+      if (unit_type == DW_UT_skeleton || unit_type == DW_UT_split_compile) {
+        r.skip(8);  // dwo id
+      } else if (unit_type == DW_UT_type || unit_type == DW_UT_split_type) {
+        r.skip(8 + (unit.is64 ? 8 : 4));  // signature and type offset
+      }
+    } else {
+      unit.abbrev_offset = r.offset(unit.is64);
+      unit.addr_size = r.u8();
+    }
+    unit.die_offset = r.offset();
+    if (!r.ok() || unit.version < 2 || unit.version > 5 ||
+        (unit.addr_size != 4 && unit.addr_size != 8)) {
+      return false;
+    }
+    // base addresses of unit DIE, used to resolve its other attributes
+    ByteReader die = info_;
+    die.seek(unit.die_offset);
+    const AbbrevTable& table = GetAbbrevs(unit.abbrev_offset);
+    uint64_t code = die.uleb();
+    if (code == 0 || code >= table.size()) {
+      return true;
+    }
+    AttrValue value;
+    for (const auto& spec : table[code].attrs) {
+      if (!ReadAttr(die, unit, spec, value)) {
+        break;
+      }
+      switch (spec.name) {
+        case DW_AT_low_pc:
+          if (value.form == DW_FORM_addr) {
+            unit.low_pc = value.value;
+          }
+          break;
+        case DW_AT_str_offsets_base:
+          unit.str_offsets_base = value.value;
+          break;
+        case DW_AT_addr_base:
+          unit.addr_base = value.value;
+          break;
+        case DW_AT_rnglists_base:
+          unit.rnglists_base = value.value;
+          break;
+      }
+    }
+    if (unit_type != DW_UT_compile && unit_type != DW_UT_partial) {
+      unit.die_offset = unit.end;  // no code in it
+    }
+    return true;
+  }
+
+  const AbbrevTable& GetAbbrevs(uint64_t offset) {
+    auto it = abbrevs_.find(offset);
+    if (it != abbrevs_.end()) {
+      return it->second;
+    }
+    AbbrevTable& table = abbrevs_[offset];
+    ByteReader r = abbrev_;
+    r.seek(offset);
+    while (r.ok()) {
+      uint64_t code = r.uleb();
+      if (code == 0 || code > (1 << 20)) {
+        break;
+      }
+      if (code >= table.size()) {
+        table.resize(code + 1);
+      }
+      Abbrev& abbrev = table[code];
+      abbrev.tag = r.uleb();
+      abbrev.has_children = r.u8() != 0;
+      while (r.ok()) {
+        AttrSpec spec{r.uleb(), r.uleb(), 0};
+        if (spec.form == DW_FORM_implicit_const) {
+          spec.implicit_const = r.sleb();
+        }
+        if (spec.name == 0 && spec.form == 0) {
+          break;
+        }
+        abbrev.attrs.emplace_back(spec);
+      }
+    }
+    return table;
+  }
+
+  // read or skip value of an attribute
+  bool ReadAttr(ByteReader& r, const Unit& unit, const AttrSpec& spec,
+                AttrValue& v) const {
+    v.form = spec.form;
+    v.value = 0;
+    v.str = nullptr;
+    switch (v.form) {
+      case DW_FORM_addr:
+        v.value = r.fixed(unit.addr_size);
+        break;
+      case DW_FORM_data1:
+      case DW_FORM_ref1:
+      case DW_FORM_flag:
+      case DW_FORM_strx1:
+      case DW_FORM_addrx1:
+        v.value = r.u8();
+        break;
+      case DW_FORM_data2:
+      case DW_FORM_ref2:
+      case DW_FORM_strx2:
+      case DW_FORM_addrx2:
+        v.value = r.u16();
+        break;
+      case DW_FORM_strx3:
+      case DW_FORM_addrx3:
+        v.value = r.fixed(3);
+        break;
+      case DW_FORM_data4:
+      case DW_FORM_ref4:
+      case DW_FORM_ref_sup4:
+      case DW_FORM_strx4:
+      case DW_FORM_addrx4:
+        v.value = r.u32();
+        break;
+      case DW_FORM_data8:
+      case DW_FORM_ref8:
+      case DW_FORM_ref_sig8:
+      case DW_FORM_ref_sup8:
+        v.value = r.u64();
+        break;
+      case DW_FORM_data16:
+        r.skip(16);
+        break;
+      case DW_FORM_sdata:
+        v.value = static_cast<uint64_t>(r.sleb());
+        break;
+      case DW_FORM_udata:
+      case DW_FORM_ref_udata:
+      case DW_FORM_strx:
+      case DW_FORM_addrx:
+      case DW_FORM_loclistx:
+      case DW_FORM_rnglistx:
+      case DW_FORM_GNU_addr_index:
+      case DW_FORM_GNU_str_index:
+        v.value = r.uleb();
+        break;
+      case DW_FORM_string:
+        v.str = r.cstr();
+        break;
+      case DW_FORM_strp:
+        v.value = r.offset(unit.is64);
+        v.str = str_.str_at(v.value);
+        break;
+      case DW_FORM_line_strp:
+        v.value = r.offset(unit.is64);
+        v.str = line_str_.str_at(v.value);
+        break;
+      case DW_FORM_ref_addr:
+        v.value = unit.version <= 2 ? r.fixed(unit.addr_size)
+                                    : r.offset(unit.is64);
+        break;
+      case DW_FORM_sec_offset:
+      case DW_FORM_strp_sup:
+      case DW_FORM_GNU_ref_alt:
+      case DW_FORM_GNU_strp_alt:
+        v.value = r.offset(unit.is64);
+        break;
+      case DW_FORM_block1:
+        r.skip(r.u8());
+        break;
+      case DW_FORM_block2:
+        r.skip(r.u16());
+        break;
+      case DW_FORM_block4:
+        r.skip(r.u32());
+        break;
+      case DW_FORM_block:
+      case DW_FORM_exprloc:
+        r.skip(r.uleb());
+        break;
+      case DW_FORM_flag_present:
+        v.value = 1;
+        break;
+      case DW_FORM_implicit_const:
+        v.value = static_cast<uint64_t>(spec.implicit_const);
+        break;
+      case DW_FORM_indirect: {
+        AttrSpec indirect{spec.name, r.uleb(), 0};
+        if (indirect.form == DW_FORM_implicit_const) {
+          indirect.implicit_const = r.sleb();
+        }
+        return ReadAttr(r, unit, indirect, v);
+      }
+      default:
+        return false;  // unknown size
+    }
+    if (IsStrx(v.form)) {
+      // offsets of unit start after the header of str_offsets table
+      uint64_t size = unit.is64 ? 8 : 4;
+      ByteReader offsets = str_offsets_;
+      if (offsets.seek(unit.str_offsets_base + v.value * size)) {
+        v.str = str_.str_at(offsets.offset(unit.is64));
+      }
+    }
+    return r.ok();
+  }
+
+  static bool IsStrx(uint64_t form) {
+    return form == DW_FORM_strx || form == DW_FORM_strx1 ||
+           form == DW_FORM_strx2 || form == DW_FORM_strx3 ||
+           form == DW_FORM_strx4 || form == DW_FORM_GNU_str_index;
+  }
+
+  static bool IsAddrx(uint64_t form) {
+    return form == DW_FORM_addrx || form == DW_FORM_addrx1 ||
+           form == DW_FORM_addrx2 || form == DW_FORM_addrx3 ||
+           form == DW_FORM_addrx4 || form == DW_FORM_GNU_addr_index;
+  }
+
+  // address of an address class attribute, false if not that class
+  bool AttrAddr(const Unit& unit, const AttrValue& v, uint64_t& addr) const {
+    if (v.form == DW_FORM_addr) {
+      addr = v.value;
+      return true;
+    }
+    if (!IsAddrx(v.form)) {
+      return false;
+    }
+    ByteReader r = addr_;
+    r.seek(unit.addr_base + v.value * unit.addr_size);
+    addr = r.fixed(unit.addr_size);
+    return r.ok();
+  }
+
+  // offset in .debug_info of a reference
+  static uint64_t AttrRef(const Unit& unit, const AttrValue& v) {
+    switch (v.form) {
+      case DW_FORM_ref1:
+      case DW_FORM_ref2:
+      case DW_FORM_ref4:
+      case DW_FORM_ref8:
+      case DW_FORM_ref_udata:
+        return unit.offset + v.value;
+      case DW_FORM_ref_addr:
+        return v.value;
+      default:
+        return 0;  // other file, or type unit
+    }
+  }
+
+  // read attributes of the DIE at r, return its abbrev or nullptr
+  const Abbrev* ReadDie(ByteReader& r, const Unit& unit,
+                        const AbbrevTable& table, DieInfo& die) const {
+    uint64_t code = r.uleb();
+    if (code == 0 || code >= table.size()) {
+      return nullptr;
+    }
+    const Abbrev& abbrev = table[code];
+    AttrValue v;
+    for (const auto& spec : abbrev.attrs) {
+      if (!ReadAttr(r, unit, spec, v)) {
+        return nullptr;
+      }
+      switch (spec.name) {
+        case DW_AT_name:
+          die.name = v.str;
+          break;
+        case DW_AT_linkage_name:
+        case DW_AT_MIPS_linkage_name:
+          die.linkage_name = v.str;
+          break;
+        case DW_AT_low_pc:
+          die.has_low_pc = AttrAddr(unit, v, die.low_pc);
+          break;
+        case DW_AT_high_pc:
+          die.has_high_pc = true;
+          die.high_pc = v;
+          break;
+        case DW_AT_ranges:
+          die.has_ranges = true;
+          die.ranges = v;
+          break;
+        case DW_AT_abstract_origin:
+        case DW_AT_specification:
+          die.origin = AttrRef(unit, v);
+          break;
+        case DW_AT_call_file:
+          die.call_file = v.value;
+          break;
+        case DW_AT_call_line:
+          die.call_line = static_cast<int64_t>(v.value);
+          break;
+      }
+    }
+    return &abbrev;
+  }
+
+  const Unit* FindUnit(uint64_t offset) const {
+    auto it = std::upper_bound(
+        units_.begin(), units_.end(), offset,
+        [](uint64_t a, const Unit& u) { return a < u.offset; });
+    if (it == units_.begin() || offset >= (--it)->end) {
+      return nullptr;
+    }
+    return &*it;
+  }
+
+  // linkage name of a function, or its name and the DIE of it, following
+  // abstract_origin and specification
+  FuncName FunctionName(const DieInfo& die, uint64_t offset, int depth) {
+    FuncName name;
+    if (die.linkage_name != nullptr) {
+      name.name = die.linkage_name;
+      name.is_linkage = true;
+      return name;
+    }
+    if (die.origin != 0 && depth < 8) {
+      const Unit* unit = FindUnit(die.origin);
+      if (unit != nullptr) {
+        ByteReader r = info_;
+        r.seek(die.origin);
+        DieInfo origin;
+        if (ReadDie(r, *unit, GetAbbrevs(unit->abbrev_offset), origin)) {
+          name = FunctionName(origin, die.origin, depth + 1);
+          if (name.name != nullptr) {
+            return name;
+          }
+        }
+      }
+    }
+    name.name = die.name;
+    name.die = offset;
+    return name;
+  }
+
+  // name prefixed by namespaces and types around its DIE, like
+  // "ns::Class::name"
+  const char* Qualify(const char* name, uint64_t die) {
+    auto it = std::upper_bound(
+        name_scopes_.begin(), name_scopes_.end(), die,
+        [](uint64_t a, const NameScope& s) { return a < s.lo; });
+    uint32_t s = it == name_scopes_.begin()
+                     ? kNoScope
+                     : static_cast<uint32_t>(it - name_scopes_.begin() - 1);
+    while (s != kNoScope && name_scopes_[s].hi <= die) {
+      s = name_scopes_[s].parent;
+    }
+    if (s == kNoScope) {
+      return name;
+    }
+    std::string qualified = name;
+    for (; s != kNoScope; s = name_scopes_[s].parent) {
+      qualified = std::string(name_scopes_[s].name) + "::" + qualified;
+    }
+    return qualified_names_.insert(std::move(qualified)).first->c_str();
+  }
+
+  // append address ranges of a DIE, return false if it has no code
+  bool ReadRanges(const Unit& unit, const DieInfo& die, uint32_t scope) {
+    if (die.has_low_pc && die.has_high_pc) {
+      uint64_t hi = 0;
+      if (!AttrAddr(unit, die.high_pc, hi)) {
+        hi = die.low_pc + die.high_pc.value;  // offset from low_pc
+      }
+      if (die.low_pc == 0 || hi <= die.low_pc) {
+        return false;  // discarded by linker
+      }
+      ranges_.push_back(Range{die.low_pc, hi, scope});
+      return true;
+    }
+    if (!die.has_ranges) {
+      return false;
+    }
+    size_t num_ranges = ranges_.size();
+    uint64_t base = unit.low_pc;
+    if (unit.version < 5) {
+      ByteReader r = ranges_sec_;
+      r.seek(die.ranges.value);
+      const uint64_t kMaxAddr =
+          unit.addr_size == 8 ? UINT64_MAX : uint64_t(UINT32_MAX);
+      while (r.ok() && !r.empty()) {
+        uint64_t lo = r.fixed(unit.addr_size);
+        uint64_t hi = r.fixed(unit.addr_size);
+        if (lo == 0 && hi == 0) {
+          break;
+        } else if (lo == kMaxAddr) {
+          base = hi;
+        } else if (base + lo != 0 && hi > lo) {
+          ranges_.push_back(Range{base + lo, base + hi, scope});
+        }
+      }
+      return ranges_.size() > num_ranges;
+    }
+
+    ByteReader r = rnglists_;
+    uint64_t offset = die.ranges.value;
+    if (die.ranges.form == DW_FORM_rnglistx) {
+      r.seek(unit.rnglists_base + offset * (unit.is64 ? 8 : 4));
+      offset = unit.rnglists_base + r.offset(unit.is64);
+    }
+    r.seek(offset);
+    auto addrx = [&](uint64_t index) {
+      AttrValue v{DW_FORM_addrx, index, nullptr};
+      uint64_t addr = 0;
+      AttrAddr(unit, v, addr);
+      return addr;
+    };
+    auto add = [&](uint64_t lo, uint64_t hi) {
+      if (lo != 0 && hi > lo) {
+        ranges_.push_back(Range{lo, hi, scope});
+      }
+    };
+    while (r.ok() && !r.empty()) {
+      uint8_t kind = r.u8();
+      if (kind == DW_RLE_end_of_list) {
+        break;
+      }
+      switch (kind) {
+        case DW_RLE_base_addressx:
+          base = addrx(r.uleb());
+          break;
+        case DW_RLE_startx_endx: {
+          uint64_t lo = addrx(r.uleb());
+          add(lo, addrx(r.uleb()));
+          break;
+        }
+        case DW_RLE_startx_length: {
+          uint64_t lo = addrx(r.uleb());
+          add(lo, lo + r.uleb());
+          break;
+        }
+        case DW_RLE_offset_pair: {
+          uint64_t lo = r.uleb();
+          add(base + lo, base + r.uleb());
+          break;
+        }
+        case DW_RLE_base_address:
+          base = r.fixed(unit.addr_size);
+          break;
+        case DW_RLE_start_end: {
+          uint64_t lo = r.fixed(unit.addr_size);
+          add(lo, r.fixed(unit.addr_size));
+          break;
+        }
+        case DW_RLE_start_length: {
+          uint64_t lo = r.fixed(unit.addr_size);
+          add(lo, lo + r.uleb());
+          break;
+        }
+        default:
+          return ranges_.size() > num_ranges;  // unknown, stop
+      }
+    }
+    return ranges_.size() > num_ranges;
+  }
+
+  uint32_t FileId(const std::string& path) {
+    auto r = file_ids_.emplace(path, static_cast<uint32_t>(files_.size()));
+    if (r.second) {
+      files_.emplace_back(path);
+    }
+    return r.first->second;
+  }
+
+  // walk all DIEs of a unit for its functions and inlined calls
+  void LoadUnit(const Unit& unit) {
+    if (unit.die_offset >= unit.end) {
+      return;
+    }
+    const AbbrevTable& table = GetAbbrevs(unit.abbrev_offset);
+    ByteReader r = info_;
+    r.seek(unit.die_offset);
+
+    // unit DIE, with line table and files of call_file
+    const char* comp_dir = nullptr;
+    uint64_t stmt_list = UINT64_MAX;
+    {
+      ByteReader header = r;
+      uint64_t code = header.uleb();
+      if (code == 0 || code >= table.size()) {
+        return;
+      }
+      AttrValue v;
+      for (const auto& spec : table[code].attrs) {
+        if (!ReadAttr(header, unit, spec, v)) {
+          return;
+        }
+        if (spec.name == DW_AT_comp_dir) {
+          comp_dir = v.str;
+        } else if (spec.name == DW_AT_stmt_list) {
+          stmt_list = v.value;
+        }
+      }
+    }
+    std::vector<uint32_t> files;
+    if (stmt_list != UINT64_MAX) {
+      LoadLineTable(unit, stmt_list, comp_dir, files);
+    }
+
+    // scope of each level, a DIE with children pushes a level
+    struct Level {
+      uint32_t enclosing;  // innermost scope around children
+      uint32_t created;    // scope created by DIE of this level
+      uint32_t enclosing_name;  // innermost name scope around children
+      uint32_t created_name;    // name scope created by DIE of this level
+    };
+    std::vector<Level> levels;
+    while (r.offset() < unit.end && r.ok()) {
+      uint64_t offset = r.offset();
+      DieInfo die;
+      const Abbrev* abbrev = ReadDie(r, unit, table, die);
+      if (abbrev == nullptr) {
+        if (!r.ok() || levels.empty()) {
+          break;  // null entry at top level, or bad data
+        }
+        if (levels.back().created != kNoScope) {
+          scopes_[levels.back().created].end =
+              static_cast<uint32_t>(scopes_.size());
+        }
+        if (levels.back().created_name != kNoScope) {
+          name_scopes_[levels.back().created_name].hi = r.offset();
+        }
+        levels.pop_back();
+        continue;
+      }
+      uint32_t enclosing = levels.empty() ? kNoScope : levels.back().enclosing;
+      uint32_t enclosing_name =
+          levels.empty() ? kNoScope : levels.back().enclosing_name;
+      uint32_t created = kNoScope;
+      uint32_t created_name = kNoScope;
+      if (abbrev->tag == DW_TAG_subprogram ||
+          abbrev->tag == DW_TAG_inlined_subroutine) {
+        uint32_t index = static_cast<uint32_t>(scopes_.size());
+        uint32_t range_begin = static_cast<uint32_t>(ranges_.size());
+        if (ReadRanges(unit, die, index)) {
+          Scope scope;
+          FuncName name = FunctionName(die, offset, 0);
+          scope.name = name.name != nullptr ? name.name : kFuncUnknown;
+          if (name.name != nullptr && !name.is_linkage) {
+            unqualified_.emplace_back(index, name.die);
+          }
+          // a nested function with code is outermost on its own
+          scope.parent = abbrev->tag == DW_TAG_inlined_subroutine
+                             ? enclosing
+                             : kNoScope;
+          scope.end = index + 1;
+          scope.call_file =
+              die.call_file < files.size() ? files[die.call_file] : UINT32_MAX;
+          scope.call_line = static_cast<int32_t>(die.call_line);
+          scope.range_begin = range_begin;
+          scope.range_end = static_cast<uint32_t>(ranges_.size());
+          scopes_.emplace_back(scope);
+          if (scope.parent == kNoScope) {
+            top_ranges_.insert(top_ranges_.end(),
+                               ranges_.begin() + range_begin, ranges_.end());
+          }
+          created = index;
+        }
+      }
+      if (abbrev->has_children &&
+          (abbrev->tag == DW_TAG_namespace ||
+           (die.name != nullptr && (abbrev->tag == DW_TAG_class_type ||
+                                    abbrev->tag == DW_TAG_structure_type ||
+                                    abbrev->tag == DW_TAG_union_type)))) {
+        created_name = static_cast<uint32_t>(name_scopes_.size());
+        const char* name =
+            die.name != nullptr ? die.name : "(anonymous namespace)";
+        name_scopes_.push_back(NameScope{offset, UINT64_MAX, name,
+                                         enclosing_name});
+      }
+      if (abbrev->has_children) {
+        levels.push_back(Level{created != kNoScope ? created : enclosing,
+                               created,
+                               created_name != kNoScope ? created_name
+                                                        : enclosing_name,
+                               created_name});
+      }
+      if (levels.empty()) {
+        break;  // unit DIE without children
+      }
+    }
+  }
+
+  // parse line number program, files are global ids of its file indices
+  void LoadLineTable(const Unit& unit, uint64_t offset, const char* comp_dir,
+                     std::vector<uint32_t>& files) {
+    ByteReader r = line_;
+    if (!r.seek(offset)) {
+      return;
+    }
+    Unit lu = unit;  // forms in header use format of line table
+    uint64_t length = r.u32();
+    lu.is64 = length == 0xffffffff;
+    if (lu.is64) {
+      length = r.u64();
+    }
+    if (!r.ok() || length > r.size() - r.offset()) {
+      return;
+    }
+    uint64_t end = r.offset() + length;
+    uint16_t version = r.u16();
+    if (version < 2 || version > 5) {
+      return;
+    }
+    if (version >= 5) {
+      lu.addr_size = r.u8();
+      r.u8();  // segment selector size
+    }
+    uint64_t header_length = r.offset(lu.is64);
+    uint64_t program = r.offset() + header_length;
+    uint8_t min_inst_length = r.u8();
+    if (version >= 4) {
+      r.u8();  // max ops per instruction, VLIW only
+    }
+    r.u8();  // default is_stmt
+    int8_t line_base = static_cast<int8_t>(r.u8());
+    uint8_t line_range = r.u8();
+    uint8_t opcode_base = r.u8();
+    std::vector<uint8_t> opcode_lengths(opcode_base, 0);
+    for (int i = 1; i < opcode_base; i++) {
+      opcode_lengths[i] = r.u8();
+    }
+    if (!r.ok() || line_range == 0) {
+      return;
+    }
+
+    auto join = [](const std::string& dir, const char* name) {
+      if (name[0] == '/' || dir.empty()) {
+        return std::string(name);
+      }
+      return dir + (dir.back() == '/' ? "" : "/") + name;
+    };
+    std::vector<std::string> dirs;
+    if (version >= 5) {
+      // entries are described by (content type, form) pairs
+      auto read_entries = [&](std::vector<std::pair<const char*, uint64_t>>&
+                                  entries) {
+        std::vector<AttrSpec> format(r.u8());
+        for (auto& spec : format) {
+          spec.name = r.uleb();
+          spec.form = r.uleb();
+        }
+        uint64_t count = r.uleb();
+        for (uint64_t i = 0; i < count && r.ok(); i++) {
+          std::pair<const char*, uint64_t> entry{"", 0};
+          AttrValue v;
+          for (const auto& spec : format) {
+            if (!ReadAttr(r, lu, spec, v)) {
+              return false;
+            }
+            if (spec.name == DW_LNCT_path && v.str) {
+              entry.first = v.str;
+            } else if (spec.name == DW_LNCT_directory_index) {
+              entry.second = v.value;
+            }
+          }
+          entries.emplace_back(entry);
+        }
+        return r.ok();
+      };
+      std::vector<std::pair<const char*, uint64_t>> dir_entries, file_entries;
+      if (!read_entries(dir_entries) || !read_entries(file_entries)) {
+        return;
+      }
+      for (const auto& d : dir_entries) {
+        dirs.emplace_back(dirs.empty() ? std::string(d.first)
+                                       : join(dirs[0], d.first));
+      }
+      for (const auto& f : file_entries) {
+        const std::string& dir = f.second < dirs.size() ? dirs[f.second] : "";
+        files.emplace_back(FileId(join(dir, f.first)));
+      }
+    } else {
+      // directory 0 and file 0 are the unit itself
+      dirs.emplace_back(comp_dir ? comp_dir : "");
+      while (r.ok()) {
+        const char* dir = r.cstr();
+        if (dir[0] == '\0') {
+          break;
+        }
+        dirs.emplace_back(join(dirs[0], dir));
+      }
+      files.emplace_back(UINT32_MAX);
+      while (r.ok()) {
+        const char* name = r.cstr();
+        if (name[0] == '\0') {
+          break;
+        }
+        uint64_t dir = r.uleb();
+        r.uleb();  // mtime
+        r.uleb();  // length
+        files.emplace_back(
+            FileId(join(dir < dirs.size() ? dirs[dir] : "", name)));
+      }
+    }
+    if (!r.seek(program)) {
+      return;
+    }
+
+    // state machine, rows are only kept if the sequence has an address
+    uint64_t address = 0;
+    uint64_t file = 1;
+    int64_t line = 1;
+    size_t sequence_begin = rows_.size();
+    auto reset = [&]() {
+      address = 0;
+      file = 1;
+      line = 1;
+    };
+    auto emit = [&]() {
+      rows_.push_back(LineRow{address,
+                              file < files.size() ? files[file] : UINT32_MAX,
+                              static_cast<int32_t>(line)});
+      if (rows_.back().file == UINT32_MAX) {
+        rows_.back().file = FileId("??");
+      }
+    };
+    auto end_sequence = [&]() {
+      // rows at the end address are empty, and would hide the next sequence
+      while (rows_.size() > sequence_begin && rows_.back().addr >= address) {
+        rows_.pop_back();
+      }
+      if (rows_.size() > sequence_begin && rows_[sequence_begin].addr == 0) {
+        rows_.resize(sequence_begin);  // discarded by linker
+      } else if (rows_.size() > sequence_begin) {
+        rows_.push_back(LineRow{address, kEndSequence, 0});
+      }
+      sequence_begin = rows_.size();
+      reset();
+    };
+    while (r.offset() < end && r.ok()) {
+      uint8_t opcode = r.u8();
+      if (opcode >= opcode_base) {
+        uint8_t adjusted = opcode - opcode_base;
+        address += (adjusted / line_range) * min_inst_length;
+        line += line_base + adjusted % line_range;
+        emit();
+        continue;
+      }
+      switch (opcode) {
+        case 0: {  // extended
+          uint64_t len = r.uleb();
+          uint64_t next = r.offset() + len;
+          uint8_t ext = len > 0 ? r.u8() : 0;
+          if (ext == DW_LNE_end_sequence) {
+            end_sequence();
+          } else if (ext == DW_LNE_set_address) {
+            address = r.fixed(len - 1 <= 8 ? len - 1 : 8);
+          } else if (ext == DW_LNE_define_file && version < 5) {
+            const char* name = r.cstr();
+            uint64_t dir = r.uleb();
+            files.emplace_back(
+                FileId(join(dir < dirs.size() ? dirs[dir] : "", name)));
+          }
+          r.seek(next);
+          break;
+        }
+        case DW_LNS_copy:
+          emit();
+          break;
+        case DW_LNS_advance_pc:
+          address += r.uleb() * min_inst_length;
+          break;
+        case DW_LNS_advance_line:
+          line += r.sleb();
+          break;
+        case DW_LNS_set_file:
+          file = r.uleb();
+          break;
+        case DW_LNS_const_add_pc:
+          address += ((255 - opcode_base) / line_range) * min_inst_length;
+          break;
+        case DW_LNS_fixed_advance_pc:
+          address += r.u16();
+          break;
+        default:
+          // column, stmt, basic block, prologue, isa and unknown opcodes
+          for (int i = 0; i < opcode_lengths[opcode]; i++) {
+            r.uleb();
+          }
+          break;
+      }
+    }
+    rows_.resize(sequence_begin);  // unterminated sequence
+  }
+
+  // innermost scope containing pc, or kNoScope
+  uint32_t FindScope(uint64_t pc) const {
+    auto it = std::upper_bound(
+        top_ranges_.begin(), top_ranges_.end(), pc,
+        [](uint64_t a, const Range& r) { return a < r.lo; });
+    if (it == top_ranges_.begin() || pc >= (--it)->hi) {
+      return kNoScope;
+    }
+    uint32_t found = it->scope;
+    // descendants in DIE order, skip subtrees not containing pc
+    uint32_t i = found + 1;
+    while (i < scopes_[found].end) {
+      if (scopes_[i].parent != kNoScope && Contains(scopes_[i], pc)) {
+        found = i++;
+      } else {
+        i = scopes_[i].end;
+      }
+    }
+    return found;
+  }
+
+  bool Contains(const Scope& scope, uint64_t pc) const {
+    for (uint32_t i = scope.range_begin; i < scope.range_end; i++) {
+      if (ranges_[i].lo <= pc && pc < ranges_[i].hi) {
+        return true;
+      }
+    }
+    return false;
+  }
+};
+
+const uint32_t ElfModule::kNoScope;
+const uint32_t ElfModule::kEndSequence;
+
+/**
+ * in-process symbolizer, modules are loaded once and kept
+ * - frames of a module without debug info, in it or a separate debug file,
+ *   only get function names
+ * - frames of a module failed to load are left to addr2line
+ * - modules are loaded and resolved concurrently, a loaded module is read
+ *   only so its frames are also resolved in parallel chunks
+ */
+class ElfSymbolizer {
+ public:
+  static ElfSymbolizer* GetInstance() {
+    static ElfSymbolizer instance;
+    return &instance;  // singleton
+  }
+
+  // min frames of a parallel chunk of a module
+  static const size_t kMinChunkFrames = 256;
+
+  /**
+   * resolve frames, frames not resolved are left in frames
+   * - symbol "exec(+0xoffset)" of a frame becomes "exec(name+0xoffset)" like
+   *   backtrace_symbols(), by .symtab or .dynsym of the module
+   */
+  void Resolve(std::vector<Frame*>& frames) {
+    std::mutex left_mutex;
+    std::vector<Frame*> left;
+    resolve_by_module(frames, "ElfSymbolizer", kMinChunkFrames,
+                      [&](ModuleChunk& chunk) {
+                        const ElfModule* module = GetModule(*chunk.exec);
+                        for (size_t i = 0; i < chunk.num_frames; i++) {
+                          Frame* frame = chunk.frames[i];
+                          if (module == nullptr || frame->faddr == nullptr) {
+                            std::lock_guard<std::mutex> lock(left_mutex);
+                            left.emplace_back(frame);
+                            continue;
+                          }
+                          uint64_t pc =
+                              Slice::offset(frame->addr, frame->faddr) +
+                              module->base_vaddr();
+                          module->Symbolize(pc, frame);
+                          SetSymbol(*module, pc, frame);
+                        }
+                      });
+    frames.swap(left);
+  }
+
+ private:
+  // loaded once, module is nullptr if failed
+  struct ModuleEntry {
+    std::once_flag loaded;
+    std::unique_ptr<ElfModule> module;
+  };
+
+  std::mutex mutex_;  // guard modules_
+  std::unordered_map<std::string, std::unique_ptr<ModuleEntry>> modules_;
+
+  ElfSymbolizer() = default;
+
+  static void SetSymbol(const ElfModule& module, uint64_t pc, Frame* frame) {
+    uint64_t start = 0;
+    const char* name = module.FindFunction(pc, &start);
+    size_t paren = frame->symbol.rfind('(');
+    if (name != nullptr && paren != std::string::npos) {
+      char offset[32];
+      snprintf(offset, sizeof(offset), "+0x%lx)", pc - start);
+      frame->symbol.replace(paren + 1, std::string::npos,
+                            std::string(name) + offset);
+    }
+  }
+
+  // load on first use, concurrent callers of the same exec wait for it
+  const ElfModule* GetModule(const std::string& exec) {
+    ModuleEntry* entry;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto& ptr = modules_[exec];
+      if (!ptr) {
+        ptr.reset(new ModuleEntry());
+      }
+      entry = ptr.get();
+    }
+    std::call_once(entry->loaded, [&]() {
+      std::unique_ptr<ElfModule> module(new ElfModule());
+      if (exec != "??" && module->Load(exec)) {
+        entry->module = std::move(module);
+      }
+    });
+    return entry->module.get();
+  }
+};
+
+const size_t ElfSymbolizer::kMinChunkFrames;
\ No newline at end of file
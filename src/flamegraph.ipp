@@ -0,0 +1,357 @@
+#include "ipp_inc.h"
+
+/**
+ * function names of frames for flame graphs, each name and frame is interned
+ * once, so a stack is a list of name ids
+ * - a frame with inlined_by is expanded to its functions, outermost first,
+ *   and the functions inlined into another are suffixed "_[i]" as
+ *   flamegraph.pl annotates them
+ * - an unknown function is "[exec]", so unknown frames of a module merge
+ * - ';' and line breaks are '_', they would break the folded format
+ */
+class FlameNames {
+ public:
+  const std::string& name(uint32_t id) const { return names_[id]; }
+
+  // name ids of a record, outermost first, records are innermost first
+  void Stack(const StackFrames& record, std::vector<uint32_t>& ids) {
+    ids.clear();
+    for (size_t f = record.frames.size(); f-- > 0;) {
+      auto range = Expand(record.frames[f]);
+      ids.insert(ids.end(), frame_names_.begin() + range.first,
+                 frame_names_.begin() + range.second);
+    }
+  }
+
+ private:
+  std::vector<std::string> names_;
+  std::unordered_map<std::string, uint32_t> name_ids_;
+  // [begin, end) in frame_names_ of each frame
+  std::unordered_map<const Frame*, std::pair<uint32_t, uint32_t>> frames_;
+  std::vector<uint32_t> frame_names_;
+
+  std::pair<uint32_t, uint32_t> Expand(const Frame* frame) {
+    auto found = frames_.emplace(frame, std::make_pair(0, 0));
+    if (!found.second) {
+      return found.first->second;
+    }
+    uint32_t begin = frame_names_.size();
+    for (size_t i = frame->inlined_by.size(); i-- > 0;) {
+      frame_names_.push_back(Intern(frame->inlined_by[i].name,
+                                    i + 1 < frame->inlined_by.size()));
+    }
+    if (frame->func == kFuncUnknown) {
+      frame_names_.push_back(Intern("[" + frame->exec + "]", false));
+    } else {
+      frame_names_.push_back(Intern(frame->func, !frame->inlined_by.empty()));
+    }
+    found.first->second = std::make_pair(begin, frame_names_.size());
+    return found.first->second;
+  }
+
+  uint32_t Intern(std::string name, bool inlined) {
+    std::replace_if(
+        name.begin(), name.end(),
+        [](char c) { return c == ';' || c == '\n' || c == '\r'; }, '_');
+    if (inlined) {
+      name += "_[i]";
+    }
+    auto found = name_ids_.emplace(name, names_.size());
+    if (found.second) {
+      names_.push_back(std::move(name));
+    }
+    return found.first->second;
+  }
+};
+
+// weight of a record, negative scores are 0
+static uint64_t flame_weight(const StackFrames& record, FlameWeight weight) {
+  if (weight == kFlameScore) {
+    return record.score > 0 ? record.score : 0;
+  }
+  return record.count;
+}
+
+void StackFramesToFolded(OutputWriter& out,
+                         const std::vector<StackFrames>& records,
+                         FlameWeight weight) {
+  FlameNames names;
+  std::vector<uint32_t> stack;
+  for (const auto& it : records) {
+    uint64_t value = flame_weight(it, weight);
+    if (value == 0 || it.frames.empty()) {
+      continue;
+    }
+    names.Stack(it, stack);
+    for (size_t i = 0; i < stack.size(); i++) {
+      if (i > 0) {
+        out << ';';
+      }
+      out << names.name(stack[i]);
+    }
+    out << ' ' << value << '\n';
+  }
+}
+
+/**
+ * SVG flame graph of records, merged into a call tree by name in a single
+ * pass over the records, the tree is a StackTable of name ids
+ * - the root "all" is at the bottom, callees above their callers, children
+ *   are sorted by name and as wide as their weight, like flamegraph.pl
+ * - frames narrower than kMinWidth are not drawn, nor their callees, so the
+ *   size of the SVG is bounded by its width whatever the number of samples
+ * - colors are hashed from names, warm for functions, aqua if inlined
+ * - a static SVG, the name and weight of a frame are in its <title> tooltip
+ */
+class FlameGraph {
+ public:
+  static constexpr double kWidth = 1200;
+  static constexpr double kPadX = 10;
+  static constexpr double kPadTop = 36;  // for the title
+  static constexpr double kPadBottom = 10;
+  static constexpr double kFrameHeight = 16;
+  static constexpr double kFontSize = 12;
+  static constexpr double kFontWidth = 0.59;  // of kFontSize, Verdana
+  static constexpr double kMinWidth = 0.1;
+
+  FlameGraph() : totals_(1, 0) {}
+
+  void Add(const std::vector<StackFrames>& records, FlameWeight weight) {
+    std::vector<uint32_t> stack;
+    for (const auto& it : records) {
+      uint64_t value = flame_weight(it, weight);
+      if (value == 0 || it.frames.empty()) {
+        continue;
+      }
+      names_.Stack(it, stack);
+      uint32_t node = StackTable::kRoot;
+      totals_[node] += value;
+      for (uint32_t name : stack) {
+        node = tree_.Child(node, reinterpret_cast<const void*>(
+                                     static_cast<uintptr_t>(name)));
+        if (node == totals_.size()) {
+          totals_.push_back(0);
+        }
+        totals_[node] += value;
+      }
+    }
+  }
+
+  void Render(OutputWriter& out, const std::string& title,
+              const char* unit) {
+    std::vector<Rect> rects;
+    Layout(rects);
+    uint32_t max_depth = 0;
+    for (const Rect& r : rects) {
+      max_depth = std::max(max_depth, r.depth);
+    }
+    const double height =
+        kPadTop + (max_depth + 1) * kFrameHeight + kPadBottom;
+    out << "<?xml version=\"1.0\" standalone=\"no\"?>\n"
+        << "<svg version=\"1.1\" width=\"" << kWidth << "\" height=\""
+        << height << "\" viewBox=\"0 0 " << kWidth << ' ' << height
+        << "\" xmlns=\"http://www.w3.org/2000/svg\">\n"
+        << "<style>text { font-family: Verdana, sans-serif; font-size: "
+        << kFontSize << "px; } rect:hover { stroke: black; }</style>\n"
+        << "<rect x=\"0\" y=\"0\" width=\"100%\" height=\"100%\" "
+           "fill=\"rgb(248,248,248)\"/>\n"
+        << "<text x=\"" << kWidth / 2 << "\" y=\"24\" text-anchor=\"middle\" "
+        << "style=\"font-size: 17px\">";
+    out.XmlText(title) << "</text>\n";
+
+    for (const Rect& r : rects) {
+      const std::string& name = r.node == StackTable::kRoot
+                                    ? kRootName
+                                    : names_.name(name_id(r.node));
+      double y = height - kPadBottom - (r.depth + 1) * kFrameHeight;
+      out << "<g><title>";
+      out.XmlText(name) << " (" << totals_[r.node] << ' ' << unit << ", "
+                        << Round(totals_[r.node] * 100.0 / totals_[0])
+                        << "%)</title>"
+                        << "<rect x=\"" << Round(r.x) << "\" y=\"" << y
+                        << "\" width=\"" << Round(r.width) << "\" height=\""
+                        << kFrameHeight - 1 << "\" fill=\"";
+      Color(out, name) << "\" rx=\"2\" ry=\"2\"/>";
+      size_t chars = r.width / (kFontSize * kFontWidth);
+      if (chars >= 3) {
+        out << "<text x=\"" << Round(r.x + 3) << "\" y=\""
+            << y + kFrameHeight - 4.5 << "\">";
+        if (name.size() <= chars) {
+          out.XmlText(name);
+        } else {
+          // no partial UTF-8 sequence
+          size_t n = chars - 2;
+          while (n > 0 && (name[n] & 0xc0) == 0x80) {
+            n--;
+          }
+          out.XmlText(name.data(), n) << "..";
+        }
+        out << "</text>";
+      }
+      out << "</g>\n";
+    }
+    out << "</svg>\n";
+  }
+
+ private:
+  static const std::string kRootName;
+
+  struct Rect {
+    uint32_t node;
+    uint32_t depth;
+    double x;
+    double width;
+  };
+
+  FlameNames names_;
+  StackTable tree_;  // addr of a node is its name id
+  std::vector<uint64_t> totals_;  // inclusive weight of each node
+
+  uint32_t name_id(uint32_t node) const {
+    return static_cast<uint32_t>(reinterpret_cast<uintptr_t>(tree_.addr(node)));
+  }
+
+  static double Round(double v) { return std::round(v * 100) / 100; }
+
+  // rects of nodes wide enough to draw, callers before callees
+  void Layout(std::vector<Rect>& rects) {
+    if (totals_[StackTable::kRoot] == 0) {
+      return;
+    }
+    // children of node i are children[first[i], first[i + 1]), sorted by
+    // name when the node is drawn
+    const uint32_t size = tree_.size();
+    std::vector<uint32_t> first(size + 1, 0);
+    for (uint32_t i = StackTable::kRoot + 1; i < size; i++) {
+      first[tree_.parent(i) + 1]++;
+    }
+    for (uint32_t i = 1; i <= size; i++) {
+      first[i] += first[i - 1];
+    }
+    std::vector<uint32_t> children(size);
+    std::vector<uint32_t> filled(first.begin(), first.end() - 1);
+    for (uint32_t i = StackTable::kRoot + 1; i < size; i++) {
+      children[filled[tree_.parent(i)]++] = i;
+    }
+    const double scale = (kWidth - 2 * kPadX) / totals_[StackTable::kRoot];
+    std::vector<Rect> pending = {
+        Rect{StackTable::kRoot, 0, kPadX, kWidth - 2 * kPadX}};
+    while (!pending.empty()) {
+      Rect r = pending.back();
+      pending.pop_back();
+      rects.push_back(r);
+      auto begin = children.begin() + first[r.node];
+      auto end = children.begin() + first[r.node + 1];
+      std::sort(begin, end, [this](uint32_t a, uint32_t b) {
+        return names_.name(name_id(a)) < names_.name(name_id(b));
+      });
+      double x = r.x;
+      for (auto it = begin; it != end; ++it) {
+        double width = totals_[*it] * scale;
+        if (width >= kMinWidth) {
+          pending.push_back(Rect{*it, r.depth + 1, x, width});
+        }
+        x += width;
+      }
+    }
+  }
+
+  // flamegraph.pl "hot" palette, and "aqua" for inlined functions
+  static OutputWriter& Color(OutputWriter& out, const std::string& name) {
+    uint64_t h = 14695981039346656037ULL;  // FNV-1a
+    for (char c : name) {
+      h = (h ^ static_cast<unsigned char>(c)) * 1099511628211ULL;
+    }
+    double v1 = (h & 0xff) / 255.0;
+    double v2 = (h >> 8 & 0xff) / 255.0;
+    double v3 = (h >> 16 & 0xff) / 255.0;
+    int r, g, b;
+    if (name.size() > 4 && name.compare(name.size() - 4, 4, "_[i]") == 0) {
+      r = 50 + 60 * v1;
+      g = 165 + 55 * v1;
+      b = 165 + 55 * v1;
+    } else {
+      r = 205 + 50 * v3;
+      g = 230 * v1;
+      b = 55 * v2;
+    }
+    return out << "rgb(" << r << ',' << g << ',' << b << ')';
+  }
+};
+
+constexpr double FlameGraph::kWidth;
+constexpr double FlameGraph::kPadX;
+constexpr double FlameGraph::kPadTop;
+constexpr double FlameGraph::kPadBottom;
+constexpr double FlameGraph::kFrameHeight;
+constexpr double FlameGraph::kFontSize;
+constexpr double FlameGraph::kFontWidth;
+constexpr double FlameGraph::kMinWidth;
+const std::string FlameGraph::kRootName = "all";
+
+void StackFramesToFlameGraph(OutputWriter& out,
+                             const std::vector<StackFrames>& records,
+                             FlameWeight weight, const std::string& title) {
+  FlameGraph graph;
+  graph.Add(records, weight);
+  graph.Render(out, title, weight == kFlameScore ? "score" : "samples");
+}
+
+std::string StackFramesToFolded(const std::vector<StackFrames>& records,
+                                FlameWeight weight) {
+  std::string str;
+  OutputWriter out(&str);
+  StackFramesToFolded(out, records, weight);
+  out.Flush();
+  return str;
+}
+
+bool WriteStackFramesFolded(int fd, const std::vector<StackFrames>& records,
+                            FlameWeight weight) {
+  OutputWriter out(fd);
+  StackFramesToFolded(out, records, weight);
+  return out.Flush();
+}
+
+bool WriteStackFramesFolded(FILE* fp, const std::vector<StackFrames>& records,
+                            FlameWeight weight) {
+  OutputWriter out(fp);
+  StackFramesToFolded(out, records, weight);
+  return out.Flush();
+}
+
+std::string StackFramesToFlameGraph(const std::vector<StackFrames>& records,
+                                    FlameWeight weight,
+                                    const std::string& title) {
+  std::string str;
+  OutputWriter out(&str);
+  StackFramesToFlameGraph(out, records, weight, title);
+  out.Flush();
+  return str;
+}
+
+bool WriteFlameGraph(int fd, const std::vector<StackFrames>& records,
+                     FlameWeight weight, const std::string& title) {
+  OutputWriter out(fd);
+  StackFramesToFlameGraph(out, records, weight, title);
+  return out.Flush();
+}
+
+bool WriteFlameGraph(FILE* fp, const std::vector<StackFrames>& records,
+                     FlameWeight weight, const std::string& title) {
+  OutputWriter out(fp);
+  StackFramesToFlameGraph(out, records, weight, title);
+  return out.Flush();
+}
+
+bool DumpFlameGraph(uint8_t id, const std::string& path, FlameWeight weight,
+                    bool since_last_dump) {
+  std::vector<StackFrames> records;
+  Dump(id, records, since_last_dump);
+  FILE* fp = fopen(path.c_str(), "we");
+  if (fp == nullptr) {
+    return false;
+  }
+  bool ok = WriteFlameGraph(fp, records, weight);
+  return fclose(fp) == 0 && ok;
+}
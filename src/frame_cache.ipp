@@ -0,0 +1,90 @@
+#include "ipp_inc.h"
+
+/**
+ * process-wide cache of resolved frames, shared by all channels
+ * - Find() is lock-free, Insert() takes a mutex and is only called for
+ *   addresses never seen before
+ * - frames are never changed or freed after inserted, so Frame* is stable
+ *   for the process lifetime
+ * - open addressing table of frame pointers, a grown table replaces the
+ *   current one, and old tables are kept for readers still probing them
+ */
+class FrameCache {
+ public:
+  static FrameCache* GetInstance() {
+    static FrameCache instance;
+    return &instance;  // singleton
+  }
+
+  // return the cached frame of addr, or nullptr
+  Frame* Find(const void* addr) const {
+    const Table* table = table_.load(std::memory_order_acquire);
+    const size_t mask = table->size - 1;
+    for (size_t pos = hash_addr(addr) & mask;; pos = (pos + 1) & mask) {
+      Frame* frame = table->slots[pos].load(std::memory_order_acquire);
+      if (frame == nullptr || frame->addr == addr) {
+        return frame;
+      }
+    }
+  }
+
+  // cache a resolved frame, or return the frame cached by another thread
+  Frame* Insert(Frame&& frame) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Frame* found = Find(frame.addr);
+    if (found != nullptr) {
+      return found;
+    }
+    frames_.emplace_back(std::move(frame));
+    Frame* inserted = &frames_.back();
+    Table* table = table_.load(std::memory_order_relaxed);
+    if ((frames_.size() + 1) * 2 > table->size) {
+      table = NewTable(table->size * 2);
+      for (const Frame& f : frames_) {
+        Put(table, const_cast<Frame*>(&f));
+      }
+      table_.store(table, std::memory_order_release);
+    } else {
+      Put(table, inserted);
+    }
+    return inserted;
+  }
+
+ private:
+  static const size_t kMinSlots = 1024;
+
+  struct Table {
+    size_t size;  // power of 2
+    std::unique_ptr<std::atomic<Frame*>[]> slots;
+  };
+
+  std::mutex mutex_;           // guard insertion
+  std::deque<Frame> frames_;   // stable on emplace_back
+  std::vector<std::unique_ptr<Table>> tables_;  // never freed
+  std::atomic<Table*> table_;  // current table, load factor <= 0.5
+
+  FrameCache() { table_.store(NewTable(kMinSlots)); }
+
+  static uint64_t hash_addr(const void* addr) { return hash_stack(&addr, 1); }
+
+  Table* NewTable(size_t size) {
+    tables_.emplace_back(new Table{size, std::unique_ptr<std::atomic<Frame*>[]>(
+                                             new std::atomic<Frame*>[size]())});
+    Table* table = tables_.back().get();
+    for (size_t i = 0; i < size; i++) {
+      table->slots[i].store(nullptr, std::memory_order_relaxed);
+    }
+    return table;
+  }
+
+  static void Put(Table* table, Frame* frame) {
+    const size_t mask = table->size - 1;
+    size_t pos = hash_addr(frame->addr) & mask;
+    while (table->slots[pos].load(std::memory_order_relaxed) != nullptr) {
+      pos = (pos + 1) & mask;
+    }
+    table->slots[pos].store(frame, std::memory_order_release);
+  }
+};
+
+const size_t FrameCache::kMinSlots;
@@ -0,0 +1,190 @@
+#include "ipp_inc.h"
+
+// set while running profiler code in current thread, so allocations of
+// profiler itself are neither sampled nor recurse into the hooks
+static thread_local bool tls_in_heap_hook
+    __attribute__((tls_model("initial-exec"))) = false;
+
+// mark current thread as in hook during its scope
+class ScopedHeapHookGuard {
+ public:
+  ScopedHeapHookGuard() : prev_(tls_in_heap_hook) { tls_in_heap_hook = true; }
+  ~ScopedHeapHookGuard() { tls_in_heap_hook = prev_; }
+
+ private:
+  bool prev_;
+};
+
+/**
+ * heap allocation profiler, fed by malloc hooks in malloc_hook.ipp
+ * - allocations are poisson sampled by size, like kSampleScore
+ * - alloc channel: sampled allocations, score is bytes
+ * - live channel: sampled allocations not freed yet, a free debits the count
+ *   and bytes of the allocating stack
+ */
+class HeapProfiler {
+ public:
+  // max stack frames of an allocation
+  static const int kMaxAllocFrames = 64;
+  // skip HeapProfiler::OnAlloc() and the hook
+  static const int kSkipFrames = 2;
+  // live samples are sharded by address
+  static const int kNumShards = 64;
+
+  static bool active() { return active_.load(std::memory_order_relaxed); }
+
+  static bool Start(uint8_t alloc_id, uint8_t live_id, int64_t sample_bytes) {
+    ScopedHeapHookGuard guard;
+    std::lock_guard<std::mutex> lock(GetState().mutex);
+    if (active()) {
+      return false;
+    }
+    alloc_id_ = alloc_id;
+    live_id_ = live_id;
+    sample_bytes_ = std::max<int64_t>(sample_bytes, 1);
+    epoch_.fetch_add(1, std::memory_order_relaxed);
+    active_.store(true, std::memory_order_release);
+    return true;
+  }
+
+  static void Stop() {
+    ScopedHeapHookGuard guard;
+    std::lock_guard<std::mutex> lock(GetState().mutex);
+    active_.store(false, std::memory_order_release);
+    // later frees of sampled allocations are not debited
+    for (auto& shard : GetState().shards) {
+      std::lock_guard<std::mutex> shard_lock(shard.mutex);
+      shard.samples.clear();
+    }
+    num_samples_.store(0, std::memory_order_relaxed);
+  }
+
+  // called by hooks after allocated, ptr may be nullptr
+  static void __attribute__((noinline, optimize("no-omit-frame-pointer")))
+  OnAlloc(void* ptr, size_t size) {
+    if (ptr == nullptr || tls_in_heap_hook) {
+      return;
+    }
+    static thread_local Sampler sampler
+        __attribute__((tls_model("initial-exec"))) = {0, 0};
+    uint32_t epoch = epoch_.load(std::memory_order_relaxed);
+    if (sampler.epoch != epoch) {
+      sampler.epoch = epoch;
+      sampler.countdown = next_poisson_interval(sample_bytes_);
+    }
+    StackStat weight;
+    int64_t bytes = static_cast<int64_t>(size);
+    if (!sample(sampler, kSampleScore, sample_bytes_, bytes, weight)) {
+      return;
+    }
+
+    ScopedHeapHookGuard guard;
+    void* addrs[kMaxAllocFrames];
+    int num_frames = unwind(addrs, kMaxAllocFrames);
+    if (num_frames <= kSkipFrames) {
+      return;
+    }
+    const void* const* stack = addrs + kSkipFrames;
+    size_t depth = num_frames - kSkipFrames;
+    GetInstance(alloc_id_).RecordWeighted(stack, depth, weight);
+    GetInstance(live_id_).RecordWeighted(stack, depth, weight);
+
+    Shard& shard = GetShard(ptr);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto& s = shard.samples[ptr];
+    s.stack.assign(stack, stack + depth);
+    s.weight = weight;
+    num_samples_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // sampled allocation not freed yet
+  struct LiveSample {
+    FramePointers stack;
+    StackStat weight;
+  };
+
+  // called by hooks before freed
+  static void OnFree(void* ptr) {
+    LiveSample s;
+    if (TakeSample(ptr, s)) {
+      Debit(s);
+    }
+  }
+
+  // remove sample of ptr before it is freed, so its address reused by
+  // another thread is not mixed up, return false if not sampled
+  static bool TakeSample(void* ptr, LiveSample& s) {
+    if (ptr == nullptr || tls_in_heap_hook ||
+        num_samples_.load(std::memory_order_relaxed) == 0) {
+      return false;
+    }
+    ScopedHeapHookGuard guard;
+    Shard& shard = GetShard(ptr);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.samples.find(ptr);
+    if (it == shard.samples.end()) {
+      return false;
+    }
+    s = std::move(it->second);
+    shard.samples.erase(it);
+    num_samples_.fetch_sub(1, std::memory_order_relaxed);
+    return true;
+  }
+
+  // put back a sample taken by TakeSample() as ptr is not freed
+  static void RestoreSample(void* ptr, LiveSample& s) {
+    ScopedHeapHookGuard guard;
+    if (!active()) {
+      return;  // samples are cleared by Stop()
+    }
+    Shard& shard = GetShard(ptr);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    shard.samples[ptr] = std::move(s);
+    num_samples_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // debit the allocating stack of a freed sample
+  static void Debit(const LiveSample& s) {
+    ScopedHeapHookGuard guard;
+    // unsigned count wraps back
+    StackStat debit{0 - s.weight.count, -s.weight.score};
+    GetInstance(live_id_).RecordWeighted(s.stack.data(), s.stack.size(),
+                                         debit);
+  }
+
+ private:
+  struct Shard {
+    std::mutex mutex;
+    std::unordered_map<const void*, LiveSample> samples;
+  };
+
+  struct State {
+    std::mutex mutex;  // guard Start() and Stop()
+    Shard shards[kNumShards];
+  };
+
+  static std::atomic<bool> active_;
+  static std::atomic<uint32_t> epoch_;
+  static std::atomic<int64_t> num_samples_;
+  static uint8_t alloc_id_;
+  static uint8_t live_id_;
+  static int64_t sample_bytes_;
+
+  static State& GetState() {
+    static State state;
+    return state;
+  }
+
+  static Shard& GetShard(const void* ptr) {
+    // allocations are at least 16 bytes aligned
+    uintptr_t key = reinterpret_cast<uintptr_t>(ptr) >> 4;
+    return GetState().shards[(key ^ (key >> 7)) % kNumShards];
+  }
+};
+
+std::atomic<bool> HeapProfiler::active_{false};
+std::atomic<uint32_t> HeapProfiler::epoch_{0};
+std::atomic<int64_t> HeapProfiler::num_samples_{0};
+uint8_t HeapProfiler::alloc_id_ = 0;
+uint8_t HeapProfiler::live_id_ = 0;
+int64_t HeapProfiler::sample_bytes_ = 1;
\ No newline at end of file
@@ -0,0 +1,137 @@
+#include "ipp_inc.h"
+
+// interpose malloc/free/new/delete for HeapProfiler, only built with
+// -DBTTRACK_HEAP_PROFILER, nothing is sampled until the program calls
+// StartHeapProfiler()
+#ifdef BTTRACK_HEAP_PROFILER
+
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t n, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+void __libc_free(void* ptr);
+}
+
+namespace {
+
+using bttrack::HeapProfiler;
+
+// keep frame pointer so HeapProfiler::kSkipFrames works
+#define HOOK_FRAME_POINTER \
+  __attribute__((noinline, optimize("no-omit-frame-pointer")))
+
+void* HOOK_FRAME_POINTER hooked_alloc(size_t size) {
+  void* ptr = __libc_malloc(size);
+  if (HeapProfiler::active()) {
+    HeapProfiler::OnAlloc(ptr, size);
+  }
+  return ptr;
+}
+
+void* HOOK_FRAME_POINTER hooked_memalign(size_t alignment, size_t size) {
+  void* ptr = __libc_memalign(alignment, size);
+  if (HeapProfiler::active()) {
+    HeapProfiler::OnAlloc(ptr, size);
+  }
+  return ptr;
+}
+
+inline void hooked_free(void* ptr) {
+  HeapProfiler::OnFree(ptr);
+  __libc_free(ptr);
+}
+
+}  // namespace
+
+extern "C" {
+
+void* HOOK_FRAME_POINTER malloc(size_t size) {
+  void* ptr = __libc_malloc(size);
+  if (HeapProfiler::active()) {
+    HeapProfiler::OnAlloc(ptr, size);
+  }
+  return ptr;
+}
+
+void* HOOK_FRAME_POINTER calloc(size_t n, size_t size) {
+  void* ptr = __libc_calloc(n, size);
+  if (HeapProfiler::active()) {
+    HeapProfiler::OnAlloc(ptr, n * size);
+  }
+  return ptr;
+}
+
+void* HOOK_FRAME_POINTER realloc(void* old_ptr, size_t size) {
+  // take the old sample first, once freed its address may be sampled by
+  // another thread
+  HeapProfiler::LiveSample old_sample;
+  bool sampled = HeapProfiler::TakeSample(old_ptr, old_sample);
+  void* ptr = __libc_realloc(old_ptr, size);
+  // old block is still allocated if failed, freed by realloc(ptr, 0)
+  if (ptr == nullptr && size != 0) {
+    if (sampled) {
+      HeapProfiler::RestoreSample(old_ptr, old_sample);
+    }
+    return ptr;
+  }
+  if (sampled) {
+    HeapProfiler::Debit(old_sample);
+  }
+  if (HeapProfiler::active()) {
+    HeapProfiler::OnAlloc(ptr, size);
+  }
+  return ptr;
+}
+
+void free(void* ptr) { hooked_free(ptr); }
+
+void* memalign(size_t alignment, size_t size) {
+  return hooked_memalign(alignment, size);
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+  return hooked_memalign(alignment, size);
+}
+
+int posix_memalign(void** out, size_t alignment, size_t size) {
+  if (alignment % sizeof(void*) != 0 ||
+      (alignment & (alignment - 1)) != 0) {
+    return EINVAL;
+  }
+  void* ptr = hooked_memalign(alignment, size);
+  if (ptr == nullptr) {
+    return ENOMEM;
+  }
+  *out = ptr;
+  return 0;
+}
+
+}  // extern "C"
+
+void* operator new(size_t size) {
+  void* ptr = hooked_alloc(size);
+  if (ptr == nullptr) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+void* operator new[](size_t size) { return operator new(size); }
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+  return hooked_alloc(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+  return hooked_alloc(size);
+}
+
+void operator delete(void* ptr) noexcept { hooked_free(ptr); }
+void operator delete[](void* ptr) noexcept { hooked_free(ptr); }
+void operator delete(void* ptr, size_t) noexcept { hooked_free(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { hooked_free(ptr); }
+
+#undef HOOK_FRAME_POINTER
+
+#endif  // BTTRACK_HEAP_PROFILER
\ No newline at end of file
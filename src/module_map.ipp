@@ -0,0 +1,169 @@
+#include "ipp_inc.h"
+
+/**
+ * snapshot of loaded modules by dl_iterate_phdr(), without symbol lookup
+ * - an address belongs to the module whose PT_LOAD segment contains it,
+ *   found by binary search on sorted segments
+ * - build-id is read from PT_NOTE in memory, the file is not opened
+ * - Snapshot() is shared and only reloaded when the loader generation
+ *   changes, modules unloaded since the last snapshot are kept unless their
+ *   range is reused, so their frames still resolve after dlclose()
+ * - Refresh() on each new recorded address keeps the snapshot up to date
+ *   before a module of it can be unloaded
+ */
+class ModuleMap {
+ public:
+  struct Module {
+    std::string path;      // the executable is resolved by /proc/self/exe
+    std::string build_id;  // hex, empty if none
+    uintptr_t base;        // address of file offset 0, like dli_fbase
+  };
+
+  // current modules, reloaded if any module was loaded or unloaded
+  static std::shared_ptr<const ModuleMap> Snapshot() {
+    static std::mutex mutex;
+    static std::shared_ptr<const ModuleMap> current;
+    static uint64_t current_generation = 0;
+    uint64_t generation = Generation();
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!current || generation != current_generation) {
+      std::shared_ptr<ModuleMap> map = std::make_shared<ModuleMap>();
+      map->Load();
+      if (current) {
+        map->Retain(*current);
+      }
+      current = std::move(map);
+      current_generation = generation;
+      LoadedGeneration().store(generation, std::memory_order_release);
+    }
+    return current;
+  }
+
+  // reload the snapshot if any module was loaded or unloaded since, without
+  // locking if not
+  static void Refresh() {
+    if (Generation() != LoadedGeneration().load(std::memory_order_acquire)) {
+      Snapshot();
+    }
+  }
+
+  // number of modules loaded and unloaded by the dynamic loader
+  static uint64_t Generation() {
+    uint64_t generation = 0;
+    dl_iterate_phdr(
+        [](struct dl_phdr_info* info, size_t size, void* data) {
+          if (size >= offsetof(struct dl_phdr_info, dlpi_subs) +
+                          sizeof(info->dlpi_subs)) {
+            *static_cast<uint64_t*>(data) = info->dlpi_adds + info->dlpi_subs;
+          }
+          return 1;  // the same for all modules
+        },
+        &generation);
+    return generation;
+  }
+
+  // take a snapshot of modules loaded now
+  void Load() {
+    modules_.clear();
+    segments_.clear();
+    dl_iterate_phdr(&ModuleMap::AddModule, this);
+    std::sort(segments_.begin(), segments_.end(),
+              [](const Segment& a, const Segment& b) { return a.lo < b.lo; });
+  }
+
+  // keep modules of an older snapshot which are unloaded now, if no loaded
+  // module took their address range
+  void Retain(const ModuleMap& old) {
+    std::vector<Segment> retained;
+    for (const Segment& seg : old.segments_) {
+      auto it = std::lower_bound(
+          segments_.begin(), segments_.end(), seg.hi,
+          [](const Segment& s, uintptr_t hi) { return s.lo < hi; });
+      // segments are disjoint, so the last one starting below seg.hi also
+      // ends the highest
+      if (it != segments_.begin() && (--it)->hi > seg.lo) {
+        continue;
+      }
+      retained.push_back(seg);
+    }
+    std::vector<int> module_ids(old.modules_.size(), -1);
+    for (Segment& seg : retained) {
+      int& id = module_ids[seg.module];
+      if (id < 0) {
+        id = modules_.size();
+        modules_.push_back(old.modules_[seg.module]);
+      }
+      seg.module = id;
+      segments_.push_back(seg);
+    }
+    std::sort(segments_.begin(), segments_.end(),
+              [](const Segment& a, const Segment& b) { return a.lo < b.lo; });
+  }
+
+  size_t size() const { return modules_.size(); }
+  const Module& module(size_t i) const { return modules_[i]; }
+
+  // index of module containing addr, or -1
+  int Find(const void* addr) const {
+    uintptr_t pc = reinterpret_cast<uintptr_t>(addr);
+    auto it = std::upper_bound(
+        segments_.begin(), segments_.end(), pc,
+        [](uintptr_t a, const Segment& s) { return a < s.lo; });
+    if (it == segments_.begin() || pc >= (--it)->hi) {
+      return -1;
+    }
+    return it->module;
+  }
+
+ private:
+  struct Segment {
+    uintptr_t lo;
+    uintptr_t hi;
+    int module;
+  };
+
+  std::vector<Module> modules_;
+  std::vector<Segment> segments_;  // sorted by lo
+
+  // generation of the latest snapshot, 0 if none
+  static std::atomic<uint64_t>& LoadedGeneration() {
+    static std::atomic<uint64_t> generation(0);
+    return generation;
+  }
+
+  static int AddModule(struct dl_phdr_info* info, size_t, void* data) {
+    ModuleMap* self = static_cast<ModuleMap*>(data);
+    Module module;
+    if (info->dlpi_name != nullptr && info->dlpi_name[0] != '\0') {
+      module.path = info->dlpi_name;
+    } else {
+      char buf[4096];
+      ssize_t n = readlink("/proc/self/exe", buf, sizeof(buf));
+      module.path = n > 0 ? std::string(buf, n) : std::string("??");
+    }
+    // lowest vaddr of file offset 0, as ElfModule::base_vaddr()
+    bool found_load = false;
+    uintptr_t base_vaddr = 0;
+    int id = self->modules_.size();
+    for (int i = 0; i < info->dlpi_phnum; i++) {
+      const ElfW(Phdr)& ph = info->dlpi_phdr[i];
+      uintptr_t lo = info->dlpi_addr + ph.p_vaddr;
+      if (ph.p_type == PT_LOAD) {
+        if (!found_load || ph.p_vaddr - ph.p_offset < base_vaddr) {
+          base_vaddr = ph.p_vaddr - ph.p_offset;
+          found_load = true;
+        }
+        self->segments_.push_back(Segment{lo, lo + ph.p_memsz, id});
+      } else if (ph.p_type == PT_NOTE && module.build_id.empty()) {
+        module.build_id = parse_build_id(
+            reinterpret_cast<const uint8_t*>(lo), ph.p_memsz);
+      }
+    }
+    if (!found_load) {
+      return 0;
+    }
+    module.base = info->dlpi_addr + base_vaddr;
+    self->modules_.emplace_back(std::move(module));
+    return 0;
+  }
+};
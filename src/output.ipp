@@ -1,39 +1,306 @@
 #include "ipp_inc.h"
 
-void StackFrameToString(std::ostringstream& oss, const StackFrames& stack,
+/**
+ * buffered writer of reports to a fd, a FILE* or a string
+ * - fixed size buffer flushed when full, so writing a report to a file takes
+ *   O(buffer) memory however large it is
+ * - integers and pointers are formatted by hand, the same as std::ostream
+ *   prints them, without locale or stream state
+ * - write errors are sticky, see ok()
+ */
+class OutputWriter {
+ public:
+  static const size_t kBufferSize = 64 << 10;
+
+  explicit OutputWriter(int fd) : fd_(fd) {}
+  explicit OutputWriter(FILE* fp) : fp_(fp) {}
+  explicit OutputWriter(std::string* str) : str_(str) {}
+  ~OutputWriter() { Flush(); }
+
+  OutputWriter(const OutputWriter&) = delete;
+  OutputWriter& operator=(const OutputWriter&) = delete;
+
+  // true if all flushed bytes are written
+  bool ok() const { return ok_; }
+
+  bool Flush() {
+    if (size_ > 0) {
+      Write(buf_.get(), size_);
+      size_ = 0;
+    }
+    if (fp_ != nullptr && fflush(fp_) != 0) {
+      ok_ = false;
+    }
+    return ok_;
+  }
+
+  OutputWriter& Append(const char* s, size_t n) {
+    if (size_ + n > kBufferSize) {
+      Write(buf_.get(), size_);
+      size_ = 0;
+      if (n > kBufferSize) {
+        Write(s, n);
+        return *this;
+      }
+    }
+    memcpy(buf_.get() + size_, s, n);
+    size_ += n;
+    return *this;
+  }
+
+  OutputWriter& operator<<(char c) {
+    if (size_ == kBufferSize) {
+      Write(buf_.get(), size_);
+      size_ = 0;
+    }
+    buf_[size_++] = c;
+    return *this;
+  }
+
+  OutputWriter& operator<<(const char* s) { return Append(s, strlen(s)); }
+  OutputWriter& operator<<(const std::string& s) {
+    return Append(s.data(), s.size());
+  }
+
+  OutputWriter& operator<<(unsigned long long v) {
+    char tmp[20];
+    char* p = tmp + sizeof(tmp);
+    do {
+      *--p = static_cast<char>('0' + v % 10);
+      v /= 10;
+    } while (v != 0);
+    return Append(p, tmp + sizeof(tmp) - p);
+  }
+
+  OutputWriter& operator<<(long long v) {
+    if (v < 0) {
+      *this << '-';
+      // well defined for LLONG_MIN
+      return *this << (0ULL - static_cast<unsigned long long>(v));
+    }
+    return *this << static_cast<unsigned long long>(v);
+  }
+
+  OutputWriter& operator<<(unsigned long v) {
+    return *this << static_cast<unsigned long long>(v);
+  }
+  OutputWriter& operator<<(long v) {
+    return *this << static_cast<long long>(v);
+  }
+  OutputWriter& operator<<(unsigned v) {
+    return *this << static_cast<unsigned long long>(v);
+  }
+  OutputWriter& operator<<(int v) { return *this << static_cast<long long>(v); }
+
+  // "0x" and lowercase hex, "0" for nullptr, as std::ostream
+  OutputWriter& operator<<(const void* ptr) {
+    uintptr_t v = reinterpret_cast<uintptr_t>(ptr);
+    if (v == 0) {
+      return *this << '0';
+    }
+    char tmp[2 + 2 * sizeof(v)];
+    char* p = tmp + sizeof(tmp);
+    for (; v != 0; v >>= 4) {
+      *--p = "0123456789abcdef"[v & 0xf];
+    }
+    *--p = 'x';
+    *--p = '0';
+    return Append(p, tmp + sizeof(tmp) - p);
+  }
+
+  // 6 significant digits, as std::ostream
+  OutputWriter& operator<<(double v) {
+    char tmp[32];
+    int n = snprintf(tmp, sizeof(tmp), "%g", v);
+    return Append(tmp, std::min<size_t>(std::max(n, 0), sizeof(tmp) - 1));
+  }
+
+  // quoted JSON string, '"', '\\' and control characters are escaped, other
+  // bytes are copied as is
+  OutputWriter& JsonString(const std::string& str) {
+    *this << '"';
+    const char* s = str.data();
+    const char* end = s + str.size();
+    while (s < end) {
+      const char* run = s;
+      while (s < end && !NeedsEscape(*s)) {
+        s++;
+      }
+      Append(run, s - run);
+      if (s == end) {
+        break;
+      }
+      unsigned char c = static_cast<unsigned char>(*s++);
+      switch (c) {
+        case '"':
+          Append("\\\"", 2);
+          break;
+        case '\\':
+          Append("\\\\", 2);
+          break;
+        case '\n':
+          Append("\\n", 2);
+          break;
+        case '\r':
+          Append("\\r", 2);
+          break;
+        case '\t':
+          Append("\\t", 2);
+          break;
+        default: {
+          char u[6] = {'\\', 'u', '0', '0', "0123456789abcdef"[c >> 4],
+                       "0123456789abcdef"[c & 0xf]};
+          Append(u, sizeof(u));
+        }
+      }
+    }
+    return *this << '"';
+  }
+
+  // XML character data or attribute value, '&', '<', '>' and '"' are
+  // escaped, control characters not allowed in XML are '?'
+  OutputWriter& XmlText(const char* s, size_t n) {
+    const char* end = s + n;
+    while (s < end) {
+      const char* run = s;
+      while (s < end && !NeedsXmlEscape(*s)) {
+        s++;
+      }
+      Append(run, s - run);
+      if (s == end) {
+        break;
+      }
+      switch (*s++) {
+        case '&':
+          Append("&amp;", 5);
+          break;
+        case '<':
+          Append("&lt;", 4);
+          break;
+        case '>':
+          Append("&gt;", 4);
+          break;
+        case '"':
+          Append("&quot;", 6);
+          break;
+        default:
+          *this << '?';
+      }
+    }
+    return *this;
+  }
+  OutputWriter& XmlText(const std::string& str) {
+    return XmlText(str.data(), str.size());
+  }
+
+  // unsigned LEB128, 7 bits per byte, low bits first
+  OutputWriter& Varint(uint64_t v) {
+    char tmp[10];
+    size_t n = 0;
+    for (; v >= 0x80; v >>= 7) {
+      tmp[n++] = static_cast<char>(v | 0x80);
+    }
+    tmp[n++] = static_cast<char>(v);
+    return Append(tmp, n);
+  }
+
+  // n spaces
+  OutputWriter& Indent(size_t n) {
+    static const char kSpaces[] = "                                ";
+    for (; n > sizeof(kSpaces) - 1; n -= sizeof(kSpaces) - 1) {
+      Append(kSpaces, sizeof(kSpaces) - 1);
+    }
+    return Append(kSpaces, n);
+  }
+
+ private:
+  int fd_ = -1;
+  FILE* fp_ = nullptr;
+  std::string* str_ = nullptr;
+  std::unique_ptr<char[]> buf_{new char[kBufferSize]};
+  size_t size_ = 0;
+  bool ok_ = true;
+
+  // control characters, '"' and '\\'
+  static bool NeedsEscape(char c) {
+    unsigned char u = static_cast<unsigned char>(c);
+    return u < 64 ? (0x4ffffffffULL >> u) & 1 : u == '\\';
+  }
+
+  // control characters but '\t', '\n' and '\r', '"', '&', '<' and '>'
+  static bool NeedsXmlEscape(char c) {
+    unsigned char u = static_cast<unsigned char>(c);
+    return u < 64 && ((0x50000044ffffd9ffULL >> u) & 1);
+  }
+
+  void Write(const char* s, size_t n) {
+    if (!ok_ || n == 0) {
+      return;
+    }
+    if (str_ != nullptr) {
+      str_->append(s, n);
+    } else if (fp_ != nullptr) {
+      ok_ = fwrite(s, 1, n, fp_) == n;
+    } else {
+      while (n > 0) {
+        ssize_t written = write(fd_, s, n);
+        if (written < 0 && errno == EINTR) {
+          continue;
+        }
+        if (written <= 0) {
+          ok_ = false;
+          return;
+        }
+        s += written;
+        n -= written;
+      }
+    }
+  }
+};
+
+const size_t OutputWriter::kBufferSize;
+
+void StackFrameToString(OutputWriter& out, const StackFrames& stack,
                         double sum, double sum_score, bool print_symbol) {
-  oss << "recorded " << stack.count << " times (" << (stack.count / sum * 100.0)
+  out << "recorded " << stack.count << " times (" << (stack.count / sum * 100.0)
       << "%), score " << stack.score << " ("
-      << (stack.score / sum_score * 100.0) << "%), stack:" << std::endl;
+      << (stack.score / sum_score * 100.0) << "%)";
+  if (stack.count_error > 0 || stack.score_error > 0) {
+    out << ", error +-" << stack.count_error << " times, score +-"
+        << stack.score_error;
+  }
+  out << ", stack:" << '\n';
   for (size_t f = 0; f < stack.frames.size(); f++) {
     auto* frame = stack.frames[f];
-    oss << "#" << f << (f < 10 ? "  " : " ") << frame->func;
-    oss << " at " << frame->file << ":";
+    out << "#" << f << (f < 10 ? "  " : " ") << frame->func;
+    out << " at " << frame->file << ":";
     if (frame->line >= 0) {
-      oss << frame->line;
+      out << frame->line;
     } else {
-      oss << "?";
+      out << "?";
     }
     if (frame->faddr) {
       void* offset = (void*)((char*)frame->addr - (char*)frame->faddr);
-      oss << " (" << frame->exec << "+" << offset << ")";
+      out << " (" << frame->exec << "+" << offset << ")";
     } else {
-      oss << " (" << frame->exec << "+?)";
+      out << " (" << frame->exec << "+?)";
     }
     if (!frame->inlined_by.empty()) {
-      oss << " (inlined by " << frame->inlined_by.size() << ")";
+      out << " (inlined by " << frame->inlined_by.size() << ")";
     }
     if (print_symbol) {
-      oss << " <symbol=" << frame->symbol << ">";
+      out << " <symbol=" << frame->symbol << ">";
     }
-    oss << std::endl;
+    out << '\n';
   }
 }
 
-std::string StackFramesToString(const std::vector<StackFrames>& records,
-                                bool print_symbol) {
+void StackFramesToString(OutputWriter& out,
+                         const std::vector<StackFrames>& records,
+                         bool print_symbol) {
   if (records.empty()) {
-    return "Report: no records.";
+    out << "Report: no records.";
+    return;
   }
   uint64_t sum = 0;
   int64_t sum_score = 0;
@@ -41,66 +308,182 @@ std::string StackFramesToString(const std::vector<StackFrames>& records,
     sum += it.count;
     sum_score += it.score;
   }
-  std::ostringstream oss;
-  oss << "Stack format: #N func at file:line (exec+offset)";
+  out << "Stack format: #N func at file:line (exec+offset)";
   if (print_symbol) {
-    oss << " <symbol=...>";
+    out << " <symbol=...>";
   }
-  oss << std::endl
+  out << '\n'
       << "Report: total " << sum << " records, score " << sum_score << ", in "
-      << records.size() << " different stack frames:" << std::endl;
+      << records.size() << " different stack frames:" << '\n';
   for (size_t i = 0; i < records.size(); i++) {
     const auto& it = records[i];
-    oss << "[" << i << "] ";
-    StackFrameToString(oss, it, (double)sum, (double)sum_score, print_symbol);
-    oss << std::endl;
+    out << "[" << i << "] ";
+    StackFrameToString(out, it, (double)sum, (double)sum_score, print_symbol);
+    out << '\n';
+  }
+}
+
+// frame as a JSON object, with the inlined functions if inlined, otherwise
+// only their number
+void FrameToJson(OutputWriter& out, const Frame& frame, bool inlined) {
+  void* offset =
+      frame.faddr ? (void*)((char*)frame.addr - (char*)frame.faddr) : 0;
+  out << "{\"address\": " << (uintptr_t)frame.addr << ", \"function\": ";
+  out.JsonString(frame.func) << ", \"file\": ";
+  out.JsonString(frame.file) << ", \"line\": " << frame.line << ", \"exec\": ";
+  out.JsonString(frame.exec) << ", \"offset\": " << (uintptr_t)offset
+                             << ", \"symbol\": ";
+  out.JsonString(frame.symbol) << ", \"inlined_by\": ";
+  if (!inlined) {
+    out << frame.inlined_by.size() << "}";
+    return;
+  }
+  out << "[";
+  for (size_t i = 0; i < frame.inlined_by.size(); i++) {
+    const Frame::Func& func = frame.inlined_by[i];
+    out << (i > 0 ? ", " : "") << "{\"function\": ";
+    out.JsonString(func.name) << ", \"file\": ";
+    out.JsonString(func.file) << ", \"line\": " << func.line << "}";
+  }
+  out << "]}";
+}
+
+// stack statistics of a record, without frames
+void StackStatToJson(OutputWriter& out, const StackFrames& stack) {
+  out << "\"count\": " << stack.count << ", \"score\": " << stack.score;
+  if (stack.count_error > 0 || stack.score_error > 0) {
+    out << ", \"count_error\": " << stack.count_error
+        << ", \"score_error\": " << stack.score_error;
   }
-  return oss.str();
 }
 
-void StackFrameToJson(std::ostringstream& oss, const StackFrames& stack,
+void StackFrameToJson(OutputWriter& out, const StackFrames& stack,
                       int indent) {
-  const std::string ind3(3 * indent, ' ');
-  const std::string ind4(4 * indent, ' ');
+  const size_t ind3 = 3 * indent;
+  const size_t ind4 = 4 * indent;
   if (indent > 0) {
-    oss << "{" << std::endl
-        << ind3 << "\"count\": " << stack.count << "," << std::endl
-        << ind3 << "\"score\": " << stack.score << "," << std::endl
-        << ind3 << "\"frames\": [";
+    out << "{" << '\n';
+    out.Indent(ind3) << "\"count\": " << stack.count << "," << '\n';
+    out.Indent(ind3) << "\"score\": " << stack.score << "," << '\n';
+    if (stack.count_error > 0 || stack.score_error > 0) {
+      out.Indent(ind3) << "\"count_error\": " << stack.count_error << ","
+                       << '\n';
+      out.Indent(ind3) << "\"score_error\": " << stack.score_error << ","
+                       << '\n';
+    }
+    out.Indent(ind3) << "\"frames\": [";
   } else {
-    oss << "{\"count\": " << stack.count << ", \"score\": " << stack.score
-        << ", \"frames\": [";
+    out << "{";
+    StackStatToJson(out, stack);
+    out << ", \"frames\": [";
   }
   for (size_t f = 0; f < stack.frames.size(); f++) {
-    auto* frame = stack.frames[f];
-    void* offset =
-        frame->faddr ? (void*)((char*)frame->addr - (char*)frame->faddr) : 0;
     if (indent > 0) {
-      oss << std::endl << ind4;
-    }
-    oss << "{\"address\": " << (uintptr_t)frame->addr << ", \"function\": \""
-        << frame->func << "\", \"file\": \"" << frame->file
-        << "\", \"line\": " << frame->line << ", \"exec\": \"" << frame->exec
-        << "\", \"offset\": " << (uintptr_t)offset << ", \"symbol\": \""
-        << frame->symbol << "\", \"inlined_by\": " << frame->inlined_by.size()
-        << "}";
+      out << '\n';
+      out.Indent(ind4);
+    }
+    FrameToJson(out, *stack.frames[f], false);
     if (f < stack.frames.size() - 1) {
-      oss << ", ";
+      out << ", ";
     }
   }
   if (indent > 0) {
-    oss << std::endl
-        << ind3 << "]" << std::endl
-        << std::string(2 * indent, ' ') << "}";
+    out << '\n';
+    out.Indent(ind3) << "]" << '\n';
+    out.Indent(2 * indent) << "}";
   } else {
-    oss << "]}";
+    out << "]}";
   }
 }
 
-std::string StackFramesToJson(const std::vector<StackFrames>& records,
-                              int indent) {
+/**
+ * kJsonFrameTable, each frame is written once in "frames", and frames of a
+ * record are indices into it, innermost first
+ * - frames are deduplicated by Frame*, which is unique per address in the
+ *   results of a dump, in the order first seen
+ * - one frame or record per line if indent > 0
+ */
+void StackFramesToJsonTable(OutputWriter& out,
+                            const std::vector<StackFrames>& records,
+                            int indent) {
+  uint64_t sum = 0;
+  int64_t sum_score = 0;
+  std::vector<const Frame*> frames;
+  std::unordered_map<const Frame*, uint32_t> frame_ids;
+  std::vector<uint32_t> frame_refs;  // frame indices of all records
+  for (const auto& it : records) {
+    sum += it.count;
+    sum_score += it.score;
+    for (const Frame* frame : it.frames) {
+      auto found = frame_ids.emplace(frame, frames.size());
+      if (found.second) {
+        frames.push_back(frame);
+      }
+      frame_refs.push_back(found.first->second);
+    }
+  }
+  // start an element of an object or array at depth, one per line if
+  // indent > 0
+  auto next = [&](size_t i, int depth) {
+    if (i > 0) {
+      out << ",";
+    }
+    if (indent > 0) {
+      out << '\n';
+      out.Indent(depth * indent);
+    } else if (i > 0) {
+      out << ' ';
+    }
+  };
+  // end an object or array at depth
+  auto close = [&](char c, int depth, bool empty) {
+    if (indent > 0 && !empty) {
+      out << '\n';
+      out.Indent(depth * indent);
+    }
+    out << c;
+  };
+  out << "{";
+  next(0, 1);
+  out << "\"version\": " << static_cast<int>(kJsonFrameTable);
+  next(1, 1);
+  out << "\"sum\": " << sum;
+  next(2, 1);
+  out << "\"sum_score\": " << sum_score;
+  next(3, 1);
+  out << "\"frames\": [";
+  for (size_t i = 0; i < frames.size(); i++) {
+    next(i, 2);
+    FrameToJson(out, *frames[i], true);
+  }
+  close(']', 1, frames.empty());
+  next(4, 1);
+  out << "\"records\": [";
+  const uint32_t* ref = frame_refs.data();
+  for (size_t i = 0; i < records.size(); i++) {
+    next(i, 2);
+    out << "{";
+    StackStatToJson(out, records[i]);
+    out << ", \"frames\": [";
+    for (size_t f = 0; f < records[i].frames.size(); f++) {
+      out << (f > 0 ? ", " : "") << *ref++;
+    }
+    out << "]}";
+  }
+  close(']', 1, records.empty());
+  close('}', 0, false);
+}
+
+void StackFramesToJson(OutputWriter& out,
+                       const std::vector<StackFrames>& records, int indent,
+                       JsonFormat format) {
+  if (format == kJsonFrameTable) {
+    StackFramesToJsonTable(out, records, indent);
+    return;
+  }
   if (records.empty()) {
-    return "{\"sum\": 0, \"sum_score\": 0, \"records\": []}";
+    out << "{\"sum\": 0, \"sum_score\": 0, \"records\": []}";
+    return;
   }
   uint64_t sum = 0;
   int64_t sum_score = 0;
@@ -108,31 +491,76 @@ std::string StackFramesToJson(const std::vector<StackFrames>& records,
     sum += it.count;
     sum_score += it.score;
   }
-  std::ostringstream oss;
   if (indent > 0) {
-    const std::string ind(indent, ' ');
-    oss << "{" << std::endl
-        << ind << "\"sum\": " << sum << "," << std::endl
-        << ind << "\"sum_score\": " << sum_score << "," << std::endl
-        << ind << "\"records\": [";
+    out << "{" << '\n';
+    out.Indent(indent) << "\"sum\": " << sum << "," << '\n';
+    out.Indent(indent) << "\"sum_score\": " << sum_score << "," << '\n';
+    out.Indent(indent) << "\"records\": [";
   } else {
-    oss << "{\"sum\": " << sum << ", \"sum_score\": " << sum_score
+    out << "{\"sum\": " << sum << ", \"sum_score\": " << sum_score
         << ", \"records\": [";
   }
   for (size_t i = 0; i < records.size(); i++) {
     const auto& it = records[i];
     if (indent > 0) {
-      oss << std::endl << std::string(2 * indent, ' ');
+      out << '\n';
+      out.Indent(2 * indent);
     }
-    StackFrameToJson(oss, it, indent);
+    StackFrameToJson(out, it, indent);
     if (i < records.size() - 1) {
-      oss << ",";
+      out << ",";
     }
   }
   if (indent > 0) {
-    oss << std::endl << std::string(indent, ' ') << "]" << std::endl << "}";
+    out << '\n';
+    out.Indent(indent) << "]" << '\n' << "}";
   } else {
-    oss << "]}";
+    out << "]}";
   }
-  return oss.str();
+}
+
+std::string StackFramesToString(const std::vector<StackFrames>& records,
+                                bool print_symbol) {
+  std::string str;
+  OutputWriter out(&str);
+  StackFramesToString(out, records, print_symbol);
+  out.Flush();
+  return str;
+}
+
+std::string StackFramesToJson(const std::vector<StackFrames>& records,
+                              int indent, JsonFormat format) {
+  std::string str;
+  OutputWriter out(&str);
+  StackFramesToJson(out, records, indent, format);
+  out.Flush();
+  return str;
+}
+
+bool WriteStackFrames(int fd, const std::vector<StackFrames>& records,
+                      bool print_symbol) {
+  OutputWriter out(fd);
+  StackFramesToString(out, records, print_symbol);
+  return out.Flush();
+}
+
+bool WriteStackFrames(FILE* fp, const std::vector<StackFrames>& records,
+                      bool print_symbol) {
+  OutputWriter out(fp);
+  StackFramesToString(out, records, print_symbol);
+  return out.Flush();
+}
+
+bool WriteStackFramesJson(int fd, const std::vector<StackFrames>& records,
+                          int indent, JsonFormat format) {
+  OutputWriter out(fd);
+  StackFramesToJson(out, records, indent, format);
+  return out.Flush();
+}
+
+bool WriteStackFramesJson(FILE* fp, const std::vector<StackFrames>& records,
+                          int indent, JsonFormat format) {
+  OutputWriter out(fp);
+  StackFramesToJson(out, records, indent, format);
+  return out.Flush();
 }
@@ -0,0 +1,459 @@
+#include "ipp_inc.h"
+
+/**
+ * protobuf wire format encoder, enough for profile.proto
+ * - fields are appended in the order written, zero varints are omitted as
+ *   proto3 defaults
+ * - a nested message is encoded by its own encoder and appended with its
+ *   length
+ */
+class ProtoEncoder {
+ public:
+  const std::string& data() const { return data_; }
+  void clear() { data_.clear(); }
+
+  void Varint(uint64_t v) {
+    char buf[10];
+    size_t n = 0;
+    for (; v >= 0x80; v >>= 7) {
+      buf[n++] = static_cast<char>(v | 0x80);
+    }
+    buf[n++] = static_cast<char>(v);
+    data_.append(buf, n);
+  }
+
+  // uint64, int64 (negative is 10 bytes) or bool
+  void Int(int field, uint64_t v) {
+    if (v != 0) {
+      Varint(static_cast<uint64_t>(field) << 3);  // wire type 0
+      Varint(v);
+    }
+  }
+
+  void Bytes(int field, const char* data, size_t size) {
+    Varint(static_cast<uint64_t>(field) << 3 | 2);  // wire type 2
+    Varint(size);
+    data_.append(data, size);
+  }
+
+  void String(int field, const std::string& s) {
+    Bytes(field, s.data(), s.size());
+  }
+
+  void Message(int field, const ProtoEncoder& msg) {
+    Bytes(field, msg.data_.data(), msg.data_.size());
+  }
+
+  // packed repeated varints
+  void Packed(int field, const std::vector<uint64_t>& values) {
+    if (values.empty()) {
+      return;
+    }
+    ProtoEncoder packed;
+    for (uint64_t v : values) {
+      packed.Varint(v);
+    }
+    Message(field, packed);
+  }
+
+ private:
+  std::string data_;
+};
+
+/**
+ * pprof profile of dumped records, see
+ * https://github.com/google/pprof/blob/main/proto/profile.proto
+ * - sample types are count and score, values of a sample are count and score
+ *   of its record
+ * - a location per Frame*, its lines are the frame then inlined_by, so the
+ *   last line is the function the others are inlined into
+ * - a function per name and file, a mapping per exec with a load base,
+ *   build-id is taken from loaded modules if the same file is still loaded
+ */
+class PprofBuilder {
+ public:
+  // fields of profile.proto
+  enum ProfileField {
+    kSampleType = 1,
+    kSample = 2,
+    kMapping = 3,
+    kLocation = 4,
+    kFunction = 5,
+    kStringTable = 6,
+    kTimeNanos = 9,
+  };
+
+  explicit PprofBuilder(const std::string& score_unit) {
+    strings_.push_back("");  // string_table[0] must be ""
+    string_ids_[""] = 0;
+    ProtoEncoder value_type;
+    value_type.Int(1, String("count"));
+    value_type.Int(2, String("count"));
+    profile_.Message(kSampleType, value_type);
+    value_type.clear();
+    value_type.Int(1, String("score"));
+    value_type.Int(2, String(score_unit));
+    profile_.Message(kSampleType, value_type);
+  }
+
+  void AddSample(const StackFrames& record) {
+    location_ids_.clear();
+    for (const Frame* frame : record.frames) {
+      location_ids_.push_back(Location(frame));
+    }
+    ProtoEncoder sample;
+    sample.Packed(1, location_ids_);
+    values_.assign({record.count, static_cast<uint64_t>(record.score)});
+    sample.Packed(2, values_);
+    profile_.Message(kSample, sample);
+  }
+
+  // encoded profile, called once after all samples are added
+  std::string Finish() {
+    std::shared_ptr<const ModuleMap> modules = ModuleMap::Snapshot();
+    ProtoEncoder mappings;
+    ProtoEncoder msg;
+    for (size_t i = 0; i < mappings_.size(); i++) {
+      const Mapping& m = mappings_[i];
+      std::string build_id;
+      int found = modules->Find(reinterpret_cast<const void*>(m.start));
+      if (found >= 0 && modules->module(found).base == m.start &&
+          modules->module(found).path == *m.exec) {
+        build_id = modules->module(found).build_id;
+      }
+      msg.clear();
+      msg.Int(1, i + 1);
+      msg.Int(2, m.start);
+      msg.Int(3, m.limit);
+      msg.Int(5, String(*m.exec));
+      msg.Int(6, String(build_id));
+      msg.Int(7, m.has_functions);
+      msg.Int(8, m.has_lines);
+      msg.Int(9, m.has_lines);
+      msg.Int(10, m.has_inlined);
+      mappings.Message(kMapping, msg);
+    }
+    ProtoEncoder tail;
+    for (const std::string& s : strings_) {
+      tail.String(kStringTable, s);
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    tail.Int(kTimeNanos, ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+    // fields of a message may be in any order, repeated ones keep theirs
+    return profile_.data() + mappings.data() + locations_.data() +
+           functions_.data() + tail.data();
+  }
+
+ private:
+  struct Mapping {
+    const std::string* exec;
+    uint64_t start;
+    uint64_t limit;  // past the highest address seen
+    bool has_functions;
+    bool has_lines;
+    bool has_inlined;
+  };
+
+  ProtoEncoder profile_;    // sample types and samples
+  ProtoEncoder locations_;  // repeated Location fields of profile
+  ProtoEncoder functions_;  // repeated Function fields of profile
+  std::vector<std::string> strings_;
+  std::unordered_map<std::string, uint64_t> string_ids_;
+  std::unordered_map<const Frame*, uint64_t> location_ids_by_frame_;
+  std::map<std::pair<uint64_t, uint64_t>, uint64_t> function_ids_;
+  std::map<std::pair<std::string, uint64_t>, uint64_t> mapping_ids_;
+  std::vector<Mapping> mappings_;
+  std::vector<uint64_t> location_ids_;  // of current sample
+  std::vector<uint64_t> values_;        // of current sample
+
+  uint64_t String(const std::string& s) {
+    auto it = string_ids_.emplace(s, strings_.size());
+    if (it.second) {
+      strings_.push_back(s);
+    }
+    return it.first->second;
+  }
+
+  uint64_t Function(const std::string& name, const std::string& file) {
+    uint64_t name_id = String(name);
+    uint64_t file_id = String(file);
+    auto it = function_ids_.emplace(std::make_pair(name_id, file_id),
+                                    function_ids_.size() + 1);
+    if (it.second) {
+      ProtoEncoder msg;
+      msg.Int(1, it.first->second);
+      msg.Int(2, name_id);
+      msg.Int(3, name_id);  // system_name
+      msg.Int(4, file_id);
+      functions_.Message(kFunction, msg);
+    }
+    return it.first->second;
+  }
+
+  // 0 if frame has no module
+  uint64_t MappingOf(const Frame& frame) {
+    if (frame.faddr == nullptr) {
+      return 0;
+    }
+    uint64_t start = reinterpret_cast<uintptr_t>(frame.faddr);
+    auto it = mapping_ids_.emplace(std::make_pair(frame.exec, start),
+                                   mappings_.size() + 1);
+    if (it.second) {
+      mappings_.push_back(
+          Mapping{&it.first->first.first, start, start, false, false, false});
+    }
+    Mapping& m = mappings_[it.first->second - 1];
+    m.limit = std::max<uint64_t>(m.limit,
+                                 reinterpret_cast<uintptr_t>(frame.addr) + 1);
+    m.has_functions |= frame.func != kFuncUnknown;
+    m.has_lines |= frame.line >= 0;
+    m.has_inlined |= !frame.inlined_by.empty();
+    return it.first->second;
+  }
+
+  uint64_t Location(const Frame* frame) {
+    auto it = location_ids_by_frame_.emplace(
+        frame, location_ids_by_frame_.size() + 1);
+    if (!it.second) {
+      return it.first->second;
+    }
+    ProtoEncoder msg;
+    ProtoEncoder line;
+    msg.Int(1, it.first->second);
+    msg.Int(2, MappingOf(*frame));
+    msg.Int(3, reinterpret_cast<uintptr_t>(frame->addr));
+    // an unknown function is left to pprof, which shows its address
+    if (frame->func != kFuncUnknown || !frame->inlined_by.empty()) {
+      line.Int(1, Function(frame->func, frame->file));
+      line.Int(2, std::max(frame->line, 0));
+      msg.Message(4, line);
+      for (const Frame::Func& caller : frame->inlined_by) {
+        line.clear();
+        line.Int(1, Function(caller.name, caller.file));
+        line.Int(2, std::max(caller.line, 0));
+        msg.Message(4, line);
+      }
+    }
+    locations_.Message(kLocation, msg);
+    return it.first->second;
+  }
+};
+
+static const uint32_t* crc32_table() {
+  static uint32_t table[256];
+  static std::once_flag once;
+  std::call_once(once, [] {
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; k++) {
+        c = c & 1 ? 0xedb88320U ^ (c >> 1) : c >> 1;
+      }
+      table[i] = c;
+    }
+  });
+  return table;
+}
+
+// CRC-32 of gzip trailer
+static uint32_t crc32(const std::string& data) {
+  const uint32_t* table = crc32_table();
+  uint32_t c = 0xffffffffU;
+  for (unsigned char b : data) {
+    c = table[(c ^ b) & 0xff] ^ (c >> 8);
+  }
+  return c ^ 0xffffffffU;
+}
+
+/**
+ * deflate with fixed Huffman codes, in a single block
+ * - greedy LZ77 matching on a 32KB window, candidates by hash of 3 bytes
+ *   with a bounded chain, so it is linear in input size
+ * - about half the ratio of zlib on profiles, only used without zlib
+ */
+class FixedDeflate {
+ public:
+  static const int kWindowSize = 32768;
+  static const int kHashBits = 15;
+  static const int kMaxChain = 16;
+  static const int kMinMatch = 3;
+  static const int kMaxMatch = 258;
+
+  static void Compress(const std::string& in, std::string& out) {
+    FixedDeflate d(out);
+    d.Put(1, 1);  // BFINAL
+    d.Put(1, 2);  // BTYPE fixed Huffman
+    const unsigned char* s = reinterpret_cast<const unsigned char*>(in.data());
+    const int n = static_cast<int>(in.size());
+    std::vector<int> head(1 << kHashBits, -1);
+    std::vector<int> prev(kWindowSize, -1);
+    auto insert = [&](int pos) {
+      if (pos + kMinMatch <= n) {
+        uint32_t h = Hash(s + pos);
+        prev[pos & (kWindowSize - 1)] = head[h];
+        head[h] = pos;
+      }
+    };
+    for (int pos = 0; pos < n;) {
+      int best_len = 0;
+      int best_dist = 0;
+      if (pos + kMinMatch <= n) {
+        int max_len = std::min(kMaxMatch, n - pos);
+        int cand = head[Hash(s + pos)];
+        for (int chain = 0; cand >= 0 && pos - cand <= kWindowSize &&
+                            chain < kMaxChain;
+             chain++) {
+          if (s[cand + best_len] == s[pos + best_len]) {
+            int len = 0;
+            while (len < max_len && s[cand + len] == s[pos + len]) {
+              len++;
+            }
+            if (len > best_len) {
+              best_len = len;
+              best_dist = pos - cand;
+              if (len == max_len) {
+                break;
+              }
+            }
+          }
+          int next = prev[cand & (kWindowSize - 1)];
+          if (next >= cand) {
+            break;  // overwritten by a later position
+          }
+          cand = next;
+        }
+      }
+      if (best_len >= kMinMatch) {
+        d.Match(best_len, best_dist);
+        for (int end = pos + best_len; pos < end; pos++) {
+          insert(pos);
+        }
+      } else {
+        d.Symbol(s[pos]);
+        insert(pos++);
+      }
+    }
+    d.Symbol(256);  // end of block
+    d.Flush();
+  }
+
+ private:
+  std::string& out_;
+  uint64_t bits_ = 0;
+  int num_bits_ = 0;
+
+  explicit FixedDeflate(std::string& out) : out_(out) {}
+
+  static uint32_t Hash(const unsigned char* p) {
+    uint32_t v = p[0] | p[1] << 8 | p[2] << 16;
+    return (v * 0x9e3779b1U) >> (32 - kHashBits);
+  }
+
+  // n bits of v, least significant first
+  void Put(uint32_t v, int n) {
+    bits_ |= static_cast<uint64_t>(v) << num_bits_;
+    num_bits_ += n;
+    while (num_bits_ >= 8) {
+      out_ += static_cast<char>(bits_ & 0xff);
+      bits_ >>= 8;
+      num_bits_ -= 8;
+    }
+  }
+
+  void Flush() {
+    if (num_bits_ > 0) {
+      out_ += static_cast<char>(bits_ & 0xff);
+    }
+    bits_ = 0;
+    num_bits_ = 0;
+  }
+
+  // Huffman codes are stored most significant bit first
+  void Code(uint32_t code, int n) {
+    uint32_t reversed = 0;
+    for (int i = 0; i < n; i++) {
+      reversed = reversed << 1 | ((code >> i) & 1);
+    }
+    Put(reversed, n);
+  }
+
+  // literal, end of block or length code
+  void Symbol(int sym) {
+    if (sym < 144) {
+      Code(0x30 + sym, 8);
+    } else if (sym < 256) {
+      Code(0x190 + sym - 144, 9);
+    } else if (sym < 280) {
+      Code(sym - 256, 7);
+    } else {
+      Code(0xc0 + sym - 280, 8);
+    }
+  }
+
+  void Match(int len, int dist) {
+    static const uint16_t kLenBase[29] = {
+        3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+        31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+    static const uint8_t kLenExtra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+                                          1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                                          4, 4, 4, 4, 5, 5, 5, 5, 0};
+    static const uint16_t kDistBase[30] = {
+        1,    2,    3,    4,    5,    7,     9,     13,    17,  25,
+        33,   49,   65,   97,   129,  193,   257,   385,   513, 769,
+        1025, 1537, 2049, 3073, 4097, 6145,  8193,  12289, 16385, 24577};
+    static const uint8_t kDistExtra[30] = {0, 0, 0,  0,  1,  1,  2,  2,
+                                           3, 3, 4,  4,  5,  5,  6,  6,
+                                           7, 7, 8,  8,  9,  9,  10, 10,
+                                           11, 11, 12, 12, 13, 13};
+    int l = 28;
+    while (kLenBase[l] > len) {
+      l--;
+    }
+    Symbol(257 + l);
+    Put(len - kLenBase[l], kLenExtra[l]);
+    int d = 29;
+    while (kDistBase[d] > dist) {
+      d--;
+    }
+    Code(d, 5);
+    Put(dist - kDistBase[d], kDistExtra[d]);
+  }
+};
+
+const int FixedDeflate::kWindowSize;
+const int FixedDeflate::kHashBits;
+const int FixedDeflate::kMaxChain;
+const int FixedDeflate::kMinMatch;
+const int FixedDeflate::kMaxMatch;
+
+// gzip by the built-in deflate
+bool gzip_builtin(const std::string& in, std::string& out) {
+  static const char kHeader[10] = {'\x1f', '\x8b', 8, 0, 0, 0, 0, 0, 0, 3};
+  out.assign(kHeader, sizeof(kHeader));
+  FixedDeflate::Compress(in, out);
+  // CRC-32 and size mod 2^32, little endian whatever the host is
+  for (uint32_t v : {crc32(in), static_cast<uint32_t>(in.size())}) {
+    for (int i = 0; i < 4; i++) {
+      out.push_back(static_cast<char>(v >> (8 * i)));
+    }
+  }
+  return true;
+}
+
+std::string StackFramesToPprof(const std::vector<StackFrames>& records,
+                               const std::string& score_unit, bool gzip) {
+  PprofBuilder builder(score_unit);
+  for (const auto& record : records) {
+    builder.AddSample(record);
+  }
+  std::string profile = builder.Finish();
+  if (!gzip) {
+    return profile;
+  }
+  std::string compressed;
+  const Zlib* zlib = Zlib::Get();
+  if (zlib == nullptr || !zlib->Gzip(profile, compressed)) {
+    gzip_builtin(profile, compressed);
+  }
+  return compressed;
+}
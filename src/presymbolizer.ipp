@@ -0,0 +1,126 @@
+#include "ipp_inc.h"
+
+/**
+ * background thread resolving addresses newly recorded by any channel
+ * - new nodes of all shards are collected every kScanIntervalMs, addresses
+ *   already in FrameCache are skipped
+ * - resolved in batches of kBatchSize by Tracker::Resolve(), so a later
+ *   Dump() only looks them up in FrameCache
+ * - runs at the lowest priority on this thread only, and idles after each
+ *   batch so it is busy at most cpu_budget of the time, busy time of a batch
+ *   is its wall time, which also covers waiting for addr2line
+ */
+class Presymbolizer {
+ public:
+  // interval to collect new addresses
+  static const int kScanIntervalMs = 200;
+  // max addresses resolved at a time
+  static const size_t kBatchSize = 256;
+
+  static Presymbolizer* GetInstance() {
+    static Presymbolizer instance;
+    return &instance;  // singleton
+  }
+
+  bool Start(double cpu_budget) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (running_ || !(cpu_budget > 0)) {
+      return false;
+    }
+    cpu_budget_ = std::min(cpu_budget, 1.0);
+    running_ = true;
+    thread_ = std::thread(&Presymbolizer::Loop, this);
+    return true;
+  }
+
+  void Stop() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (running_) {
+      {
+        std::lock_guard<std::mutex> wait_lock(wait_mutex_);
+        stop_ = true;
+      }
+      wait_cv_.notify_all();
+      thread_.join();
+      stop_ = false;
+      running_ = false;
+    }
+  }
+
+ private:
+  std::mutex mutex_;  // guard Start() and Stop()
+  bool running_ = false;
+  double cpu_budget_ = 1.0;
+  std::thread thread_;
+  std::mutex wait_mutex_;
+  std::condition_variable wait_cv_;
+  bool stop_ = false;  // guarded by wait_mutex_
+
+  Presymbolizer() {
+    // singletons used by the thread are destroyed after this one, which
+    // stops the thread at exit
+    bttrack::GetInstance(0);
+    FrameCache::GetInstance();
+    DemangleCache::GetInstance();
+    SymbolCache::GetInstance();
+    ElfSymbolizer::GetInstance();
+    Addr2lineTool::GetInstance();
+    ModuleMap::Snapshot();
+  }
+
+  ~Presymbolizer() { Stop(); }
+
+  // return false if stopped while waiting
+  bool Wait(uint64_t nanos) {
+    std::unique_lock<std::mutex> lock(wait_mutex_);
+    return !wait_cv_.wait_for(lock, std::chrono::nanoseconds(nanos),
+                              [this] { return stop_; });
+  }
+
+  // addresses recorded since last call and not resolved yet, sorted
+  static void Collect(FramePointers& addrs) {
+    addrs.clear();
+    for (int i = 0; i < 256; i++) {
+      bttrack::GetInstance(static_cast<uint8_t>(i)).CollectNewAddrs(addrs);
+    }
+    FrameCache* cache = FrameCache::GetInstance();
+    addrs.erase(std::remove_if(addrs.begin(), addrs.end(),
+                               [cache](const void* addr) {
+                                 return cache->Find(addr) != nullptr;
+                               }),
+                addrs.end());
+    std::sort(addrs.begin(), addrs.end());
+    addrs.erase(std::unique(addrs.begin(), addrs.end()), addrs.end());
+  }
+
+  void Loop() {
+    ScopedHeapHookGuard guard;  // not to profile symbolizer itself
+    setpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)), 19);
+    // no threads of run_parallel(), so wall time bounds the CPU time
+    tls_symbolize_serial = true;
+    FramePointers pending;
+    FramePointers batch;
+    std::vector<Frame*> frames;
+    while (Wait(pending.empty() ? kScanIntervalMs * 1000000ULL : 0)) {
+      if (pending.empty()) {
+        Collect(pending);
+        continue;
+      }
+      // sorted, so a batch is likely a few modules
+      size_t n = std::min(kBatchSize, pending.size());
+      batch.assign(pending.end() - n, pending.end());
+      pending.resize(pending.size() - n);
+      uint64_t start = get_nanos();
+      Tracker::Resolve(batch, frames);
+      uint64_t busy = get_nanos() - start;
+      // busy / (busy + idle) <= cpu_budget
+      if (!Wait(static_cast<uint64_t>(busy * (1 - cpu_budget_) /
+                                      cpu_budget_))) {
+        break;
+      }
+    }
+  }
+};
+
+const int Presymbolizer::kScanIntervalMs;
+const size_t Presymbolizer::kBatchSize;
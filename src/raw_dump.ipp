@@ -0,0 +1,290 @@
+#include "ipp_inc.h"
+
+/**
+ * raw dump file written by DumpRaw(), symbolized by SymbolizeRawDump()
+ * - header, modules, call tree nodes, then stacks, in native byte order
+ * - a module is its load base, followed by its path and hex build-id
+ * - a node is an address as module index and offset in module, nodes of the
+ *   stack table are stored as is, so a stack is its innermost node
+ */
+struct RawDump {
+  struct Header {
+    char magic[8];
+    uint32_t num_modules;
+    uint32_t num_nodes;
+    uint32_t num_stacks;
+    uint32_t reserved;
+  };
+
+  struct Module {
+    uint64_t base;
+    uint32_t path_size;
+    uint32_t build_id_size;
+  };
+
+  struct Node {
+    uint64_t offset;  // address if module is kNoModule
+    uint32_t module;
+    uint32_t parent;  // kNoParent for root
+  };
+
+  struct Stack {
+    uint64_t count;
+    int64_t score;
+    uint64_t count_error;
+    int64_t score_error;
+    uint32_t node;
+    uint32_t reserved;
+  };
+
+  static const char kMagic[8];
+  static const uint32_t kNoModule = UINT32_MAX;
+  static const uint32_t kNoParent = UINT32_MAX;
+};
+
+const char RawDump::kMagic[8] = {'B', 'T', 'R', 'A', 'W', '0', '1', 0};
+const uint32_t RawDump::kNoModule;
+const uint32_t RawDump::kNoParent;
+
+// write nodes of records and the stacks to report as a raw dump
+static bool write_raw_dump(const std::string& path, const StackTable& records,
+                           const std::vector<uint32_t>& stacks) {
+  std::shared_ptr<const ModuleMap> snapshot = ModuleMap::Snapshot();
+  const ModuleMap& modules = *snapshot;
+  std::vector<uint32_t> module_ids(modules.size(), RawDump::kNoModule);
+  std::vector<uint32_t> used_modules;
+  std::vector<RawDump::Node> nodes(records.size());
+  for (uint32_t i = 0; i < records.size(); i++) {
+    RawDump::Node& node = nodes[i];
+    node.parent = i == StackTable::kRoot ? RawDump::kNoParent
+                                         : records.parent(i);
+    node.module = RawDump::kNoModule;
+    node.offset = reinterpret_cast<uintptr_t>(records.addr(i));
+    int m = i == StackTable::kRoot ? -1 : modules.Find(records.addr(i));
+    if (m >= 0) {
+      if (module_ids[m] == RawDump::kNoModule) {
+        module_ids[m] = used_modules.size();
+        used_modules.push_back(m);
+      }
+      node.module = module_ids[m];
+      node.offset -= modules.module(m).base;
+    }
+  }
+
+  FILE* fp = fopen(path.c_str(), "wbe");
+  if (fp == nullptr) {
+    return false;
+  }
+  RawDump::Header h;
+  memcpy(h.magic, RawDump::kMagic, sizeof(RawDump::kMagic));
+  h.num_modules = used_modules.size();
+  h.num_nodes = nodes.size();
+  h.num_stacks = stacks.size();
+  h.reserved = 0;
+  bool ok = fwrite(&h, sizeof(h), 1, fp) == 1;
+  for (uint32_t m : used_modules) {
+    const ModuleMap::Module& module = modules.module(m);
+    RawDump::Module rm = {module.base,
+                          static_cast<uint32_t>(module.path.size()),
+                          static_cast<uint32_t>(module.build_id.size())};
+    ok = ok && fwrite(&rm, sizeof(rm), 1, fp) == 1 &&
+         fwrite(module.path.data(), 1, module.path.size(), fp) ==
+             module.path.size() &&
+         fwrite(module.build_id.data(), 1, module.build_id.size(), fp) ==
+             module.build_id.size();
+  }
+  ok = ok &&
+       fwrite(nodes.data(), sizeof(RawDump::Node), nodes.size(), fp) ==
+           nodes.size();
+  for (uint32_t node : stacks) {
+    StackStat error = records.error(node);
+    RawDump::Stack s = {records.stat(node).count,
+                        records.stat(node).score,
+                        error.count,
+                        error.score,
+                        node,
+                        0};
+    ok = ok && fwrite(&s, sizeof(s), 1, fp) == 1;
+  }
+  return fclose(fp) == 0 && ok;
+}
+
+// file to symbolize a module with, found by build-id in debug_dir, or its
+// recorded path, empty if none matches the build-id
+static std::string find_module_file(const std::string& path,
+                                    const std::string& build_id,
+                                    const std::string& debug_dir) {
+  std::vector<std::string> candidates;
+  if (!debug_dir.empty()) {
+    if (build_id.size() > 2) {
+      // layout of /usr/lib/debug/.build-id
+      std::string prefix = debug_dir + "/.build-id/" + build_id.substr(0, 2) +
+                           "/" + build_id.substr(2);
+      candidates.push_back(prefix + ".debug");
+      candidates.push_back(prefix);
+    }
+    size_t slash = path.rfind('/');
+    candidates.push_back(debug_dir + "/" +
+                         (slash == std::string::npos ? path
+                                                     : path.substr(slash + 1)));
+  }
+  candidates.push_back(path);
+  for (const auto& file : candidates) {
+    if (access(file.c_str(), R_OK) == 0 &&
+        (build_id.empty() || read_build_id(file) == build_id)) {
+      return file;
+    }
+  }
+  return "";
+}
+
+// frames of symbolized raw dumps, never freed
+static std::mutex g_raw_frames_mutex;
+static std::deque<Frame> g_raw_frames;
+
+// bytes of fp after current position, bound allocations sized by the file
+static uint64_t remaining_bytes(FILE* fp) {
+  struct stat st;
+  long pos = ftell(fp);
+  if (pos < 0 || fstat(fileno(fp), &st) != 0 || st.st_size < pos) {
+    return 0;
+  }
+  return st.st_size - pos;
+}
+
+static bool read_raw_dump(FILE* fp, std::vector<StackFrames>& result,
+                          const std::string& debug_dir) {
+  RawDump::Header h;
+  if (fread(&h, sizeof(h), 1, fp) != 1 ||
+      memcmp(h.magic, RawDump::kMagic, sizeof(RawDump::kMagic)) != 0 ||
+      h.num_modules > remaining_bytes(fp) / sizeof(RawDump::Module)) {
+    return false;
+  }
+  struct ModuleInfo {
+    uint64_t base;
+    std::string path;
+    std::string build_id;
+  };
+  std::vector<ModuleInfo> modules(h.num_modules);
+  for (auto& module : modules) {
+    RawDump::Module rm;
+    if (fread(&rm, sizeof(rm), 1, fp) != 1 || rm.path_size > PATH_MAX ||
+        rm.build_id_size > 128 ||
+        rm.path_size + rm.build_id_size > remaining_bytes(fp)) {
+      return false;
+    }
+    module.base = rm.base;
+    module.path.resize(rm.path_size);
+    module.build_id.resize(rm.build_id_size);
+    if (fread(&module.path[0], 1, rm.path_size, fp) != rm.path_size ||
+        fread(&module.build_id[0], 1, rm.build_id_size, fp) !=
+            rm.build_id_size) {
+      return false;
+    }
+  }
+  // counts are 32 bits, no overflow
+  uint64_t tables_size = h.num_nodes * uint64_t(sizeof(RawDump::Node)) +
+                         h.num_stacks * uint64_t(sizeof(RawDump::Stack));
+  if (tables_size > remaining_bytes(fp)) {
+    return false;
+  }
+  std::vector<RawDump::Node> nodes(h.num_nodes);
+  std::vector<RawDump::Stack> stacks(h.num_stacks);
+  if (fread(nodes.data(), sizeof(RawDump::Node), nodes.size(), fp) !=
+          nodes.size() ||
+      fread(stacks.data(), sizeof(RawDump::Stack), stacks.size(), fp) !=
+          stacks.size()) {
+    return false;
+  }
+  // parents are before children in a stack table
+  for (uint32_t i = 0; i < nodes.size(); i++) {
+    if ((nodes[i].parent != RawDump::kNoParent && nodes[i].parent >= i) ||
+        (nodes[i].module != RawDump::kNoModule &&
+         nodes[i].module >= modules.size())) {
+      return false;
+    }
+  }
+  for (const auto& s : stacks) {
+    if (s.node >= nodes.size() || nodes[s.node].parent == RawDump::kNoParent) {
+      return false;
+    }
+  }
+
+  // one frame per address, as frames of Dump()
+  std::vector<Frame*> frames(nodes.size(), nullptr);
+  std::vector<std::vector<Frame*>> by_module(modules.size());
+  {
+    std::lock_guard<std::mutex> lock(g_raw_frames_mutex);
+    std::map<std::pair<uint32_t, uint64_t>, Frame*> unique_frames;
+    for (uint32_t i = 0; i < nodes.size(); i++) {
+      const RawDump::Node& node = nodes[i];
+      if (node.parent == RawDump::kNoParent) {
+        continue;
+      }
+      Frame*& frame = unique_frames[std::make_pair(node.module, node.offset)];
+      if (frame == nullptr) {
+        g_raw_frames.emplace_back();
+        frame = &g_raw_frames.back();
+        frame->func = kFuncUnknown;
+        frame->file = "??";
+        frame->line = -1;
+        char offset[32];
+        snprintf(offset, sizeof(offset), "(+0x%lx)", node.offset);
+        if (node.module == RawDump::kNoModule) {
+          frame->addr = reinterpret_cast<const void*>(node.offset);
+          frame->faddr = nullptr;
+          frame->exec = "??";
+          frame->symbol = "??";
+        } else {
+          const ModuleInfo& module = modules[node.module];
+          frame->addr =
+              reinterpret_cast<const void*>(module.base + node.offset);
+          frame->faddr = reinterpret_cast<const void*>(module.base);
+          frame->exec = module.path;
+          frame->symbol = module.path + offset;
+          by_module[node.module].push_back(frame);
+        }
+      }
+      frames[i] = frame;
+    }
+  }
+
+  // symbolize with files found here, then restore the recorded paths
+  std::vector<Frame*> to_resolve;
+  for (size_t m = 0; m < modules.size(); m++) {
+    std::string file =
+        find_module_file(modules[m].path, modules[m].build_id, debug_dir);
+    if (file.empty()) {
+      fprintf(stderr, "SymbolizeRawDump: %s (build-id %s) not found\n",
+              modules[m].path.c_str(), modules[m].build_id.c_str());
+      continue;
+    }
+    for (Frame* frame : by_module[m]) {
+      frame->exec = file;
+      to_resolve.push_back(frame);
+    }
+  }
+  if (!to_resolve.empty()) {
+    symbolize(to_resolve);
+  }
+  for (size_t m = 0; m < modules.size(); m++) {
+    for (Frame* frame : by_module[m]) {
+      frame->exec = modules[m].path;
+    }
+  }
+
+  result.resize(stacks.size());
+  for (size_t i = 0; i < stacks.size(); i++) {
+    const RawDump::Stack& s = stacks[i];
+    result[i].count = s.count;
+    result[i].score = s.score;
+    result[i].count_error = s.count_error;
+    result[i].score_error = s.score_error;
+    result[i].frames.clear();
+    for (uint32_t node = s.node; nodes[node].parent != RawDump::kNoParent;
+         node = nodes[node].parent) {
+      result[i].frames.push_back(frames[node]);
+    }
+  }
+  return true;
+}
@@ -0,0 +1,68 @@
+#include "ipp_inc.h"
+
+// per thread sampling state of a channel
+struct Sampler {
+  int64_t countdown;  // score or calls until next sample
+  uint32_t epoch;     // reset when not equal to epoch of channel
+};
+
+// xorshift64*, per thread
+static uint64_t next_random() {
+  static thread_local uint64_t state = 0;
+  if (state == 0) {
+    state = get_nanos() ^ reinterpret_cast<uintptr_t>(&state);
+    state |= 1;
+  }
+  state ^= state >> 12;
+  state ^= state << 25;
+  state ^= state >> 27;
+  return state * 0x2545f4914f6cdd1dULL;
+}
+
+// uniform in (0, 1]
+static double next_uniform() {
+  return ((next_random() >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+// exponential interval with given mean, at least 1
+static int64_t next_poisson_interval(int64_t mean) {
+  double interval = -std::log(next_uniform()) * mean;
+  return std::max<int64_t>(1, static_cast<int64_t>(interval));
+}
+
+// round x to an adjacent integer, unbiased in expectation
+static int64_t random_round(double x) {
+  double floor_x = std::floor(x);
+  return static_cast<int64_t>(floor_x) + (next_uniform() <= x - floor_x);
+}
+
+/**
+ * decide if a call with score is sampled, and its unbiased weight
+ * - kSampleScore: like tcmalloc, a call with score s is sampled with
+ *   probability p = 1 - exp(-s / param), and weighted 1/p
+ * - kSampleEveryN: every param-th call is sampled, and weighted param
+ * - return false if not sampled, only decrements countdown
+ */
+static bool sample(Sampler& s, int mode, int64_t param, int64_t score,
+                   StackStat& weight) {
+  if (mode == kSampleEveryN) {
+    if (--s.countdown > 0) {
+      return false;
+    }
+    s.countdown = param;
+    weight.count = param;
+    weight.score = score * param;
+    return true;
+  }
+  // kSampleScore, non-positive score is sampled as 1
+  int64_t size = std::max<int64_t>(score, 1);
+  s.countdown -= size;
+  if (s.countdown > 0) {
+    return false;
+  }
+  s.countdown = next_poisson_interval(param);
+  double scale = 1.0 / -std::expm1(-static_cast<double>(size) / param);
+  weight.count = random_round(scale);
+  weight.score = random_round(score * scale);
+  return true;
+}
\ No newline at end of file
@@ -37,6 +37,7 @@ class Slice {
   }
 
   size_t size() const { return size_; }
+  const char* data() const { return data_; }
 
   bool starts_with(const Slice& s) const {
     if (empty()) return false;
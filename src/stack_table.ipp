@@ -0,0 +1,303 @@
+#include "ipp_inc.h"
+
+struct StackStat {
+  uint64_t count;
+  int64_t score;
+};
+
+// nodes of a call tree, stored as columns so Match() only touches addrs and
+// parents, nodes[0] is the root
+struct StackNodes {
+  std::vector<const void*> addrs;
+  std::vector<uint32_t> parents;
+  std::vector<StackStat> stats;
+  // only in bounded tables, error of a stack is floor + errors[node] (mod
+  // 2^64), so a stack not in the table has error floor
+  std::vector<StackStat> errors;
+  StackStat floor = {0, 0};
+};
+
+/**
+ * interned call tree of stacks
+ * - each unique (parent, addr) edge is stored once as a node, and a stack is
+ *   the node of its innermost frame, the root is the outermost caller
+ * - stacks are indexed by a precomputed 64-bit hash with linear probing, a hit
+ *   costs one hash and one walk up the parent chain
+ * - node ids are stable, parent id is always less than child id
+ * - nodes are never removed, only cleared all at once, or by Compact() in a
+ *   bounded table
+ * - bounded by set_max_stacks(), it keeps the heavy hitters like Space-Saving,
+ *   see Compact()
+ */
+class StackTable {
+ public:
+  static const uint32_t kRoot = 0;  // virtual root, no address
+
+  StackTable() { clear(); }
+
+  // find or insert a stack (addrs[0] is the innermost frame), return its
+  // statistics
+  StackStat& Find(const void* const* addrs, size_t size) {
+    return Find(addrs, size, hash_stack(addrs, size));
+  }
+
+  StackStat& Find(const void* const* addrs, size_t size, uint64_t hash) {
+    return nodes_.stats[FindNode(addrs, size, hash)];
+  }
+
+  /**
+   * keep at most about 2 * max_stacks stacks, 0 is unbounded
+   * - a new stack starts from the floor, the max count of all evicted stacks,
+   *   so count never underestimates and its error is at most the floor
+   * - a full table is compacted down to max_stacks stacks, amortized O(1) per
+   *   new stack
+   */
+  void set_max_stacks(size_t max_stacks) {
+    max_stacks_ = max_stacks;
+    if (max_stacks_ > 0) {
+      nodes_.errors.resize(nodes_.addrs.size(), StackStat{0, 0});
+      if (num_stacks_ > 2 * max_stacks_) {
+        Compact();
+      }
+    }
+  }
+
+  size_t max_stacks() const { return max_stacks_; }
+
+  // find or insert the edge from parent to addr, return the child node
+  uint32_t Child(uint32_t parent, const void* addr) {
+    if ((nodes_.addrs.size() + 1) * 2 > edges_.size()) {
+      GrowEdges();
+    }
+    const size_t mask = edges_.size() - 1;
+    size_t pos = hash_edge(parent, addr) & mask;
+    while (edges_[pos] != kRoot) {
+      uint32_t node = edges_[pos];
+      if (nodes_.parents[node] == parent && nodes_.addrs[node] == addr) {
+        return node;
+      }
+      pos = (pos + 1) & mask;
+    }
+    uint32_t node = static_cast<uint32_t>(nodes_.addrs.size());
+    nodes_.addrs.emplace_back(addr);
+    nodes_.parents.emplace_back(parent);
+    nodes_.stats.emplace_back(StackStat{0, 0});
+    if (!nodes_.errors.empty()) {
+      nodes_.errors.emplace_back(StackStat{0, 0});
+    }
+    edges_[pos] = node;
+    return node;
+  }
+
+  // add all nodes and statistics of other tree, or subtract statistics,
+  // errors of a bounded tree are added but never subtracted
+  void Merge(const StackNodes& other, bool subtract = false) {
+    const bool merge_errors = !subtract && !other.errors.empty();
+    if (merge_errors) {
+      nodes_.errors.resize(nodes_.addrs.size(), StackStat{0, 0});
+      add_stat(nodes_.floor, other.floor);
+    }
+    std::vector<uint32_t> mapped(other.addrs.size(), kRoot);
+    for (uint32_t i = kRoot + 1; i < other.addrs.size(); i++) {
+      mapped[i] = Child(mapped[other.parents[i]], other.addrs[i]);
+      StackStat& stat = nodes_.stats[mapped[i]];
+      if (subtract) {
+        stat.count -= other.stats[i].count;
+        stat.score -= other.stats[i].score;
+      } else {
+        add_stat(stat, other.stats[i]);
+      }
+      if (merge_errors) {
+        add_stat(nodes_.errors[mapped[i]], other.errors[i]);
+      }
+    }
+  }
+
+  // all nodes, copying it is a cheap snapshot of the table
+  const StackNodes& nodes() const { return nodes_; }
+
+  // number of nodes including root
+  uint32_t size() const { return static_cast<uint32_t>(nodes_.addrs.size()); }
+  const void* addr(uint32_t node) const { return nodes_.addrs[node]; }
+  uint32_t parent(uint32_t node) const { return nodes_.parents[node]; }
+  // exclusive, recorded stacks ending at this node
+  const StackStat& stat(uint32_t node) const { return nodes_.stats[node]; }
+  // max difference between stat(node) and the actual, 0 if never bounded
+  StackStat error(uint32_t node) const {
+    if (nodes_.errors.empty()) {
+      return StackStat{0, 0};
+    }
+    StackStat err = nodes_.floor;
+    add_stat(err, nodes_.errors[node]);
+    return err;
+  }
+
+  // clear all nodes, keep max_stacks()
+  void clear() {
+    nodes_.addrs.assign(1, nullptr);
+    nodes_.parents.assign(1, kRoot);
+    nodes_.stats.assign(1, StackStat{0, 0});
+    nodes_.errors.assign(max_stacks_ > 0 ? 1 : 0, StackStat{0, 0});
+    nodes_.floor = StackStat{0, 0};
+    edges_.clear();
+    stacks_.clear();
+    num_stacks_ = 0;
+  }
+
+ private:
+  static const size_t kMinSlots = 64;
+
+  // node == kRoot means empty
+  struct StackSlot {
+    uint64_t hash;
+    uint32_t node;
+  };
+
+  StackNodes nodes_;
+  std::vector<uint32_t> edges_;    // node ids, size is power of 2
+  std::vector<StackSlot> stacks_;  // size is power of 2
+  size_t num_stacks_;
+  size_t max_stacks_ = 0;
+
+  static void add_stat(StackStat& stat, const StackStat& other) {
+    stat.count += other.count;
+    stat.score += other.score;
+  }
+
+  uint32_t FindNode(const void* const* addrs, size_t size, uint64_t hash) {
+    if (size == 0) {
+      return kRoot;
+    }
+    if ((num_stacks_ + 1) * 2 > stacks_.size()) {
+      GrowStacks();  // keep load factor <= 0.5
+    }
+    const size_t mask = stacks_.size() - 1;
+    size_t pos = hash & mask;
+    while (stacks_[pos].node != kRoot) {
+      const StackSlot& slot = stacks_[pos];
+      if (slot.hash == hash && Match(slot.node, addrs, size)) {
+        return slot.node;
+      }
+      pos = (pos + 1) & mask;
+    }
+    if (max_stacks_ > 0 && num_stacks_ >= 2 * max_stacks_) {
+      Compact();  // full, find again in the compacted table
+      return FindNode(addrs, size, hash);
+    }
+    // not indexed, intern from the outermost frame
+    uint32_t node = kRoot;
+    for (size_t i = size; i > 0; i--) {
+      node = Child(node, addrs[i - 1]);
+    }
+    stacks_[pos].hash = hash;
+    stacks_[pos].node = node;
+    num_stacks_++;
+    if (max_stacks_ > 0) {
+      // may have been evicted with a count up to the floor, and errors[node]
+      // is 0 as it was not indexed
+      add_stat(nodes_.stats[node], nodes_.floor);
+    }
+    return node;
+  }
+
+  /**
+   * keep max_stacks_ stacks with the largest counts, and rebuild the tree so
+   * nodes only reachable from evicted stacks are freed
+   * - floor is raised to the max count and score of evicted stacks, stored
+   *   errors are rebased so error of kept stacks is unchanged
+   * - score bound assumes scores are not negative
+   */
+  void Compact() {
+    std::vector<StackSlot> slots;
+    slots.reserve(num_stacks_);
+    for (const auto& slot : stacks_) {
+      if (slot.node != kRoot) {
+        slots.emplace_back(slot);
+      }
+    }
+    if (slots.size() <= max_stacks_) {
+      return;
+    }
+    auto by_count = [this](const StackSlot& a, const StackSlot& b) {
+      return nodes_.stats[a.node].count > nodes_.stats[b.node].count;
+    };
+    std::nth_element(slots.begin(), slots.begin() + max_stacks_, slots.end(),
+                     by_count);
+    StackStat floor = nodes_.floor;
+    for (size_t i = max_stacks_; i < slots.size(); i++) {
+      const StackStat& stat = nodes_.stats[slots[i].node];
+      floor.count = std::max(floor.count, stat.count);
+      floor.score = std::max(floor.score, stat.score);
+    }
+
+    StackTable kept;
+    kept.nodes_.errors.assign(1, StackStat{0, 0});
+    kept.nodes_.floor = floor;
+    FramePointers stack;
+    for (size_t i = 0; i < max_stacks_; i++) {
+      stack.clear();
+      for (uint32_t node = slots[i].node; node != kRoot;
+           node = nodes_.parents[node]) {
+        stack.emplace_back(nodes_.addrs[node]);
+      }
+      // unbounded yet, so it is only interned and indexed
+      uint32_t node = kept.FindNode(stack.data(), stack.size(), slots[i].hash);
+      kept.nodes_.stats[node] = nodes_.stats[slots[i].node];
+      StackStat& err = kept.nodes_.errors[node];
+      err = error(slots[i].node);
+      err.count -= floor.count;
+      err.score -= floor.score;
+    }
+    kept.max_stacks_ = max_stacks_;
+    *this = std::move(kept);
+  }
+
+  static uint64_t hash_edge(uint32_t parent, const void* addr) {
+    const void* key[2] = {addr, reinterpret_cast<const void*>(
+                                    static_cast<uintptr_t>(parent))};
+    return hash_stack(key, 2);
+  }
+
+  // match if the path from node to root is exactly addrs
+  bool Match(uint32_t node, const void* const* addrs, size_t size) const {
+    for (size_t i = 0; i < size; i++, node = nodes_.parents[node]) {
+      if (node == kRoot || nodes_.addrs[node] != addrs[i]) {
+        return false;
+      }
+    }
+    return node == kRoot;
+  }
+
+  void GrowEdges() {
+    size_t num_slots = std::max(kMinSlots, edges_.size() * 2);
+    edges_.assign(num_slots, kRoot);
+    const size_t mask = num_slots - 1;
+    for (uint32_t i = kRoot + 1; i < nodes_.addrs.size(); i++) {
+      size_t pos = hash_edge(nodes_.parents[i], nodes_.addrs[i]) & mask;
+      while (edges_[pos] != kRoot) {
+        pos = (pos + 1) & mask;
+      }
+      edges_[pos] = i;
+    }
+  }
+
+  void GrowStacks() {
+    std::vector<StackSlot> old(std::max(kMinSlots, stacks_.size() * 2),
+                               StackSlot{0, kRoot});
+    old.swap(stacks_);
+    const size_t mask = stacks_.size() - 1;
+    for (const auto& slot : old) {
+      if (slot.node == kRoot) {
+        continue;
+      }
+      size_t pos = slot.hash & mask;
+      while (stacks_[pos].node != kRoot) {
+        pos = (pos + 1) & mask;
+      }
+      stacks_[pos] = slot;
+    }
+  }
+};
+
+const uint32_t StackTable::kRoot;
+const size_t StackTable::kMinSlots;
\ No newline at end of file
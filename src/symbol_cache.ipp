@@ -0,0 +1,375 @@
+#include "ipp_inc.h"
+
+// GNU build-id of an ELF file in hex, empty if it has none
+static std::string read_build_id(const std::string& path) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return "";
+  }
+  std::string build_id;
+  Elf64_Ehdr eh;
+  if (pread(fd, &eh, sizeof(eh), 0) != sizeof(eh) ||
+      memcmp(eh.e_ident, ELFMAG, SELFMAG) != 0 ||
+      eh.e_ident[EI_CLASS] != ELFCLASS64 ||
+      eh.e_phentsize != sizeof(Elf64_Phdr)) {
+    close(fd);
+    return "";
+  }
+  std::vector<uint8_t> notes;
+  for (int i = 0; i < eh.e_phnum && build_id.empty(); i++) {
+    Elf64_Phdr ph;
+    if (pread(fd, &ph, sizeof(ph), eh.e_phoff + i * sizeof(ph)) !=
+        sizeof(ph)) {
+      break;
+    }
+    if (ph.p_type != PT_NOTE || ph.p_filesz > (1 << 16)) {
+      continue;
+    }
+    notes.resize(ph.p_filesz);
+    if (pread(fd, notes.data(), notes.size(), ph.p_offset) ==
+        static_cast<ssize_t>(notes.size())) {
+      build_id = parse_build_id(notes.data(), notes.size());
+    }
+  }
+  close(fd);
+  return build_id;
+}
+
+/**
+ * symbol cache file of a module, mapped read only
+ * - header, entries sorted by offset, inlined functions, then '\0'
+ *   terminated strings, all in native byte order
+ * - strings of entries are offsets into the string table
+ */
+class SymbolCacheFile {
+ public:
+  struct Header {
+    char magic[8];
+    uint32_t num_entries;
+    uint32_t num_inlined;
+    uint64_t strings_size;
+  };
+
+  struct Entry {
+    uint64_t offset;  // address - file base address
+    uint32_t func;
+    uint32_t file;
+    int32_t line;
+    uint32_t inlined_begin;
+    uint32_t num_inlined;
+    uint32_t reserved;
+  };
+
+  struct Inlined {
+    uint32_t name;
+    uint32_t file;
+    int32_t line;
+  };
+
+  static const char kMagic[8];
+
+  ~SymbolCacheFile() {
+    if (data_ != nullptr) {
+      munmap(const_cast<uint8_t*>(data_), size_);
+    }
+  }
+
+  // map a cache file, nullptr if missing or malformed
+  static std::unique_ptr<SymbolCacheFile> Open(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(Header)) {
+      close(fd);
+      return nullptr;
+    }
+    void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+      return nullptr;
+    }
+    std::unique_ptr<SymbolCacheFile> file(new SymbolCacheFile());
+    file->data_ = static_cast<const uint8_t*>(data);
+    file->size_ = st.st_size;
+    const Header* h = reinterpret_cast<const Header*>(file->data_);
+    // each table is checked against the bytes left, so no sum overflows
+    uint64_t left = file->size_ - sizeof(Header);
+    uint64_t entries_size = uint64_t(h->num_entries) * sizeof(Entry);
+    uint64_t inlined_size = uint64_t(h->num_inlined) * sizeof(Inlined);
+    if (memcmp(h->magic, kMagic, sizeof(kMagic)) != 0 ||
+        entries_size > left || inlined_size > left - entries_size ||
+        h->strings_size != left - entries_size - inlined_size ||
+        (h->strings_size > 0 && file->data_[file->size_ - 1] != '\0')) {
+      return nullptr;
+    }
+    file->entries_ = reinterpret_cast<const Entry*>(h + 1);
+    file->inlined_ =
+        reinterpret_cast<const Inlined*>(file->entries_ + h->num_entries);
+    file->strings_ =
+        reinterpret_cast<const char*>(file->inlined_ + h->num_inlined);
+    file->header_ = h;
+    return file;
+  }
+
+  size_t size() const { return header_->num_entries; }
+
+  // index of entry at offset, or -1
+  int64_t Find(uint64_t offset) const {
+    const Entry* end = entries_ + size();
+    const Entry* it = std::lower_bound(
+        entries_, end, offset,
+        [](const Entry& e, uint64_t o) { return e.offset < o; });
+    return it != end && it->offset == offset ? it - entries_ : -1;
+  }
+
+  uint64_t offset(size_t i) const { return entries_[i].offset; }
+
+  // fill func, file, line and inlined_by of frame, false if malformed
+  bool Get(size_t i, Frame* frame) const {
+    const Entry& e = entries_[i];
+    if (e.inlined_begin > header_->num_inlined ||
+        e.num_inlined > header_->num_inlined - e.inlined_begin ||
+        !Valid(e.func) || !Valid(e.file)) {
+      return false;
+    }
+    for (uint32_t j = 0; j < e.num_inlined; j++) {
+      const Inlined& f = inlined_[e.inlined_begin + j];
+      if (!Valid(f.name) || !Valid(f.file)) {
+        return false;
+      }
+    }
+    frame->func = strings_ + e.func;
+    frame->file = strings_ + e.file;
+    frame->line = e.line;
+    frame->inlined_by.clear();
+    for (uint32_t j = 0; j < e.num_inlined; j++) {
+      const Inlined& f = inlined_[e.inlined_begin + j];
+      frame->inlined_by.push_back(
+          Frame::Func{strings_ + f.name, strings_ + f.file, f.line});
+    }
+    return true;
+  }
+
+  // write frames sorted by offset to path, replaced by rename so readers
+  // never see a partial file
+  static bool Write(const std::string& path,
+                    const std::vector<std::pair<uint64_t, Frame>>& frames) {
+    std::vector<Entry> entries;
+    std::vector<Inlined> inlined;
+    std::string strings;
+    std::unordered_map<std::string, uint32_t> string_ids;
+    auto add_string = [&](const std::string& s) {
+      auto it = string_ids.emplace(s, strings.size());
+      if (it.second) {
+        strings.append(s.c_str(), s.size() + 1);
+      }
+      return it.first->second;
+    };
+    for (const auto& it : frames) {
+      const Frame& frame = it.second;
+      Entry e = {it.first,
+                 add_string(frame.func),
+                 add_string(frame.file),
+                 frame.line,
+                 static_cast<uint32_t>(inlined.size()),
+                 static_cast<uint32_t>(frame.inlined_by.size()),
+                 0};
+      for (const auto& f : frame.inlined_by) {
+        inlined.push_back(Inlined{add_string(f.name), add_string(f.file),
+                                  f.line});
+      }
+      entries.push_back(e);
+    }
+    Header h;
+    memcpy(h.magic, kMagic, sizeof(kMagic));
+    h.num_entries = entries.size();
+    h.num_inlined = inlined.size();
+    h.strings_size = strings.size();
+
+    std::string tmp_path = path + ".tmp" + std::to_string(getpid());
+    FILE* fp = fopen(tmp_path.c_str(), "wbe");
+    if (fp == nullptr) {
+      return false;
+    }
+    bool ok =
+        fwrite(&h, sizeof(h), 1, fp) == 1 &&
+        fwrite(entries.data(), sizeof(Entry), entries.size(), fp) ==
+            entries.size() &&
+        fwrite(inlined.data(), sizeof(Inlined), inlined.size(), fp) ==
+            inlined.size() &&
+        fwrite(strings.data(), 1, strings.size(), fp) == strings.size();
+    ok = fclose(fp) == 0 && ok;
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+      unlink(tmp_path.c_str());
+      return false;
+    }
+    return true;
+  }
+
+ private:
+  const uint8_t* data_ = nullptr;
+  size_t size_ = 0;
+  const Header* header_ = nullptr;
+  const Entry* entries_ = nullptr;
+  const Inlined* inlined_ = nullptr;
+  const char* strings_ = nullptr;
+
+  SymbolCacheFile() = default;
+
+  bool Valid(uint32_t str) const { return str < header_->strings_size; }
+};
+
+const char SymbolCacheFile::kMagic[8] = {'B', 'T', 'S', 'Y', 'M', '0', '1', 0};
+
+/**
+ * on-disk cache of resolved frames, set by SetSymbolCacheDir()
+ * - one file per module named by its GNU build-id, so later processes and
+ *   other processes of the same binary share it, and a rebuilt binary never
+ *   reads stale entries
+ * - cached frames are found by binary search in the mapped file, with no
+ *   DWARF work or addr2line
+ * - new frames are merged with the latest file, concurrent writers may lose
+ *   entries of each other, which are resolved and written again later
+ * - only frames with a source line are cached, modules without build-id are
+ *   not cached
+ */
+class SymbolCache {
+ public:
+  static SymbolCache* GetInstance() {
+    static SymbolCache instance;
+    return &instance;  // singleton
+  }
+
+  bool enabled() const { return enabled_.load(std::memory_order_relaxed); }
+
+  // empty dir disables the cache
+  bool SetDir(const std::string& dir) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!dir.empty()) {
+      struct stat st;
+      if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+        return false;
+      }
+      if (stat(dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+        return false;
+      }
+    }
+    dir_ = dir;
+    modules_.clear();
+    enabled_.store(!dir.empty(), std::memory_order_relaxed);
+    return true;
+  }
+
+  // resolve frames in cache, frames not found are left in frames
+  void Lookup(std::vector<Frame*>& frames) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<Frame*> left;
+    for (Frame* frame : frames) {
+      const SymbolCacheFile* file = nullptr;
+      if (frame->faddr != nullptr) {
+        file = GetModule(frame->exec).file.get();
+      }
+      int64_t i = -1;
+      if (file != nullptr) {
+        i = file->Find(Slice::offset(frame->addr, frame->faddr));
+      }
+      if (i < 0 || !file->Get(i, frame)) {
+        left.emplace_back(frame);
+      }
+    }
+    frames.swap(left);
+  }
+
+  // save frames resolved by symbolizers
+  void Store(const std::vector<Frame*>& frames) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::unordered_map<std::string, std::vector<const Frame*>> by_exec;
+    for (const Frame* frame : frames) {
+      if (frame->line >= 0 && frame->faddr != nullptr) {
+        by_exec[frame->exec].emplace_back(frame);
+      }
+    }
+    for (auto& it : by_exec) {
+      Module& module = GetModule(it.first);
+      if (!module.path.empty()) {
+        Merge(module, it.second);
+      }
+    }
+  }
+
+ private:
+  struct Module {
+    std::string path;  // empty if not cached
+    std::unique_ptr<SymbolCacheFile> file;
+  };
+
+  std::atomic<bool> enabled_{false};
+  std::mutex mutex_;  // guard all below
+  std::string dir_;
+  std::unordered_map<std::string, Module> modules_;  // by exec
+
+  SymbolCache() = default;
+
+  Module& GetModule(const std::string& exec) {
+    auto it = modules_.find(exec);
+    if (it != modules_.end()) {
+      return it->second;
+    }
+    Module& module = modules_[exec];
+    std::string build_id = exec == "??" ? "" : read_build_id(exec);
+    if (!build_id.empty()) {
+      module.path = dir_ + "/" + build_id + ".sym";
+      module.file = SymbolCacheFile::Open(module.path);
+    }
+    return module;
+  }
+
+  // rewrite file of module with entries of the latest file and new frames
+  void Merge(Module& module, const std::vector<const Frame*>& frames) {
+    std::vector<std::pair<uint64_t, Frame>> merged;
+    std::unique_ptr<SymbolCacheFile> latest =
+        SymbolCacheFile::Open(module.path);
+    if (latest) {
+      merged.reserve(latest->size() + frames.size());
+      Frame frame;
+      for (size_t i = 0; i < latest->size(); i++) {
+        if (latest->Get(i, &frame)) {
+          merged.emplace_back(latest->offset(i), frame);
+        }
+      }
+    }
+    size_t num_old = merged.size();
+    for (const Frame* frame : frames) {
+      uint64_t offset = Slice::offset(frame->addr, frame->faddr);
+      if (!latest || latest->Find(offset) < 0) {
+        merged.emplace_back(offset, *frame);
+      }
+    }
+    if (merged.size() == num_old) {
+      module.file = std::move(latest);
+      return;
+    }
+    auto by_offset = [](const std::pair<uint64_t, Frame>& a,
+                        const std::pair<uint64_t, Frame>& b) {
+      return a.first < b.first;
+    };
+    std::sort(merged.begin() + num_old, merged.end(), by_offset);
+    std::inplace_merge(merged.begin(), merged.begin() + num_old, merged.end(),
+                       by_offset);
+    merged.erase(std::unique(merged.begin(), merged.end(),
+                             [](const std::pair<uint64_t, Frame>& a,
+                                const std::pair<uint64_t, Frame>& b) {
+                               return a.first == b.first;
+                             }),
+                 merged.end());
+    if (SymbolCacheFile::Write(module.path, merged)) {
+      module.file = SymbolCacheFile::Open(module.path);
+    } else {
+      fprintf(stderr, "SymbolCache: failed to write %s\n",
+              module.path.c_str());
+      module.path.clear();  // not to retry
+    }
+  }
+};
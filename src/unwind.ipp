@@ -0,0 +1,185 @@
+#include "ipp_inc.h"
+
+// selected by SetUnwinder()
+static std::atomic<int> g_unwinder(kUnwindBacktrace);
+
+// stack range [lo, hi) of a thread
+struct StackRange {
+  uintptr_t lo;
+  uintptr_t hi;
+};
+
+// cached per thread, initial-exec so it is safe to read in signal handler
+static thread_local StackRange tls_stack_range
+    __attribute__((tls_model("initial-exec"))) = {0, 0};
+
+// set once init_stack_range() ran on current thread
+static thread_local bool tls_stack_range_tried = false;
+
+// cache stack range of current thread, not async-signal-safe
+// - a failure is cached too, as pthread_getattr_np() of the main thread
+//   reads /proc/self/maps
+static bool init_stack_range() {
+  if (tls_stack_range.hi != 0) {
+    return true;
+  }
+  if (tls_stack_range_tried) {
+    return false;
+  }
+  tls_stack_range_tried = true;
+  pthread_attr_t attr;
+  if (pthread_getattr_np(pthread_self(), &attr) != 0) {
+    return false;
+  }
+  void* addr = nullptr;
+  size_t size = 0;
+  int ret = pthread_attr_getstack(&attr, &addr, &size);
+  pthread_attr_destroy(&attr);
+  if (ret != 0 || addr == nullptr || size == 0) {
+    return false;
+  }
+  tls_stack_range.lo = reinterpret_cast<uintptr_t>(addr);
+  tls_stack_range.hi = tls_stack_range.lo + size;
+  return true;
+}
+
+// cached stack range of current thread, return false if unknown, as a guess
+// around a garbage fp may fault in signal handler
+static bool get_stack_range(StackRange& range, uintptr_t& max_step) {
+  range = tls_stack_range;
+  if (range.hi == 0) {
+    return false;
+  }
+  max_step = range.hi - range.lo;
+  return true;
+}
+
+// max distance between frames of a stack whose range is unknown
+static const uintptr_t kMaxUnknownFrameStep = 8 << 20;
+
+// read n bytes at addr by a syscall, which fails rather than faults on
+// unmapped memory, async-signal-safe
+static bool checked_read(uintptr_t addr, void* out, size_t n) {
+  struct iovec local = {out, n};
+  struct iovec remote = {reinterpret_cast<void*>(addr), n};
+  return process_vm_readv(getpid(), &local, 1, &remote, 1, 0) ==
+         static_cast<ssize_t>(n);
+}
+
+/**
+ * walk frame pointers starting from fp, async-signal-safe
+ * - x86_64 and aarch64 frame record: fp[0] is caller fp, fp[1] is return addr
+ * - stop at a fp out of range, misaligned, or not growing toward stack bottom
+ * - frames are read by checked_read() if checked, when the range is a guess
+ */
+static int walk_frame_pointers(uintptr_t fp, const StackRange& range,
+                               uintptr_t max_step, void** addrs,
+                               int max_frames, bool checked = false) {
+  int n = 0;
+  while (n < max_frames) {
+    if (fp < range.lo || fp > range.hi - 2 * sizeof(uintptr_t) ||
+        fp % sizeof(uintptr_t) != 0) {
+      break;
+    }
+    uintptr_t frame[2];
+    if (checked) {
+      if (!checked_read(fp, frame, sizeof(frame))) {
+        break;
+      }
+    } else {
+      memcpy(frame, reinterpret_cast<const void*>(fp), sizeof(frame));
+    }
+    uintptr_t next = frame[0];
+    uintptr_t ret = frame[1];
+    if (ret == 0) {
+      break;
+    }
+    addrs[n++] = reinterpret_cast<void*>(ret);
+    if (next <= fp || next - fp > max_step) {
+      break;  // stack grows down, callers are at higher address
+    }
+    fp = next;
+  }
+  return n;
+}
+
+/**
+ * same as backtrace() but walk frame pointers, async-signal-safe
+ * - like backtrace(), addrs[0] is the return address into the caller
+ * - callers need frame pointers, or frames will be skipped
+ * - return 0 if stack range of current thread is unknown
+ */
+static int __attribute__((noinline))
+fp_backtrace(void** addrs, int max_frames) {
+  uintptr_t fp = reinterpret_cast<uintptr_t>(__builtin_frame_address(0));
+  StackRange range;
+  uintptr_t max_step;
+  if (!get_stack_range(range, max_step)) {
+    return 0;
+  }
+  return walk_frame_pointers(fp, range, max_step, addrs, max_frames);
+}
+
+#if defined(__x86_64__) || defined(__aarch64__)
+#define BTTRACK_HAS_FP_UNWINDER 1
+#else
+#define BTTRACK_HAS_FP_UNWINDER 0
+#endif
+
+/**
+ * unwind the interrupted stack in a signal handler, async-signal-safe
+ * - context is the third argument of a SA_SIGINFO handler
+ * - addrs[0] is the interrupted pc, others are return addresses
+ * - if stack range of the interrupted thread is unknown, see
+ *   init_stack_range(), frames above the interrupted sp are read by
+ *   checked_read(), a syscall per frame
+ * - without frame pointer unwinder, fall back to backtrace() which includes
+ *   the handler frames and is not guaranteed async-signal-safe
+ */
+static int unwind_context(void* context, void** addrs, int max_frames) {
+#if BTTRACK_HAS_FP_UNWINDER
+  const ucontext_t* uc = static_cast<const ucontext_t*>(context);
+#if defined(__x86_64__)
+  uintptr_t pc = uc->uc_mcontext.gregs[REG_RIP];
+  uintptr_t sp = uc->uc_mcontext.gregs[REG_RSP];
+  uintptr_t fp = uc->uc_mcontext.gregs[REG_RBP];
+#else
+  uintptr_t pc = uc->uc_mcontext.pc;
+  uintptr_t sp = uc->uc_mcontext.sp;
+  uintptr_t fp = uc->uc_mcontext.regs[29];
+#endif
+  if (max_frames <= 0) {
+    return 0;
+  }
+  addrs[0] = reinterpret_cast<void*>(pc);
+  StackRange range;
+  uintptr_t max_step;
+  if (!get_stack_range(range, max_step)) {
+    // a thread never seen by bttrack, frames are above the interrupted sp
+    range.lo = sp;
+    range.hi = UINTPTR_MAX;
+    return 1 + walk_frame_pointers(fp, range, kMaxUnknownFrameStep, addrs + 1,
+                                   max_frames - 1, true);
+  }
+  return 1 + walk_frame_pointers(fp, range, max_step, addrs + 1,
+                                 max_frames - 1);
+#else
+  return backtrace(addrs, max_frames);
+#endif
+}
+
+// get backtrace with the selected unwinder, must be inlined into caller so
+// both unwinders skip the same frames
+// - also caches stack range of current thread for later CPU samples
+static inline __attribute__((always_inline)) int unwind(void** addrs,
+                                                        int max_frames) {
+#if BTTRACK_HAS_FP_UNWINDER
+  bool has_range = tls_stack_range.hi != 0 || init_stack_range();
+  if (has_range &&
+      g_unwinder.load(std::memory_order_relaxed) == kUnwindFramePointer) {
+    return fp_backtrace(addrs, max_frames);
+  }
+#endif
+  // @ref https://linux.die.net/man/3/backtrace
+  return backtrace(addrs, max_frames);
+}
\ No newline at end of file
@@ -3,4 +3,19 @@ static uint64_t get_nanos() {
   constexpr uint64_t kNanosInSec = 1000 * 1000 * 1000;
   clock_gettime(CLOCK_MONOTONIC, &ts);
   return ts.tv_sec * kNanosInSec + ts.tv_nsec;
+}
+
+// 64-bit hash of an array of addresses
+static uint64_t hash_stack(const void* const* addrs, size_t size) {
+  uint64_t h = 0x9e3779b97f4a7c15ULL ^ size;
+  for (size_t i = 0; i < size; i++) {
+    h ^= reinterpret_cast<uintptr_t>(addrs[i]);
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 32;
+  }
+  // finalizer of murmur3
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
 }
\ No newline at end of file
@@ -0,0 +1,97 @@
+#include "ipp_inc.h"
+
+/**
+ * zlib loaded by dlopen(), so it is used if installed without linking -lz
+ * - z_stream is declared here with the layout of zlib.h, stable since 1.0
+ * - gzip of pprof profiles, and compressed debug sections of ELF files
+ */
+class Zlib {
+ public:
+  static const Zlib* Get() {
+    static Zlib instance;
+    return instance.version_ != nullptr ? &instance : nullptr;
+  }
+
+  // gzip by deflate level 6, false if failed
+  bool Gzip(const std::string& in, std::string& out) const {
+    if (deflate_ == nullptr) {
+      return false;
+    }
+    ZStream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflate_init2_(&zs, 6, 8 /* Z_DEFLATED */, 15 + 16 /* gzip */, 8,
+                       0 /* Z_DEFAULT_STRATEGY */, version_(),
+                       static_cast<int>(sizeof(zs))) != 0) {
+      return false;
+    }
+    out.resize(deflate_bound_(&zs, in.size()));
+    zs.next_in = reinterpret_cast<const unsigned char*>(in.data());
+    zs.avail_in = static_cast<unsigned>(in.size());
+    zs.next_out = reinterpret_cast<unsigned char*>(&out[0]);
+    zs.avail_out = static_cast<unsigned>(out.size());
+    int ret = deflate_(&zs, 4 /* Z_FINISH */);
+    out.resize(zs.total_out);
+    deflate_end_(&zs);
+    return ret == 1;  // Z_STREAM_END
+  }
+
+  // inflate a zlib stream into exactly out_size bytes, false if failed
+  bool Uncompress(const uint8_t* in, size_t in_size, uint8_t* out,
+                  size_t out_size) const {
+    unsigned long size = out_size;
+    return uncompress_ != nullptr &&
+           uncompress_(out, &size, in, in_size) == 0 /* Z_OK */ &&
+           size == out_size;
+  }
+
+ private:
+  struct ZStream {
+    const unsigned char* next_in;
+    unsigned avail_in;
+    unsigned long total_in;
+    unsigned char* next_out;
+    unsigned avail_out;
+    unsigned long total_out;
+    const char* msg;
+    void* state;
+    void* zalloc;
+    void* zfree;
+    void* opaque;
+    int data_type;
+    unsigned long adler;
+    unsigned long reserved;
+  };
+
+  const char* (*version_)() = nullptr;
+  int (*deflate_init2_)(ZStream*, int, int, int, int, int, const char*,
+                        int) = nullptr;
+  unsigned long (*deflate_bound_)(ZStream*, unsigned long) = nullptr;
+  int (*deflate_)(ZStream*, int) = nullptr;
+  int (*deflate_end_)(ZStream*) = nullptr;
+  int (*uncompress_)(uint8_t*, unsigned long*, const uint8_t*,
+                     unsigned long) = nullptr;
+
+  Zlib() {
+    void* lib = dlopen("libz.so.1", RTLD_NOW | RTLD_LOCAL);  // never closed
+    if (lib == nullptr) {
+      return;
+    }
+    version_ = reinterpret_cast<const char* (*)()>(dlsym(lib, "zlibVersion"));
+    deflate_init2_ = reinterpret_cast<decltype(deflate_init2_)>(
+        dlsym(lib, "deflateInit2_"));
+    deflate_bound_ = reinterpret_cast<decltype(deflate_bound_)>(
+        dlsym(lib, "deflateBound"));
+    deflate_end_ =
+        reinterpret_cast<decltype(deflate_end_)>(dlsym(lib, "deflateEnd"));
+    deflate_ = reinterpret_cast<decltype(deflate_)>(dlsym(lib, "deflate"));
+    uncompress_ =
+        reinterpret_cast<decltype(uncompress_)>(dlsym(lib, "uncompress"));
+    if (version_ == nullptr || version_()[0] != '1') {
+      version_ = nullptr;
+    }
+    if (deflate_init2_ == nullptr || deflate_bound_ == nullptr ||
+        deflate_end_ == nullptr) {
+      deflate_ = nullptr;
+    }
+  }
+};
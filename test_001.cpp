@@ -42,6 +42,17 @@ void Print(int id) {
   printf("%s", report.c_str());
   report = bttrack::StackFramesToJson(records, json_indent);
   printf("JSON:\n%s\n", report.c_str());
+
+  // call tree with exclusive and inclusive counts
+  std::vector<bttrack::CallNode> nodes;
+  bttrack::DumpCallTree(id, nodes);
+  std::vector<int> depth(nodes.size(), 0);
+  printf("Call tree (self/total):\n");
+  for (size_t i = 1; i < nodes.size(); i++) {
+    depth[i] = depth[nodes[i].parent] + 1;
+    printf("%*s%s %lu/%lu\n", 2 * depth[i], "", nodes[i].frame->func.c_str(),
+           nodes[i].self_count, nodes[i].total_count);
+  }
 }
 
 int main() {
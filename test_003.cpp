@@ -0,0 +1,48 @@
+#include <chrono>
+#include <cstdio>
+#include <thread>
+
+#include "bttrack.h"
+
+// record from many threads, threads exit and new threads reuse their shards
+
+void RecordLoop(int n) {
+  for (int i = 0; i < n; i++) {
+    bttrack::Record(0);
+  }
+}
+
+double RunThreads(int num_threads, int n) {
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (int i = 0; i < num_threads; i++) {
+    threads.emplace_back(RecordLoop, n);
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+int main() {
+  const int kNumRecords = 100000;
+  const int max_threads = std::max(4u, std::thread::hardware_concurrency());
+  uint64_t expected = 0;
+  for (int n = 1; n <= max_threads; n *= 2) {
+    double sec = RunThreads(n, kNumRecords);
+    expected += (uint64_t)n * kNumRecords;
+    printf("%3d threads: %.2f M records/s\n", n, n * kNumRecords / sec / 1e6);
+  }
+
+  std::vector<bttrack::StackFrames> records;
+  bttrack::Dump(0, records);
+  uint64_t sum = 0;
+  for (const auto& it : records) {
+    sum += it.count;
+  }
+  printf("recorded %lu, expected %lu, in %lu stacks\n", sum, expected,
+         records.size());
+  return sum == expected ? 0 : 1;
+}
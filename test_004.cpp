@@ -0,0 +1,67 @@
+#include <chrono>
+#include <cstdio>
+
+#include "bttrack.h"
+
+// compare frame pointer unwinder with backtrace(), build with
+// -fno-omit-frame-pointer
+
+void __attribute__((noinline)) Capture(bttrack::FramePointers& stack) {
+  bttrack::GetBacktrace(stack);
+  asm volatile("" ::: "memory");  // no tail call
+}
+
+// stacks are the same in Capture() and CaptureWith(), differ in main()
+void __attribute__((noinline))
+CaptureWith(bttrack::Unwinder unwinder, bttrack::FramePointers& stack) {
+  bttrack::SetUnwinder(unwinder);
+  Capture(stack);
+  asm volatile("" ::: "memory");
+}
+
+template <typename F>
+double Measure(int n, F&& func) {
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < n; i++) {
+    func();
+  }
+  std::chrono::duration<double, std::nano> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count() / n;
+}
+
+// recurse to get a typical depth
+template <int N>
+void __attribute__((noinline)) Deep(const char* name) {
+  Deep<N - 1>(name);
+  asm volatile("" ::: "memory");
+}
+
+template <>
+void __attribute__((noinline)) Deep<0>(const char* name) {
+  const int kNumCalls = 100000;
+  bttrack::FramePointers stack;
+  double t_get = Measure(kNumCalls, [&] { bttrack::GetBacktrace(stack); });
+  double t_rec = Measure(kNumCalls, [] { bttrack::Record(0); });
+  printf("%-14s depth %3lu: GetBacktrace %7.1f ns, Record %7.1f ns\n", name,
+         stack.size(), t_get, t_rec);
+}
+
+int main() {
+  bttrack::FramePointers stacks[2];
+  CaptureWith(bttrack::kUnwindBacktrace, stacks[0]);
+  CaptureWith(bttrack::kUnwindFramePointer, stacks[1]);
+  size_t n = std::min(stacks[0].size(), stacks[1].size());
+  size_t same = 0;
+  while (same < n && stacks[0][same] == stacks[1][same]) {
+    same++;
+  }
+  printf("backtrace %lu frames, frame pointer %lu frames, %lu same\n",
+         stacks[0].size(), stacks[1].size(), same);
+
+  bttrack::SetUnwinder(bttrack::kUnwindBacktrace);
+  Deep<20>("backtrace");
+  bttrack::SetUnwinder(bttrack::kUnwindFramePointer);
+  Deep<20>("frame pointer");
+  return same >= 2 && stacks[1].size() >= 3 ? 0 : 1;
+}
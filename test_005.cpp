@@ -0,0 +1,62 @@
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <random>
+
+#include "bttrack.h"
+
+// sampled channels should estimate the same count and score as channel 0,
+// which records every call
+
+const uint8_t kChannelAll = 0;
+const uint8_t kChannelScore = 1;
+const uint8_t kChannelEveryN = 2;
+
+void Sum(uint8_t id, double& count, double& score) {
+  std::vector<bttrack::StackFrames> records;
+  bttrack::Dump(id, records);
+  count = score = 0;
+  for (const auto& it : records) {
+    count += it.count;
+    score += it.score;
+  }
+}
+
+int main() {
+  bttrack::SetSampling(kChannelScore, bttrack::kSampleScore, 16 * 1024);
+  bttrack::SetSampling(kChannelEveryN, bttrack::kSampleEveryN, 100);
+
+  // allocation-like scores, mostly small and sometimes large
+  std::mt19937 rng(42);
+  std::vector<int64_t> scores(1000000);
+  for (auto& s : scores) {
+    s = (rng() % 16 == 0) ? 4096 + rng() % 65536 : 8 + rng() % 256;
+  }
+
+  double t[3];
+  const uint8_t ids[3] = {kChannelAll, kChannelScore, kChannelEveryN};
+  for (int c = 0; c < 3; c++) {
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < scores.size(); i++) {
+      bttrack::Record(ids[c], scores[i]);
+    }
+    std::chrono::duration<double, std::nano> elapsed =
+        std::chrono::steady_clock::now() - start;
+    t[c] = elapsed.count() / scores.size();
+  }
+
+  double count[3], score[3];
+  bool ok = true;
+  const char* names[3] = {"all", "score", "every_n"};
+  for (int c = 0; c < 3; c++) {
+    Sum(ids[c], count[c], score[c]);
+    double err_count = std::fabs(count[c] / count[0] - 1);
+    double err_score = std::fabs(score[c] / score[0] - 1);
+    printf("%-8s %6.1f ns/call, count %.0f (err %.2f%%), score %.0f "
+           "(err %.2f%%)\n",
+           names[c], t[c], count[c], err_count * 100, score[c],
+           err_score * 100);
+    ok = ok && err_count < 0.05 && err_score < 0.05;
+  }
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,41 @@
+#include <cstdio>
+
+#include "bttrack.h"
+
+// delta dumps and dump-and-reset, Frame* stays valid across them
+
+uint64_t Sum(const std::vector<bttrack::StackFrames>& records) {
+  uint64_t sum = 0;
+  for (const auto& it : records) {
+    sum += it.count;
+  }
+  return sum;
+}
+
+void __attribute__((noinline)) RecordN(int n) {
+  for (int i = 0; i < n; i++) {
+    bttrack::Record(0);
+  }
+}
+
+int main() {
+  std::vector<bttrack::StackFrames> first, delta, rotated, after, delta2;
+  RecordN(10);
+  bttrack::Dump(0, first);
+  RecordN(5);
+  bttrack::Dump(0, delta, true);  // 5 since last dump
+  RecordN(3);
+  bttrack::DumpAndReset(0, rotated);  // all 18, then clear
+  bttrack::Dump(0, after);            // 0 after reset
+  RecordN(2);
+  bttrack::Dump(0, delta2, true);  // 2 since reset
+
+  printf("first %lu, delta %lu, rotated %lu, after reset %lu, delta %lu\n",
+         Sum(first), Sum(delta), Sum(rotated), Sum(after), Sum(delta2));
+  // frames resolved before reset are still valid
+  printf("first frame: %s\n", first[0].frames[0]->func.c_str());
+  bool ok = Sum(first) == 10 && Sum(delta) == 5 && Sum(rotated) == 18 &&
+            Sum(after) == 0 && Sum(delta2) == 2 &&
+            first[0].frames[0] == delta2[0].frames[0];
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,53 @@
+#include <cmath>
+#include <cstdio>
+
+#include "bttrack.h"
+
+// sampling CPU profiler, run with -fno-omit-frame-pointer
+
+volatile double g_sink;
+
+double __attribute__((noinline)) BurnA(int n) {
+  double sum = 0;
+  for (int i = 0; i < n; i++) {
+    sum += std::sqrt(i + sum);
+  }
+  return sum;
+}
+
+double __attribute__((noinline)) BurnB(int n) { return BurnA(n * 3) + 1; }
+
+int main() {
+  const uint8_t id = 0;
+  // samples are taken by timer, never sampled again by the channel
+  bttrack::SetSampling(id, bttrack::kSampleEveryN, 1000000);
+  if (!bttrack::StartCpuProfiler(id, 1000)) {
+    printf("StartCpuProfiler failed\n");
+    return 1;
+  }
+  for (int i = 0; i < 500; i++) {
+    g_sink = BurnA(100000 + i);  // about 1/4 of CPU time
+    g_sink = BurnB(100000 + i);  // about 3/4 of CPU time
+  }
+  bttrack::StopCpuProfiler();
+
+  std::vector<bttrack::StackFrames> records;
+  bttrack::Dump(id, records);
+  uint64_t sum = 0, in_b = 0;
+  bool weight_ok = true;
+  for (const auto& it : records) {
+    sum += it.count;
+    weight_ok &= it.score == static_cast<int64_t>(it.count) * 1000;
+    for (auto* frame : it.frames) {
+      if (frame->func.find("BurnB") != std::string::npos) {
+        in_b += it.count;
+        break;
+      }
+    }
+  }
+  printf("%lu samples in %lu stacks, %.1f%% in BurnB\n", sum, records.size(),
+         sum ? in_b * 100.0 / sum : 0);
+  records.resize(std::min<size_t>(records.size(), 3));
+  printf("%s", bttrack::StackFramesToString(records, false).c_str());
+  return sum > 0 && sum < 1000000 && weight_ok && in_b > sum / 2 ? 0 : 1;
+}
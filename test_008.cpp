@@ -0,0 +1,141 @@
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+
+#include "bttrack.h"
+
+// heap profiler, run with -DBTTRACK_HEAP_PROFILER -fno-omit-frame-pointer
+
+const uint8_t kAllocId = 0;
+const uint8_t kLiveId = 1;
+
+std::vector<void*> g_leaked;
+
+void __attribute__((noinline)) Leak(size_t size) {
+  g_leaked.push_back(malloc(size));
+}
+
+void __attribute__((noinline)) Temp(size_t size) {
+  std::string* s = new std::string(size, 'x');
+  asm volatile("" ::"r"(s->data()) : "memory");
+  delete s;
+}
+
+// freed by TLS destructor after bttrack's one, as it is constructed earlier
+struct FreeOnExit {
+  void* ptr = nullptr;
+  ~FreeOnExit() { free(ptr); }
+};
+
+void LateFree() {
+  static thread_local FreeOnExit holder;
+  holder.ptr = malloc(64 << 20);
+}
+
+// a distinct stack per depth, so records of the tracker grow
+void __attribute__((noinline)) RecordDeep(int depth, uint8_t id) {
+  if (depth > 0) {
+    RecordDeep(depth - 1, id);
+  } else {
+    bttrack::Record(id, 0);
+  }
+  asm volatile("" ::: "memory");  // no tail call
+}
+
+// blocks moved by realloc while other threads reuse freed addresses
+void ReallocChurn() {
+  for (int i = 0; i < 20000; i++) {
+    void* p = malloc(4096 + i % 512);
+    asm volatile("" ::"r"(p) : "memory");
+    p = realloc(p, 16384 + i % 512);
+    asm volatile("" ::"r"(p) : "memory");
+    free(p);
+  }
+}
+
+int64_t SumScore(uint8_t id) {
+  std::vector<bttrack::StackFrames> records;
+  bttrack::Dump(id, records);
+  int64_t sum = 0;
+  for (const auto& it : records) {
+    sum += it.score;
+  }
+  return sum;
+}
+
+int main() {
+  if (!bttrack::StartHeapProfiler(kAllocId, kLiveId, 64 * 1024)) {
+    printf("StartHeapProfiler failed, build with -DBTTRACK_HEAP_PROFILER\n");
+    return 1;
+  }
+  g_leaked.reserve(20000);
+  size_t leaked = 0, total = 0;
+  for (int i = 0; i < 20000; i++) {
+    size_t size = 256 + (i % 64) * 64;
+    Leak(size);
+    Temp(size * 3);
+    leaked += size;
+    total += size + size * 3 + 1;
+  }
+  int64_t alloc_bytes = SumScore(kAllocId);
+  int64_t live_bytes = SumScore(kLiveId);
+
+  // a failed realloc keeps the old block live
+  void* big = malloc(64 << 20);
+  int64_t live_before = SumScore(kLiveId);
+  volatile size_t huge = SIZE_MAX / 2;
+  void* moved = realloc(big, huge);
+  bool realloc_ok =
+      moved == nullptr && SumScore(kLiveId) > live_before - (1 << 20);
+  free(moved == nullptr ? big : moved);
+
+  // a free after bttrack's TLS of the thread is destroyed is still debited
+  live_before = SumScore(kLiveId);
+  std::thread(LateFree).join();
+  bool late_free_ok = std::abs(SumScore(kLiveId) - live_before) < (1 << 20);
+
+  // all blocks moved and freed by realloc are debited
+  live_before = SumScore(kLiveId);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; i++) {
+    threads.emplace_back(ReallocChurn);
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  bool churn_ok = std::abs(SumScore(kLiveId) - live_before) < (1 << 20);
+
+  // records of the heap channel and others, allocations of the tracker
+  // neither deadlock in the hooks nor are sampled
+  for (int i = 0; i < 20000; i++) {
+    RecordDeep(i % 200, i % 2 ? kAllocId : 2);
+  }
+  std::vector<bttrack::StackFrames> allocs;
+  bttrack::Dump(kAllocId, allocs);
+  bool self_ok = true;
+  for (const auto& it : allocs) {
+    for (const auto* frame : it.frames) {
+      self_ok &= frame->func.find("bttrack::") == std::string::npos;
+    }
+  }
+  bttrack::StopHeapProfiler();
+
+  printf("allocated %lu bytes, estimated %ld\n", total, alloc_bytes);
+  printf("leaked %lu bytes, estimated live %ld\n", leaked, live_bytes);
+  printf("failed realloc: %s\n", realloc_ok ? "still live" : "debited");
+  printf("late free: %s\n", late_free_ok ? "debited" : "still live");
+  printf("realloc churn: %s\n", churn_ok ? "debited" : "still live");
+  printf("tracker allocations: %s\n", self_ok ? "not sampled" : "sampled");
+  std::vector<bttrack::StackFrames> records;
+  bttrack::Dump(kLiveId, records);
+  records.resize(std::min<size_t>(records.size(), 1));
+  printf("%s", bttrack::StackFramesToString(records, false).c_str());
+  for (void* p : g_leaked) {
+    free(p);
+  }
+  bool ok = std::abs(alloc_bytes / (double)total - 1) < 0.1 &&
+            std::abs(live_bytes / (double)leaked - 1) < 0.1 && realloc_ok &&
+            late_free_ok && churn_ok && self_ok;
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,57 @@
+#include <cstdio>
+#include <map>
+
+#include "bttrack.h"
+
+// bounded channel keeps heavy hitters with error bounds
+
+const int kMaxStacks = 16;
+const int kNumHeavy = 5;
+const int kNumLight = 5000;
+
+int main() {
+  bttrack::FramePointers base;
+  if (!bttrack::GetBacktrace(base)) {
+    return 1;
+  }
+  bttrack::SetMaxStacks(0, kMaxStacks);
+
+  // innermost frame tells stacks apart, heavy stacks are interleaved with
+  // many light ones
+  std::map<const void*, uint64_t> actual;
+  auto record = [&](int i) {
+    bttrack::FramePointers stack = base;
+    stack.insert(stack.begin(), reinterpret_cast<const char*>(&main) + i);
+    bttrack::Record(0, stack);
+    actual[stack[0]]++;
+  };
+  for (int i = 0; i < kNumLight; i++) {
+    for (int h = 0; h < kNumHeavy; h++) {
+      if (i % (h + 1) == 0) {
+        record(h);  // stack h is recorded kNumLight / (h + 1) times
+      }
+    }
+    record(kNumHeavy + i);
+  }
+
+  std::vector<bttrack::StackFrames> result;
+  bttrack::Dump(0, result);
+  bool ok = !result.empty() && result.size() <= kMaxStacks;
+  for (size_t i = 0; i < result.size(); i++) {
+    const auto& it = result[i];
+    uint64_t count = actual[it.frames[0]->addr];
+    if (i < 3) {
+      printf("[%lu] count %lu error %lu actual %lu\n", i, it.count,
+             it.count_error, count);
+    }
+    // heavy hitters in order, and all within error bound
+    if (i < kNumHeavy) {
+      ok = ok && it.frames[0]->addr ==
+                     reinterpret_cast<const char*>(&main) + i;
+    }
+    ok = ok && count + it.count_error >= it.count &&
+         count <= it.count + it.count_error;
+  }
+  printf("%lu stacks, %s\n", result.size(), ok ? "ok" : "failed");
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,151 @@
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <string>
+
+#include "bttrack.h"
+
+// in-process ELF symbolizer resolves the same as addr2line, except names of
+// inlined functions without linkage name are qualified by namespaces and
+// classes, also at -O2
+
+std::vector<bttrack::FramePointers> stacks;
+
+inline void Capture() {
+  bttrack::FramePointers stack;
+  if (bttrack::GetBacktrace(stack)) {
+    stacks.emplace_back(stack);
+  }
+}
+
+inline int Inlined(int x) {
+  Capture();
+  return x + 1;
+}
+
+template <typename T>
+T __attribute__((noinline)) Template(T x) {
+  return Inlined(static_cast<int>(x)) * 2;
+}
+
+void __attribute__((noinline)) SortWithCapture() {
+  std::vector<int> v = {3, 1, 2};
+  std::sort(v.begin(), v.end(), [](int a, int b) {
+    if (stacks.size() < 8) {
+      Capture();  // inlined into std::sort internals
+    }
+    return a < b;
+  });
+}
+
+// dump channel 0 in a child process, so no frame is cached yet, one line per
+// frame with debug info, tab separated name and location of the function and
+// its inlined_by callers
+std::vector<std::string> ResolveInChild(bttrack::Symbolizer symbolizer) {
+  int fds[2];
+  if (pipe(fds) != 0) {
+    return {};
+  }
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(fds[0]);
+    bttrack::SetSymbolizer(symbolizer);
+    std::vector<bttrack::StackFrames> records;
+    bttrack::Dump(0, records);
+    std::string out;
+    for (const auto& record : records) {
+      for (const auto* frame : record.frames) {
+        if (frame->line < 0) {
+          continue;  // no debug info, addr2line guesses the nearest symbol
+        }
+        out += frame->func + "\t" + frame->file + ":" +
+               std::to_string(frame->line);
+        for (const auto& f : frame->inlined_by) {
+          out += "\t" + f.name + "\t" + f.file + ":" + std::to_string(f.line);
+        }
+        out += "\n";
+      }
+    }
+    ssize_t n = write(fds[1], out.data(), out.size());
+    _exit(n == static_cast<ssize_t>(out.size()) ? 0 : 1);
+  }
+  close(fds[1]);
+  std::string out;
+  char buf[4096];
+  ssize_t n;
+  while ((n = read(fds[0], buf, sizeof(buf))) > 0) {
+    out.append(buf, n);
+  }
+  close(fds[0]);
+  waitpid(pid, nullptr, 0);
+
+  std::vector<std::string> lines;
+  for (size_t pos = 0, end; (end = out.find('\n', pos)) != std::string::npos;
+       pos = end + 1) {
+    lines.emplace_back(out.substr(pos, end - pos));
+  }
+  return lines;
+}
+
+std::vector<std::string> Split(const std::string& line) {
+  std::vector<std::string> fields;
+  for (size_t pos = 0, end;; pos = end + 1) {
+    end = line.find('\t', pos);
+    fields.emplace_back(line.substr(pos, end - pos));
+    if (end == std::string::npos) {
+      return fields;
+    }
+  }
+}
+
+// same locations, and names are the same or qualified by elf
+bool Same(const std::string& elf, const std::string& addr2line) {
+  auto a = Split(elf);
+  auto b = Split(addr2line);
+  if (a.size() != b.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < a.size(); i++) {
+    const std::string suffix = "::" + b[i];
+    bool qualified = i % 2 == 0 && a[i].size() > suffix.size() &&
+                     a[i].compare(a[i].size() - suffix.size(), suffix.size(),
+                                  suffix) == 0;
+    if (a[i] != b[i] && !qualified) {
+      return false;
+    }
+  }
+  return true;
+}
+
+int main() {
+  Capture();
+  Inlined(1);
+  Template<int>(2);
+  Template<long>(3);
+  SortWithCapture();
+  for (const auto& stack : stacks) {
+    bttrack::Record(0, stack);
+  }
+
+  auto elf = ResolveInChild(bttrack::kSymbolizeElf);
+  auto addr2line = ResolveInChild(bttrack::kSymbolizeAddr2line);
+  int num_diff = 0;
+  int num_qualified = 0;
+  for (size_t i = 0; i < elf.size() && i < addr2line.size(); i++) {
+    if (!Same(elf[i], addr2line[i])) {
+      num_diff++;
+      printf("elf:       %s\naddr2line: %s\n", elf[i].c_str(),
+             addr2line[i].c_str());
+    }
+    num_qualified += elf[i].find("\tstd::__") != std::string::npos;
+  }
+  // std::sort internals inlined into each other
+  printf("%lu frames, %d different, %d qualified\n", elf.size(), num_diff,
+         num_qualified);
+  return !elf.empty() && elf.size() == addr2line.size() && num_diff == 0 &&
+                 num_qualified > 0
+             ? 0
+             : 1;
+}
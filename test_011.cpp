@@ -0,0 +1,158 @@
+#include <dirent.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include "bttrack.h"
+
+// frames resolved by a process are read back from the symbol cache by later
+// processes, even if they cannot symbolize
+// - a cache file whose header sizes overflow is ignored
+
+inline void __attribute__((noinline)) Leaf() { bttrack::Record(0); }
+
+inline void Inlined() { Leaf(); }
+
+bool g_children_ok = true;  // no child crashed
+
+void __attribute__((noinline)) Caller() { Inlined(); }
+
+// dump channel 0 in a child process with a cold frame cache, one line per
+// frame with a source line
+std::vector<std::string> DumpInChild(const std::string& cache_dir,
+                                     bool can_symbolize) {
+  int fds[2];
+  if (pipe(fds) != 0) {
+    return {};
+  }
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(fds[0]);
+    if (!can_symbolize) {
+      // addr2line is not found, and the ELF symbolizer is not used
+      setenv("PATH", "", 1);
+      bttrack::SetSymbolizer(bttrack::kSymbolizeAddr2line);
+    }
+    if (!cache_dir.empty() && !bttrack::SetSymbolCacheDir(cache_dir)) {
+      _exit(1);
+    }
+    std::vector<bttrack::StackFrames> records;
+    bttrack::Dump(0, records);
+    std::string out;
+    for (const auto& record : records) {
+      for (const auto* frame : record.frames) {
+        if (frame->line < 0) {
+          continue;
+        }
+        out += frame->func + " at " + frame->file + ":" +
+               std::to_string(frame->line);
+        for (const auto& f : frame->inlined_by) {
+          out += " (inlined by) " + f.name + " at " + f.file + ":" +
+                 std::to_string(f.line);
+        }
+        out += "\n";
+      }
+    }
+    ssize_t n = write(fds[1], out.data(), out.size());
+    _exit(n == static_cast<ssize_t>(out.size()) ? 0 : 1);
+  }
+  close(fds[1]);
+  std::string out;
+  char buf[4096];
+  ssize_t n;
+  while ((n = read(fds[0], buf, sizeof(buf))) > 0) {
+    out.append(buf, n);
+  }
+  close(fds[0]);
+  int status = 0;
+  g_children_ok &= waitpid(pid, &status, 0) == pid && WIFEXITED(status);
+
+  std::vector<std::string> lines;
+  for (size_t pos = 0, end; (end = out.find('\n', pos)) != std::string::npos;
+       pos = end + 1) {
+    lines.emplace_back(out.substr(pos, end - pos));
+  }
+  return lines;
+}
+
+// call fn on each file of dir
+template <typename Fn>
+void ForEachFile(const std::string& dir, Fn fn) {
+  DIR* d = opendir(dir.c_str());
+  if (d == nullptr) {
+    return;
+  }
+  while (struct dirent* e = readdir(d)) {
+    std::string name = e->d_name;
+    if (name != "." && name != "..") {
+      fn(dir + "/" + name);
+    }
+  }
+  closedir(d);
+}
+
+void RemoveDir(const std::string& dir) {
+  ForEachFile(dir, [](const std::string& path) { unlink(path.c_str()); });
+  rmdir(dir.c_str());
+}
+
+// more entries than the file has, and a strings size which wraps the sum of
+// sizes around to the file size
+void Corrupt(const std::string& path) {
+  struct {
+    char magic[8];
+    uint32_t num_entries;
+    uint32_t num_inlined;
+    uint64_t strings_size;
+  } header;
+  FILE* fp = fopen(path.c_str(), "r+b");
+  if (fp == nullptr) {
+    return;
+  }
+  if (fread(&header, sizeof(header), 1, fp) == 1) {
+    header.num_entries += 1 << 20;
+    header.strings_size -= (1 << 20) * 32ULL;  // sizeof(Entry)
+    fseek(fp, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, fp);
+  }
+  fclose(fp);
+}
+
+int main() {
+  for (int i = 0; i < 3; i++) {
+    Caller();
+  }
+
+  char tmpl[] = "/tmp/bttrack_cache_XXXXXX";
+  if (mkdtemp(tmpl) == nullptr) {
+    perror("mkdtemp");
+    return 1;
+  }
+  std::string dir = tmpl;
+  auto first = DumpInChild(dir, true);
+  auto cached = DumpInChild(dir, false);
+  auto uncached = DumpInChild("", false);
+  ForEachFile(dir, Corrupt);
+  auto corrupted = DumpInChild(dir, false);
+  RemoveDir(dir);
+
+  int num_diff = 0;
+  for (size_t i = 0; i < first.size() && i < cached.size(); i++) {
+    if (first[i] != cached[i]) {
+      num_diff++;
+      printf("first:  %s\ncached: %s\n", first[i].c_str(), cached[i].c_str());
+    }
+  }
+  printf("%lu frames, %lu from cache, %lu without cache, %d different\n",
+         first.size(), cached.size(), uncached.size(), num_diff);
+  printf("corrupted cache: %lu frames, children %s\n", corrupted.size(),
+         g_children_ok ? "ok" : "crashed");
+  return !first.empty() && first.size() == cached.size() && num_diff == 0 &&
+                 uncached.empty() && corrupted.empty() && g_children_ok
+             ? 0
+             : 1;
+}
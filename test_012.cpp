@@ -0,0 +1,83 @@
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include "bttrack.h"
+
+// a raw dump symbolized offline is the same as Dump(), except exec paths
+
+inline void __attribute__((noinline)) Leaf(int n) { bttrack::Record(0, n); }
+
+inline void Inlined(int n) { Leaf(n); }
+
+template <int N>
+void __attribute__((noinline)) Caller() {
+  Inlined(N);
+}
+
+// one line per frame, without exec which is the real path in raw dumps
+std::string ToLines(const std::vector<bttrack::StackFrames>& records) {
+  std::string out;
+  for (const auto& record : records) {
+    out += "count " + std::to_string(record.count) + " score " +
+           std::to_string(record.score) + "\n";
+    for (const auto* frame : record.frames) {
+      char addr[32];
+      snprintf(addr, sizeof(addr), "%p", frame->addr);
+      out += std::string("  ") + addr + " " + frame->func + " at " +
+             frame->file + ":" + std::to_string(frame->line) + " inlined " +
+             std::to_string(frame->inlined_by.size()) + "\n";
+    }
+  }
+  return out;
+}
+
+int main() {
+  for (int i = 0; i < 3; i++) {
+    Caller<1>();
+  }
+  Caller<2>();
+
+  char path[] = "/tmp/bttrack_raw_XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    perror("mkstemp");
+    return 1;
+  }
+  close(fd);
+  bool written = bttrack::DumpRaw(0, path);
+  std::vector<bttrack::StackFrames> offline;
+  bool read = bttrack::SymbolizeRawDump(path, offline);
+
+  // a header with counts beyond the file size is rejected before allocated
+  struct {
+    char magic[8];
+    uint32_t num_modules, num_nodes, num_stacks, reserved;
+  } header = {{'B', 'T', 'R', 'A', 'W', '0', '1', 0}, 0, UINT32_MAX, 1, 0};
+  bool malformed_ok = true;
+  for (int i = 0; i < 2; i++) {
+    FILE* fp = fopen(path, "wb");
+    fwrite(&header, sizeof(header), 1, fp);
+    fclose(fp);
+    std::vector<bttrack::StackFrames> bad;
+    malformed_ok &= !bttrack::SymbolizeRawDump(path, bad) && bad.empty();
+    header.num_modules = UINT32_MAX;
+  }
+  unlink(path);
+
+  std::vector<bttrack::StackFrames> records;
+  bttrack::Dump(0, records);
+  std::string expected = ToLines(records);
+  std::string actual = ToLines(offline);
+  if (expected != actual) {
+    printf("Dump():\n%s\nSymbolizeRawDump():\n%s\n", expected.c_str(),
+           actual.c_str());
+  }
+  printf("written %d, read %d, %lu stacks, %s, malformed %s\n", written, read,
+         offline.size(), expected == actual ? "same" : "different",
+         malformed_ok ? "rejected" : "accepted");
+  bool ok = written && read && !offline.empty() && expected == actual;
+  return ok && malformed_ok ? 0 : 1;
+}
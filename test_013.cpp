@@ -0,0 +1,48 @@
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include "bttrack.h"
+
+// function names come from .symtab, even for functions not exported by
+// -rdynamic, so backtrace_symbols() does not know them, with -g the name is
+// from DWARF like addr2line, unqualified for local functions
+
+namespace {
+
+void __attribute__((noinline)) LocalLeaf() {
+  bttrack::Record(0);
+  asm volatile("");  // keep the return address inside this function
+}
+
+}  // namespace
+
+static void __attribute__((noinline)) StaticCaller() {
+  LocalLeaf();
+  asm volatile("");
+}
+
+void __attribute__((noinline, visibility("hidden"))) HiddenCaller() {
+  StaticCaller();
+  asm volatile("");
+}
+
+int main() {
+  HiddenCaller();
+
+  std::vector<bttrack::StackFrames> records;
+  bttrack::Dump(0, records);
+  if (records.size() != 1) {
+    printf("%lu stacks\n", records.size());
+    return 1;
+  }
+  const char* expected[] = {"LocalLeaf", "StaticCaller", "HiddenCaller"};
+  const auto& frames = records[0].frames;
+  int num_wrong = 0;
+  for (size_t i = 0; i < 3 && i < frames.size(); i++) {
+    bool ok = strstr(frames[i]->func.c_str(), expected[i]) != nullptr;
+    num_wrong += !ok;
+    printf("#%lu %s%s\n", i, frames[i]->func.c_str(), ok ? "" : " (wrong)");
+  }
+  return frames.size() >= 3 && num_wrong == 0 ? 0 : 1;
+}
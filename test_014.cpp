@@ -0,0 +1,61 @@
+#include <dlfcn.h>
+#include <execinfo.h>
+
+#include <cstdio>
+#include <string>
+
+#include "bttrack.h"
+
+// frames of a module unloaded by dlclose() after they are recorded still
+// resolve from the module map, with no dump in between
+// - exec and symbol of frames are from the module map and the ELF symbol
+//   table, not backtrace_symbols()
+
+int g_backtrace_symbols_calls = 0;
+
+// interposed, as the program is linked with -rdynamic
+extern "C" char** backtrace_symbols(void* const*, int) throw() {
+  g_backtrace_symbols_calls++;
+  return nullptr;
+}
+
+int main() {
+  const char* lib = "libz.so.1";
+  void* handle = dlopen(lib, RTLD_NOW | RTLD_LOCAL);
+  if (handle == nullptr) {
+    printf("skipped, %s not found\n", lib);
+    return 0;
+  }
+  if (dlopen(lib, RTLD_NOW | RTLD_NOLOAD) != handle) {
+    printf("skipped, %s is not loaded by dlopen\n", lib);
+    return 0;
+  }
+  dlclose(handle);  // the NOLOAD reference
+  const char* func = static_cast<const char*>(dlsym(handle, "adler32"));
+  if (func == nullptr) {
+    printf("skipped, adler32 not found\n");
+    return 0;
+  }
+  // an address inside adler32(), like a return address
+  bttrack::FramePointers stack = {func + 1};
+  bttrack::Record(0, stack);
+
+  dlclose(handle);
+  bool unloaded = dlopen(lib, RTLD_NOW | RTLD_NOLOAD) == nullptr;
+
+  std::vector<bttrack::StackFrames> records;
+  bttrack::Dump(0, records);
+  if (records.size() != 1 || records[0].frames.empty()) {
+    printf("%lu stacks\n", records.size());
+    return 1;
+  }
+  const bttrack::Frame* frame = records[0].frames[0];
+  bool ok = frame->func == "adler32" &&
+            frame->exec.find(lib) != std::string::npos &&
+            frame->faddr != nullptr &&
+            frame->symbol == frame->exec + "(adler32+0x1)" &&
+            g_backtrace_symbols_calls == 0;
+  printf("unloaded %d, frame %s in %s, %s\n", unloaded, frame->symbol.c_str(),
+         frame->exec.c_str(), ok ? "ok" : "wrong");
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,80 @@
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <thread>
+
+#include "bttrack.h"
+
+// a dump after the presymbolizer caught up only looks up resolved frames,
+// compared with the first dump of a child which symbolizes all of them
+
+template <int N>
+void __attribute__((noinline)) Leaf() {
+  bttrack::Record(0);
+  asm volatile("");
+}
+
+template <int N>
+void __attribute__((noinline)) Caller() {
+  Leaf<N>();
+  Leaf<N + 1>();
+  asm volatile("");
+}
+
+uint64_t DumpNanos(size_t& num_frames) {
+  auto start = std::chrono::steady_clock::now();
+  std::vector<bttrack::StackFrames> records;
+  bttrack::Dump(0, records);
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  num_frames = 0;
+  for (const auto& record : records) {
+    num_frames += record.frames.size();
+  }
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+}
+
+int main() {
+  Caller<0>();
+  Caller<2>();
+  Caller<4>();
+  Caller<6>();
+
+  // cold dump in a child, nothing resolved yet
+  int fds[2];
+  if (pipe(fds) != 0) {
+    return 1;
+  }
+  pid_t pid = fork();
+  if (pid == 0) {
+    size_t num_frames;
+    uint64_t nanos = DumpNanos(num_frames);
+    ssize_t n = write(fds[1], &nanos, sizeof(nanos));
+    _exit(n == sizeof(nanos) ? 0 : 1);
+  }
+  uint64_t cold_nanos = 0;
+  bool cold_ok = read(fds[0], &cold_nanos, sizeof(cold_nanos)) ==
+                 sizeof(cold_nanos);
+  close(fds[0]);
+  close(fds[1]);
+  int status;
+  waitpid(pid, &status, 0);
+  if (!cold_ok) {
+    printf("child failed\n");
+    return 1;
+  }
+
+  bool started = bttrack::StartPresymbolizer(1.0);
+  bool started_twice = bttrack::StartPresymbolizer(1.0);
+  std::this_thread::sleep_for(std::chrono::seconds(2));
+  bttrack::StopPresymbolizer();
+
+  size_t num_frames;
+  uint64_t warm_nanos = DumpNanos(num_frames);
+  bool ok = started && !started_twice && num_frames > 0 &&
+            warm_nanos * 2 < cold_nanos;
+  printf("cold dump %.3fms, presymbolized dump %.3fms, %lu frames, %s\n",
+         cold_nanos / 1e6, warm_nanos / 1e6, num_frames, ok ? "ok" : "wrong");
+  return ok ? 0 : 1;
+}
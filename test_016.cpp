@@ -0,0 +1,96 @@
+#include <cstdio>
+#include <string>
+
+#include "bttrack.h"
+
+// strings are escaped in JSON, and kJsonFrameTable writes each frame once
+
+bool Expect(const char* label, const std::string& json,
+            const std::string& expected) {
+  bool ok = json == expected;
+  printf("%s: %s\n", label, ok ? "ok" : "wrong");
+  if (!ok) {
+    printf("  got      %s\n  expected %s\n", json.c_str(), expected.c_str());
+  }
+  return ok;
+}
+
+int main() {
+  bttrack::Frame a;
+  a.addr = reinterpret_cast<const void*>(0x1010);
+  a.faddr = reinterpret_cast<const void*>(0x1000);
+  a.func = "operator\"\"_x(char const*)";
+  a.file = "C:\\src\\a.cpp";
+  a.line = 3;
+  a.exec = "/bin/a\tb";
+  a.symbol = "sym\n\x01";
+  a.inlined_by.push_back({"inl", "b.h", 7});
+
+  bttrack::Frame b;
+  b.addr = reinterpret_cast<const void*>(0x2000);
+  b.faddr = nullptr;
+  b.func = "main";
+  b.file = "??";
+  b.line = -1;
+  b.exec = "??";
+  b.symbol = "(nil)";
+
+  std::vector<bttrack::StackFrames> records(2);
+  records[0].frames = {&a, &b};
+  records[0].count = 3;
+  records[0].score = 30;
+  records[0].count_error = 0;
+  records[0].score_error = 0;
+  records[1].frames = {&b};
+  records[1].count = 1;
+  records[1].score = -2;
+  records[1].count_error = 1;
+  records[1].score_error = 4;
+
+  const std::string json_a =
+      "{\"address\": 4112, \"function\": \"operator\\\"\\\"_x(char const*)\", "
+      "\"file\": \"C:\\\\src\\\\a.cpp\", \"line\": 3, \"exec\": "
+      "\"/bin/a\\tb\", \"offset\": 16, \"symbol\": \"sym\\n\\u0001\", "
+      "\"inlined_by\": ";
+  const std::string json_b =
+      "{\"address\": 8192, \"function\": \"main\", \"file\": \"??\", "
+      "\"line\": -1, \"exec\": \"??\", \"offset\": 0, \"symbol\": \"(nil)\", "
+      "\"inlined_by\": ";
+
+  bool ok = true;
+  ok &= Expect("inline", bttrack::StackFramesToJson(records),
+               "{\"sum\": 4, \"sum_score\": 28, \"records\": ["
+               "{\"count\": 3, \"score\": 30, \"frames\": [" +
+                   json_a + "1}, " + json_b +
+                   "0}]},"
+                   "{\"count\": 1, \"score\": -2, \"count_error\": 1, "
+                   "\"score_error\": 4, \"frames\": [" +
+                   json_b + "0}]}]}");
+  ok &= Expect("frame table",
+               bttrack::StackFramesToJson(records, 0, bttrack::kJsonFrameTable),
+               "{\"version\": 2, \"sum\": 4, \"sum_score\": 28, \"frames\": [" +
+                   json_a +
+                   "[{\"function\": \"inl\", \"file\": \"b.h\", "
+                   "\"line\": 7}]}, " +
+                   json_b +
+                   "[]}], \"records\": ["
+                   "{\"count\": 3, \"score\": 30, \"frames\": [0, 1]}, "
+                   "{\"count\": 1, \"score\": -2, \"count_error\": 1, "
+                   "\"score_error\": 4, \"frames\": [1]}]}");
+  records.pop_back();
+  records[0].frames = {&b, &b};
+  ok &= Expect("frame table indent",
+               bttrack::StackFramesToJson(records, 2, bttrack::kJsonFrameTable),
+               "{\n  \"version\": 2,\n  \"sum\": 3,\n  \"sum_score\": 30,\n"
+               "  \"frames\": [\n    " +
+                   json_b +
+                   "[]}\n  ],\n  \"records\": [\n"
+                   "    {\"count\": 3, \"score\": 30, \"frames\": [0, 0]}\n"
+                   "  ]\n}");
+  records.clear();
+  ok &= Expect("frame table empty",
+               bttrack::StackFramesToJson(records, 2, bttrack::kJsonFrameTable),
+               "{\n  \"version\": 2,\n  \"sum\": 0,\n  \"sum_score\": 0,\n"
+               "  \"frames\": [],\n  \"records\": []\n}");
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,238 @@
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include "bttrack.h"
+
+// pprof export decoded by a minimal protobuf reader, and its gzip output
+// decompressed by gzip(1) if installed
+
+namespace bttrack {
+// internal, gzip without zlib
+bool gzip_builtin(const std::string& in, std::string& out);
+}  // namespace bttrack
+
+// fields of a message, varint fields have value, others have bytes
+struct Field {
+  int number;
+  uint64_t value;
+  std::string bytes;
+};
+
+bool ReadVarint(const std::string& data, size_t& pos, uint64_t& v) {
+  v = 0;
+  for (int shift = 0; pos < data.size() && shift < 64; shift += 7) {
+    uint8_t b = data[pos++];
+    v |= static_cast<uint64_t>(b & 0x7f) << shift;
+    if ((b & 0x80) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool Decode(const std::string& data, std::vector<Field>& fields) {
+  fields.clear();
+  size_t pos = 0;
+  while (pos < data.size()) {
+    uint64_t key, size;
+    if (!ReadVarint(data, pos, key)) {
+      return false;
+    }
+    Field f{static_cast<int>(key >> 3), 0, ""};
+    if ((key & 7) == 0) {
+      if (!ReadVarint(data, pos, f.value)) {
+        return false;
+      }
+    } else if ((key & 7) == 2) {
+      if (!ReadVarint(data, pos, size) || size > data.size() - pos) {
+        return false;
+      }
+      f.bytes = data.substr(pos, size);
+      pos += size;
+    } else {
+      return false;
+    }
+    fields.push_back(f);
+  }
+  return true;
+}
+
+// packed repeated varints
+std::vector<uint64_t> Packed(const std::string& bytes) {
+  std::vector<uint64_t> values;
+  uint64_t v;
+  for (size_t pos = 0; pos < bytes.size() && ReadVarint(bytes, pos, v);) {
+    values.push_back(v);
+  }
+  return values;
+}
+
+uint64_t Get(const std::vector<Field>& fields, int number) {
+  for (const auto& f : fields) {
+    if (f.number == number) {
+      return f.value;
+    }
+  }
+  return 0;
+}
+
+// field numbers of profile.proto
+struct Profile {
+  std::vector<std::string> strings;             // 6
+  std::vector<std::vector<Field>> sample_types;  // 1
+  std::vector<std::vector<Field>> samples;       // 2
+  std::vector<std::vector<Field>> mappings;      // 3
+  std::vector<std::vector<Field>> locations;     // 4
+  std::vector<std::vector<Field>> functions;     // 5
+
+  bool Parse(const std::string& data) {
+    std::vector<Field> fields;
+    if (!Decode(data, fields)) {
+      return false;
+    }
+    for (const auto& f : fields) {
+      std::vector<Field> sub;
+      if (f.number == 6) {
+        strings.push_back(f.bytes);
+      } else if (f.number >= 1 && f.number <= 5) {
+        if (!Decode(f.bytes, sub)) {
+          return false;
+        }
+        std::vector<std::vector<Field>>* tables[] = {
+            &sample_types, &samples, &mappings, &locations, &functions};
+        tables[f.number - 1]->push_back(sub);
+      }
+    }
+    return !strings.empty() && strings[0].empty();
+  }
+
+  // names of lines of location id, innermost first
+  std::vector<std::string> Lines(uint64_t id) const {
+    std::vector<std::string> names;
+    for (const auto& loc : locations) {
+      if (Get(loc, 1) != id) {
+        continue;
+      }
+      for (const auto& f : loc) {
+        std::vector<Field> line;
+        if (f.number != 4 || !Decode(f.bytes, line)) {
+          continue;
+        }
+        for (const auto& func : functions) {
+          if (Get(func, 1) == Get(line, 1)) {
+            names.push_back(strings[Get(func, 2)] + ":" +
+                            std::to_string(Get(line, 2)));
+          }
+        }
+      }
+    }
+    return names;
+  }
+};
+
+bool Gunzip(const std::string& gz, std::string& out) {
+  if (system("gzip --version > /dev/null 2>&1") != 0) {
+    printf("skipped gunzip, gzip not found\n");
+    out.clear();
+    return true;
+  }
+  char path[] = "/tmp/bttrack_pprof_XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0 || write(fd, gz.data(), gz.size()) != (ssize_t)gz.size()) {
+    return false;
+  }
+  close(fd);
+  std::string cmd = std::string("gzip -dc < ") + path;
+  FILE* fp = popen(cmd.c_str(), "r");
+  char buf[4096];
+  size_t n;
+  out.clear();
+  while (fp != nullptr && (n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+    out.append(buf, n);
+  }
+  bool ok = fp != nullptr && pclose(fp) == 0;
+  unlink(path);
+  return ok;
+}
+
+int main() {
+  bttrack::Frame inlined;
+  inlined.addr = reinterpret_cast<const void*>(0x401010);
+  inlined.faddr = reinterpret_cast<const void*>(0x400000);
+  inlined.func = "Inner()";
+  inlined.file = "a.h";
+  inlined.line = 3;
+  inlined.exec = "/bin/prog";
+  inlined.inlined_by.push_back({"Middle()", "a.cpp", 10});
+  inlined.inlined_by.push_back({"Outer()", "a.cpp", 20});
+
+  bttrack::Frame caller = inlined;
+  caller.addr = reinterpret_cast<const void*>(0x401100);
+  caller.func = "main";
+  caller.line = -1;
+  caller.inlined_by.clear();
+
+  bttrack::Frame unknown = caller;
+  unknown.addr = reinterpret_cast<const void*>(0x9000);
+  unknown.faddr = nullptr;
+  unknown.func = bttrack::kFuncUnknown;
+
+  std::vector<bttrack::StackFrames> records(2);
+  records[0].frames = {&inlined, &caller, &unknown};
+  records[0].count = 3;
+  records[0].score = 300;
+  records[1].frames = {&caller, &unknown};
+  records[1].count = 1;
+  records[1].score = -5;
+
+  std::string raw = bttrack::StackFramesToPprof(records, "bytes", false);
+  Profile p;
+  if (!p.Parse(raw)) {
+    printf("malformed profile\n");
+    return 1;
+  }
+  bool ok = p.sample_types.size() == 2 &&
+            p.strings[Get(p.sample_types[0], 1)] == "count" &&
+            p.strings[Get(p.sample_types[1], 1)] == "score" &&
+            p.strings[Get(p.sample_types[1], 2)] == "bytes";
+  printf("sample types %s\n", ok ? "ok" : "wrong");
+
+  bool samples_ok = p.samples.size() == 2 && p.locations.size() == 3 &&
+                    p.mappings.size() == 1 &&
+                    p.strings[Get(p.mappings[0], 5)] == "/bin/prog";
+  for (size_t i = 0; samples_ok && i < p.samples.size(); i++) {
+    std::vector<uint64_t> ids, values;
+    for (const auto& f : p.samples[i]) {
+      (f.number == 1 ? ids : values) = Packed(f.bytes);
+    }
+    samples_ok = ids.size() == records[i].frames.size() &&
+                 values.size() == 2 && values[0] == records[i].count &&
+                 static_cast<int64_t>(values[1]) == records[i].score;
+  }
+  printf("samples %s\n", samples_ok ? "ok" : "wrong");
+
+  // location 1 is inlined, 3 has no function and no mapping
+  std::vector<std::string> lines = p.Lines(1);
+  bool lines_ok = lines.size() == 3 && lines[0] == "Inner():3" &&
+                  lines[1] == "Middle():10" && lines[2] == "Outer():20" &&
+                  p.Lines(2).size() == 1 && p.Lines(2)[0] == "main:0" &&
+                  p.Lines(3).empty() && Get(p.locations[2], 2) == 0 &&
+                  Get(p.locations[2], 3) == 0x9000;
+  printf("locations %s\n", lines_ok ? "ok" : "wrong");
+
+  // time_nanos differs between calls, so output of zlib is only parsed, and
+  // the built-in gzip of raw is compared with it
+  std::string gz = bttrack::StackFramesToPprof(records, "bytes", true);
+  std::string builtin;
+  bttrack::gzip_builtin(raw, builtin);
+  std::string out, out_builtin;
+  bool gzip_ok = gz.size() > 2 && gz[0] == '\x1f' && gz[1] == '\x8b' &&
+                 Gunzip(gz, out) && Gunzip(builtin, out_builtin) &&
+                 (out.empty() || Profile().Parse(out)) &&
+                 (out_builtin.empty() || out_builtin == raw);
+  printf("gzip %s\n", gzip_ok ? "ok" : "wrong");
+  return ok && samples_ok && lines_ok && gzip_ok ? 0 : 1;
+}
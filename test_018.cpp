@@ -0,0 +1,131 @@
+#include <unistd.h>
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include "bttrack.h"
+
+// folded stacks with inlined functions expanded, and SVG flame graphs of
+// records and of a live channel
+
+bool Expect(const char* label, const std::string& got,
+            const std::string& expected) {
+  bool ok = got == expected;
+  printf("%s: %s\n", label, ok ? "ok" : "wrong");
+  if (!ok) {
+    printf("  got      %s\n  expected %s\n", got.c_str(), expected.c_str());
+  }
+  return ok;
+}
+
+size_t Count(const std::string& str, const std::string& pattern) {
+  size_t n = 0;
+  for (size_t pos = str.find(pattern); pos != std::string::npos;
+       pos = str.find(pattern, pos + 1)) {
+    n++;
+  }
+  return n;
+}
+
+void __attribute__((noinline)) Leaf() {
+  bttrack::Record(0);
+  asm volatile("" ::: "memory");  // no tail call
+}
+
+void __attribute__((noinline)) Branch(int n) {
+  for (int i = 0; i < n; i++) {
+    Leaf();
+  }
+}
+
+int main() {
+  bttrack::Frame inner;
+  inner.addr = reinterpret_cast<const void*>(0x1010);
+  inner.faddr = reinterpret_cast<const void*>(0x1000);
+  inner.func = "Inner<a;b>()";
+  inner.exec = "/bin/prog";
+  inner.inlined_by.push_back({"Middle()", "a.cpp", 10});
+  inner.inlined_by.push_back({"Outer()", "a.cpp", 20});
+
+  bttrack::Frame main_frame = inner;
+  main_frame.addr = reinterpret_cast<const void*>(0x1100);
+  main_frame.func = "main";
+  main_frame.inlined_by.clear();
+
+  bttrack::Frame unknown = main_frame;
+  unknown.addr = reinterpret_cast<const void*>(0x1200);
+  unknown.func = bttrack::kFuncUnknown;
+
+  bttrack::Frame other = main_frame;
+  other.addr = reinterpret_cast<const void*>(0x1300);
+  other.func = "Other<int>&";
+
+  std::vector<bttrack::StackFrames> records(4);
+  records[0].frames = {&inner, &main_frame};
+  records[0].count = 3;
+  records[0].score = 30000;
+  records[1].frames = {&unknown, &main_frame};
+  records[1].count = 1;
+  records[1].score = -5;
+  records[2].frames = {&other, &main_frame};
+  records[2].count = 2;
+  records[2].score = 10000;
+  // too narrow to draw in the flame graph
+  records[3].frames = {&other, &inner, &main_frame};
+  records[3].count = 0;
+  records[3].score = 1;
+
+  bool ok = true;
+  ok &= Expect("folded count", bttrack::StackFramesToFolded(records),
+               "main;Outer();Middle()_[i];Inner<a_b>()_[i] 3\n"
+               "main;[/bin/prog] 1\n"
+               "main;Other<int>& 2\n");
+  ok &= Expect("folded score",
+               bttrack::StackFramesToFolded(records, bttrack::kFlameScore),
+               "main;Outer();Middle()_[i];Inner<a_b>()_[i] 30000\n"
+               "main;Other<int>& 10000\n"
+               "main;Outer();Middle()_[i];Inner<a_b>()_[i];Other<int>& 1\n");
+
+  // all, main, Outer(), Middle(), Inner(), Other, the narrow Other is
+  // omitted, one rect each and the background
+  std::string svg =
+      bttrack::StackFramesToFlameGraph(records, bttrack::kFlameScore, "a&b");
+  bool svg_ok = svg.compare(0, 5, "<?xml") == 0 &&
+                svg.compare(svg.size() - 7, 7, "</svg>\n") == 0 &&
+                Count(svg, "<rect ") == 7 && Count(svg, "<g>") == 6 &&
+                Count(svg, "<g>") == Count(svg, "</g>") &&
+                svg.find(">a&amp;b</text>") != std::string::npos &&
+                svg.find("<title>all (40001 score, 100%)</title>") !=
+                    std::string::npos &&
+                svg.find("<title>Other&lt;int&gt;&amp; (10000 score, "
+                         "25%)</title>") != std::string::npos &&
+                svg.find("<title>Inner&lt;a_b&gt;()_[i] (30001 score") !=
+                    std::string::npos &&
+                svg.find("[/bin/prog]") == std::string::npos;
+  printf("flame graph: %s\n", svg_ok ? "ok" : "wrong");
+
+  std::string empty = bttrack::StackFramesToFlameGraph({});
+  bool empty_ok = Count(empty, "<rect ") == 1 &&
+                  empty.find("</svg>") != std::string::npos;
+  printf("empty flame graph: %s\n", empty_ok ? "ok" : "wrong");
+
+  Branch(30);
+  Leaf();
+  char path[] = "/tmp/bttrack_flame_XXXXXX";
+  int fd = mkstemp(path);
+  close(fd);
+  bool live_ok = bttrack::DumpFlameGraph(0, path);
+  std::ifstream in(path);
+  std::stringstream live;
+  live << in.rdbuf();
+  unlink(path);
+  live_ok = live_ok &&
+            live.str().find("<title>Branch(int) (30 samples") !=
+                std::string::npos &&
+            live.str().find("<title>Leaf() (1 samples") !=
+                std::string::npos;
+  printf("live flame graph: %s\n", live_ok ? "ok" : "wrong");
+  return ok && svg_ok && empty_ok && live_ok ? 0 : 1;
+}
@@ -0,0 +1,128 @@
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include "bttrack.h"
+
+// binary records round trip to the same JSON, read from a mapped file by
+// StackFramesReader, and malformed data is rejected
+
+void __attribute__((noinline)) Leaf(int n) {
+  for (int i = 0; i < n; i++) {
+    bttrack::Record(0, i);
+  }
+  asm volatile("" ::: "memory");  // no tail call
+}
+
+bool SameJson(const std::vector<bttrack::StackFrames>& a,
+              const std::vector<bttrack::StackFrames>& b) {
+  return bttrack::StackFramesToJson(a) == bttrack::StackFramesToJson(b) &&
+         bttrack::StackFramesToJson(a, 0, bttrack::kJsonFrameTable) ==
+             bttrack::StackFramesToJson(b, 0, bttrack::kJsonFrameTable);
+}
+
+int main() {
+  bttrack::Frame a;
+  a.addr = reinterpret_cast<const void*>(0x1010);
+  a.faddr = reinterpret_cast<const void*>(0x1000);
+  a.func = "operator\"\"_x(char const*)";
+  a.file = "C:\\src\\a.cpp";
+  a.line = 3;
+  a.exec = "/bin/a\tb";
+  a.symbol = std::string("sym\0\x01", 5);
+  a.inlined_by.push_back({"inl", "b.h", 7});
+  a.inlined_by.push_back({"outer", "", -1});
+
+  bttrack::Frame b;
+  b.addr = reinterpret_cast<const void*>(0x2000);
+  b.faddr = nullptr;
+  b.func = "main";
+  b.file = "??";
+  b.line = -1;
+  b.exec = "??";
+  b.symbol = "(nil)";
+
+  std::vector<bttrack::StackFrames> records(3);
+  records[0].frames = {&a, &b};
+  records[0].count = 3;
+  records[0].score = INT64_MIN;
+  records[0].count_error = 0;
+  records[0].score_error = 0;
+  records[1].frames = {&b, &a, &b};
+  records[1].count = UINT64_MAX;
+  records[1].score = -2;
+  records[1].count_error = 1;
+  records[1].score_error = INT64_MAX;
+  records[2].frames = {};
+  records[2].count = 1;
+  records[2].score = 1;
+  records[2].count_error = 0;
+  records[2].score_error = 0;
+
+  std::string data = bttrack::StackFramesToBinary(records);
+  bttrack::StackFramesReader reader;
+  std::vector<bttrack::StackFrames> read;
+  bool ok = reader.Open(data.data(), data.size()) && reader.ReadAll(read) &&
+            SameJson(records, read) && read[0].frames[0]->symbol == a.symbol &&
+            read[0].frames[0]->inlined_by.size() == 2 &&
+            read[0].frames[0]->inlined_by[1].line == -1;
+  printf("round trip: %s\n", ok ? "ok" : "wrong");
+
+  // every record in order, frames shared by records are one index
+  bttrack::StackFramesReader::Stack stack;
+  bool next_ok = reader.num_stacks() == 3 && reader.num_frames() == 2;
+  for (size_t i = 0; next_ok && reader.Next(stack); i++) {
+    next_ok = stack.count == records[i].count &&
+              stack.score == records[i].score &&
+              stack.count_error == records[i].count_error &&
+              stack.score_error == records[i].score_error &&
+              stack.frames.size() == records[i].frames.size();
+  }
+  bttrack::StackFramesReader::FrameRef f = reader.frame(1);
+  next_ok = next_ok && reader.ok() && !reader.Next(stack) &&
+            f.addr == b.addr && f.faddr == nullptr &&
+            std::string(f.func) == "main" && f.line == -1 &&
+            std::string(reader.inlined(0, 0).name) == "inl";
+  printf("iterate: %s\n", next_ok ? "ok" : "wrong");
+
+  // truncated tables are rejected, a truncated stack stops Next()
+  bttrack::StackFramesReader bad;
+  bool malformed_ok = !bad.Open(data.data(), data.size() - 1) &&
+                      !bad.Open(data.data(), 16);
+  std::string corrupt = data;
+  corrupt[corrupt.size() - 1] = '\x80';
+  malformed_ok = malformed_ok && bad.Open(corrupt.data(), corrupt.size()) &&
+                 bad.Next(stack) && bad.Next(stack) && !bad.Next(stack) &&
+                 !bad.ok() && !bad.ReadAll(read) && read.empty();
+  // more stacks than stack bytes can hold
+  std::string huge = data;
+  uint32_t num_stacks = UINT32_MAX;
+  memcpy(&huge[24], &num_stacks, sizeof(num_stacks));
+  malformed_ok = malformed_ok && !bad.Open(huge.data(), huge.size());
+  std::string empty = bttrack::StackFramesToBinary({});
+  malformed_ok = malformed_ok && bad.Open(empty.data(), empty.size()) &&
+                 bad.ReadAll(read) && read.empty();
+  printf("malformed: %s\n", malformed_ok ? "ok" : "wrong");
+
+  // live records written to a file and mapped
+  Leaf(20);
+  std::vector<bttrack::StackFrames> dumped;
+  bttrack::Dump(0, dumped);
+  char path[] = "/tmp/bttrack_binary_XXXXXX";
+  int fd = mkstemp(path);
+  bool file_ok = fd >= 0 && bttrack::WriteStackFramesBinary(fd, dumped);
+  close(fd);
+  bttrack::StackFramesReader mapped;
+  file_ok = file_ok && mapped.Open(path) && mapped.ReadAll(read) &&
+            SameJson(dumped, read);
+  unlink(path);
+  bool build_id = false;
+  for (uint32_t i = 0; file_ok && i < mapped.num_frames(); i++) {
+    build_id |= mapped.frame(i).build_id[0] != '\0';
+  }
+  printf("mapped file: %s, build-id %s\n", file_ok ? "ok" : "wrong",
+         build_id ? "found" : "not found");
+  return ok && next_ok && malformed_ok && file_ok ? 0 : 1;
+}
@@ -0,0 +1,118 @@
+#include <chrono>
+#include <cstdio>
+#include <thread>
+
+#include "bttrack.h"
+
+// CPU samples of threads running code without frame pointers, frame pointer
+// register holds garbage, never walked whether stack range is known or not
+// - code with frame pointers on a thread never seen by bttrack is unwound
+
+// spin with frame pointer register set to a garbage address
+void __attribute__((noinline)) SpinBadFp(long n) {
+#if defined(__x86_64__)
+  asm volatile(
+      "mov %%rbp, %%r11\n"
+      "mov $0x40, %%rbp\n"
+      "1: dec %0\n"
+      "jnz 1b\n"
+      "mov %%r11, %%rbp\n"
+      : "+r"(n)
+      :
+      : "r11", "memory", "cc");
+#elif defined(__aarch64__)
+  asm volatile(
+      "mov x9, x29\n"
+      "mov x29, #0x40\n"
+      "1: subs %0, %0, #1\n"
+      "b.ne 1b\n"
+      "mov x29, x9\n"
+      : "+r"(n)
+      :
+      : "x9", "memory", "cc");
+#else
+  for (volatile long i = 0; i < n; i++) {
+  }
+#endif
+}
+
+void Spin(bool registered) {
+  if (registered) {
+    bttrack::RegisterProfiledThread();
+  }
+  auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(300);
+  while (std::chrono::steady_clock::now() < end) {
+    SpinBadFp(1000000);
+  }
+}
+
+#define KEEP_FRAME_POINTER __attribute__((optimize("no-omit-frame-pointer")))
+
+volatile long g_count;
+
+// a leaf has no frame record, its caller is skipped by the unwinder
+void __attribute__((noinline)) KEEP_FRAME_POINTER SpinFp(long n) {
+  for (long i = 0; i < n; i++) {
+    g_count = g_count + 1;
+  }
+}
+
+void __attribute__((noinline)) KEEP_FRAME_POINTER SpinFpMiddle(long n) {
+  SpinFp(n);
+  asm volatile("" ::: "memory");  // no tail call
+}
+
+void __attribute__((noinline)) KEEP_FRAME_POINTER SpinFpCaller() {
+  auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(300);
+  while (std::chrono::steady_clock::now() < end) {
+    SpinFpMiddle(1000000);
+  }
+  asm volatile("" ::: "memory");
+}
+
+int main() {
+  const uint8_t id = 0;
+  if (!bttrack::StartCpuProfiler(id, 1000)) {
+    printf("StartCpuProfiler failed\n");
+    return 1;
+  }
+  // a thread never seen by bttrack, and a registered one
+  std::thread unknown(Spin, false);
+  unknown.join();
+  std::thread registered(Spin, true);
+  registered.join();
+  std::thread unknown_fp(SpinFpCaller);
+  unknown_fp.join();
+  bttrack::StopCpuProfiler();
+
+  std::vector<bttrack::StackFrames> records;
+  bttrack::Dump(id, records);
+  uint64_t spin = 0;
+  size_t max_depth = 0;
+  uint64_t spin_fp = 0;
+  uint64_t with_caller = 0;
+  for (const auto& it : records) {
+    if (it.frames.empty()) {
+      continue;
+    }
+    if (it.frames[0]->func.find("SpinBadFp") != std::string::npos) {
+      spin += it.count;
+      max_depth = std::max(max_depth, it.frames.size());
+    } else if (it.frames[0]->func.find("SpinFp") != std::string::npos) {
+      spin_fp += it.count;
+      for (const auto* frame : it.frames) {
+        if (frame->func.find("SpinFpCaller") != std::string::npos) {
+          with_caller += it.count;
+          break;
+        }
+      }
+    }
+  }
+  printf("samples in SpinBadFp: %lu, max depth %lu\n", spin, max_depth);
+  printf("samples in SpinFp: %lu, %lu with its caller\n", spin_fp,
+         with_caller);
+  return spin > 0 && max_depth == 1 && spin_fp > 0 &&
+                 with_caller * 10 >= spin_fp * 9
+             ? 0
+             : 1;
+}
@@ -0,0 +1,76 @@
+#include <unistd.h>
+
+#include <cstdio>
+#include <string>
+#include <utility>
+
+#include "bttrack.h"
+
+// frames resolved concurrently are the same as resolved by a single thread,
+// by both symbolizers, a raw dump is symbolized again on each call
+
+void __attribute__((noinline)) Leaf() {
+  bttrack::Record(0);
+  asm volatile("" ::: "memory");  // no tail call
+}
+
+// enough functions to split the exec into chunks of ElfSymbolizer
+template <size_t N>
+void __attribute__((noinline)) Caller() {
+  Leaf();
+  asm volatile("" ::: "memory");
+}
+
+template <size_t... N>
+void CallAll(std::index_sequence<N...>) {
+  void (*callers[])() = {&Caller<N>...};
+  for (auto caller : callers) {
+    caller();
+  }
+}
+
+std::string ToLines(const std::vector<bttrack::StackFrames>& records) {
+  std::string out;
+  for (const auto& record : records) {
+    out += "count " + std::to_string(record.count) + "\n";
+    for (const auto* frame : record.frames) {
+      char addr[32];
+      snprintf(addr, sizeof(addr), "%p", frame->addr);
+      out += std::string("  ") + addr + " " + frame->func + " at " +
+             frame->file + ":" + std::to_string(frame->line) + " inlined " +
+             std::to_string(frame->inlined_by.size()) + "\n";
+    }
+  }
+  return out;
+}
+
+int main() {
+  CallAll(std::make_index_sequence<600>());
+  char path[] = "/tmp/bttrack_parallel_XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    perror("mkstemp");
+    return 1;
+  }
+  close(fd);
+  bool ok = bttrack::DumpRaw(0, path);
+
+  const bttrack::Symbolizer symbolizers[] = {bttrack::kSymbolizeElf,
+                                             bttrack::kSymbolizeAddr2line};
+  const char* names[] = {"elf", "addr2line"};
+  for (int i = 0; ok && i < 2; i++) {
+    bttrack::SetSymbolizer(symbolizers[i]);
+    std::vector<bttrack::StackFrames> serial, parallel;
+    bttrack::SetSymbolizeThreads(1);
+    ok = bttrack::SymbolizeRawDump(path, serial);
+    bttrack::SetSymbolizeThreads(8);
+    ok = ok && bttrack::SymbolizeRawDump(path, parallel);
+    bool same = ToLines(serial) == ToLines(parallel);
+    printf("%s: %lu stacks, %s\n", names[i], serial.size(),
+           same ? "same" : "different");
+    ok = ok && same && serial.size() >= 600 &&
+         serial[0].frames[1]->func.find("Caller") != std::string::npos;
+  }
+  unlink(path);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,66 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <utility>
+
+#include "bttrack.h"
+
+// Record() of other threads goes on while Dump() symbolizes the same channel
+
+void __attribute__((noinline)) Leaf() {
+  bttrack::Record(0);
+  asm volatile("" ::: "memory");  // no tail call
+}
+
+// new addresses, so the dump is slowed by addr2line
+template <size_t N>
+void __attribute__((noinline)) Caller() {
+  Leaf();
+  asm volatile("" ::: "memory");
+}
+
+template <size_t... N>
+void CallAll(std::index_sequence<N...>) {
+  void (*callers[])() = {&Caller<N>...};
+  for (auto caller : callers) {
+    caller();
+  }
+}
+
+int main() {
+  using Clock = std::chrono::steady_clock;
+  bttrack::SetSymbolizer(bttrack::kSymbolizeAddr2line);
+  CallAll(std::make_index_sequence<3000>());
+
+  std::atomic<int> state(0);  // 0: before dump, 1: dumping, 2: done
+  uint64_t during = 0;
+  Clock::duration max_latency(0);
+  std::thread recorder([&] {
+    Leaf();  // first call of a thread takes its shard
+    while (state.load() != 2) {
+      auto start = Clock::now();
+      Leaf();
+      auto latency = Clock::now() - start;
+      if (state.load() == 1) {
+        during++;
+        max_latency = std::max(max_latency, latency);
+      }
+    }
+  });
+
+  auto start = Clock::now();
+  state.store(1);
+  std::vector<bttrack::StackFrames> records;
+  bttrack::Dump(0, records);
+  state.store(2);
+  std::chrono::duration<double> elapsed = Clock::now() - start;
+  recorder.join();
+  std::chrono::duration<double> latency = max_latency;
+
+  printf("dump %.3fs, %lu records during dump, max latency %.3fs\n",
+         elapsed.count(), during, latency.count());
+  bool ok = !records.empty() && during >= 1000 &&
+            latency.count() < elapsed.count() / 2;
+  return ok ? 0 : 1;
+}
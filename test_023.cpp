@@ -0,0 +1,191 @@
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+
+#include "bttrack.h"
+
+// addr2line coprocess, run through a wrapper script on PATH which logs its
+// spawns and input, or hangs or is missing when told by the environment
+// - batches of 100 addresses each end with a sentinel, coprocess of a file
+//   is spawned once and reused by later dumps
+// - a hung coprocess is killed after the timeout, frames left unresolved
+// - without addr2line, frames are left unresolved
+
+void __attribute__((noinline)) Leaf() {
+  bttrack::Record(0);
+  asm volatile("" ::: "memory");  // no tail call
+}
+
+volatile int g_calls;
+
+// work after the call, so the return address is in Inlined()
+inline __attribute__((always_inline)) void Inlined() {
+  Leaf();
+  g_calls = g_calls + 1;
+}
+
+void __attribute__((noinline)) Outer() {
+  Inlined();
+  asm volatile("" ::: "memory");
+}
+
+// more frames than a batch
+template <size_t N>
+void __attribute__((noinline)) Caller() {
+  Leaf();
+  asm volatile("" ::: "memory");
+}
+
+template <size_t... N>
+void CallAll(std::index_sequence<N...>) {
+  void (*callers[])() = {&Caller<N>...};
+  for (auto caller : callers) {
+    caller();
+  }
+}
+
+const char* kWrapper =
+    "#!/bin/sh\n"
+    "echo spawn >> \"$ADDR2LINE_LOG\"\n"
+    "case \"$ADDR2LINE_MODE\" in\n"
+    "  hang) exec sleep 1000 ;;\n"
+    "esac\n"
+    "tee -a \"$ADDR2LINE_LOG\" | PATH=\"${PATH#*:}\" addr2line \"$@\"\n";
+
+std::string g_raw_path;
+
+// frames of Caller<N>() resolved by addr2line
+size_t NumCallers(const std::vector<bttrack::StackFrames>& records) {
+  size_t n = 0;
+  for (const auto& record : records) {
+    n += record.frames.size() > 1 &&
+         record.frames[1]->func.find("Caller<") != std::string::npos;
+  }
+  return n;
+}
+
+size_t CountLines(const std::string& path, const std::string& line) {
+  std::ifstream in(path);
+  size_t n = 0;
+  for (std::string s; std::getline(in, s);) {
+    n += s == line;
+  }
+  return n;
+}
+
+// run fn in a child process, so its addr2line state is not shared
+bool InChild(bool (*fn)()) {
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    bool ok = fn();
+    fflush(stdout);
+    _exit(ok ? 0 : 1);
+  }
+  int status = 0;
+  return pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+         WEXITSTATUS(status) == 0;
+}
+
+bool Missing() {
+  setenv("PATH", "/nonexistent", 1);
+  std::vector<bttrack::StackFrames> records;
+  bool ok = bttrack::SymbolizeRawDump(g_raw_path, records) &&
+            !records.empty() && NumCallers(records) == 0;
+  printf("missing: %s\n", ok ? "unresolved" : "wrong");
+  return ok;
+}
+
+bool Hang() {
+  setenv("ADDR2LINE_MODE", "hang", 1);
+  bttrack::SetSymbolizeThreads(8);  // files time out together
+  auto start = std::chrono::steady_clock::now();
+  std::vector<bttrack::StackFrames> records;
+  bool ok = bttrack::SymbolizeRawDump(g_raw_path, records) &&
+            NumCallers(records) == 0;
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  ok = ok && elapsed.count() >= 29;  // timeout is 30s
+  printf("hang: %s after %.1fs\n", ok ? "unresolved" : "wrong",
+         elapsed.count());
+  return ok;
+}
+
+int main() {
+  CallAll(std::make_index_sequence<250>());
+  Outer();
+  char dir[] = "/tmp/bttrack_addr2line_XXXXXX";
+  if (mkdtemp(dir) == nullptr) {
+    perror("mkdtemp");
+    return 1;
+  }
+  std::string wrapper = std::string(dir) + "/addr2line";
+  std::string log = std::string(dir) + "/log";
+  g_raw_path = std::string(dir) + "/raw";
+  {
+    std::ofstream out(wrapper);
+    out << kWrapper;
+  }
+  chmod(wrapper.c_str(), 0755);
+  setenv("PATH", (std::string(dir) + ":" + getenv("PATH")).c_str(), 1);
+  setenv("ADDR2LINE_LOG", log.c_str(), 1);
+  bttrack::SetSymbolizer(bttrack::kSymbolizeAddr2line);
+  bttrack::SetSymbolizeThreads(1);  // inputs of coprocesses not interleaved
+  bool ok = bttrack::DumpRaw(0, g_raw_path);
+
+  ok = InChild(Missing) && ok;
+  ok = InChild(Hang) && ok;
+  unlink(log.c_str());
+
+  // one coprocess per file, a batch per 100 frames of it
+  std::vector<bttrack::StackFrames> records;
+  ok = bttrack::SymbolizeRawDump(g_raw_path, records) && ok;
+  std::map<std::string, std::set<const bttrack::Frame*>> files;
+  for (const auto& record : records) {
+    for (const auto* frame : record.frames) {
+      files[frame->exec].insert(frame);
+    }
+  }
+  size_t batches = 0;
+  for (const auto& it : files) {
+    batches += (it.second.size() + 99) / 100;
+  }
+  size_t spawns = CountLines(log, "spawn");
+  size_t sentinels = CountLines(log, "0x0");
+  bool batch_ok = NumCallers(records) == 250 && spawns == files.size() &&
+                  sentinels == batches;
+  printf("batches: %lu files, %lu spawns, %lu sentinels of %lu batches\n",
+         files.size(), spawns, sentinels, batches);
+
+  // inlined function is the frame, and its caller is inlined_by
+  bool inlined_ok = false;
+  for (const auto& record : records) {
+    for (const auto* frame : record.frames) {
+      inlined_ok |= frame->func == "Inlined()" &&
+                    !frame->inlined_by.empty() &&
+                    frame->inlined_by[0].name == "Outer()";
+    }
+  }
+  printf("inlined: %s\n", inlined_ok ? "ok" : "wrong");
+
+  // coprocesses are reused by later dumps
+  ok = bttrack::SymbolizeRawDump(g_raw_path, records) && ok;
+  bool reuse_ok =
+      NumCallers(records) == 250 && CountLines(log, "spawn") == spawns;
+  printf("reuse: %s\n", reuse_ok ? "ok" : "wrong");
+
+  unlink(log.c_str());
+  unlink(wrapper.c_str());
+  unlink(g_raw_path.c_str());
+  rmdir(dir);
+  return ok && batch_ok && inlined_ok && reuse_ok ? 0 : 1;
+}
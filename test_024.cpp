@@ -0,0 +1,112 @@
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "bttrack.h"
+
+// debug info of a copy of this program made by objcopy is read by the ELF
+// symbolizer like that of the program itself
+// - compressed debug sections, SHF_COMPRESSED and legacy .zdebug_*
+// - debug info split into a file found by .gnu_debuglink
+
+void __attribute__((noinline)) Leaf() {
+  bttrack::Record(0);
+  asm volatile("" ::: "memory");  // no tail call
+}
+
+volatile int g_calls;
+
+inline __attribute__((always_inline)) void Inlined() {
+  Leaf();
+  g_calls = g_calls + 1;
+}
+
+void __attribute__((noinline)) Outer() {
+  Inlined();
+  asm volatile("" ::: "memory");
+}
+
+// one line per frame, without exec which is the real path in raw dumps
+std::string ToLines(const std::vector<bttrack::StackFrames>& records) {
+  std::string out;
+  for (const auto& record : records) {
+    for (const auto* frame : record.frames) {
+      out += frame->func + " at " + frame->file + ":" +
+             std::to_string(frame->line) + " inlined " +
+             std::to_string(frame->inlined_by.size()) + "\n";
+    }
+  }
+  return out;
+}
+
+std::string g_raw_path;
+
+std::string Symbolize(const std::string& debug_dir) {
+  std::vector<bttrack::StackFrames> records;
+  if (!bttrack::SymbolizeRawDump(g_raw_path, records, debug_dir)) {
+    return "";
+  }
+  return ToLines(records);
+}
+
+int main() {
+  Outer();
+  char dir[] = "/tmp/bttrack_debug_XXXXXX";
+  if (mkdtemp(dir) == nullptr) {
+    perror("mkdtemp");
+    return 1;
+  }
+  g_raw_path = std::string(dir) + "/raw";
+  bool ok = bttrack::DumpRaw(0, g_raw_path);
+  std::string expected = Symbolize("");
+  ok = ok && expected.find("Inlined() at ") != std::string::npos &&
+       expected.find("test_024.cpp:") != std::string::npos;
+
+  char exe[4096];
+  ssize_t n = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+  if (n <= 0) {
+    perror("readlink");
+    return 1;
+  }
+  exe[n] = '\0';
+  std::string base = strrchr(exe, '/') + 1;
+  std::string copy = std::string(dir) + "/" + base;
+  std::string debug = std::string(dir) + "/" + base + ".debug";
+  struct {
+    const char* name;
+    std::string command;
+  } cases[] = {
+      {"zlib", "objcopy --compress-debug-sections=zlib " + std::string(exe) +
+                   " " + copy},
+      {"zlib-gnu", "objcopy --compress-debug-sections=zlib-gnu " +
+                       std::string(exe) + " " + copy},
+      {"debuglink", "objcopy --only-keep-debug " + std::string(exe) + " " +
+                        debug + " && objcopy --strip-debug " +
+                        "--add-gnu-debuglink=" + debug + " " + exe + " " +
+                        copy},
+  };
+  for (const auto& c : cases) {
+    std::string actual;
+    bool made = system((c.command + " 2>/dev/null").c_str()) == 0;
+    if (made) {
+      actual = Symbolize(dir);
+      ok = ok && actual == expected;
+    }
+    printf("%s: %s\n", c.name,
+           !made ? "skipped" : actual == expected ? "same" : "different");
+    if (made && actual != expected) {
+      printf("expected:\n%s\nactual:\n%s\n", expected.c_str(),
+             actual.c_str());
+    }
+    unlink(copy.c_str());
+    unlink(debug.c_str());
+  }
+
+  unlink(g_raw_path.c_str());
+  rmdir(dir);
+  return ok ? 0 : 1;
+}